@@ -325,7 +325,8 @@ int main(int argc, char* argv[])
 
       OrthancStone::OrthancHttpConnection orthanc(params);
       OrthancWSI::DicomPyramid source(orthanc, options[OPTION_INPUT].as<std::string>(), 
-                                      false /* don't use cached metadata */);
+                                      false /* don't use cached metadata */,
+                                      false /* don't synthesize missing levels */);
 
       OrthancWSI::TiledPyramidStatistics stats(source);
       Run(stats, options);
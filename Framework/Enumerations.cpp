@@ -66,6 +66,9 @@ namespace OrthancWSI
       case ImageCompression_JpegLS:
         return "JPEG-LS";
 
+      case ImageCompression_WebP:
+        return "WebP";
+
       default:
         throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
@@ -158,6 +161,11 @@ namespace OrthancWSI
       return ImageCompression_Jpeg2000;
     }
 
+    if (boost::algorithm::ends_with(lower, ".webp"))
+    {
+      return ImageCompression_WebP;
+    }
+
     if (boost::algorithm::ends_with(lower, ".dcm"))
     {
       return ImageCompression_Dicom;
@@ -186,6 +194,13 @@ namespace OrthancWSI
       return ImageCompression_Png;
     }
 
+    if (size >= 12 &&
+        MatchHeader(buffer, size, HEADER("RIFF")) &&
+        MatchHeader(reinterpret_cast<const uint8_t*>(buffer) + 8, size - 8, HEADER("WEBP")))
+    {
+      return ImageCompression_WebP;
+    }
+
     if (MatchHeader(buffer, size, HEADER("\115\115\000\052")) ||
         MatchHeader(buffer, size, HEADER("\111\111\052\000")) ||
         MatchHeader(buffer, size, HEADER("\115\115\000\053\000\010\000\000")) ||
@@ -44,7 +44,8 @@ namespace OrthancWSI
     ImageCompression_Jpeg2000 = 6,
     ImageCompression_Tiff = 7,
     ImageCompression_UseOrthancPreview = 8,
-    ImageCompression_JpegLS = 9
+    ImageCompression_JpegLS = 9,
+    ImageCompression_WebP = 10
   };
 
   enum OpticalPath
@@ -27,6 +27,10 @@
 #include "Jpeg2000Reader.h"
 #include "Jpeg2000Writer.h"
 
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+#  include "WebPWriter.h"
+#endif
+
 #include <Compatibility.h>  // For std::unique_ptr
 #include <OrthancException.h>
 #include <Images/ImageProcessing.h>
@@ -34,11 +38,17 @@
 #include <Images/PngWriter.h>
 #include <Images/JpegReader.h>
 #include <Images/JpegWriter.h>
+#include <Cache/LeastRecentlyUsedIndex.h>
 #include <Logging.h>
 
+#include <boost/math/special_functions/fpclassify.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
 #include <limits>
 #include <string.h>
 #include <memory>
+#include <vector>
 
 
 namespace OrthancWSI
@@ -219,6 +229,21 @@ namespace OrthancWSI
             writer.reset(new Jpeg2000Writer);
             break;
 
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+          case ImageCompression_WebP:
+          {
+            // WebP is lossless if the quality is set to 100
+            std::unique_ptr<WebPWriter> webp(new WebPWriter);
+            webp->SetLossless(quality >= 100);
+            if (quality < 100)
+            {
+              webp->SetQuality(quality);
+            }
+            writer.reset(webp.release());
+            break;
+          }
+#endif
+
           default:
             throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
         }
@@ -354,6 +379,199 @@ namespace OrthancWSI
     }
 
 
+    template <typename PixelType>
+    static void ApplyLookupTable(Orthanc::ImageAccessor& target,
+                                 const Orthanc::ImageAccessor& source,
+                                 const uint8_t* lut /* indexed by the samples, offset by "bias" */,
+                                 int bias)
+    {
+      const unsigned int width = source.GetWidth();
+      const unsigned int height = source.GetHeight();
+
+      for (unsigned int y = 0; y < height; y++)
+      {
+        const PixelType* p = reinterpret_cast<const PixelType*>(source.GetConstRow(y));
+        uint8_t* q = reinterpret_cast<uint8_t*>(target.GetRow(y));
+
+        for (unsigned int x = 0; x < width; x++)
+        {
+          q[x] = lut[static_cast<int>(p[x]) + bias];
+        }
+      }
+    }
+
+
+    class WindowingKey
+    {
+    private:
+      bool    isSigned_;
+      double  rescaleSlope_;
+      double  rescaleIntercept_;
+      double  windowCenter_;
+      double  windowWidth_;
+      bool    invert_;
+
+    public:
+      WindowingKey(bool isSigned,
+                   double rescaleSlope,
+                   double rescaleIntercept,
+                   double windowCenter,
+                   double windowWidth,
+                   bool invert) :
+        isSigned_(isSigned),
+        rescaleSlope_(rescaleSlope),
+        rescaleIntercept_(rescaleIntercept),
+        windowCenter_(windowCenter),
+        windowWidth_(windowWidth),
+        invert_(invert)
+      {
+      }
+
+      bool operator< (const WindowingKey& other) const
+      {
+        if (isSigned_ != other.isSigned_)
+        {
+          return isSigned_ < other.isSigned_;
+        }
+        else if (rescaleSlope_ != other.rescaleSlope_)
+        {
+          return rescaleSlope_ < other.rescaleSlope_;
+        }
+        else if (rescaleIntercept_ != other.rescaleIntercept_)
+        {
+          return rescaleIntercept_ < other.rescaleIntercept_;
+        }
+        else if (windowCenter_ != other.windowCenter_)
+        {
+          return windowCenter_ < other.windowCenter_;
+        }
+        else if (windowWidth_ != other.windowWidth_)
+        {
+          return windowWidth_ < other.windowWidth_;
+        }
+        else
+        {
+          return invert_ < other.invert_;
+        }
+      }
+    };
+
+    typedef boost::shared_ptr<const std::vector<uint8_t> >  WindowingTable;
+
+    // The viewers only use a few windows at a time: The most recent
+    // tables (64KB each) are shared by all the pyramids
+    static const size_t MAX_WINDOWING_TABLES = 16;
+
+    static boost::mutex  windowingMutex_;
+    static Orthanc::LeastRecentlyUsedIndex<WindowingKey, WindowingTable>  windowingTables_;
+
+
+    static WindowingTable GetWindowingTable(bool isSigned,
+                                            double rescaleSlope,
+                                            double rescaleIntercept,
+                                            double windowCenter,
+                                            double windowWidth,
+                                            bool invert)
+    {
+      const WindowingKey key(isSigned, rescaleSlope, rescaleIntercept, windowCenter, windowWidth, invert);
+
+      {
+        boost::mutex::scoped_lock lock(windowingMutex_);
+
+        WindowingTable table;
+        if (windowingTables_.Contains(key, table))
+        {
+          windowingTables_.MakeMostRecent(key);
+          return table;
+        }
+      }
+
+      /**
+       * The rescale and the window are folded into one affine
+       * transform of the stored values, which is evaluated once for
+       * each of the 65536 possible samples by a branchless loop that
+       * the compiler can vectorize. The table is computed without
+       * holding the mutex: Concurrent computations of the same table
+       * produce the same values.
+       **/
+      const float scaling = static_cast<float>(255.0 * rescaleSlope / windowWidth);
+      const float offset = static_cast<float>(255.0 * (rescaleIntercept - windowCenter + windowWidth / 2.0) / windowWidth);
+      const float first = (isSigned ? -32768.0f : 0.0f);
+
+      boost::shared_ptr<std::vector<uint8_t> > lut(new std::vector<uint8_t>(65536));
+
+      for (unsigned int i = 0; i < 65536; i++)
+      {
+        float v = (first + static_cast<float>(i)) * scaling + offset + 0.5f;
+        v = std::min(255.0f, std::max(0.0f, v));
+
+        const uint8_t value = static_cast<uint8_t>(v);
+        (*lut) [i] = (invert ? 255 - value : value);
+      }
+
+      boost::mutex::scoped_lock lock(windowingMutex_);
+
+      if (!windowingTables_.Contains(key))
+      {
+        while (windowingTables_.GetSize() >= MAX_WINDOWING_TABLES)
+        {
+          windowingTables_.RemoveOldest();
+        }
+
+        windowingTables_.Add(key, lut);
+      }
+
+      return lut;
+    }
+
+
+    void ApplyWindowing(Orthanc::ImageAccessor& target,
+                        const Orthanc::ImageAccessor& source,
+                        double rescaleSlope,
+                        double rescaleIntercept,
+                        double windowCenter,
+                        double windowWidth,
+                        bool invert)
+    {
+      if (target.GetFormat() != Orthanc::PixelFormat_Grayscale8 ||
+          (source.GetFormat() != Orthanc::PixelFormat_Grayscale16 &&
+           source.GetFormat() != Orthanc::PixelFormat_SignedGrayscale16))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+      }
+
+      if (target.GetWidth() != source.GetWidth() ||
+          target.GetHeight() != source.GetHeight())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+      }
+
+      // NaN would break the ordering of the keys of the windowing tables
+      if (!boost::math::isfinite(rescaleSlope) ||
+          !boost::math::isfinite(rescaleIntercept) ||
+          !boost::math::isfinite(windowCenter) ||
+          !boost::math::isfinite(windowWidth) ||
+          windowWidth <= 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      const bool isSigned = (source.GetFormat() == Orthanc::PixelFormat_SignedGrayscale16);
+
+      // Each pixel amounts to one lookup in the table of its window
+      const WindowingTable lut = GetWindowingTable(isSigned, rescaleSlope, rescaleIntercept, windowCenter, windowWidth, invert);
+
+      if (isSigned)
+      {
+        ApplyLookupTable<int16_t>(target, source, &(*lut) [0], 32768);
+      }
+      else
+      {
+        ApplyLookupTable<uint16_t>(target, source, &(*lut) [0], 0);
+      }
+    }
+
+
     ImageCompression Convert(Orthanc::MimeType type)
     {
       switch (type)
@@ -367,6 +585,31 @@ namespace OrthancWSI
         case Orthanc::MimeType_Jpeg2000:
           return ImageCompression_Jpeg2000;
 
+        case Orthanc::MimeType_WebP:
+          return ImageCompression_WebP;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+
+
+    Orthanc::MimeType Convert(ImageCompression compression)
+    {
+      switch (compression)
+      {
+        case ImageCompression_Png:
+          return Orthanc::MimeType_Png;
+
+        case ImageCompression_Jpeg:
+          return Orthanc::MimeType_Jpeg;
+
+        case ImageCompression_Jpeg2000:
+          return Orthanc::MimeType_Jpeg2000;
+
+        case ImageCompression_WebP:
+          return Orthanc::MimeType_WebP;
+
         default:
           throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
       }
@@ -68,7 +68,7 @@ namespace OrthancWSI
     void EncodeTile(std::string& target,
                     const Orthanc::ImageAccessor& source,
                     ImageCompression compression,
-                    uint8_t quality);  // Only for JPEG compression
+                    uint8_t quality);  // Only for JPEG and WebP compressions (WebP is lossless if 100)
 
     void ChangeTileCompression(std::string& target,
                                const std::string& source,
@@ -83,8 +83,21 @@ namespace OrthancWSI
 
     void ConvertJpegYCbCrToRgb(Orthanc::ImageAccessor& image /* inplace */);
 
+    // Renders a 16bpp grayscale image as 8bpp through a lookup table.
+    // The window is expressed in the rescaled values (modality LUT),
+    // and "invert" corresponds to MONOCHROME1.
+    void ApplyWindowing(Orthanc::ImageAccessor& target /* Grayscale8 */,
+                        const Orthanc::ImageAccessor& source /* Grayscale16 or SignedGrayscale16 */,
+                        double rescaleSlope,
+                        double rescaleIntercept,
+                        double windowCenter,
+                        double windowWidth,
+                        bool invert);
+
     ImageCompression Convert(Orthanc::MimeType type);
 
+    Orthanc::MimeType Convert(ImageCompression compression);
+
     bool HasPngSignature(const std::string& buffer);
 
     bool HasJpegSignature(const std::string& buffer);
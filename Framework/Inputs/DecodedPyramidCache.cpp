@@ -24,6 +24,10 @@
 #include "../PrecompiledHeadersWSI.h"
 #include "DecodedPyramidCache.h"
 
+#include <Logging.h>
+
+#include <cassert>
+
 
 static std::unique_ptr<OrthancWSI::DecodedPyramidCache>  singleton_;
 
@@ -32,8 +36,8 @@ namespace OrthancWSI
   class DecodedPyramidCache::CachedPyramid : public boost::noncopyable
   {
   private:
-    std::unique_ptr<DecodedTiledPyramid>  pyramid_;
-    size_t                                memory_;
+    boost::shared_ptr<DecodedTiledPyramid>  pyramid_;
+    size_t                                  memory_;   // Protected by the mutex of the cache
 
   public:
     explicit CachedPyramid(DecodedTiledPyramid* pyramid) :
@@ -51,24 +55,61 @@ namespace OrthancWSI
 
     DecodedTiledPyramid& GetPyramid() const
     {
-      assert(pyramid_ != NULL);
+      assert(pyramid_.get() != NULL);
       return *pyramid_;
     }
 
+    const boost::shared_ptr<DecodedTiledPyramid>& GetSharedPyramid() const
+    {
+      return pyramid_;
+    }
+
     size_t GetMemoryUsage() const
     {
       return memory_;
     }
+
+    // The memory usage of the pyramids that are lazily computed grows
+    // as their tiles are read
+    void RefreshMemoryUsage()
+    {
+      memory_ = pyramid_->GetMemoryUsage();
+    }
   };
 
 
   bool DecodedPyramidCache::SanityCheck()
   {
-    return (cache_.GetSize() < maxCount_);
+    return (cache_.GetSize() <= maxCount_ &&
+            cache_.GetSize() == cached_.size());
   }
 
 
-  void DecodedPyramidCache::MakeRoom(size_t memory)
+  void DecodedPyramidCache::RemoveOldest(Evicted& evicted)
+  {
+    // Mutex must be locked
+
+    // The pyramid is only destroyed once the pending accessors have
+    // released it, and once the fetcher has been notified
+    CachedHandle oldest;
+    const FrameIdentifier identifier = cache_.RemoveOldest(oldest);
+
+    if (oldest.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else
+    {
+      assert(memoryUsage_ >= oldest->GetMemoryUsage());
+      memoryUsage_ -= oldest->GetMemoryUsage();
+      cached_.erase(identifier);
+      evicted.push_back(std::make_pair(identifier, oldest));
+    }
+  }
+
+
+  void DecodedPyramidCache::MakeRoom(Evicted& evicted,
+                                     size_t memory)
   {
     // Mutex must be locked
 
@@ -77,60 +118,137 @@ namespace OrthancWSI
             maxMemory_ != 0 &&
             memoryUsage_ + memory > maxMemory_))
     {
-      CachedPyramid* oldest = NULL;
-      cache_.RemoveOldest(oldest);
+      RemoveOldest(evicted);
+    }
+
+    assert(SanityCheck());
+  }
+
+
+  void DecodedPyramidCache::NotifyEvicted(const Evicted& evicted)
+  {
+    // Mutex must *not* be locked
 
-      if (oldest == NULL)
+    for (size_t i = 0; i < evicted.size(); i++)
+    {
+      try
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        fetcher_->NotifyEvicted(evicted[i].first.first, evicted[i].first.second, evicted[i].second->GetSharedPyramid());
       }
-      else
+      catch (Orthanc::OrthancException& e)
       {
-        memoryUsage_ -= oldest->GetMemoryUsage();
-        delete oldest;
+        LOG(ERROR) << "Error while evicting frame " << evicted[i].first.second << " of instance "
+                   << evicted[i].first.first << " from the cache of pyramids: " << e.What();
       }
     }
-
-    assert(SanityCheck());
   }
 
 
-  DecodedPyramidCache::CachedPyramid * DecodedPyramidCache::Store(FrameIdentifier identifier,
-                                                                  DecodedTiledPyramid *pyramid)
+  DecodedPyramidCache::CachedHandle DecodedPyramidCache::GetPyramid(const FrameIdentifier& identifier)
   {
-    // Mutex must be locked
+    {
+      boost::mutex::scoped_lock lock(mutex_);
 
-    std::unique_ptr<CachedPyramid> payload(new CachedPyramid(pyramid));
-    CachedPyramid* result;
+      // If another thread is fetching this frame, wait for it
+      while (fetching_.find(identifier) != fetching_.end())
+      {
+        fetched_.wait(lock);
+      }
 
-    if (cache_.Contains(identifier, result))
-    {
-      // This element has already been cached by another thread
-      if (result == NULL)
+      CachedHandle cached;
+      if (cache_.Contains(identifier, cached))
+      {
+        if (cached.get() == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        // Tag the frame as the most recently used
+        cache_.MakeMostRecent(identifier);
+        return cached;
+      }
+      else
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        fetching_.insert(identifier);
       }
+    }
 
-      // Tag the series as the most recently used
-      cache_.MakeMostRecent(identifier);
+    // The mutex is not locked while fetching the pyramid (this is a
+    // time-consuming operation, we don't want it to block other clients)
+    CachedHandle pyramid;
 
-      return result;
+    try
+    {
+      pyramid.reset(new CachedPyramid(fetcher_->Fetch(identifier.first, identifier.second)));
     }
-    else
+    catch (...)
     {
-      result = payload.get();
+      boost::mutex::scoped_lock lock(mutex_);
+      fetching_.erase(identifier);
+      fetched_.notify_all();
+      throw;
+    }
 
-      MakeRoom(payload->GetMemoryUsage());
+    Evicted evicted;
 
-      memoryUsage_ += payload->GetMemoryUsage();
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      fetching_.erase(identifier);
+      fetched_.notify_all();
 
-      // Add a new element to the cache and make it the most
-      // recently used entry
-      cache_.Add(identifier, payload.release());
+      if (maxMemory_ != 0 &&
+          pyramid->GetMemoryUsage() > maxMemory_)
+      {
+        // This pyramid alone is larger than the cache, don't store it
+        LOG(WARNING) << "The pyramid of frame " << identifier.second << " of instance " << identifier.first << " uses "
+                     << (pyramid->GetMemoryUsage() / (1024 * 1024)) << "MB, which is larger than the cache of pyramids";
+        return pyramid;
+      }
+
+      MakeRoom(evicted, pyramid->GetMemoryUsage());
+
+      // Add a new element to the cache and make it the most recently
+      // used entry
+      cache_.Add(identifier, pyramid);
+      cached_.insert(identifier);
+      memoryUsage_ += pyramid->GetMemoryUsage();
 
       assert(SanityCheck());
-      return result;
     }
+
+    NotifyEvicted(evicted);
+    return pyramid;
+  }
+
+
+  void DecodedPyramidCache::UpdateMemoryUsage(const FrameIdentifier& identifier,
+                                              CachedHandle pyramid)
+  {
+    Evicted evicted;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      CachedHandle cached;
+      if (cache_.Contains(identifier, cached) &&
+          cached == pyramid)
+      {
+        memoryUsage_ -= pyramid->GetMemoryUsage();
+        pyramid->RefreshMemoryUsage();
+        memoryUsage_ += pyramid->GetMemoryUsage();
+
+        // Evict the other pyramids if the memory budget is now exceeded
+        while (maxMemory_ != 0 &&
+               memoryUsage_ > maxMemory_ &&
+               cache_.GetSize() > 1 &&
+               cache_.GetOldest() != identifier)
+        {
+          RemoveOldest(evicted);
+        }
+      }
+    }
+
+    NotifyEvicted(evicted);
   }
 
 
@@ -156,21 +274,6 @@ namespace OrthancWSI
   }
 
 
-  DecodedPyramidCache::~DecodedPyramidCache()
-  {
-    while (!cache_.IsEmpty())
-    {
-      CachedPyramid* pyramid = NULL;
-      cache_.RemoveOldest(pyramid);
-
-      if (pyramid != NULL)
-      {
-        delete pyramid;
-      }
-    }
-  }
-
-
   void DecodedPyramidCache::InitializeInstance(IPyramidFetcher *fetcher,
                                                  size_t maxSize,
                                                  size_t maxMemory)
@@ -212,33 +315,49 @@ namespace OrthancWSI
   }
 
 
+  void DecodedPyramidCache::Invalidate(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::set<FrameIdentifier>::iterator it = cached_.lower_bound(std::make_pair(instanceId, 0u));
+
+    while (it != cached_.end() &&
+           it->first == instanceId)
+    {
+      // The pending accessors keep the pyramid alive
+      CachedHandle pyramid = cache_.Invalidate(*it);
+      assert(pyramid.get() != NULL &&
+             memoryUsage_ >= pyramid->GetMemoryUsage());
+      memoryUsage_ -= pyramid->GetMemoryUsage();
+      cached_.erase(it++);
+    }
+
+    assert(SanityCheck());
+  }
+
+
   DecodedPyramidCache::Accessor::Accessor(DecodedPyramidCache& that,
                                             const std::string &instanceId,
                                             unsigned int frameNumber):
-    lock_(that.mutex_),
+    that_(that),
     identifier_(instanceId, frameNumber),
-    pyramid_(NULL)
+    pyramid_(that.GetPyramid(identifier_))
+  {
+  }
+
+
+  DecodedPyramidCache::Accessor::~Accessor()
   {
-    if (that.cache_.Contains(identifier_, pyramid_))
+    if (pyramid_.get() != NULL)
     {
-      if (pyramid_ == NULL)
+      try
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        that_.UpdateMemoryUsage(identifier_, pyramid_);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot update the memory usage of a decoded pyramid: " << e.What();
       }
-
-      // Tag the series as the most recently used
-      that.cache_.MakeMostRecent(identifier_);
-    }
-    else
-    {
-      // Unlock the mutex as creating the pyramid is a time-consuming operation
-      lock_.unlock();
-
-      std::unique_ptr<DecodedTiledPyramid> payload(that.fetcher_->Fetch(instanceId, frameNumber));
-
-      // Re-lock, as we now modify the cache
-      lock_.lock();
-      pyramid_ = that.Store(identifier_, payload.release());
     }
   }
 
@@ -27,11 +27,23 @@
 
 #include <Cache/LeastRecentlyUsedIndex.h>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <set>
+#include <vector>
 
 
 namespace OrthancWSI
 {
+  /**
+   * Least-recently-used cache of the pyramids of individual frames,
+   * bounded both by a number of pyramids and by a memory budget. Each
+   * frame is fetched only once: The threads that ask for a frame that
+   * is being fetched wait for the result of the first thread. This
+   * class is thread-safe, and the fetched pyramids must also be
+   * thread-safe, as their tiles are read concurrently.
+   **/
   class DecodedPyramidCache : public boost::noncopyable
   {
   public:
@@ -44,6 +56,16 @@ namespace OrthancWSI
 
       virtual DecodedTiledPyramid* Fetch(const std::string& instanceId,
                                          unsigned int frameNumber) = 0;
+
+      // Called once a pyramid has been evicted from the cache, without
+      // holding the mutex of the cache. The fetcher can keep a
+      // reference to the pyramid (e.g. to spill it to the disk in
+      // the background).
+      virtual void NotifyEvicted(const std::string& instanceId,
+                                 unsigned int frameNumber,
+                                 const boost::shared_ptr<DecodedTiledPyramid>& pyramid)
+      {
+      }
     };
 
   private:
@@ -51,30 +73,42 @@ namespace OrthancWSI
 
     typedef std::pair<std::string, unsigned int> FrameIdentifier;  // Associates an instance ID with a frame number
 
-    typedef Orthanc::LeastRecentlyUsedIndex<FrameIdentifier, CachedPyramid*>  Cache;
+    typedef boost::shared_ptr<CachedPyramid>  CachedHandle;
+
+    typedef Orthanc::LeastRecentlyUsedIndex<FrameIdentifier, CachedHandle>  Cache;
+
+    typedef std::vector<std::pair<FrameIdentifier, CachedHandle> >  Evicted;
 
     std::unique_ptr<IPyramidFetcher> fetcher_;
 
-    boost::mutex  mutex_;
-    size_t        maxCount_;
-    size_t        maxMemory_;
-    size_t        memoryUsage_;
-    Cache         cache_;
+    boost::mutex                mutex_;
+    boost::condition_variable   fetched_;
+    size_t                      maxCount_;
+    size_t                      maxMemory_;
+    size_t                      memoryUsage_;
+    Cache                       cache_;
+    std::set<FrameIdentifier>   cached_;  // Same content as "cache_", sorted by instance
+    std::set<FrameIdentifier>   fetching_;
 
     bool SanityCheck();
 
-    void MakeRoom(size_t memory);
+    void RemoveOldest(Evicted& evicted);
+
+    void MakeRoom(Evicted& evicted,
+                  size_t memory);
 
-    CachedPyramid* Store(FrameIdentifier identifier,
-                         DecodedTiledPyramid* pyramid);
+    void NotifyEvicted(const Evicted& evicted);
+
+    CachedHandle GetPyramid(const FrameIdentifier& identifier);
+
+    void UpdateMemoryUsage(const FrameIdentifier& identifier,
+                           CachedHandle pyramid);
 
     DecodedPyramidCache(IPyramidFetcher* fetcher /* takes ownership */,
                           size_t maxCount,
                           size_t maxMemory);
 
   public:
-    ~DecodedPyramidCache();
-
     static void InitializeInstance(IPyramidFetcher* fetcher,
                                    size_t maxSize,
                                    size_t maxMemory);
@@ -83,21 +117,33 @@ namespace OrthancWSI
 
     static DecodedPyramidCache& GetInstance();
 
+    // Removes all the frames of one instance, without notifying the
+    // fetcher, as the instance has been deleted
+    void Invalidate(const std::string& instanceId);
+
+    /**
+     * The accessor holds a reference to the pyramid, but not the
+     * mutex of the cache: The pyramid survives its eviction from the
+     * cache until the last accessor is destroyed, and the tiles of
+     * the same frame can be decoded concurrently.
+     **/
     class Accessor : public boost::noncopyable
     {
     private:
-      boost::mutex::scoped_lock lock_;
-      FrameIdentifier           identifier_;
-      CachedPyramid*            pyramid_;
+      DecodedPyramidCache&  that_;
+      FrameIdentifier       identifier_;
+      CachedHandle          pyramid_;
 
     public:
       Accessor(DecodedPyramidCache& that,
                const std::string& instanceId,
                unsigned int frameNumber);
 
+      ~Accessor();
+
       bool IsValid() const
       {
-        return pyramid_ != NULL;
+        return pyramid_.get() != NULL;
       }
 
       const std::string& GetInstanceId() const
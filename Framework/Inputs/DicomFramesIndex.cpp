@@ -0,0 +1,656 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../PrecompiledHeadersWSI.h"
+#include "DicomFramesIndex.h"
+
+#include "../LittleEndian.h"
+
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <boost/lexical_cast.hpp>
+#include <string.h>
+
+
+static const uint32_t UNDEFINED_LENGTH = 0xffffffffu;
+
+static const char* const INDEX_MAGIC = "WSIFRAME";
+static const uint32_t    INDEX_VERSION = 1;
+
+
+namespace OrthancWSI
+{
+  namespace
+  {
+    struct ElementHeader
+    {
+      uint16_t     group_;
+      uint16_t     element_;
+      std::string  vr_;
+      uint32_t     length_;
+
+      bool Is(uint16_t group,
+              uint16_t element) const
+      {
+        return (group_ == group &&
+                element_ == element);
+      }
+    };
+  }
+
+
+  static bool ReadElementHeader(ElementHeader& header,
+                                LittleEndian::Reader& reader,
+                                bool explicitVR)
+  {
+    if (!reader.ReadUInt16(header.group_) ||
+        !reader.ReadUInt16(header.element_))
+    {
+      return false;
+    }
+
+    header.vr_.clear();
+
+    if (header.group_ == 0xfffe ||  // Items and delimiters have no VR
+        !explicitVR)
+    {
+      return reader.ReadUInt32(header.length_);
+    }
+
+    if (!reader.ReadString(header.vr_, 2))
+    {
+      return false;
+    }
+
+    // PS3.5 Section 7.1.2: VRs with a 32-bit length
+    if (header.vr_ == "OB" || header.vr_ == "OD" || header.vr_ == "OF" ||
+        header.vr_ == "OL" || header.vr_ == "OV" || header.vr_ == "OW" ||
+        header.vr_ == "SQ" || header.vr_ == "SV" || header.vr_ == "UC" ||
+        header.vr_ == "UN" || header.vr_ == "UR" || header.vr_ == "UT" ||
+        header.vr_ == "UV")
+    {
+      return (reader.Skip(2) &&
+              reader.ReadUInt32(header.length_));
+    }
+    else
+    {
+      uint16_t length;
+      if (reader.ReadUInt16(length))
+      {
+        header.length_ = length;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+  }
+
+
+  static bool SkipValue(LittleEndian::Reader& reader,
+                        const ElementHeader& header,
+                        bool explicitVR);
+
+
+  static bool SkipSequence(LittleEndian::Reader& reader,
+                           bool explicitVR)
+  {
+    // Sequence of undefined length: Loop over the items until the
+    // sequence delimitation item
+    for (;;)
+    {
+      ElementHeader item;
+      if (!ReadElementHeader(item, reader, explicitVR))
+      {
+        return false;
+      }
+      else if (item.Is(0xfffe, 0xe0dd))
+      {
+        return true;
+      }
+      else if (!item.Is(0xfffe, 0xe000))
+      {
+        return false;
+      }
+      else if (item.length_ != UNDEFINED_LENGTH)
+      {
+        if (!reader.Skip(item.length_))
+        {
+          return false;
+        }
+      }
+      else
+      {
+        // Item of undefined length: Loop over its elements until the
+        // item delimitation item
+        for (;;)
+        {
+          ElementHeader element;
+          if (!ReadElementHeader(element, reader, explicitVR))
+          {
+            return false;
+          }
+          else if (element.Is(0xfffe, 0xe00d))
+          {
+            break;
+          }
+          else if (element.group_ == 0xfffe ||
+                   !SkipValue(reader, element, explicitVR))
+          {
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+
+  static bool SkipValue(LittleEndian::Reader& reader,
+                        const ElementHeader& header,
+                        bool explicitVR)
+  {
+    if (header.length_ == UNDEFINED_LENGTH)
+    {
+      // The content of a "UN" element of undefined length is always
+      // encoded as implicit VR little endian (PS3.5 Section 6.2.2)
+      return SkipSequence(reader, header.vr_ == "UN" ? false : explicitVR);
+    }
+    else
+    {
+      return reader.Skip(header.length_);
+    }
+  }
+
+
+  static bool ReadUInt16Value(uint16_t& value,
+                              LittleEndian::Reader& reader,
+                              const ElementHeader& header)
+  {
+    return (header.length_ == 2 &&
+            reader.ReadUInt16(value));
+  }
+
+
+  static bool IsFrameStart(const uint8_t* fragment,
+                           uint64_t size)
+  {
+    static const uint8_t JP2_SIGNATURE[] = { 0x00, 0x00, 0x00, 0x0c, 0x6a, 0x50, 0x20, 0x20 };
+
+    return ((size >= 2 && fragment[0] == 0xff && fragment[1] == 0xd8) ||   // JPEG or JPEG-LS (SOI marker)
+            (size >= 2 && fragment[0] == 0xff && fragment[1] == 0x4f) ||   // JPEG 2000 codestream (SOC marker)
+            (size >= sizeof(JP2_SIGNATURE) && memcmp(fragment, JP2_SIGNATURE, sizeof(JP2_SIGNATURE)) == 0));
+  }
+
+
+  bool DicomFramesIndex::Parse(const void* dicom,
+                               size_t size)
+  {
+    fileSize_ = size;
+    frames_.clear();
+
+    if (size < 132 ||
+        memcmp(reinterpret_cast<const uint8_t*>(dicom) + 128, "DICM", 4) != 0)
+    {
+      return false;
+    }
+
+    LittleEndian::Reader reader(dicom, size, 132);
+
+    // The file meta information is always explicit VR little endian
+    std::string transferSyntax;
+
+    for (;;)
+    {
+      uint16_t group;
+      if (!reader.PeekUInt16(group))
+      {
+        return false;
+      }
+      else if (group != 0x0002)
+      {
+        break;
+      }
+
+      ElementHeader header;
+      if (!ReadElementHeader(header, reader, true))
+      {
+        return false;
+      }
+      else if (header.Is(0x0002, 0x0010))
+      {
+        if (header.length_ == UNDEFINED_LENGTH ||
+            !reader.ReadString(transferSyntax, header.length_))
+        {
+          return false;
+        }
+
+        // Remove the padding
+        while (!transferSyntax.empty() &&
+               (transferSyntax[transferSyntax.size() - 1] == '\0' ||
+                transferSyntax[transferSyntax.size() - 1] == ' '))
+        {
+          transferSyntax.resize(transferSyntax.size() - 1);
+        }
+      }
+      else if (!SkipValue(reader, header, true))
+      {
+        return false;
+      }
+    }
+
+    if (transferSyntax == "1.2.840.10008.1.2.2" ||    // Explicit VR big endian
+        transferSyntax == "1.2.840.10008.1.2.1.99")   // Deflated explicit VR little endian
+    {
+      return false;
+    }
+
+    const bool explicitVR = (transferSyntax != "1.2.840.10008.1.2");  // Implicit VR little endian
+
+    unsigned int framesCount = 1;
+    uint16_t rows = 0;
+    uint16_t columns = 0;
+    uint16_t samplesPerPixel = 1;
+    uint16_t bitsAllocated = 0;
+    std::vector<uint64_t> extendedOffsets;
+
+    for (;;)
+    {
+      ElementHeader header;
+      if (!ReadElementHeader(header, reader, explicitVR))
+      {
+        return false;  // No pixel data
+      }
+
+      if (header.Is(0x0028, 0x0008))  // Number of Frames
+      {
+        std::string s;
+        if (header.length_ == UNDEFINED_LENGTH ||
+            !reader.ReadString(s, header.length_))
+        {
+          return false;
+        }
+
+        try
+        {
+          int count = boost::lexical_cast<int>(Orthanc::Toolbox::StripSpaces(s));
+          if (count <= 0)
+          {
+            return false;
+          }
+
+          framesCount = static_cast<unsigned int>(count);
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+          return false;
+        }
+      }
+      else if (header.Is(0x0028, 0x0002))  // Samples per Pixel
+      {
+        if (!ReadUInt16Value(samplesPerPixel, reader, header))
+        {
+          return false;
+        }
+      }
+      else if (header.Is(0x0028, 0x0010))  // Rows
+      {
+        if (!ReadUInt16Value(rows, reader, header))
+        {
+          return false;
+        }
+      }
+      else if (header.Is(0x0028, 0x0011))  // Columns
+      {
+        if (!ReadUInt16Value(columns, reader, header))
+        {
+          return false;
+        }
+      }
+      else if (header.Is(0x0028, 0x0100))  // Bits Allocated
+      {
+        if (!ReadUInt16Value(bitsAllocated, reader, header))
+        {
+          return false;
+        }
+      }
+      else if (header.Is(0x7fe0, 0x0001))  // Extended Offset Table
+      {
+        // Check the length against the buffer before allocating
+        if (header.length_ == UNDEFINED_LENGTH ||
+            header.length_ % 8 != 0 ||
+            header.length_ > reader.GetRemainingSize())
+        {
+          return false;
+        }
+
+        extendedOffsets.resize(header.length_ / 8);
+        for (size_t i = 0; i < extendedOffsets.size(); i++)
+        {
+          if (!reader.ReadUInt64(extendedOffsets[i]))
+          {
+            return false;
+          }
+        }
+      }
+      else if (header.Is(0x7fe0, 0x0010))  // Pixel Data
+      {
+        if (header.length_ != UNDEFINED_LENGTH)
+        {
+          // Native pixel data: The frames are contiguous
+          if (bitsAllocated == 0 ||
+              bitsAllocated % 8 != 0)
+          {
+            return false;  // Bit-packed frames (e.g. 1 bit per pixel) are not aligned on bytes
+          }
+
+          const uint64_t frameSize = (static_cast<uint64_t>(rows) * static_cast<uint64_t>(columns) *
+                                      static_cast<uint64_t>(samplesPerPixel) * (bitsAllocated / 8));
+
+          if (frameSize == 0 ||
+              framesCount > header.length_ / frameSize ||  // Avoids overflows
+              !reader.Skip(header.length_))
+          {
+            return false;
+          }
+
+          const uint64_t start = reader.GetPosition() - header.length_;
+
+          frames_.resize(framesCount);
+          for (unsigned int i = 0; i < framesCount; i++)
+          {
+            frames_[i].push_back(Fragment(start + i * frameSize, frameSize));
+          }
+
+          return true;
+        }
+
+        // Encapsulated pixel data, starting with the Basic Offset Table
+        ElementHeader item;
+        if (!ReadElementHeader(item, reader, explicitVR) ||
+            !item.Is(0xfffe, 0xe000) ||
+            item.length_ == UNDEFINED_LENGTH ||
+            item.length_ % 4 != 0 ||
+            item.length_ > reader.GetRemainingSize())
+        {
+          return false;
+        }
+
+        std::vector<uint64_t> basicOffsets(item.length_ / 4);
+        for (size_t i = 0; i < basicOffsets.size(); i++)
+        {
+          uint32_t offset;
+          if (!reader.ReadUInt32(offset))
+          {
+            return false;
+          }
+
+          basicOffsets[i] = offset;
+        }
+
+        // The offsets of both tables are relative to the first byte
+        // of the item tag of the first fragment
+        const uint64_t base = reader.GetPosition();
+
+        std::vector<uint64_t> itemOffsets;   // Relative to "base"
+        Fragments fragments;
+
+        for (;;)
+        {
+          const uint64_t position = reader.GetPosition();
+
+          if (!ReadElementHeader(item, reader, explicitVR))
+          {
+            return false;
+          }
+          else if (item.Is(0xfffe, 0xe0dd))
+          {
+            break;
+          }
+          else if (!item.Is(0xfffe, 0xe000) ||
+                   item.length_ == UNDEFINED_LENGTH ||
+                   !reader.Skip(item.length_))
+          {
+            return false;
+          }
+
+          itemOffsets.push_back(position - base);
+          fragments.push_back(Fragment(reader.GetPosition() - item.length_, item.length_));
+        }
+
+        if (fragments.empty() ||
+            framesCount > fragments.size())  // Each frame has at least one fragment
+        {
+          return false;
+        }
+
+        const std::vector<uint64_t>* offsets = NULL;
+        if (extendedOffsets.size() == framesCount)
+        {
+          offsets = &extendedOffsets;
+        }
+        else if (basicOffsets.size() == framesCount)
+        {
+          offsets = &basicOffsets;
+        }
+
+        frames_.resize(framesCount);
+
+        if (framesCount == 1)
+        {
+          frames_[0] = fragments;
+        }
+        else if (offsets != NULL)
+        {
+          // Attribute each fragment to the last frame that starts
+          // before it
+          size_t frame = 0;
+          for (size_t i = 0; i < fragments.size(); i++)
+          {
+            while (frame + 1 < framesCount &&
+                   (*offsets) [frame + 1] <= itemOffsets[i])
+            {
+              frame++;
+            }
+
+            if ((*offsets) [frame] > itemOffsets[i])
+            {
+              return false;
+            }
+
+            frames_[frame].push_back(fragments[i]);
+          }
+        }
+        else if (fragments.size() == framesCount)
+        {
+          // Empty offset table, but one fragment per frame
+          for (size_t i = 0; i < fragments.size(); i++)
+          {
+            frames_[i].push_back(fragments[i]);
+          }
+        }
+        else
+        {
+          // Empty offset table, and several fragments per frame:
+          // Detect the beginning of the frames from the signatures of
+          // the codestreams
+          size_t frame = 0;
+          for (size_t i = 0; i < fragments.size(); i++)
+          {
+            if (i > 0 &&
+                IsFrameStart(reader.GetData() + fragments[i].offset_, fragments[i].size_))
+            {
+              frame++;
+            }
+
+            if (frame >= framesCount)
+            {
+              return false;
+            }
+
+            frames_[frame].push_back(fragments[i]);
+          }
+        }
+
+        for (size_t i = 0; i < frames_.size(); i++)
+        {
+          if (frames_[i].empty())
+          {
+            frames_.clear();
+            return false;
+          }
+        }
+
+        return true;
+      }
+      else if (!SkipValue(reader, header, explicitVR))
+      {
+        return false;
+      }
+    }
+  }
+
+
+  void DicomFramesIndex::Serialize(std::string& target) const
+  {
+    target.assign(INDEX_MAGIC, strlen(INDEX_MAGIC));
+    LittleEndian::WriteUInt32(target, INDEX_VERSION);
+    LittleEndian::WriteUInt64(target, fileSize_);
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(frames_.size()));
+
+    for (size_t i = 0; i < frames_.size(); i++)
+    {
+      LittleEndian::WriteUInt32(target, static_cast<uint32_t>(frames_[i].size()));
+
+      for (size_t j = 0; j < frames_[i].size(); j++)
+      {
+        LittleEndian::WriteUInt64(target, frames_[i][j].offset_);
+        LittleEndian::WriteUInt64(target, frames_[i][j].size_);
+      }
+    }
+  }
+
+
+  bool DicomFramesIndex::Unserialize(const std::string& source)
+  {
+    fileSize_ = 0;
+    frames_.clear();
+
+    const size_t magicSize = strlen(INDEX_MAGIC);
+
+    if (source.size() < magicSize ||
+        source.compare(0, magicSize, INDEX_MAGIC) != 0)
+    {
+      return false;
+    }
+
+    LittleEndian::Reader reader(source.c_str(), source.size(), magicSize);
+
+    uint32_t version, framesCount;
+    if (!reader.ReadUInt32(version) ||
+        version != INDEX_VERSION ||
+        !reader.ReadUInt64(fileSize_) ||
+        !reader.ReadUInt32(framesCount) ||
+        framesCount > reader.GetRemainingSize() / 20)  // Each frame takes at least 20 bytes, check before allocating
+    {
+      return false;
+    }
+
+    std::vector<Fragments> frames(framesCount);
+
+    for (uint32_t i = 0; i < framesCount; i++)
+    {
+      uint32_t fragmentsCount;
+      if (!reader.ReadUInt32(fragmentsCount) ||
+          fragmentsCount == 0)
+      {
+        return false;
+      }
+
+      for (uint32_t j = 0; j < fragmentsCount; j++)
+      {
+        uint64_t offset, size;
+        if (!reader.ReadUInt64(offset) ||
+            !reader.ReadUInt64(size) ||
+            offset > fileSize_ ||
+            size > fileSize_ - offset)
+        {
+          return false;
+        }
+
+        frames[i].push_back(Fragment(offset, size));
+      }
+    }
+
+    if (!reader.IsEnd())
+    {
+      return false;
+    }
+
+    frames_.swap(frames);
+    return true;
+  }
+
+
+  void DicomFramesIndex::ExtractFrame(std::string& target,
+                                      const void* dicom,
+                                      size_t size,
+                                      unsigned int frame) const
+  {
+    if (size != fileSize_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                      "The DICOM file does not match its index of frames");
+    }
+
+    if (frame >= frames_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const Fragments& fragments = frames_[frame];
+    const char* data = reinterpret_cast<const char*>(dicom);
+
+    if (fragments.size() == 1)
+    {
+      target.assign(data + fragments[0].offset_, fragments[0].size_);
+    }
+    else
+    {
+      size_t total = 0;
+      for (size_t i = 0; i < fragments.size(); i++)
+      {
+        total += fragments[i].size_;
+      }
+
+      target.clear();
+      target.reserve(total);
+
+      for (size_t i = 0; i < fragments.size(); i++)
+      {
+        target.append(data + fragments[i].offset_, fragments[i].size_);
+      }
+    }
+  }
+}
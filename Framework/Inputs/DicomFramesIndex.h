@@ -0,0 +1,98 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Location of the raw frames inside a DICOM file, which allows to
+   * extract one frame without parsing the file. The index is built
+   * from the Extended or Basic Offset Table of encapsulated pixel
+   * data, or from a scan of the fragments if these tables are
+   * empty. It can be serialized to be stored next to the DICOM file.
+   **/
+  class DicomFramesIndex : public boost::noncopyable
+  {
+  private:
+    struct Fragment
+    {
+      uint64_t  offset_;
+      uint64_t  size_;
+
+      Fragment(uint64_t offset,
+               uint64_t size) :
+        offset_(offset),
+        size_(size)
+      {
+      }
+    };
+
+    typedef std::vector<Fragment>  Fragments;
+
+    uint64_t                fileSize_;
+    std::vector<Fragments>  frames_;
+
+  public:
+    DicomFramesIndex() :
+      fileSize_(0)
+    {
+    }
+
+    /**
+     * Returns "false" if the layout of the file is not supported, in
+     * which case the frames must be read using a full DICOM parser
+     * (e.g. big endian or deflated transfer syntaxes, or fragments
+     * that cannot be unambiguously attributed to the frames).
+     **/
+    bool Parse(const void* dicom,
+               size_t size);
+
+    void Serialize(std::string& target) const;
+
+    // Returns "false" if the serialized index is corrupted
+    bool Unserialize(const std::string& source);
+
+    uint64_t GetFileSize() const
+    {
+      return fileSize_;
+    }
+
+    unsigned int GetFramesCount() const
+    {
+      return static_cast<unsigned int>(frames_.size());
+    }
+
+    // Copies the raw frame, concatenating its fragments if need be
+    void ExtractFrame(std::string& target,
+                      const void* dicom,
+                      size_t size,
+                      unsigned int frame) const;
+  };
+}
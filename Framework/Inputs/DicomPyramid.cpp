@@ -26,14 +26,37 @@
 
 #include "../ImageToolbox.h"
 #include "../DicomToolbox.h"
+#include "../LittleEndian.h"
+#include "../MultiThreading/BagOfTasksProcessor.h"
 
 #include <Compatibility.h>
+#include <Images/Image.h>
+#include <Images/ImageProcessing.h>
 #include <Logging.h>
 #include <OrthancException.h>
 #include <Toolbox.h>
 
 #include <algorithm>
+#include <boost/lexical_cast.hpp>
 #include <cassert>
+#include <string.h>
+
+
+// Maximum number of bytes of the encoded synthetic tiles of one pyramid
+static const size_t MAX_SYNTHETIC_TILES_MEMORY = 16 * 1024 * 1024;
+
+// Binary index of the instances of the pyramid, encoded as Base64
+#define SERIES_INDEX_METADATA  "4202"
+
+static const char* const SERIES_INDEX_MAGIC = "WSIINDEX";
+static const uint32_t    SERIES_INDEX_VERSION = 2;
+
+// Maximum number of instances whose tags are loaded concurrently
+static const size_t MAX_LOADING_THREADS = 4;
+
+// Pool of threads shared by the constructions of all the pyramids
+static std::unique_ptr<OrthancWSI::BagOfTasksProcessor>  loadingProcessor_;
+
 
 namespace OrthancWSI
 {
@@ -47,6 +70,40 @@ namespace OrthancWSI
   };
 
 
+  class DicomPyramid::SyntheticTile : public boost::noncopyable
+  {
+  private:
+    std::string       encoded_;   // Empty if the tile is empty
+    ImageCompression  compression_;
+
+  public:
+    SyntheticTile() :
+      compression_(ImageCompression_Jpeg)
+    {
+    }
+
+    std::string& GetEncoded()
+    {
+      return encoded_;
+    }
+
+    const std::string& GetEncoded() const
+    {
+      return encoded_;
+    }
+
+    ImageCompression GetCompression() const
+    {
+      return compression_;
+    }
+
+    void SetCompression(ImageCompression compression)
+    {
+      compression_ = compression;
+    }
+  };
+
+
   void DicomPyramid::Clear()
   {
     for (size_t i = 0; i < levels_.size(); i++)
@@ -67,11 +124,142 @@ namespace OrthancWSI
   }
 
 
-  void DicomPyramid::RegisterInstances(const std::string& seriesId,
-                                       bool useCache)
+  class DicomPyramid::LoadInstanceCommand : public ICommand
+  {
+  private:
+    OrthancStone::IOrthancConnection&  orthanc_;
+    std::string                        instanceId_;
+    bool                               useCache_;
+    DicomPyramidInstance*&             target_;
+
+  public:
+    LoadInstanceCommand(OrthancStone::IOrthancConnection& orthanc,
+                        const std::string& instanceId,
+                        bool useCache,
+                        DicomPyramidInstance*& target) :
+      orthanc_(orthanc),
+      instanceId_(instanceId),
+      useCache_(useCache),
+      target_(target)
+    {
+    }
+
+    virtual bool Execute() ORTHANC_OVERRIDE
+    {
+      // Each command only writes to its own slot, so no mutex is needed
+      try
+      {
+        std::unique_ptr<DicomPyramidInstance> instance(new DicomPyramidInstance(orthanc_, instanceId_, useCache_));
+
+        if (useCache_)
+        {
+          // The compression is part of the index of the series: Detect
+          // it here, on the pool of threads, rather than while storing
+          // the index with one sequential call per instance
+          instance->GetImageCompression(orthanc_);
+        }
+
+        target_ = instance.release();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // The slot stays NULL, which prevents the index of the series from being stored
+        LOG(ERROR) << "Skipping a DICOM instance that is not part of a whole-slide image: " << instanceId_
+                   << " (" << e.What() << ")";
+      }
+
+      return true;
+    }
+  };
+
+
+  static bool IsPyramidImageType(const std::string& imageType)
+  {
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, imageType, '\\');
+
+    /**
+     * Don't consider the "LABEL" and "OVERVIEW" that are not part
+     * of the pyramid. Originally introduced in release 1.0, but
+     * fixed in release 3.1.
+     * https://dicom.nema.org/medical/dicom/current/output/chtml/part03/sect_C.8.12.4.html#sect_C.8.12.4.1.1
+     **/
+    return (tokens.size() < 3 ||
+            tokens[2] == "VOLUME" ||
+            tokens[2] == "THUMBNAIL" /* "may be the apex (lowest resolution) layer of a Multi-Resolution Pyramid" */);
+  }
+
+
+  static bool ListInstancesWithImageType(std::vector<std::string>& instances,
+                                         std::vector<std::string>& listed,  // Including those that are not part of the pyramid
+                                         OrthancStone::IOrthancConnection& orthanc,
+                                         const std::string& seriesId)
+  {
+    /**
+     * Since Orthanc 1.11.0, the "requestedTags" argument gives access
+     * to the "ImageType" of all the instances of the series in one
+     * single call, which allows to discard the "LABEL" and "OVERVIEW"
+     * images before loading their tags. Older versions of Orthanc
+     * silently ignore this argument.
+     **/
+    Json::Value series;
+
+    try
+    {
+      OrthancStone::IOrthancConnection::RestApiGet(series, orthanc, "/series/" + seriesId + "/instances?expand&requestedTags=ImageType");
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;
+    }
+
+    if (series.type() != Json::arrayValue)
+    {
+      return false;
+    }
+
+    std::vector<std::string> result, all;
+    result.reserve(series.size());
+    all.reserve(series.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
+    {
+      if (series[i].type() != Json::objectValue ||
+          !series[i].isMember("ID") ||
+          series[i]["ID"].type() != Json::stringValue ||
+          !series[i].isMember("RequestedTags") ||
+          series[i]["RequestedTags"].type() != Json::objectValue)
+      {
+        return false;
+      }
+
+      const Json::Value& tags = series[i]["RequestedTags"];
+      all.push_back(series[i]["ID"].asString());
+
+      if (!tags.isMember("ImageType") ||
+          tags["ImageType"].type() != Json::stringValue ||
+          IsPyramidImageType(tags["ImageType"].asString()))
+      {
+        result.push_back(series[i]["ID"].asString());
+      }
+      else
+      {
+        LOG(INFO) << "Skipping a DICOM instance that is not part of the pyramid: " << series[i]["ID"].asString();
+      }
+    }
+
+    instances.swap(result);
+    listed.swap(all);
+    return true;
+  }
+
+
+  static void ListInstances(std::vector<std::string>& instances,
+                            OrthancStone::IOrthancConnection& orthanc,
+                            const std::string& seriesId)
   {
     Json::Value series;
-    OrthancStone::IOrthancConnection::RestApiGet(series, orthanc_, "/series/" + seriesId);
+    OrthancStone::IOrthancConnection::RestApiGet(series, orthanc, "/series/" + seriesId);
 
     if (series.type() != Json::objectValue ||
         !series.isMember("Instances") ||
@@ -80,34 +268,128 @@ namespace OrthancWSI
       throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
     }
 
-    const Json::Value& instances = series["Instances"];
-    instances_.reserve(instances.size());
+    const Json::Value& items = series["Instances"];
+    instances.reserve(items.size());
 
-    for (Json::Value::ArrayIndex i = 0; i < instances.size(); i++)
+    for (Json::Value::ArrayIndex i = 0; i < items.size(); i++)
     {
-      if (instances[i].type() != Json::stringValue)
+      if (items[i].type() != Json::stringValue)
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
       }
 
-      std::string instanceId = instances[i].asString();
+      instances.push_back(items[i].asString());
+    }
+  }
 
-      try
+
+  static std::string ComputeInstancesFingerprint(const std::vector<std::string>& instances)
+  {
+    // The fingerprint doesn't depend on the order of the instances
+    std::vector<std::string> sorted(instances);
+    std::sort(sorted.begin(), sorted.end());
+
+    std::string s;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      s += sorted[i] + "|";
+    }
+
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, s);
+
+    return boost::lexical_cast<std::string>(sorted.size()) + "-" + md5;
+  }
+
+
+  bool DicomPyramid::RegisterInstances(const std::string& seriesId,
+                                       bool useCache,
+                                       const std::string& fingerprint)
+  {
+    std::vector<std::string> instanceIds, listed;
+
+    if (!ListInstancesWithImageType(instanceIds, listed, orthanc_, seriesId))
+    {
+      ListInstances(instanceIds, orthanc_, seriesId);
+      listed = instanceIds;
+    }
+
+    // The index can only be stored if the instances of the series
+    // have not changed since its fingerprint was computed
+    bool isComplete = (!fingerprint.empty() &&
+                       ComputeInstancesFingerprint(listed) == fingerprint);
+
+    /**
+     * The instances are loaded concurrently, as each of them requires
+     * at least one call to the REST API of Orthanc. The connection
+     * must be thread-safe, which is the case of the connection of
+     * the plugin. The results are kept in the order of the series.
+     **/
+    std::vector<DicomPyramidInstance*> loaded(instanceIds.size(), NULL);
+
+    try
+    {
+      if (instanceIds.size() == 1)
       {
-        std::unique_ptr<DicomPyramidInstance> instance(new DicomPyramidInstance(orthanc_, instanceId, useCache));
-
-        std::vector<std::string> tokens;
-        Orthanc::Toolbox::TokenizeString(tokens, instance->GetImageType(), '\\');
-
-        /**
-         * Don't consider the "LABEL" and "OVERVIEW" that are not part
-         * of the pyramid. Originally introduced in release 1.0, but
-         * fixed in release 3.1.
-         * https://dicom.nema.org/medical/dicom/current/output/chtml/part03/sect_C.8.12.4.html#sect_C.8.12.4.1.1
-         **/
-        if (tokens.size() < 3 ||
-            tokens[2] == "VOLUME" ||
-            tokens[2] == "THUMBNAIL" /* "may be the apex (lowest resolution) layer of a Multi-Resolution Pyramid" */)
+        LoadInstanceCommand command(orthanc_, instanceIds[0], useCache, loaded[0]);
+        command.Execute();
+      }
+      else if (instanceIds.size() > 1)
+      {
+        BagOfTasks tasks;
+
+        for (size_t i = 0; i < instanceIds.size(); i++)
+        {
+          tasks.Push(new LoadInstanceCommand(orthanc_, instanceIds[i], useCache, loaded[i]));
+        }
+
+        std::unique_ptr<BagOfTasksProcessor> temporary;
+        BagOfTasksProcessor* processor = loadingProcessor_.get();
+
+        if (processor == NULL)
+        {
+          // No shared pool, as in the command-line tools that open one single pyramid
+          temporary.reset(new BagOfTasksProcessor(std::min(instanceIds.size(), MAX_LOADING_THREADS)));
+          processor = temporary.get();
+        }
+
+        // The commands never open a pyramid, so they cannot wait for
+        // the shared pool themselves
+        std::unique_ptr<BagOfTasksProcessor::Handle> handle(processor->Submit(tasks));
+
+        if (!handle->Join())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                          "Cannot load the instances of series: " + seriesId);
+        }
+      }
+    }
+    catch (...)
+    {
+      for (size_t i = 0; i < loaded.size(); i++)
+      {
+        delete loaded[i];
+      }
+
+      throw;
+    }
+
+    instances_.reserve(loaded.size());
+
+    for (size_t i = 0; i < loaded.size(); i++)
+    {
+      if (loaded[i] == NULL)
+      {
+        // This instance could not be loaded (e.g. network error)
+        isComplete = false;
+      }
+      else
+      {
+        std::unique_ptr<DicomPyramidInstance> instance(loaded[i]);
+
+        // The "ImageType" is checked again, in the case where the
+        // bulk request was not available
+        if (IsPyramidImageType(instance->GetImageType()))
         {
           if (instance->HasBackgroundColor())
           {
@@ -119,11 +401,146 @@ namespace OrthancWSI
           instances_.push_back(instance.release());
         }
       }
-      catch (Orthanc::OrthancException&)
+    }
+
+    return isComplete;
+  }
+
+
+  bool DicomPyramid::LoadSeriesIndex(bool& hasLastUpdate,
+                                     std::string& lastUpdate,
+                                     const std::string& seriesId,
+                                     const std::string& fingerprint)
+  {
+    /**
+     * The "LastUpdate" metadata of the series changes whenever an
+     * instance is added to the series, but only has a precision of
+     * one second, and doesn't change if an instance is deleted. The
+     * index is thus only used if it was built both for the same
+     * "LastUpdate" and for the same set of instances, as summarized
+     * by their fingerprint.
+     **/
+    hasLastUpdate = false;
+
+    Json::Value metadata;
+
+    try
+    {
+      OrthancStone::IOrthancConnection::RestApiGet(metadata, orthanc_, "/series/" + seriesId + "/metadata?expand");
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;
+    }
+
+    if (metadata.type() != Json::objectValue ||
+        !metadata.isMember("LastUpdate") ||
+        metadata["LastUpdate"].type() != Json::stringValue)
+    {
+      return false;
+    }
+
+    hasLastUpdate = true;
+    lastUpdate = metadata["LastUpdate"].asString();
+
+    if (!metadata.isMember(SERIES_INDEX_METADATA) ||
+        metadata[SERIES_INDEX_METADATA].type() != Json::stringValue)
+    {
+      return false;  // No index yet
+    }
+
+    std::string index;
+
+    try
+    {
+      Orthanc::Toolbox::DecodeBase64(index, metadata[SERIES_INDEX_METADATA].asString());
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;
+    }
+
+    const size_t magicSize = strlen(SERIES_INDEX_MAGIC);
+    if (index.size() < magicSize ||
+        index.compare(0, magicSize, SERIES_INDEX_MAGIC) != 0)
+    {
+      return false;
+    }
+
+    LittleEndian::Reader reader(index.c_str(), index.size(), magicSize);
+
+    uint32_t version, lastUpdateSize, fingerprintSize, background, countInstances;
+    std::string indexedLastUpdate, indexedFingerprint;
+
+    if (!reader.ReadUInt32(version) ||
+        version != SERIES_INDEX_VERSION ||
+        !reader.ReadUInt32(lastUpdateSize) ||
+        !reader.ReadString(indexedLastUpdate, lastUpdateSize) ||
+        indexedLastUpdate != lastUpdate ||
+        !reader.ReadUInt32(fingerprintSize) ||
+        !reader.ReadString(indexedFingerprint, fingerprintSize) ||
+        indexedFingerprint != fingerprint ||
+        !reader.ReadUInt32(background) ||
+        !reader.ReadUInt32(countInstances) ||
+        countInstances == 0)
+    {
+      return false;  // Different version of the plugin, or outdated index
+    }
+
+    std::vector<DicomPyramidInstance*> instances;
+
+    for (uint32_t i = 0; i < countInstances; i++)
+    {
+      DicomPyramidInstance* instance = DicomPyramidInstance::ReadSeriesIndex(reader);
+
+      if (instance == NULL)
       {
-        LOG(ERROR) << "Skipping a DICOM instance that is not part of a whole-slide image: " << instanceId;
+        for (size_t j = 0; j < instances.size(); j++)
+        {
+          delete instances[j];
+        }
+
+        return false;
       }
+      else
+      {
+        instances.push_back(instance);
+      }
+    }
+
+    instances_.swap(instances);
+    backgroundRed_ = (background & 0xff);
+    backgroundGreen_ = ((background >> 8) & 0xff);
+    backgroundBlue_ = ((background >> 16) & 0xff);
+
+    return true;
+  }
+
+
+  void DicomPyramid::StoreSeriesIndex(const std::string& seriesId,
+                                      const std::string& lastUpdate,
+                                      const std::string& fingerprint)
+  {
+    std::string index(SERIES_INDEX_MAGIC);
+    LittleEndian::WriteUInt32(index, SERIES_INDEX_VERSION);
+    LittleEndian::WriteUInt32(index, static_cast<uint32_t>(lastUpdate.size()));
+    index.append(lastUpdate);
+    LittleEndian::WriteUInt32(index, static_cast<uint32_t>(fingerprint.size()));
+    index.append(fingerprint);
+    LittleEndian::WriteUInt32(index, (static_cast<uint32_t>(backgroundRed_) |
+                                      static_cast<uint32_t>(backgroundGreen_) << 8 |
+                                      static_cast<uint32_t>(backgroundBlue_) << 16));
+    LittleEndian::WriteUInt32(index, static_cast<uint32_t>(instances_.size()));
+
+    for (size_t i = 0; i < instances_.size(); i++)
+    {
+      assert(instances_[i] != NULL);
+      instances_[i]->WriteSeriesIndex(index);
     }
+
+    std::string encoded, tmp;
+    Orthanc::Toolbox::EncodeBase64(encoded, index);
+    orthanc_.RestApiPut(tmp, "/series/" + seriesId + "/metadata/" + SERIES_INDEX_METADATA, encoded);
   }
 
 
@@ -159,26 +576,282 @@ namespace OrthancWSI
 
   void DicomPyramid::CheckLevel(size_t level) const
   {
-    if (level >= levels_.size())
+    if (level >= GetLevelCount())
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
   }
 
 
+  void DicomPyramid::AddSyntheticLevels()
+  {
+    assert(!levels_.empty() &&
+           levels_.back() != NULL);
+
+    const DicomPyramidLevel& coarsest = *levels_.back();
+
+    unsigned int width = coarsest.GetTotalWidth();
+    unsigned int height = coarsest.GetTotalHeight();
+
+    if (coarsest.GetTileWidth() == 0 ||
+        coarsest.GetTileHeight() == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    while (width > coarsest.GetTileWidth() ||
+           height > coarsest.GetTileHeight())
+    {
+      width = CeilingDivision(width, 2);
+      height = CeilingDivision(height, 2);
+      syntheticWidths_.push_back(width);
+      syntheticHeights_.push_back(height);
+    }
+
+    if (!syntheticWidths_.empty())
+    {
+      LOG(INFO) << "The pyramid of series " << seriesId_ << " is incomplete, adding "
+                << syntheticWidths_.size() << " synthetic level(s)";
+    }
+  }
+
+
+  Orthanc::ImageAccessor* DicomPyramid::DecodeSourceTile(bool& isEmpty,
+                                                         ImageCompression& compression,
+                                                         unsigned int level,
+                                                         unsigned int tileX,
+                                                         unsigned int tileY)
+  {
+    std::string tile;
+
+    if (!ReadRawTile(tile, compression, level, tileX, tileY))
+    {
+      isEmpty = true;
+      return NULL;
+    }
+
+    isEmpty = false;
+
+    if (compression == ImageCompression_None)
+    {
+      return ImageToolbox::DecodeRawTile(tile, GetPixelFormat(), GetTileWidth(level), GetTileHeight(level));
+    }
+
+    std::unique_ptr<Orthanc::ImageAccessor> decoded(ImageToolbox::DecodeTile(tile, compression));
+
+    if (compression == ImageCompression_Jpeg2000)
+    {
+      switch (GetPhotometricInterpretation())
+      {
+        case Orthanc::PhotometricInterpretation_YBRFull:
+        case Orthanc::PhotometricInterpretation_YBRFull422:
+        case Orthanc::PhotometricInterpretation_YBRPartial420:
+        case Orthanc::PhotometricInterpretation_YBRPartial422:
+        case Orthanc::PhotometricInterpretation_YBR_ICT:
+        case Orthanc::PhotometricInterpretation_YBR_RCT:
+          ImageToolbox::ConvertJpegYCbCrToRgb(*decoded);
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    return decoded.release();
+  }
+
+
+  bool DicomPyramid::ReadSyntheticTile(std::string& tile,
+                                       ImageCompression& compression,
+                                       unsigned int level,
+                                       unsigned int tileX,
+                                       unsigned int tileY)
+  {
+    assert(IsSyntheticLevel(level) &&
+           level > 0);
+
+    if (tileX >= CeilingDivision(GetLevelWidth(level), GetTileWidth(level)) ||
+        tileY >= CeilingDivision(GetLevelHeight(level), GetTileHeight(level)))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const std::string key = (boost::lexical_cast<std::string>(level) + "-" +
+                             boost::lexical_cast<std::string>(tileX) + "-" +
+                             boost::lexical_cast<std::string>(tileY));
+
+    {
+      boost::mutex::scoped_lock lock(syntheticMutex_);
+
+      // If another thread is generating this tile, wait for it
+      while (syntheticLoading_.find(key) != syntheticLoading_.end())
+      {
+        syntheticLoaded_.wait(lock);
+      }
+
+      SyntheticTileHandle cached;
+      if (syntheticTiles_.Contains(key, cached))
+      {
+        syntheticTiles_.MakeMostRecent(key);
+
+        if (cached->GetEncoded().empty())
+        {
+          return false;
+        }
+        else
+        {
+          tile = cached->GetEncoded();
+          compression = cached->GetCompression();
+          return true;
+        }
+      }
+
+      syntheticLoading_.insert(key);
+    }
+
+    /**
+     * Generate the tile by downsampling the 2x2 tiles of the finer
+     * level, which is itself possibly synthetic. The mutex is not
+     * locked during this computation. The tiles of a synthetic level
+     * only depend on the tiles of finer levels, so the threads that
+     * generate different tiles never wait for each other in a cycle.
+     **/
+
+    SyntheticTileHandle generated(new SyntheticTile);
+
+    try
+    {
+      const unsigned int tileWidth = GetTileWidth(level);
+      const unsigned int tileHeight = GetTileHeight(level);
+      const unsigned int finer = level - 1;
+      const unsigned int finerCountX = CeilingDivision(GetLevelWidth(finer), GetTileWidth(finer));
+      const unsigned int finerCountY = CeilingDivision(GetLevelHeight(finer), GetTileHeight(finer));
+
+      Orthanc::Image mosaic(GetPixelFormat(), 2 * tileWidth, 2 * tileHeight, false);
+      ImageToolbox::Set(mosaic, backgroundRed_, backgroundGreen_, backgroundBlue_);
+
+      bool isEmpty = true;
+      bool isLossless = false;
+
+      for (unsigned int dy = 0; dy < 2; dy++)
+      {
+        for (unsigned int dx = 0; dx < 2; dx++)
+        {
+          if (2 * tileX + dx < finerCountX &&
+              2 * tileY + dy < finerCountY)
+          {
+            bool isSubTileEmpty;
+            ImageCompression subTileCompression;
+            std::unique_ptr<Orthanc::ImageAccessor> subTile(
+              DecodeSourceTile(isSubTileEmpty, subTileCompression, finer, 2 * tileX + dx, 2 * tileY + dy));
+
+            if (!isSubTileEmpty &&
+                subTile.get() != NULL)
+            {
+              ImageToolbox::Embed(mosaic, *subTile, dx * tileWidth, dy * tileHeight);
+              isEmpty = false;
+
+              if (subTileCompression != ImageCompression_Jpeg)
+              {
+                isLossless = true;
+              }
+            }
+          }
+        }
+      }
+
+      if (!isEmpty)
+      {
+        // Don't introduce lossy compression if the source is lossless
+        // (JPEG 2000, or uncompressed)
+        generated->SetCompression(isLossless ? ImageCompression_Png : ImageCompression_Jpeg);
+
+        std::unique_ptr<Orthanc::ImageAccessor> halved(
+          Orthanc::ImageProcessing::Halve(mosaic, false /* don't force minimal pitch */));
+        ImageToolbox::EncodeTile(generated->GetEncoded(), *halved, generated->GetCompression(), 90);
+      }
+    }
+    catch (...)
+    {
+      {
+        boost::mutex::scoped_lock lock(syntheticMutex_);
+        syntheticLoading_.erase(key);
+      }
+
+      syntheticLoaded_.notify_all();
+      throw;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(syntheticMutex_);
+
+      syntheticLoading_.erase(key);
+
+      if (!syntheticTiles_.Contains(key))
+      {
+        while (!syntheticTiles_.IsEmpty() &&
+               syntheticMemory_ + generated->GetEncoded().size() > MAX_SYNTHETIC_TILES_MEMORY)
+        {
+          SyntheticTileHandle oldest;
+          syntheticTiles_.RemoveOldest(oldest);
+          assert(syntheticMemory_ >= oldest->GetEncoded().size());
+          syntheticMemory_ -= oldest->GetEncoded().size();
+        }
+
+        syntheticTiles_.Add(key, generated);
+        syntheticMemory_ += generated->GetEncoded().size();
+      }
+    }
+
+    syntheticLoaded_.notify_all();
+
+    if (generated->GetEncoded().empty())
+    {
+      return false;
+    }
+    else
+    {
+      tile = generated->GetEncoded();
+      compression = generated->GetCompression();
+      return true;
+    }
+  }
+
+
   DicomPyramid::DicomPyramid(OrthancStone::IOrthancConnection& orthanc,
                              const std::string& seriesId,
-                             bool useCache) :
+                             bool useCache,
+                             bool synthesizeLevels) :
     orthanc_(orthanc),
     seriesId_(seriesId),
     backgroundRed_(255),
     backgroundGreen_(255),
-    backgroundBlue_(255)
+    backgroundBlue_(255),
+    syntheticMemory_(0)
   {
-    RegisterInstances(seriesId, useCache);
+    bool hasIndex = false;
+    bool hasLastUpdate = false;
+    std::string lastUpdate, fingerprint;
+
+    if (useCache)
+    {
+      std::vector<std::string> seriesInstances;
+      ListInstances(seriesInstances, orthanc_, seriesId);
+      fingerprint = ComputeInstancesFingerprint(seriesInstances);
+
+      hasIndex = LoadSeriesIndex(hasLastUpdate, lastUpdate, seriesId, fingerprint);
+    }
+
+    bool isComplete = false;
+
+    if (!hasIndex)
+    {
+      isComplete = RegisterInstances(seriesId, useCache, fingerprint);
 
-    // Sort the instances of the pyramid by decreasing total widths
-    std::sort(instances_.begin(), instances_.end(), Comparator());
+      // Sort the instances of the pyramid by decreasing total widths
+      // (the index stores the instances in this order)
+      std::sort(instances_.begin(), instances_.end(), Comparator());
+    }
 
     try
     {
@@ -190,6 +863,28 @@ namespace OrthancWSI
       throw;
     }
 
+    if (!hasIndex &&
+        hasLastUpdate &&
+        !isComplete)
+    {
+      // Don't persist a pyramid that misses some of its instances
+      LOG(WARNING) << "Not storing the index of the pyramid of series " << seriesId
+                   << ", as some of its instances could not be loaded, or as it was modified meanwhile";
+    }
+    else if (!hasIndex &&
+             hasLastUpdate)
+    {
+      try
+      {
+        StoreSeriesIndex(seriesId, lastUpdate, fingerprint);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // Not fatal, the index will be created on the next access
+        LOG(WARNING) << "Cannot store the index of the pyramid of series " << seriesId << ": " << e.What();
+      }
+    }
+
     for (size_t i = 0; i < instances_.size(); i++)
     {
       assert(instances_[i] != NULL);
@@ -207,34 +902,88 @@ namespace OrthancWSI
 
       instances_[i]->SetLevel(levels_.size() - 1);
     }
+
+    if (synthesizeLevels)
+    {
+      AddSyntheticLevels();
+    }
+  }
+
+
+  void DicomPyramid::InitializeLoadingProcessor()
+  {
+    if (loadingProcessor_.get() == NULL)
+    {
+      loadingProcessor_.reset(new BagOfTasksProcessor(MAX_LOADING_THREADS));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void DicomPyramid::FinalizeLoadingProcessor()
+  {
+    loadingProcessor_.reset(NULL);
+  }
+
+
+  void DicomPyramid::GetInstanceIds(std::vector<std::string>& target) const
+  {
+    target.resize(instances_.size());
+
+    for (size_t i = 0; i < instances_.size(); i++)
+    {
+      assert(instances_[i] != NULL);
+      target[i] = instances_[i]->GetInstanceId();
+    }
   }
 
 
   unsigned int DicomPyramid::GetLevelWidth(unsigned int level) const
   {
     CheckLevel(level);
-    return levels_[level]->GetTotalWidth();
+
+    if (IsSyntheticLevel(level))
+    {
+      return syntheticWidths_[level - levels_.size()];
+    }
+    else
+    {
+      return levels_[level]->GetTotalWidth();
+    }
   }
 
 
   unsigned int DicomPyramid::GetLevelHeight(unsigned int level) const
   {
     CheckLevel(level);
-    return levels_[level]->GetTotalHeight();
+
+    if (IsSyntheticLevel(level))
+    {
+      return syntheticHeights_[level - levels_.size()];
+    }
+    else
+    {
+      return levels_[level]->GetTotalHeight();
+    }
   }
 
 
   unsigned int DicomPyramid::GetTileWidth(unsigned int level) const
   {
     CheckLevel(level);
-    return levels_[level]->GetTileWidth();
+
+    // The synthetic levels use the tile size of the coarsest level of the series
+    return levels_[IsSyntheticLevel(level) ? levels_.size() - 1 : level]->GetTileWidth();
   }
 
 
   unsigned int DicomPyramid::GetTileHeight(unsigned int level) const
   {
     CheckLevel(level);
-    return levels_[level]->GetTileHeight();
+    return levels_[IsSyntheticLevel(level) ? levels_.size() - 1 : level]->GetTileHeight();
   }
 
 
@@ -245,7 +994,12 @@ namespace OrthancWSI
                                  unsigned int tileY)
   {
     CheckLevel(level);
-      
+
+    if (IsSyntheticLevel(level))
+    {
+      return ReadSyntheticTile(tile, compression, level, tileX, tileY);
+    }
+
     Orthanc::PixelFormat format;
       
     if (levels_[level]->DownloadRawTile(tile, format, compression, orthanc_, tileX, tileY))
@@ -307,4 +1061,33 @@ namespace OrthancWSI
 
     return found;
   }
+
+
+  size_t DicomPyramid::GetMemoryUsage() const
+  {
+    size_t memory = (sizeof(DicomPyramid) +
+                     seriesId_.capacity() +
+                     instances_.capacity() * sizeof(DicomPyramidInstance*) +
+                     levels_.capacity() * sizeof(DicomPyramidLevel*) +
+                     (syntheticWidths_.capacity() + syntheticHeights_.capacity()) * sizeof(unsigned int));
+
+    {
+      boost::mutex::scoped_lock lock(syntheticMutex_);
+      memory += syntheticMemory_;
+    }
+
+    for (size_t i = 0; i < instances_.size(); i++)
+    {
+      assert(instances_[i] != NULL);
+      memory += instances_[i]->GetMemoryUsage();
+    }
+
+    for (size_t i = 0; i < levels_.size(); i++)
+    {
+      assert(levels_[i] != NULL);
+      memory += levels_[i]->GetMemoryUsage();
+    }
+
+    return memory;
+  }
 }
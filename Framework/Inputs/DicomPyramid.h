@@ -27,12 +27,25 @@
 #include "DicomPyramidInstance.h"
 #include "DicomPyramidLevel.h"
 
+#include <Cache/LeastRecentlyUsedIndex.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <set>
+
 namespace OrthancWSI
 {
   class DicomPyramid : public PyramidWithRawTiles
   {
   private:
     struct Comparator;
+    class LoadInstanceCommand;
+
+    class SyntheticTile;
+
+    typedef boost::shared_ptr<SyntheticTile>                                    SyntheticTileHandle;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, SyntheticTileHandle>  SyntheticTiles;
 
     OrthancStone::IOrthancConnection&   orthanc_;
     std::string                         seriesId_;
@@ -42,25 +55,85 @@ namespace OrthancWSI
     uint8_t                             backgroundGreen_;
     uint8_t                             backgroundBlue_;
 
+    /**
+     * Coarser levels that are missing from the series, and whose
+     * tiles are generated on-the-fly by downsampling 2x2 tiles of the
+     * finer level. The generated tiles are stored in a bounded cache,
+     * as PNG if the source tiles are lossless, or as JPEG otherwise.
+     * Concurrent reads of the same missing tile only generate it once.
+     **/
+    std::vector<unsigned int>           syntheticWidths_;
+    std::vector<unsigned int>           syntheticHeights_;
+    mutable boost::mutex                syntheticMutex_;
+    boost::condition_variable           syntheticLoaded_;
+    SyntheticTiles                      syntheticTiles_;
+    std::set<std::string>               syntheticLoading_;
+    size_t                              syntheticMemory_;
+
     void Clear();
 
-    void RegisterInstances(const std::string& seriesId,
-                           bool useCache);
+    void AddSyntheticLevels();
+
+    Orthanc::ImageAccessor* DecodeSourceTile(bool& isEmpty,
+                                             ImageCompression& compression,
+                                             unsigned int level,
+                                             unsigned int tileX,
+                                             unsigned int tileY);
+
+    bool ReadSyntheticTile(std::string& tile,
+                           ImageCompression& compression,
+                           unsigned int level,
+                           unsigned int tileX,
+                           unsigned int tileY);
+
+    // Returns "false" if the index of the series must not be stored,
+    // because some instance could not be loaded, or because the
+    // instances don't match "fingerprint" anymore
+    bool RegisterInstances(const std::string& seriesId,
+                           bool useCache,
+                           const std::string& fingerprint);
+
+    bool LoadSeriesIndex(bool& hasLastUpdate,
+                         std::string& lastUpdate,
+                         const std::string& seriesId,
+                         const std::string& fingerprint);
+
+    void StoreSeriesIndex(const std::string& seriesId,
+                          const std::string& lastUpdate,
+                          const std::string& fingerprint);
 
     void Check(const std::string& seriesId) const;
 
     void CheckLevel(size_t level) const;
 
   public:
+    /**
+     * If "synthesizeLevels" is "true", coarser levels are added until
+     * the coarsest level fits within one single tile. If "useCache"
+     * is "true", the instances of the pyramid are read from a binary
+     * index that is stored as a metadata of the series, which is
+     * created on the first access, and recreated once the instances
+     * of the series have changed.
+     **/
     DicomPyramid(OrthancStone::IOrthancConnection& orthanc,
                  const std::string& seriesId,
-                 bool useCache);
+                 bool useCache,
+                 bool synthesizeLevels);
 
     virtual ~DicomPyramid()
     {
       Clear();
     }
 
+    /**
+     * Shared pool of threads that load the instances of the pyramids
+     * being constructed, whose number of threads is fixed. If it is
+     * not initialized, each construction uses its own threads.
+     **/
+    static void InitializeLoadingProcessor();
+
+    static void FinalizeLoadingProcessor();
+
     const std::string& GetSeriesId() const
     {
       return seriesId_;
@@ -68,9 +141,21 @@ namespace OrthancWSI
 
     virtual unsigned int GetLevelCount() const ORTHANC_OVERRIDE
     {
-      return levels_.size();
+      return levels_.size() + syntheticWidths_.size();
+    }
+
+    bool IsSyntheticLevel(unsigned int level) const
+    {
+      return level >= levels_.size();
     }
 
+    bool HasSyntheticLevels() const
+    {
+      return !syntheticWidths_.empty();
+    }
+
+    void GetInstanceIds(std::vector<std::string>& target) const;
+
     virtual unsigned int GetLevelWidth(unsigned int level) const ORTHANC_OVERRIDE;
 
     virtual unsigned int GetLevelHeight(unsigned int level) const ORTHANC_OVERRIDE;
@@ -106,5 +191,11 @@ namespace OrthancWSI
 
     bool LookupImagedVolumeSize(double& width,
                                 double& height) const;
+
+    // Approximate number of bytes used by the instances, the frame
+    // tables and the grids of tiles of this pyramid, plus the current
+    // size of the cache of synthetic tiles, which grows as the tiles
+    // of the synthetic levels are read
+    size_t GetMemoryUsage() const;
   };
 }
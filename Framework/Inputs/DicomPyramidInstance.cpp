@@ -62,11 +62,22 @@ namespace OrthancWSI
   {
     using namespace OrthancStone;
 
-    FullOrthancDataset dataset(orthanc, "/instances/" + instanceId + "/header");
-    DicomDatasetReader header(dataset);
+    std::string s;
 
-    std::string s = Orthanc::Toolbox::StripSpaces
-      (header.GetMandatoryStringValue(Orthanc::DicomPath(Orthanc::DICOM_TAG_TRANSFER_SYNTAX_UID)));
+    try
+    {
+      // The "TransferSyntax" metadata is much cheaper than the
+      // "/header" route, but might be missing in old databases
+      orthanc.RestApiGet(s, "/instances/" + instanceId + "/metadata/TransferSyntax");
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      FullOrthancDataset dataset(orthanc, "/instances/" + instanceId + "/header");
+      DicomDatasetReader header(dataset);
+      s = header.GetMandatoryStringValue(Orthanc::DicomPath(Orthanc::DICOM_TAG_TRANSFER_SYNTAX_UID));
+    }
+
+    s = Orthanc::Toolbox::StripSpaces(s);
 
     if (s == "1.2.840.10008.1.2" ||
         s == "1.2.840.10008.1.2.1")
@@ -157,8 +168,11 @@ namespace OrthancWSI
      * the decoding of the DICOM image by Orthanc, whereas the "/tags"
      * endpoint only reads the "DICOM-as-JSON" attachment), the
      * "/header" REST call is delayed until it is really required.
+     * The mutex is needed, as tiles are read concurrently.
      **/
 
+    boost::mutex::scoped_lock lock(compressionMutex_);
+
     if (!hasCompression_)
     {
       compression_ = DetectImageCompression(orthanc, instanceId_);
@@ -168,6 +182,13 @@ namespace OrthancWSI
     return compression_;
   }
 
+
+  bool DicomPyramidInstance::HasImageCompression() const
+  {
+    boost::mutex::scoped_lock lock(compressionMutex_);
+    return hasCompression_;
+  }
+
   
   void DicomPyramidInstance::Load(OrthancStone::IOrthancConnection&  orthanc,
                                   const std::string& instanceId)
@@ -304,6 +325,29 @@ namespace OrthancWSI
   }
 
 
+  DicomPyramidInstance::DicomPyramidInstance(const std::string& instanceId) :
+    instanceId_(instanceId),
+    hasCompression_(false),
+    compression_(ImageCompression_None),
+    format_(Orthanc::PixelFormat_RGB24),
+    tileWidth_(0),
+    tileHeight_(0),
+    totalWidth_(0),
+    totalHeight_(0),
+    photometric_(Orthanc::PhotometricInterpretation_RGB),
+    hasBackgroundColor_(false),
+    backgroundRed_(0),
+    backgroundGreen_(0),
+    backgroundBlue_(0),
+    hasImagedVolumeSize_(false),
+    imagedVolumeWidth_(0),
+    imagedVolumeHeight_(0),
+    hasLevel_(false),
+    level_(0)
+  {
+  }
+
+
   DicomPyramidInstance::DicomPyramidInstance(OrthancStone::IOrthancConnection&  orthanc,
                                              const std::string& instanceId,
                                              bool useCache) :
@@ -520,6 +564,211 @@ namespace OrthancWSI
   }
 
 
+  static const uint32_t SERIES_INDEX_HAS_BACKGROUND_COLOR = (1 << 0);
+  static const uint32_t SERIES_INDEX_HAS_IMAGED_VOLUME_SIZE = (1 << 1);
+  static const uint32_t SERIES_INDEX_REGULAR_GRID = (1 << 2);
+
+
+  static void WriteString(std::string& target,
+                          const std::string& value)
+  {
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(value.size()));
+    target.append(value);
+  }
+
+
+  static bool ReadString(std::string& value,
+                         LittleEndian::Reader& reader)
+  {
+    uint32_t size;
+    return (reader.ReadUInt32(size) &&
+            reader.ReadString(value, size));
+  }
+
+
+  void DicomPyramidInstance::WriteSeriesIndex(std::string& target) const
+  {
+    ImageCompression compression;
+
+    {
+      boost::mutex::scoped_lock lock(compressionMutex_);
+
+      if (!hasCompression_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                        "The image compression of instance " + instanceId_ + " is unknown");
+      }
+
+      compression = compression_;
+    }
+
+    /**
+     * The frames of most instances follow the row-major order of the
+     * grid of tiles (which is always the case if the "Per frame
+     * functional groups sequence" is absent). Their locations are
+     * not stored in this case, which keeps the index small.
+     **/
+    const unsigned int countTilesX = CeilingDivision(totalWidth_, tileWidth_);
+    const unsigned int countTilesY = CeilingDivision(totalHeight_, tileHeight_);
+
+    bool isRegular = (frames_.size() == static_cast<size_t>(countTilesX) * static_cast<size_t>(countTilesY));
+    for (size_t i = 0; isRegular && i < frames_.size(); i++)
+    {
+      isRegular = (frames_[i].first == i % countTilesX &&
+                   frames_[i].second == i / countTilesX);
+    }
+
+    uint32_t flags = 0;
+    if (hasBackgroundColor_)
+    {
+      flags |= SERIES_INDEX_HAS_BACKGROUND_COLOR;
+    }
+
+    if (hasImagedVolumeSize_)
+    {
+      flags |= SERIES_INDEX_HAS_IMAGED_VOLUME_SIZE;
+    }
+
+    if (isRegular)
+    {
+      flags |= SERIES_INDEX_REGULAR_GRID;
+    }
+
+    WriteString(target, instanceId_);
+    WriteString(target, imageType_);
+    WriteString(target, Orthanc::EnumerationToString(photometric_));
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(compression));
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(format_));
+    LittleEndian::WriteUInt32(target, tileWidth_);
+    LittleEndian::WriteUInt32(target, tileHeight_);
+    LittleEndian::WriteUInt32(target, totalWidth_);
+    LittleEndian::WriteUInt32(target, totalHeight_);
+    LittleEndian::WriteUInt32(target, flags);
+    LittleEndian::WriteUInt32(target, (static_cast<uint32_t>(backgroundRed_) |
+                                       static_cast<uint32_t>(backgroundGreen_) << 8 |
+                                       static_cast<uint32_t>(backgroundBlue_) << 16));
+    LittleEndian::WriteDouble(target, imagedVolumeWidth_);
+    LittleEndian::WriteDouble(target, imagedVolumeHeight_);
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(frames_.size()));
+
+    if (!isRegular)
+    {
+      for (size_t i = 0; i < frames_.size(); i++)
+      {
+        LittleEndian::WriteUInt32(target, frames_[i].first);
+        LittleEndian::WriteUInt32(target, frames_[i].second);
+      }
+    }
+  }
+
+
+  DicomPyramidInstance* DicomPyramidInstance::ReadSeriesIndex(LittleEndian::Reader& reader)
+  {
+    std::string instanceId, imageType, photometric;
+    uint32_t compression, format, tileWidth, tileHeight, totalWidth, totalHeight, flags, background, countFrames;
+    double imagedVolumeWidth, imagedVolumeHeight;
+
+    if (!ReadString(instanceId, reader) ||
+        !ReadString(imageType, reader) ||
+        !ReadString(photometric, reader) ||
+        !reader.ReadUInt32(compression) ||
+        !reader.ReadUInt32(format) ||
+        !reader.ReadUInt32(tileWidth) ||
+        !reader.ReadUInt32(tileHeight) ||
+        !reader.ReadUInt32(totalWidth) ||
+        !reader.ReadUInt32(totalHeight) ||
+        !reader.ReadUInt32(flags) ||
+        !reader.ReadUInt32(background) ||
+        !reader.ReadDouble(imagedVolumeWidth) ||
+        !reader.ReadDouble(imagedVolumeHeight) ||
+        !reader.ReadUInt32(countFrames) ||
+        tileWidth == 0 ||
+        tileHeight == 0 ||
+        (compression != ImageCompression_None &&
+         compression != ImageCompression_Jpeg &&
+         compression != ImageCompression_Jpeg2000 &&
+         compression != ImageCompression_UseOrthancPreview) ||
+        (format != Orthanc::PixelFormat_Grayscale8 &&
+         format != Orthanc::PixelFormat_RGB24))
+    {
+      return NULL;
+    }
+
+    std::unique_ptr<DicomPyramidInstance> instance(new DicomPyramidInstance(instanceId));
+
+    try
+    {
+      instance->photometric_ = Orthanc::StringToPhotometricInterpretation(photometric.c_str());
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return NULL;
+    }
+
+    instance->hasCompression_ = true;
+    instance->compression_ = static_cast<ImageCompression>(compression);
+    instance->format_ = static_cast<Orthanc::PixelFormat>(format);
+    instance->tileWidth_ = tileWidth;
+    instance->tileHeight_ = tileHeight;
+    instance->totalWidth_ = totalWidth;
+    instance->totalHeight_ = totalHeight;
+    instance->imageType_ = imageType;
+
+    if (flags & SERIES_INDEX_HAS_BACKGROUND_COLOR)
+    {
+      instance->hasBackgroundColor_ = true;
+      instance->backgroundRed_ = (background & 0xff);
+      instance->backgroundGreen_ = ((background >> 8) & 0xff);
+      instance->backgroundBlue_ = ((background >> 16) & 0xff);
+    }
+
+    if (flags & SERIES_INDEX_HAS_IMAGED_VOLUME_SIZE)
+    {
+      instance->hasImagedVolumeSize_ = true;
+      instance->imagedVolumeWidth_ = imagedVolumeWidth;
+      instance->imagedVolumeHeight_ = imagedVolumeHeight;
+    }
+
+    const unsigned int countTilesX = CeilingDivision(totalWidth, tileWidth);
+    const unsigned int countTilesY = CeilingDivision(totalHeight, tileHeight);
+
+    if (flags & SERIES_INDEX_REGULAR_GRID)
+    {
+      if (countFrames != static_cast<uint64_t>(countTilesX) * static_cast<uint64_t>(countTilesY))
+      {
+        return NULL;
+      }
+
+      instance->frames_.resize(countFrames);
+
+      for (size_t i = 0; i < instance->frames_.size(); i++)
+      {
+        instance->frames_[i].first = i % countTilesX;
+        instance->frames_[i].second = i / countTilesX;
+      }
+    }
+    else
+    {
+      // The frames are not preallocated, as "countFrames" is not trusted yet
+      for (uint32_t i = 0; i < countFrames; i++)
+      {
+        uint32_t x, y;
+        if (!reader.ReadUInt32(x) ||
+            !reader.ReadUInt32(y) ||
+            x >= countTilesX ||
+            y >= countTilesY)
+        {
+          return NULL;
+        }
+
+        instance->frames_.push_back(std::make_pair(x, y));
+      }
+    }
+
+    return instance.release();
+  }
+
+
   uint8_t DicomPyramidInstance::GetBackgroundRed() const
   {
     if (hasBackgroundColor_)
@@ -604,4 +853,13 @@ namespace OrthancWSI
     return (hasLevel_ &&
             level_ == level);
   }
+
+
+  size_t DicomPyramidInstance::GetMemoryUsage() const
+  {
+    return (sizeof(DicomPyramidInstance) +
+            instanceId_.capacity() +
+            imageType_.capacity() +
+            frames_.capacity() * sizeof(FrameLocation));
+  }
 }
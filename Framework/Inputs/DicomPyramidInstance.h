@@ -24,9 +24,11 @@
 #pragma once
 
 #include "../Enumerations.h"
+#include "../LittleEndian.h"
 #include "../../Resources/Orthanc/Stone/IOrthancConnection.h"
 
 #include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <vector>
 
 namespace OrthancWSI
@@ -37,6 +39,7 @@ namespace OrthancWSI
     typedef std::pair<unsigned int, unsigned int>  FrameLocation;
 
     std::string                         instanceId_;
+    mutable boost::mutex                compressionMutex_;  // Protects the lazy detection of the compression
     bool                                hasCompression_;
     ImageCompression                    compression_;
     Orthanc::PixelFormat                format_;
@@ -62,6 +65,9 @@ namespace OrthancWSI
 
     bool Deserialize(const std::string& content);
 
+    // Constructor used by "ReadSeriesIndex()"
+    explicit DicomPyramidInstance(const std::string& instanceId);
+
   public:
     DicomPyramidInstance(OrthancStone::IOrthancConnection&  orthanc,
                          const std::string& instanceId,
@@ -74,6 +80,8 @@ namespace OrthancWSI
 
     ImageCompression GetImageCompression(OrthancStone::IOrthancConnection& orthanc);
 
+    bool HasImageCompression() const;
+
     Orthanc::PixelFormat GetPixelFormat() const
     {
       return format_;
@@ -120,6 +128,17 @@ namespace OrthancWSI
 
     void Serialize(std::string& result) const;
 
+    /**
+     * Compact binary record of this instance, as stored in the index
+     * of the whole series (cf. "DicomPyramid"). The image compression
+     * must have been detected before, so that no call to the REST API
+     * is made.
+     **/
+    void WriteSeriesIndex(std::string& target) const;
+
+    // Returns NULL if the record is corrupted
+    static DicomPyramidInstance* ReadSeriesIndex(LittleEndian::Reader& reader);
+
     bool HasBackgroundColor() const
     {
       return hasBackgroundColor_;
@@ -143,5 +162,8 @@ namespace OrthancWSI
     void SetLevel(unsigned int level);
 
     bool IsLevel(unsigned int level) const;
+
+    // Approximate number of bytes used by this object
+    size_t GetMemoryUsage() const;
   };
 }
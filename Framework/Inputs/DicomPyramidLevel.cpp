@@ -24,6 +24,7 @@
 #include "../PrecompiledHeadersWSI.h"
 #include "DicomPyramidLevel.h"
 
+#include "IRawFramesSource.h"
 #include "../ImageToolbox.h"
 
 #include <Logging.h>
@@ -162,9 +163,16 @@ namespace OrthancWSI
       }
       else
       {
-        std::string uri = ("/instances/" + instance.GetInstanceId() +
-                           "/frames/" + boost::lexical_cast<std::string>(tile.frame_) + "/raw");
-        orthanc.RestApiGet(raw, uri);
+        IRawFramesSource* source = dynamic_cast<IRawFramesSource*>(&orthanc);
+
+        if (source == NULL ||
+            !source->ReadRawFrame(raw, instance.GetInstanceId(), tile.frame_))
+        {
+          std::string uri = ("/instances/" + instance.GetInstanceId() +
+                             "/frames/" + boost::lexical_cast<std::string>(tile.frame_) + "/raw");
+          orthanc.RestApiGet(raw, uri);
+        }
+
         return true;
       }
     }
@@ -93,5 +93,12 @@ namespace OrthancWSI
                          OrthancStone::IOrthancConnection& orthanc,
                          unsigned int tileX,
                          unsigned int tileY) const;
+
+    // Approximate number of bytes used by the grid of tiles (the
+    // instances are not owned by the level)
+    size_t GetMemoryUsage() const
+    {
+      return sizeof(DicomPyramidLevel) + tiles_.capacity() * sizeof(TileContent);
+    }
   };
 }
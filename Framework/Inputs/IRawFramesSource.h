@@ -0,0 +1,50 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Optional interface for the connections to Orthanc that can read
+   * the raw frames of the DICOM instances without going through the
+   * REST API. "DicomPyramidLevel" uses it if the connection of the
+   * pyramid implements this interface.
+   **/
+  class IRawFramesSource
+  {
+  public:
+    virtual ~IRawFramesSource()
+    {
+    }
+
+    // Returns "false" if this frame cannot be read through this
+    // interface, in which case the REST API must be used
+    virtual bool ReadRawFrame(std::string& target,
+                              const std::string& instanceId,
+                              unsigned int frame) = 0;
+  };
+}
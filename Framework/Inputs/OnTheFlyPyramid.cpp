@@ -24,15 +24,542 @@
 #include "../PrecompiledHeadersWSI.h"
 #include "OnTheFlyPyramid.h"
 
+#include "../ImageToolbox.h"
+#include "../LittleEndian.h"
+
 #include <OrthancException.h>
 
+#include <algorithm>
+#include <boost/math/special_functions/fpclassify.hpp>
 #include <cassert>
 #include <Images/Image.h>
 #include <Images/ImageProcessing.h>
+#include <limits>
+#include <string.h>
+
+
+static const char* const SERIALIZATION_MAGIC = "WSIPYRAM";
+static const uint32_t    SERIALIZATION_VERSION = 2;
 
 
 namespace OrthancWSI
 {
+  static const uint8_t JPEG_STORAGE_QUALITY = 95;
+
+
+  template <typename PixelType>
+  static Orthanc::ImageAccessor* HalveGrayscale16(const Orthanc::ImageAccessor& source)
+  {
+    // "ImageProcessing::Halve()" only supports 8bpp images. Each 2x2
+    // block is averaged, after shifting the signed samples to positive
+    // values, so that the rounding is the same for both signednesses.
+    const int32_t bias = (std::numeric_limits<PixelType>::is_signed ? 32768 : 0);
+
+    const unsigned int width = source.GetWidth() / 2;
+    const unsigned int height = source.GetHeight() / 2;
+
+    std::unique_ptr<Orthanc::ImageAccessor> target(new Orthanc::Image(source.GetFormat(), width, height, false));
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      const PixelType* a = reinterpret_cast<const PixelType*>(source.GetConstRow(2 * y));
+      const PixelType* b = reinterpret_cast<const PixelType*>(source.GetConstRow(2 * y + 1));
+      PixelType* q = reinterpret_cast<PixelType*>(target->GetRow(y));
+
+      for (unsigned int x = 0; x < width; x++)
+      {
+        const int32_t sum = (static_cast<int32_t>(a[2 * x]) + static_cast<int32_t>(a[2 * x + 1]) +
+                             static_cast<int32_t>(b[2 * x]) + static_cast<int32_t>(b[2 * x + 1]) + 4 * bias);
+        q[x] = static_cast<PixelType>((sum + 2) / 4 - bias);
+      }
+    }
+
+    return target.release();
+  }
+
+
+  template <typename PixelType>
+  static void SmoothGaussian5x5Grayscale16(Orthanc::ImageAccessor& image)
+  {
+    // "ImageProcessing::SmoothGaussian5x5()" only supports 8bpp images.
+    // This is the same separable kernel (1 4 6 4 1) / 16, with the
+    // borders replicated. The integer sums are computed after shifting
+    // the signed samples to positive values, as in "HalveGrayscale16()".
+    static const int32_t KERNEL[5] = { 1, 4, 6, 4, 1 };
+
+    const int32_t bias = (std::numeric_limits<PixelType>::is_signed ? 32768 : 0);
+
+    const int width = static_cast<int>(image.GetWidth());
+    const int height = static_cast<int>(image.GetHeight());
+
+    if (width == 0 ||
+        height == 0)
+    {
+      return;
+    }
+
+    // Horizontal pass, whose results are scaled by 16
+    std::vector<int32_t> horizontal(static_cast<size_t>(width) * static_cast<size_t>(height));
+
+    for (int y = 0; y < height; y++)
+    {
+      const PixelType* p = reinterpret_cast<const PixelType*>(image.GetConstRow(y));
+      int32_t* q = &horizontal[static_cast<size_t>(y) * width];
+
+      for (int x = 0; x < width; x++)
+      {
+        int32_t sum = 0;
+        for (int k = 0; k < 5; k++)
+        {
+          const int xx = std::min(std::max(x + k - 2, 0), width - 1);
+          sum += KERNEL[k] * (static_cast<int32_t>(p[xx]) + bias);
+        }
+
+        q[x] = sum;
+      }
+    }
+
+    // Vertical pass, whose results are scaled by 256 (at most 2^24)
+    for (int y = 0; y < height; y++)
+    {
+      PixelType* q = reinterpret_cast<PixelType*>(image.GetRow(y));
+
+      for (int x = 0; x < width; x++)
+      {
+        int32_t sum = 0;
+        for (int k = 0; k < 5; k++)
+        {
+          const int yy = std::min(std::max(y + k - 2, 0), height - 1);
+          sum += KERNEL[k] * horizontal[static_cast<size_t>(yy) * width + x];
+        }
+
+        q[x] = static_cast<PixelType>((sum + 128) / 256 - bias);
+      }
+    }
+  }
+
+
+  static bool IsSamplesFormat(Orthanc::PixelFormat format)
+  {
+    return (format == Orthanc::PixelFormat_RGB24 ||
+            format == Orthanc::PixelFormat_Grayscale16 ||
+            format == Orthanc::PixelFormat_SignedGrayscale16);
+  }
+
+
+  class OnTheFlyPyramid::StoredTile : public boost::noncopyable
+  {
+  private:
+    std::unique_ptr<Orthanc::ImageAccessor>  decoded_;   // If the tile is not compressed
+    std::string                              compressed_;
+    ImageCompression                         compression_;
+
+  public:
+    // Stores a tile that is already compressed
+    StoredTile(const std::string& compressed,
+               ImageCompression compression) :
+      compressed_(compressed),
+      compression_(compression)
+    {
+      if (compression == ImageCompression_None)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+
+    StoredTile(Orthanc::ImageAccessor* tile /* takes ownership */,
+               ImageCompression compression) :
+      compression_(compression)
+    {
+      std::unique_ptr<Orthanc::ImageAccessor> protection(tile);
+
+      if (tile == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      }
+      else if (compression == ImageCompression_None)
+      {
+        decoded_.reset(protection.release());
+      }
+      else
+      {
+        ImageToolbox::EncodeTile(compressed_, *protection, compression, JPEG_STORAGE_QUALITY);
+      }
+    }
+
+    bool IsCompressed() const
+    {
+      return compression_ != ImageCompression_None;
+    }
+
+    ImageCompression GetCompression() const
+    {
+      return compression_;
+    }
+
+    const std::string& GetCompressed() const
+    {
+      return compressed_;
+    }
+
+    size_t GetMemoryUsage() const
+    {
+      if (IsCompressed())
+      {
+        return compressed_.size();
+      }
+      else
+      {
+        return decoded_->GetSize();
+      }
+    }
+
+    // Compressed tiles are decoded into "buffer"
+    const Orthanc::ImageAccessor& GetPixels(std::unique_ptr<Orthanc::ImageAccessor>& buffer) const
+    {
+      if (IsCompressed())
+      {
+        buffer.reset(ImageToolbox::DecodeTile(compressed_, compression_));
+        return *buffer;
+      }
+      else
+      {
+        return *decoded_;
+      }
+    }
+  };
+
+
+  void OnTheFlyPyramid::Store(unsigned int level,
+                              unsigned int tileX,
+                              unsigned int tileY,
+                              StoredTile* tile)
+  {
+    // Mutex must be locked
+    std::unique_ptr<StoredTile> protection(tile);
+
+    TileKey key(level, tileX, tileY);
+
+    if (tiles_.find(key) == tiles_.end())
+    {
+      memory_ += protection->GetMemoryUsage();
+      tiles_[key] = protection.release();
+    }
+  }
+
+
+  const OnTheFlyPyramid::StoredTile* OnTheFlyPyramid::LookupTile(unsigned int level,
+                                                                 unsigned int tileX,
+                                                                 unsigned int tileY) const
+  {
+    // Mutex must be locked
+    Tiles::const_iterator found = tiles_.find(TileKey(level, tileX, tileY));
+
+    if (found == tiles_.end())
+    {
+      return NULL;
+    }
+    else
+    {
+      assert(found->second != NULL);
+      return found->second;
+    }
+  }
+
+
+  const OnTheFlyPyramid::StoredTile& OnTheFlyPyramid::GetTile(unsigned int level,
+                                                              unsigned int tileX,
+                                                              unsigned int tileY)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      const StoredTile* tile = LookupTile(level, tileX, tileY);
+      if (tile != NULL)
+      {
+        return *tile;
+      }
+      else if (level == 0)
+      {
+        // All the tiles of the base level are created by the constructor
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+
+    const unsigned int x = tileX * tileWidth_;
+    const unsigned int y = tileY * tileHeight_;
+
+    if (x >= GetLevelWidth(level) ||
+        y >= GetLevelHeight(level))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    /**
+     * The mutex is not locked during the rendering and the encoding
+     * of the tile. Concurrent renderings of the same tile produce the
+     * same pixels, and only the first one is stored.
+     **/
+    std::unique_ptr<StoredTile> rendered(
+      new StoredTile(RenderRegion(level, x, y,
+                                  std::min(tileWidth_, GetLevelWidth(level) - x),
+                                  std::min(tileHeight_, GetLevelHeight(level) - y)), compression_));
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Store(level, tileX, tileY, rendered.release());
+
+    const StoredTile* tile = LookupTile(level, tileX, tileY);
+    assert(tile != NULL);
+    return *tile;
+  }
+
+
+  void OnTheFlyPyramid::CopyTiles(Orthanc::ImageAccessor& target,
+                                  unsigned int x,
+                                  unsigned int y,
+                                  const std::vector<const StoredTile*>& tiles) const
+  {
+    // The stored tiles are never modified nor removed, so they can be
+    // read without holding the mutex
+    const unsigned int firstTileX = x / tileWidth_;
+    const unsigned int firstTileY = y / tileHeight_;
+    const unsigned int lastTileX = (x + target.GetWidth() - 1) / tileWidth_;
+    const unsigned int lastTileY = (y + target.GetHeight() - 1) / tileHeight_;
+
+    assert(tiles.size() == (lastTileX - firstTileX + 1) * (lastTileY - firstTileY + 1));
+
+    size_t i = 0;
+    for (unsigned int tileY = firstTileY; tileY <= lastTileY; tileY++)
+    {
+      for (unsigned int tileX = firstTileX; tileX <= lastTileX; tileX++, i++)
+      {
+        std::unique_ptr<Orthanc::ImageAccessor> buffer;
+        const Orthanc::ImageAccessor& tile = tiles[i]->GetPixels(buffer);
+
+        const unsigned int fromX = std::max(x, tileX * tileWidth_);
+        const unsigned int fromY = std::max(y, tileY * tileHeight_);
+        const unsigned int toX = std::min(x + target.GetWidth(), tileX * tileWidth_ + tile.GetWidth());
+        const unsigned int toY = std::min(y + target.GetHeight(), tileY * tileHeight_ + tile.GetHeight());
+
+        if (fromX >= toX ||
+            fromY >= toY)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        Orthanc::ImageAccessor source;
+        tile.GetRegion(source, fromX - tileX * tileWidth_, fromY - tileY * tileHeight_, toX - fromX, toY - fromY);
+
+        Orthanc::ImageAccessor region;
+        target.GetRegion(region, fromX - x, fromY - y, toX - fromX, toY - fromY);
+
+        Orthanc::ImageProcessing::Copy(region, source);
+      }
+    }
+  }
+
+
+  bool OnTheFlyPyramid::LookupRenderedRegion(Orthanc::ImageAccessor& target,
+                                             unsigned int level,
+                                             unsigned int x,
+                                             unsigned int y) const
+  {
+    // Returns "false" if some tile covering the region has not been rendered yet
+
+    assert(target.GetWidth() > 0 &&
+           target.GetHeight() > 0);
+
+    const unsigned int firstTileX = x / tileWidth_;
+    const unsigned int firstTileY = y / tileHeight_;
+    const unsigned int lastTileX = (x + target.GetWidth() - 1) / tileWidth_;
+    const unsigned int lastTileY = (y + target.GetHeight() - 1) / tileHeight_;
+
+    std::vector<const StoredTile*> tiles;
+    tiles.reserve((lastTileX - firstTileX + 1) * (lastTileY - firstTileY + 1));
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (unsigned int tileY = firstTileY; tileY <= lastTileY; tileY++)
+      {
+        for (unsigned int tileX = firstTileX; tileX <= lastTileX; tileX++)
+        {
+          const StoredTile* tile = LookupTile(level, tileX, tileY);
+          if (tile == NULL)
+          {
+            return false;
+          }
+          else
+          {
+            tiles.push_back(tile);
+          }
+        }
+      }
+    }
+
+    CopyTiles(target, x, y, tiles);
+    return true;
+  }
+
+
+  void OnTheFlyPyramid::ReadTiles(Orthanc::ImageAccessor& target,
+                                  unsigned int level,
+                                  unsigned int x,
+                                  unsigned int y)
+  {
+    // The missing tiles covering the region are rendered and stored,
+    // so that they are reused by the next regions of this level and
+    // of the upper levels
+
+    assert(target.GetWidth() > 0 &&
+           target.GetHeight() > 0);
+
+    const unsigned int firstTileX = x / tileWidth_;
+    const unsigned int firstTileY = y / tileHeight_;
+    const unsigned int lastTileX = (x + target.GetWidth() - 1) / tileWidth_;
+    const unsigned int lastTileY = (y + target.GetHeight() - 1) / tileHeight_;
+
+    std::vector<const StoredTile*> tiles;
+    tiles.reserve((lastTileX - firstTileX + 1) * (lastTileY - firstTileY + 1));
+
+    for (unsigned int tileY = firstTileY; tileY <= lastTileY; tileY++)
+    {
+      for (unsigned int tileX = firstTileX; tileX <= lastTileX; tileX++)
+      {
+        tiles.push_back(&GetTile(level, tileX, tileY));
+      }
+    }
+
+    CopyTiles(target, x, y, tiles);
+  }
+
+
+  Orthanc::ImageAccessor* OnTheFlyPyramid::RenderRegion(unsigned int level,
+                                                        unsigned int x,
+                                                        unsigned int y,
+                                                        unsigned int width,
+                                                        unsigned int height)
+  {
+    assert(x + width <= GetLevelWidth(level) &&
+           y + height <= GetLevelHeight(level));
+
+    std::unique_ptr<Orthanc::ImageAccessor> result(new Orthanc::Image(samplesFormat_, width, height, false));
+
+    if (LookupRenderedRegion(*result, level, x, y))
+    {
+      return result.release();
+    }
+    else if (level == 0)
+    {
+      // The base level is always complete
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    /**
+     * The region is obtained by halving the "2*width" x "2*height"
+     * region of the level below. If smoothing, the region of the
+     * level below is extended by the radius of the Gaussian kernel,
+     * so that the smoothed pixels are the same as if the full level
+     * were smoothed. As "2*x" is even, the pairs of halved pixels are
+     * also the same as for the full level. The region of the level
+     * below is read from its tiles, which are rendered and stored if
+     * missing: Browsing from the coarsest level to the finest level
+     * thus renders each tile only once.
+     **/
+    const unsigned int margin = (smooth_ ? 2 : 0);
+
+    const unsigned int sourceX = (2 * x >= margin ? 2 * x - margin : 0);
+    const unsigned int sourceY = (2 * y >= margin ? 2 * y - margin : 0);
+    const unsigned int sourceEndX = std::min(2 * (x + width) + margin, GetLevelWidth(level - 1));
+    const unsigned int sourceEndY = std::min(2 * (y + height) + margin, GetLevelHeight(level - 1));
+
+    std::unique_ptr<Orthanc::ImageAccessor> source(
+      new Orthanc::Image(samplesFormat_, sourceEndX - sourceX, sourceEndY - sourceY, false));
+    ReadTiles(*source, level - 1, sourceX, sourceY);
+
+    if (smooth_)
+    {
+      switch (samplesFormat_)
+      {
+        case Orthanc::PixelFormat_Grayscale16:
+          SmoothGaussian5x5Grayscale16<uint16_t>(*source);
+          break;
+
+        case Orthanc::PixelFormat_SignedGrayscale16:
+          SmoothGaussian5x5Grayscale16<int16_t>(*source);
+          break;
+
+        default:
+          Orthanc::ImageProcessing::SmoothGaussian5x5(*source, false);
+          break;
+      }
+    }
+
+    Orthanc::ImageAccessor toHalve;
+    source->GetRegion(toHalve, 2 * x - sourceX, 2 * y - sourceY, 2 * width, 2 * height);
+
+    switch (samplesFormat_)
+    {
+      case Orthanc::PixelFormat_Grayscale16:
+        result.reset(HalveGrayscale16<uint16_t>(toHalve));
+        break;
+
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        result.reset(HalveGrayscale16<int16_t>(toHalve));
+        break;
+
+      default:
+        result.reset(Orthanc::ImageProcessing::Halve(toHalve, false));
+        break;
+    }
+
+    assert(result->GetWidth() == width &&
+           result->GetHeight() == height);
+
+    return result.release();
+  }
+
+
+  void OnTheFlyPyramid::ReadSamples(Orthanc::ImageAccessor& target,
+                                    unsigned int level,
+                                    unsigned int x,
+                                    unsigned int y)
+  {
+    if (target.GetFormat() != samplesFormat_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+    }
+    else if (target.GetWidth() > tileWidth_ ||
+        target.GetHeight() > tileHeight_ ||
+        x + target.GetWidth() > GetLevelWidth(level) ||
+        y + target.GetHeight() > GetLevelHeight(level))
+    {
+      // This should be handled by the base class
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else if (target.GetWidth() == 0 ||
+             target.GetHeight() == 0)
+    {
+      return;
+    }
+    else if (x % tileWidth_ == 0 &&
+             y % tileHeight_ == 0 &&
+             target.GetWidth() == std::min(tileWidth_, GetLevelWidth(level) - x) &&
+             target.GetHeight() == std::min(tileHeight_, GetLevelHeight(level) - y))
+    {
+      // This region corresponds to one tile: Render it once, and keep it
+      std::unique_ptr<Orthanc::ImageAccessor> buffer;
+      const StoredTile& tile = GetTile(level, x / tileWidth_, y / tileHeight_);
+      Orthanc::ImageProcessing::Copy(target, tile.GetPixels(buffer));
+    }
+    else
+    {
+      // Arbitrary region: Render and keep the tiles covering it
+      ReadTiles(target, level, x, y);
+    }
+  }
+
+
   void OnTheFlyPyramid::ReadRegion(Orthanc::ImageAccessor &target,
                                    bool &isEmpty,
                                    unsigned level,
@@ -41,21 +568,15 @@ namespace OrthancWSI
   {
     isEmpty = false;
 
-    const Orthanc::ImageAccessor& source = GetLevel(level);
-
-    if (target.GetWidth() > tileWidth_ ||
-      target.GetHeight() > tileHeight_ ||
-      x + target.GetWidth() > source.GetWidth() ||
-      y + target.GetHeight() > source.GetHeight())
+    if (HasWindowing())
     {
-      // This should be handled by the base class
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      Orthanc::Image samples(samplesFormat_, target.GetWidth(), target.GetHeight(), false);
+      ReadSamples(samples, level, x, y);
+      ImageToolbox::ApplyWindowing(target, samples, rescaleSlope_, rescaleIntercept_, windowCenter_, windowWidth_, invert_);
     }
     else
     {
-      Orthanc::ImageAccessor from;
-      source.GetRegion(from, x, y, target.GetWidth(), target.GetHeight());
-      Orthanc::ImageProcessing::Copy(target, from);
+      ReadSamples(target, level, x, y);
     }
   }
 
@@ -63,9 +584,19 @@ namespace OrthancWSI
   OnTheFlyPyramid::OnTheFlyPyramid(Orthanc::ImageAccessor *baseLevel,
                                    unsigned int tileWidth,
                                    unsigned int tileHeight,
-                                   bool smooth) :
+                                   bool smooth,
+                                   ImageCompression compression) :
     tileWidth_(tileWidth),
-    tileHeight_(tileHeight)
+    tileHeight_(tileHeight),
+    smooth_(smooth),
+    compression_(compression),
+    samplesFormat_(Orthanc::PixelFormat_RGB24),
+    rescaleSlope_(1),
+    rescaleIntercept_(0),
+    windowCenter_(128),
+    windowWidth_(256),
+    invert_(false),
+    memory_(0)
   {
     if (baseLevel == NULL)
     {
@@ -74,78 +605,471 @@ namespace OrthancWSI
 
     std::unique_ptr<Orthanc::ImageAccessor> protection(baseLevel);
 
-    if (protection->GetFormat() == Orthanc::PixelFormat_RGB24)
+    if (protection->GetFormat() == Orthanc::PixelFormat_Grayscale16 ||
+        protection->GetFormat() == Orthanc::PixelFormat_SignedGrayscale16)
     {
-      baseLevel_.reset(protection.release());
+      samplesFormat_ = protection->GetFormat();
     }
-    else
+
+    if (tileWidth == 0 ||
+        tileHeight == 0 ||
+        (compression != ImageCompression_None &&
+         compression != ImageCompression_Png &&
+         compression != ImageCompression_Jpeg))
     {
-      baseLevel_.reset(new Orthanc::Image(Orthanc::PixelFormat_RGB24, protection->GetWidth(), protection->GetHeight(), false));
-      Orthanc::ImageProcessing::Convert(*baseLevel_, *protection);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    // JPEG cannot store 16bpp samples, and PNG cannot store signed samples
+    if (samplesFormat_ == Orthanc::PixelFormat_Grayscale16 &&
+        compression_ != ImageCompression_None)
+    {
+      compression_ = ImageCompression_Png;
+    }
+    else if (samplesFormat_ == Orthanc::PixelFormat_SignedGrayscale16)
+    {
+      compression_ = ImageCompression_None;
+    }
+
+    // Only the dimensions of the upper levels are computed at this
+    // point, which corresponds to "ImageProcessing::Halve()"
+    unsigned int width = protection->GetWidth();
+    unsigned int height = protection->GetHeight();
+
+    levelWidths_.push_back(width);
+    levelHeights_.push_back(height);
+
+    while (width > tileWidth_ ||
+           height > tileHeight_)
+    {
+      width /= 2;
+      height /= 2;
+
+      levelWidths_.push_back(width);
+      levelHeights_.push_back(height);
     }
 
-    Orthanc::ImageAccessor* current = baseLevel_.get();
-    while (current->GetWidth() > tileWidth_ ||
-           current->GetHeight() > tileHeight_)
+    // Split the base level into tiles, converted to RGB24 unless they contain 16bpp samples
+    try
     {
-      std::unique_ptr<Orthanc::ImageAccessor> next;
+      const unsigned int countTilesX = CeilingDivision(protection->GetWidth(), tileWidth_);
+      const unsigned int countTilesY = CeilingDivision(protection->GetHeight(), tileHeight_);
 
-      if (smooth)
+      for (unsigned int tileY = 0; tileY < countTilesY; tileY++)
       {
-        std::unique_ptr<Orthanc::ImageAccessor> smoothed(Orthanc::Image::Clone(*current));
-        Orthanc::ImageProcessing::SmoothGaussian5x5(*smoothed, false);
-        next.reset(Orthanc::ImageProcessing::Halve(*smoothed, false));
+        for (unsigned int tileX = 0; tileX < countTilesX; tileX++)
+        {
+          const unsigned int x = tileX * tileWidth_;
+          const unsigned int y = tileY * tileHeight_;
+
+          Orthanc::ImageAccessor region;
+          protection->GetRegion(region, x, y, std::min(tileWidth_, protection->GetWidth() - x),
+                                std::min(tileHeight_, protection->GetHeight() - y));
+
+          std::unique_ptr<Orthanc::ImageAccessor> tile(
+            new Orthanc::Image(samplesFormat_, region.GetWidth(), region.GetHeight(), false));
+
+          if (region.GetFormat() == samplesFormat_)
+          {
+            Orthanc::ImageProcessing::Copy(*tile, region);
+          }
+          else
+          {
+            Orthanc::ImageProcessing::Convert(*tile, region);
+          }
+
+          Store(0, tileX, tileY, new StoredTile(tile.release(), compression_));
+        }
       }
-      else
+    }
+    catch (...)
+    {
+      for (Tiles::iterator it = tiles_.begin(); it != tiles_.end(); ++it)
       {
-        next.reset(Orthanc::ImageProcessing::Halve(*current, false));
+        delete it->second;
       }
 
-      higherLevels_.push_back(next.release());
-      current = higherLevels_.back();
+      throw;
     }
   }
 
 
   OnTheFlyPyramid::~OnTheFlyPyramid()
   {
-    for (size_t i = 0; i < higherLevels_.size(); i++)
+    for (Tiles::iterator it = tiles_.begin(); it != tiles_.end(); ++it)
     {
-      assert(higherLevels_[i] != NULL);
-      delete higherLevels_[i];
+      assert(it->second != NULL);
+      delete it->second;
     }
   }
 
 
-  const Orthanc::ImageAccessor & OnTheFlyPyramid::GetLevel(unsigned int level) const
+  unsigned OnTheFlyPyramid::GetLevelWidth(unsigned int level) const
   {
-    if (level >= GetLevelCount())
+    if (level >= levelWidths_.size())
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
-    else if (level == 0)
+    else
+    {
+      return levelWidths_[level];
+    }
+  }
+
+
+  unsigned OnTheFlyPyramid::GetLevelHeight(unsigned int level) const
+  {
+    if (level >= levelHeights_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
+    {
+      return levelHeights_[level];
+    }
+  }
+
+
+  bool OnTheFlyPyramid::ReadRawTile(std::string& tile,
+                                    ImageCompression& compression,
+                                    unsigned int level,
+                                    unsigned int tileX,
+                                    unsigned int tileY)
+  {
+    if (compression_ == ImageCompression_None ||
+        HasWindowing() ||
+        level >= GetLevelCount() ||
+        (tileX + 1) * tileWidth_ > GetLevelWidth(level) ||
+        (tileY + 1) * tileHeight_ > GetLevelHeight(level))
     {
-      assert(baseLevel_.get() != NULL);
-      return *baseLevel_;
+      return false;
     }
     else
     {
-      assert(higherLevels_[level - 1] != NULL);
-      return *higherLevels_[level - 1];
+      const StoredTile& stored = GetTile(level, tileX, tileY);
+      assert(stored.IsCompressed());
+
+      tile = stored.GetCompressed();
+      compression = stored.GetCompression();
+      return true;
     }
   }
 
 
   size_t OnTheFlyPyramid::GetMemoryUsage() const
   {
-    size_t memory = baseLevel_->GetSize();
+    boost::mutex::scoped_lock lock(mutex_);
+    return memory_;
+  }
+
 
-    for (size_t i= 0; i < higherLevels_.size(); i++)
+  void OnTheFlyPyramid::SetWindowing(double rescaleSlope,
+                                     double rescaleIntercept,
+                                     double defaultWindowCenter,
+                                     double defaultWindowWidth,
+                                     bool invert)
+  {
+    if (!HasWindowing())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else if (!boost::math::isfinite(rescaleSlope) ||
+             !boost::math::isfinite(rescaleIntercept) ||
+             !boost::math::isfinite(defaultWindowCenter) ||
+             !boost::math::isfinite(defaultWindowWidth) ||
+             defaultWindowWidth <= 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
     {
-      assert(higherLevels_[i] != NULL);
-      memory += higherLevels_[i]->GetSize();
+      rescaleSlope_ = rescaleSlope;
+      rescaleIntercept_ = rescaleIntercept;
+      windowCenter_ = defaultWindowCenter;
+      windowWidth_ = defaultWindowWidth;
+      invert_ = invert;
+    }
+  }
+
+
+  Orthanc::ImageAccessor* OnTheFlyPyramid::DecodeWindowedTile(bool& isEmpty,
+                                                              unsigned int level,
+                                                              unsigned int tileX,
+                                                              unsigned int tileY,
+                                                              double windowCenter,
+                                                              double windowWidth)
+  {
+    if (!HasWindowing())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    const unsigned int x = tileX * tileWidth_;
+    const unsigned int y = tileY * tileHeight_;
+
+    uint8_t red, green, blue;
+    GetBackgroundColor(red, green, blue);
+
+    std::unique_ptr<Orthanc::ImageAccessor> tile(
+      ImageToolbox::Allocate(Orthanc::PixelFormat_Grayscale8, tileWidth_, tileHeight_));
+
+    // Same handling of the borders as "DecodedTiledPyramid::DecodeTile()"
+    if (x >= GetLevelWidth(level) ||
+        y >= GetLevelHeight(level))
+    {
+      isEmpty = true;
+      ImageToolbox::Set(*tile, red, green, blue);
+      return tile.release();
+    }
+
+    isEmpty = false;
+
+    const unsigned int width = std::min(tileWidth_, GetLevelWidth(level) - x);
+    const unsigned int height = std::min(tileHeight_, GetLevelHeight(level) - y);
+
+    if (width != tileWidth_ ||
+        height != tileHeight_)
+    {
+      ImageToolbox::Set(*tile, red, green, blue);
+    }
+
+    Orthanc::Image samples(samplesFormat_, width, height, false);
+    ReadSamples(samples, level, x, y);
+
+    Orthanc::ImageAccessor region;
+    tile->GetRegion(region, 0, 0, width, height);
+    ImageToolbox::ApplyWindowing(region, samples, rescaleSlope_, rescaleIntercept_, windowCenter, windowWidth, invert_);
+
+    return tile.release();
+  }
+
+
+  OnTheFlyPyramid::OnTheFlyPyramid(unsigned int tileWidth,
+                                   unsigned int tileHeight,
+                                   bool smooth,
+                                   ImageCompression compression,
+                                   Orthanc::PixelFormat samplesFormat) :
+    tileWidth_(tileWidth),
+    tileHeight_(tileHeight),
+    smooth_(smooth),
+    compression_(compression),
+    samplesFormat_(samplesFormat),
+    rescaleSlope_(1),
+    rescaleIntercept_(0),
+    windowCenter_(128),
+    windowWidth_(256),
+    invert_(false),
+    memory_(0)
+  {
+  }
+
+
+  void OnTheFlyPyramid::Serialize(std::string& target) const
+  {
+    std::vector<std::pair<TileKey, const StoredTile*> > tiles;
+
+    {
+      // As the stored tiles are never modified nor removed, they are
+      // serialized without holding the mutex
+      boost::mutex::scoped_lock lock(mutex_);
+      tiles.reserve(tiles_.size());
+
+      for (Tiles::const_iterator it = tiles_.begin(); it != tiles_.end(); ++it)
+      {
+        tiles.push_back(std::make_pair(it->first, it->second));
+      }
+    }
+
+    uint8_t red, green, blue;
+    GetBackgroundColor(red, green, blue);
+
+    target.assign(SERIALIZATION_MAGIC, strlen(SERIALIZATION_MAGIC));
+    LittleEndian::WriteUInt32(target, SERIALIZATION_VERSION);
+    LittleEndian::WriteUInt32(target, tileWidth_);
+    LittleEndian::WriteUInt32(target, tileHeight_);
+    LittleEndian::WriteUInt32(target, smooth_ ? 1 : 0);
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(compression_));
+    LittleEndian::WriteUInt32(target, (static_cast<uint32_t>(red) |
+                                       static_cast<uint32_t>(green) << 8 |
+                                       static_cast<uint32_t>(blue) << 16));
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(samplesFormat_));
+    LittleEndian::WriteDouble(target, rescaleSlope_);
+    LittleEndian::WriteDouble(target, rescaleIntercept_);
+    LittleEndian::WriteDouble(target, windowCenter_);
+    LittleEndian::WriteDouble(target, windowWidth_);
+    LittleEndian::WriteUInt32(target, invert_ ? 1 : 0);
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(levelWidths_.size()));
+
+    for (size_t i = 0; i < levelWidths_.size(); i++)
+    {
+      LittleEndian::WriteUInt32(target, levelWidths_[i]);
+      LittleEndian::WriteUInt32(target, levelHeights_[i]);
+    }
+
+    LittleEndian::WriteUInt32(target, static_cast<uint32_t>(tiles.size()));
+
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+      const TileKey& key = tiles[i].first;
+      const StoredTile& tile = *tiles[i].second;
+
+      LittleEndian::WriteUInt32(target, key.GetLevel());
+      LittleEndian::WriteUInt32(target, key.GetTileX());
+      LittleEndian::WriteUInt32(target, key.GetTileY());
+
+      if (tile.IsCompressed())
+      {
+        LittleEndian::WriteUInt64(target, tile.GetCompressed().size());
+        target.append(tile.GetCompressed());
+      }
+      else
+      {
+        std::unique_ptr<Orthanc::ImageAccessor> buffer;
+
+        std::string raw;
+        ImageToolbox::EncodeUncompressedTile(raw, tile.GetPixels(buffer));
+
+        LittleEndian::WriteUInt64(target, raw.size());
+        target.append(raw);
+      }
+    }
+  }
+
+
+  OnTheFlyPyramid* OnTheFlyPyramid::Unserialize(const void* data,
+                                                size_t size)
+  {
+    const size_t magicSize = strlen(SERIALIZATION_MAGIC);
+
+    if (size < magicSize ||
+        memcmp(data, SERIALIZATION_MAGIC, magicSize) != 0)
+    {
+      return NULL;
+    }
+
+    LittleEndian::Reader reader(data, size, magicSize);
+
+    uint32_t version, tileWidth, tileHeight, smooth, compression, background, format, invert, levelsCount;
+    double rescaleSlope, rescaleIntercept, windowCenter, windowWidth;
+    if (!reader.ReadUInt32(version) ||
+        version != SERIALIZATION_VERSION ||
+        !reader.ReadUInt32(tileWidth) ||
+        !reader.ReadUInt32(tileHeight) ||
+        !reader.ReadUInt32(smooth) ||
+        !reader.ReadUInt32(compression) ||
+        !reader.ReadUInt32(background) ||
+        !reader.ReadUInt32(format) ||
+        !reader.ReadDouble(rescaleSlope) ||
+        !reader.ReadDouble(rescaleIntercept) ||
+        !reader.ReadDouble(windowCenter) ||
+        !reader.ReadDouble(windowWidth) ||
+        !reader.ReadUInt32(invert) ||
+        !reader.ReadUInt32(levelsCount) ||
+        tileWidth == 0 ||
+        tileHeight == 0 ||
+        levelsCount == 0 ||
+        levelsCount > 32 ||
+        !(windowWidth > 0) ||
+        (compression != ImageCompression_None &&
+         compression != ImageCompression_Png &&
+         compression != ImageCompression_Jpeg) ||
+        !IsSamplesFormat(static_cast<Orthanc::PixelFormat>(format)) ||
+        (format == Orthanc::PixelFormat_Grayscale16 &&
+         compression == ImageCompression_Jpeg) ||
+        (format == Orthanc::PixelFormat_SignedGrayscale16 &&
+         compression != ImageCompression_None))
+    {
+      return NULL;
+    }
+
+    const Orthanc::PixelFormat samplesFormat = static_cast<Orthanc::PixelFormat>(format);
+
+    std::unique_ptr<OnTheFlyPyramid> pyramid(
+      new OnTheFlyPyramid(tileWidth, tileHeight, smooth != 0, static_cast<ImageCompression>(compression), samplesFormat));
+
+    pyramid->SetBackgroundColor(background & 0xff, (background >> 8) & 0xff, (background >> 16) & 0xff);
+
+    if (pyramid->HasWindowing())
+    {
+      pyramid->SetWindowing(rescaleSlope, rescaleIntercept, windowCenter, windowWidth, invert != 0);
+    }
+
+    for (uint32_t i = 0; i < levelsCount; i++)
+    {
+      uint32_t width, height;
+      if (!reader.ReadUInt32(width) ||
+          !reader.ReadUInt32(height))
+      {
+        return NULL;
+      }
+
+      pyramid->levelWidths_.push_back(width);
+      pyramid->levelHeights_.push_back(height);
+    }
+
+    uint32_t tilesCount;
+    if (!reader.ReadUInt32(tilesCount))
+    {
+      return NULL;
+    }
+
+    for (uint32_t i = 0; i < tilesCount; i++)
+    {
+      uint32_t level, tileX, tileY;
+      uint64_t tileSize;
+      std::string content;
+
+      if (!reader.ReadUInt32(level) ||
+          !reader.ReadUInt32(tileX) ||
+          !reader.ReadUInt32(tileY) ||
+          !reader.ReadUInt64(tileSize) ||
+          !reader.ReadString(content, tileSize) ||
+          level >= levelsCount ||
+          tileX >= CeilingDivision(pyramid->levelWidths_[level], tileWidth) ||
+          tileY >= CeilingDivision(pyramid->levelHeights_[level], tileHeight))
+      {
+        return NULL;
+      }
+
+      std::unique_ptr<StoredTile> tile;
+
+      if (compression == ImageCompression_None)
+      {
+        const unsigned int width = std::min(tileWidth, pyramid->levelWidths_[level] - tileX * tileWidth);
+        const unsigned int height = std::min(tileHeight, pyramid->levelHeights_[level] - tileY * tileHeight);
+
+        if (content.size() != (Orthanc::GetBytesPerPixel(samplesFormat) *
+                                static_cast<size_t>(width) * static_cast<size_t>(height)))
+        {
+          return NULL;
+        }
+
+        tile.reset(new StoredTile(ImageToolbox::DecodeRawTile(content, samplesFormat, width, height),
+                                  ImageCompression_None));
+      }
+      else
+      {
+        tile.reset(new StoredTile(content, static_cast<ImageCompression>(compression)));
+      }
+
+      pyramid->Store(level, tileX, tileY, tile.release());
+    }
+
+    // The base level must be complete
+    const unsigned int countTilesX = CeilingDivision(pyramid->levelWidths_[0], tileWidth);
+    const unsigned int countTilesY = CeilingDivision(pyramid->levelHeights_[0], tileHeight);
+
+    for (unsigned int tileY = 0; tileY < countTilesY; tileY++)
+    {
+      for (unsigned int tileX = 0; tileX < countTilesX; tileX++)
+      {
+        if (pyramid->LookupTile(0, tileX, tileY) == NULL)
+        {
+          return NULL;
+        }
+      }
     }
 
-    return memory;
+    return pyramid.release();
   }
 }
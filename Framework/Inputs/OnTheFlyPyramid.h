@@ -27,18 +27,150 @@
 
 #include <Compatibility.h>
 
+#include <boost/thread/mutex.hpp>
+#include <map>
 #include <vector>
 
 
 namespace OrthancWSI
 {
+  /**
+   * Pyramid that is computed from one decoded image. The upper levels
+   * are not computed in the constructor: Each of their tiles is
+   * rendered from the tiles of the level below the first time it is
+   * read, and is kept in the pyramid. The missing tiles of the level
+   * below are themselves rendered and kept recursively. The rendered tiles are identical to those obtained by
+   * halving the full levels.
+   *
+   * The tiles are stored either uncompressed, or compressed as PNG
+   * (lossless) or JPEG (lossy), in which case they are decoded on
+   * access, and they are available as raw tiles. This class is
+   * thread-safe.
+   *
+   * The 16bpp grayscale images keep their original samples, which
+   * are rendered as 8bpp by applying a window when the tiles are
+   * read. This allows to change the window without recomputing the
+   * pyramid.
+   **/
   class OnTheFlyPyramid : public DecodedTiledPyramid
   {
   private:
-    std::unique_ptr<Orthanc::ImageAccessor>  baseLevel_;
-    std::vector<Orthanc::ImageAccessor*>     higherLevels_;
-    unsigned int                             tileWidth_;
-    unsigned int                             tileHeight_;
+    class StoredTile;
+
+    class TileKey
+    {
+    private:
+      unsigned int  level_;
+      unsigned int  tileX_;
+      unsigned int  tileY_;
+
+    public:
+      TileKey(unsigned int level,
+              unsigned int tileX,
+              unsigned int tileY) :
+        level_(level),
+        tileX_(tileX),
+        tileY_(tileY)
+      {
+      }
+
+      unsigned int GetLevel() const
+      {
+        return level_;
+      }
+
+      unsigned int GetTileX() const
+      {
+        return tileX_;
+      }
+
+      unsigned int GetTileY() const
+      {
+        return tileY_;
+      }
+
+      bool operator< (const TileKey& other) const
+      {
+        if (level_ != other.level_)
+        {
+          return level_ < other.level_;
+        }
+        else if (tileY_ != other.tileY_)
+        {
+          return tileY_ < other.tileY_;
+        }
+        else
+        {
+          return tileX_ < other.tileX_;
+        }
+      }
+    };
+
+    typedef std::map<TileKey, StoredTile*>  Tiles;
+
+    std::vector<unsigned int>  levelWidths_;
+    std::vector<unsigned int>  levelHeights_;
+    unsigned int               tileWidth_;
+    unsigned int               tileHeight_;
+    bool                       smooth_;
+    ImageCompression           compression_;
+    Orthanc::PixelFormat       samplesFormat_;
+    double                     rescaleSlope_;
+    double                     rescaleIntercept_;
+    double                     windowCenter_;
+    double                     windowWidth_;
+    bool                       invert_;
+
+    mutable boost::mutex       mutex_;
+    Tiles                      tiles_;    // All the tiles of the base level, and the rendered tiles of the upper levels
+    size_t                     memory_;
+
+    void Store(unsigned int level,
+               unsigned int tileX,
+               unsigned int tileY,
+               StoredTile* tile);
+
+    const StoredTile* LookupTile(unsigned int level,
+                                 unsigned int tileX,
+                                 unsigned int tileY) const;
+
+    const StoredTile& GetTile(unsigned int level,
+                              unsigned int tileX,
+                              unsigned int tileY);
+
+    void CopyTiles(Orthanc::ImageAccessor& target,
+                   unsigned int x,
+                   unsigned int y,
+                   const std::vector<const StoredTile*>& tiles) const;
+
+    bool LookupRenderedRegion(Orthanc::ImageAccessor& target,
+                              unsigned int level,
+                              unsigned int x,
+                              unsigned int y) const;
+
+    void ReadTiles(Orthanc::ImageAccessor& target,
+                   unsigned int level,
+                   unsigned int x,
+                   unsigned int y);
+
+    Orthanc::ImageAccessor* RenderRegion(unsigned int level,
+                                         unsigned int x,
+                                         unsigned int y,
+                                         unsigned int width,
+                                         unsigned int height);
+
+    // Reads the original samples, before windowing
+    void ReadSamples(Orthanc::ImageAccessor& target,
+                     unsigned int level,
+                     unsigned int x,
+                     unsigned int y);
+
+    // Constructor used by "Unserialize()"
+    OnTheFlyPyramid(unsigned int tileWidth,
+                    unsigned int tileHeight,
+                    bool smooth,
+                    ImageCompression compression,
+                    Orthanc::PixelFormat samplesFormat);
 
   protected:
     void ReadRegion(Orthanc::ImageAccessor &target,
@@ -48,29 +180,30 @@ namespace OrthancWSI
                     unsigned y) ORTHANC_OVERRIDE;
 
   public:
+    // "compression" must be "ImageCompression_None", "ImageCompression_Png" or "ImageCompression_Jpeg".
+    // The 16bpp grayscale tiles are compressed as PNG if "compression" is not "None", but are never
+    // compressed if signed.
     OnTheFlyPyramid(Orthanc::ImageAccessor* baseLevel /* takes ownership */,
                     unsigned int tileWidth,
                     unsigned int tileHeight,
-                    bool smooth);
+                    bool smooth,
+                    ImageCompression compression);
 
     virtual ~OnTheFlyPyramid();
 
-    const Orthanc::ImageAccessor& GetLevel(unsigned int level) const;
-
-    unsigned GetLevelCount() const ORTHANC_OVERRIDE
+    ImageCompression GetCompression() const
     {
-      return higherLevels_.size() + 1 /* base level */;
+      return compression_;
     }
 
-    unsigned GetLevelWidth(unsigned int level) const ORTHANC_OVERRIDE
+    unsigned GetLevelCount() const ORTHANC_OVERRIDE
     {
-      return GetLevel(level).GetWidth();
+      return levelWidths_.size();
     }
 
-    unsigned GetLevelHeight(unsigned int level) const ORTHANC_OVERRIDE
-    {
-      return GetLevel(level).GetHeight();
-    }
+    unsigned GetLevelWidth(unsigned int level) const ORTHANC_OVERRIDE;
+
+    unsigned GetLevelHeight(unsigned int level) const ORTHANC_OVERRIDE;
 
     unsigned GetTileWidth(unsigned int level) const ORTHANC_OVERRIDE
     {
@@ -82,16 +215,70 @@ namespace OrthancWSI
       return tileHeight_;
     }
 
+    // The 16bpp grayscale images are rendered with the default window
     Orthanc::PixelFormat GetPixelFormat() const ORTHANC_OVERRIDE
     {
-      return baseLevel_->GetFormat();
+      return (HasWindowing() ? Orthanc::PixelFormat_Grayscale8 : Orthanc::PixelFormat_RGB24);
     }
 
     Orthanc::PhotometricInterpretation GetPhotometricInterpretation() const ORTHANC_OVERRIDE
     {
-      return Orthanc::PhotometricInterpretation_RGB;
+      return (HasWindowing() ? Orthanc::PhotometricInterpretation_Monochrome2 : Orthanc::PhotometricInterpretation_RGB);
+    }
+
+    // Whether the original samples are 16bpp grayscale
+    bool HasWindowing() const
+    {
+      return samplesFormat_ != Orthanc::PixelFormat_RGB24;
+    }
+
+    // Must be called before the pyramid is shared between threads
+    void SetWindowing(double rescaleSlope,
+                      double rescaleIntercept,
+                      double defaultWindowCenter,
+                      double defaultWindowWidth,
+                      bool invert);
+
+    double GetDefaultWindowCenter() const
+    {
+      return windowCenter_;
+    }
+
+    double GetDefaultWindowWidth() const
+    {
+      return windowWidth_;
     }
 
+    // Same as "DecodeTile()", but applies the given window (expressed
+    // in rescaled values) to the 16bpp grayscale samples
+    Orthanc::ImageAccessor* DecodeWindowedTile(bool& isEmpty,
+                                               unsigned int level,
+                                               unsigned int tileX,
+                                               unsigned int tileY,
+                                               double windowCenter,
+                                               double windowWidth);
+
+    // The compressed tiles are served as such. Returns "false" if the
+    // tiles are not compressed, if they contain 16bpp samples, or for
+    // the partial tiles at the right and bottom borders.
+    bool ReadRawTile(std::string& tile,
+                     ImageCompression& compression,
+                     unsigned int level,
+                     unsigned int tileX,
+                     unsigned int tileY) ORTHANC_OVERRIDE;
+
+    // Only accounts for the tiles that have been rendered so far
     size_t GetMemoryUsage() const ORTHANC_OVERRIDE;
+
+    /**
+     * Binary serialization of the pyramid, together with the tiles
+     * of the upper levels that have been rendered so far. This is
+     * used to spill the pyramids to the disk.
+     **/
+    void Serialize(std::string& target) const;
+
+    // Returns NULL if the serialized pyramid is corrupted
+    static OnTheFlyPyramid* Unserialize(const void* data,
+                                        size_t size);
   };
 }
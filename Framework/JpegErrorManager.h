@@ -0,0 +1,66 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <stdio.h>   // Must be included before "jpeglib.h"
+#include <setjmp.h>
+#include <jpeglib.h>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Error manager for the direct calls to libjpeg: Fatal errors jump
+   * back to the "setjmp()" of the caller, that must destroy the codec
+   * and throw an exception, and the warnings are silenced. No C++
+   * object with a destructor may be created on the stack between the
+   * "setjmp()" and the calls to libjpeg.
+   **/
+  struct JpegErrorManager
+  {
+    struct jpeg_error_mgr  pub_;    // Must be the first field
+    jmp_buf                jump_;
+    char                   message_[JMSG_LENGTH_MAX];
+
+    static void ErrorExit(j_common_ptr cinfo)
+    {
+      JpegErrorManager* manager = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+      (*cinfo->err->format_message) (cinfo, manager->message_);
+      longjmp(manager->jump_, 1);
+    }
+
+    static void OutputMessage(j_common_ptr cinfo)
+    {
+    }
+
+    struct jpeg_error_mgr* Setup()
+    {
+      struct jpeg_error_mgr* result = jpeg_std_error(&pub_);
+      pub_.error_exit = ErrorExit;
+      pub_.output_message = OutputMessage;
+      message_[0] = '\0';
+      return result;
+    }
+  };
+}
@@ -0,0 +1,137 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PrecompiledHeadersWSI.h"
+#include "JpegToolbox.h"
+
+#include "JpegErrorManager.h"
+
+#include <OrthancException.h>
+
+#include <stdlib.h>
+
+
+namespace OrthancWSI
+{
+  namespace JpegToolbox
+  {
+    void LosslessCrop(std::string& target,
+                      const std::string& source,
+                      unsigned int width,
+                      unsigned int height)
+    {
+      if (source.empty())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      if (width == 0 ||
+          height == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      struct jpeg_decompress_struct input;
+      struct jpeg_compress_struct output;
+      JpegErrorManager manager;
+
+      // The error manager is shared by the decompressor and the compressor
+      input.err = manager.Setup();
+      output.err = input.err;
+
+      // Buffer that is allocated by "jpeg_mem_dest()"
+      unsigned char* buffer = NULL;
+      unsigned long size = 0;
+
+      jpeg_create_decompress(&input);
+      jpeg_create_compress(&output);
+
+      if (setjmp(manager.jump_))
+      {
+        jpeg_destroy_compress(&output);
+        jpeg_destroy_decompress(&input);
+
+        if (buffer != NULL)
+        {
+          free(buffer);
+        }
+
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Cannot crop a JPEG image: " +
+                                        std::string(manager.message_));
+      }
+
+      jpeg_mem_src(&input, const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(source.c_str())),
+                   static_cast<unsigned long>(source.size()));
+      jpeg_read_header(&input, TRUE);
+
+      if (width > input.image_width ||
+          height > input.image_height)
+      {
+        jpeg_destroy_compress(&output);
+        jpeg_destroy_decompress(&input);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&input);
+
+      /**
+       * As the crop starts at the origin, the coefficients of the
+       * source can be written as such: The compressor only reads the
+       * blocks that cover the new dimensions of the image.
+       **/
+      jpeg_copy_critical_parameters(&input, &output);
+
+#if JPEG_LIB_VERSION >= 70
+      output.jpeg_width = width;
+      output.jpeg_height = height;
+#endif
+      output.image_width = width;
+      output.image_height = height;
+
+      jpeg_mem_dest(&output, &buffer, &size);
+      jpeg_write_coefficients(&output, coefficients);
+      jpeg_finish_compress(&output);
+      jpeg_finish_decompress(&input);
+
+      jpeg_destroy_compress(&output);
+      jpeg_destroy_decompress(&input);
+
+      if (buffer == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      try
+      {
+        target.assign(reinterpret_cast<const char*>(buffer), size);
+      }
+      catch (...)
+      {
+        free(buffer);
+        throw;
+      }
+
+      free(buffer);
+    }
+  }
+}
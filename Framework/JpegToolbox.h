@@ -0,0 +1,47 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <string>
+
+
+namespace OrthancWSI
+{
+  namespace JpegToolbox
+  {
+    /**
+     * Crops the top-left "width" x "height" pixels of a JPEG image in
+     * the transform domain, as "jpegtran -crop WxH+0+0": The DCT
+     * coefficients are copied without being decoded, which avoids
+     * the IDCT/DCT round trip and a new generation of JPEG loss. As
+     * the origin of the crop is aligned on the MCU grid, any size is
+     * supported: The JPEG decoders discard the pixels of the partial
+     * MCU at the right and bottom edges.
+     **/
+    void LosslessCrop(std::string& target,
+                      const std::string& source,
+                      unsigned int width,
+                      unsigned int height);
+  }
+}
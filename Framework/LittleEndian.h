@@ -0,0 +1,198 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  namespace LittleEndian
+  {
+    inline void WriteUInt32(std::string& target,
+                            uint32_t value)
+    {
+      for (unsigned int i = 0; i < 4; i++)
+      {
+        target.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+      }
+    }
+
+
+    inline void WriteUInt64(std::string& target,
+                            uint64_t value)
+    {
+      WriteUInt32(target, static_cast<uint32_t>(value & 0xffffffffu));
+      WriteUInt32(target, static_cast<uint32_t>(value >> 32));
+    }
+
+
+    // Assumes IEEE 754 doubles
+    inline void WriteDouble(std::string& target,
+                            double value)
+    {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      WriteUInt64(target, bits);
+    }
+
+
+    // Little-endian reader over a memory buffer, that never reads
+    // past the end of the buffer
+    class Reader : public boost::noncopyable
+    {
+    private:
+      const uint8_t*  data_;
+      uint64_t        size_;
+      uint64_t        position_;
+
+    public:
+      Reader(const void* data,
+             uint64_t size,
+             uint64_t position) :
+        data_(reinterpret_cast<const uint8_t*>(data)),
+        size_(size),
+        position_(position)
+      {
+      }
+
+      const uint8_t* GetData() const
+      {
+        return data_;
+      }
+
+      uint64_t GetPosition() const
+      {
+        return position_;
+      }
+
+      bool IsEnd() const
+      {
+        return position_ >= size_;
+      }
+
+      uint64_t GetRemainingSize() const
+      {
+        return size_ - position_;
+      }
+
+      bool Skip(uint64_t length)
+      {
+        if (length > size_ - position_)
+        {
+          return false;
+        }
+        else
+        {
+          position_ += length;
+          return true;
+        }
+      }
+
+      bool PeekUInt16(uint16_t& value) const
+      {
+        if (size_ - position_ < 2)
+        {
+          return false;
+        }
+        else
+        {
+          value = (static_cast<uint16_t>(data_[position_]) |
+                   static_cast<uint16_t>(data_[position_ + 1]) << 8);
+          return true;
+        }
+      }
+
+      bool ReadUInt16(uint16_t& value)
+      {
+        return (PeekUInt16(value) &&
+                Skip(2));
+      }
+
+      bool ReadUInt32(uint32_t& value)
+      {
+        if (size_ - position_ < 4)
+        {
+          return false;
+        }
+        else
+        {
+          value = (static_cast<uint32_t>(data_[position_]) |
+                   static_cast<uint32_t>(data_[position_ + 1]) << 8 |
+                   static_cast<uint32_t>(data_[position_ + 2]) << 16 |
+                   static_cast<uint32_t>(data_[position_ + 3]) << 24);
+          position_ += 4;
+          return true;
+        }
+      }
+
+      bool ReadUInt64(uint64_t& value)
+      {
+        uint32_t low, high;
+        if (ReadUInt32(low) &&
+            ReadUInt32(high))
+        {
+          value = static_cast<uint64_t>(low) | (static_cast<uint64_t>(high) << 32);
+          return true;
+        }
+        else
+        {
+          return false;
+        }
+      }
+
+      bool ReadDouble(double& value)
+      {
+        uint64_t bits;
+        if (ReadUInt64(bits))
+        {
+          memcpy(&value, &bits, sizeof(value));
+          return true;
+        }
+        else
+        {
+          return false;
+        }
+      }
+
+      bool ReadString(std::string& value,
+                      uint64_t length)
+      {
+        if (length > size_ - position_)
+        {
+          return false;
+        }
+        else
+        {
+          value.assign(reinterpret_cast<const char*>(data_) + position_, length);
+          position_ += length;
+          return true;
+        }
+      }
+    };
+  }
+}
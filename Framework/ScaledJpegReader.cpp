@@ -0,0 +1,133 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PrecompiledHeadersWSI.h"
+#include "ScaledJpegReader.h"
+
+#include "JpegErrorManager.h"
+
+#include <OrthancException.h>
+
+
+namespace OrthancWSI
+{
+  void ScaledJpegReader::ReadFromMemory(const void* buffer,
+                                        size_t size,
+                                        unsigned int scaleDenominator)
+  {
+    if (!IsSupportedScaleDenominator(scaleDenominator))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    if (buffer == NULL ||
+        size == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    /**
+     * No C++ object with a destructor must be created as a local
+     * variable after "setjmp()", as "longjmp()" would skip it.
+     **/
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager manager;
+    cinfo.err = manager.Setup();
+
+    if (setjmp(manager.jump_))
+    {
+      jpeg_destroy_decompress(&cinfo);
+      image_.reset(NULL);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                      "Cannot decode a JPEG image: " + std::string(manager.message_));
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(buffer)),
+                 static_cast<unsigned long>(size));
+    jpeg_read_header(&cinfo, TRUE);
+
+    Orthanc::PixelFormat format;
+
+    if (cinfo.num_components == 1)
+    {
+      cinfo.out_color_space = JCS_GRAYSCALE;
+      format = Orthanc::PixelFormat_Grayscale8;
+    }
+    else if (cinfo.num_components == 3)
+    {
+      cinfo.out_color_space = JCS_RGB;
+      format = Orthanc::PixelFormat_RGB24;
+    }
+    else
+    {
+      jpeg_destroy_decompress(&cinfo);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented,
+                                      "Unsupported number of components in a JPEG image");
+    }
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scaleDenominator;
+
+    jpeg_start_decompress(&cinfo);
+
+    try
+    {
+      image_.reset(new Orthanc::Image(format, cinfo.output_width, cinfo.output_height, false));
+    }
+    catch (...)
+    {
+      jpeg_destroy_decompress(&cinfo);
+      throw;
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = reinterpret_cast<JSAMPROW>(image_->GetRow(cinfo.output_scanline));
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    AssignWritable(image_->GetFormat(),
+                   image_->GetWidth(),
+                   image_->GetHeight(),
+                   image_->GetPitch(),
+                   image_->GetBuffer());
+  }
+
+
+  void ScaledJpegReader::ReadFromMemory(const std::string& buffer,
+                                        unsigned int scaleDenominator)
+  {
+    if (buffer.empty())
+    {
+      ReadFromMemory(NULL, 0, scaleDenominator);
+    }
+    else
+    {
+      ReadFromMemory(buffer.c_str(), buffer.size(), scaleDenominator);
+    }
+  }
+}
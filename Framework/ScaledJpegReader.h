@@ -0,0 +1,60 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Images/Image.h>
+
+#include <memory>
+
+namespace OrthancWSI
+{
+  /**
+   * JPEG decoder that uses the DCT scaling of libjpeg to decode the
+   * image at a reduced resolution (1/1, 1/2, 1/4 or 1/8), which is
+   * much faster than decoding the full image then downsampling it.
+   * The size of the decoded image is rounded up, as in libjpeg.
+   **/
+  class ScaledJpegReader : public Orthanc::ImageAccessor
+  {
+  private:
+    std::unique_ptr<Orthanc::ImageAccessor> image_;
+
+  public:
+    void ReadFromMemory(const void* buffer,
+                        size_t size,
+                        unsigned int scaleDenominator);
+
+    void ReadFromMemory(const std::string& buffer,
+                        unsigned int scaleDenominator);
+
+    static bool IsSupportedScaleDenominator(unsigned int scaleDenominator)
+    {
+      return (scaleDenominator == 1 ||
+              scaleDenominator == 2 ||
+              scaleDenominator == 4 ||
+              scaleDenominator == 8);
+    }
+  };
+}
@@ -0,0 +1,139 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PrecompiledHeadersWSI.h"
+#include "WebPWriter.h"
+
+#include <Images/Image.h>
+#include <Images/ImageProcessing.h>
+#include <OrthancException.h>
+
+#include <webp/encode.h>
+
+
+namespace OrthancWSI
+{
+  void WebPWriter::WriteToMemoryInternal(std::string& compressed,
+                                         unsigned int width,
+                                         unsigned int height,
+                                         unsigned int pitch,
+                                         Orthanc::PixelFormat format,
+                                         const void* buffer)
+  {
+    if (width == 0 ||
+        height == 0 ||
+        width > WEBP_MAX_DIMENSION ||
+        height > WEBP_MAX_DIMENSION)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                      "Image size not supported by WebP");
+    }
+
+    // WebP has no grayscale mode, expand grayscale images to RGB
+    std::unique_ptr<Orthanc::ImageAccessor> converted;
+
+    switch (format)
+    {
+      case Orthanc::PixelFormat_RGB24:
+      case Orthanc::PixelFormat_RGBA32:
+        break;
+
+      case Orthanc::PixelFormat_Grayscale8:
+      {
+        Orthanc::ImageAccessor source;
+        source.AssignReadOnly(format, width, height, pitch, buffer);
+
+        converted.reset(new Orthanc::Image(Orthanc::PixelFormat_RGB24, width, height, false));
+        Orthanc::ImageProcessing::Convert(*converted, source);
+
+        format = Orthanc::PixelFormat_RGB24;
+        pitch = converted->GetPitch();
+        buffer = converted->GetConstBuffer();
+        break;
+      }
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const uint8_t* pixels = reinterpret_cast<const uint8_t*>(buffer);
+    const int w = static_cast<int>(width);
+    const int h = static_cast<int>(height);
+    const int stride = static_cast<int>(pitch);
+    const float quality = static_cast<float>(quality_);
+
+    uint8_t* output = NULL;
+    size_t size;
+
+    if (format == Orthanc::PixelFormat_RGB24)
+    {
+      size = (isLossless_ ?
+              WebPEncodeLosslessRGB(pixels, w, h, stride, &output) :
+              WebPEncodeRGB(pixels, w, h, stride, quality, &output));
+    }
+    else
+    {
+      size = (isLossless_ ?
+              WebPEncodeLosslessRGBA(pixels, w, h, stride, &output) :
+              WebPEncodeRGBA(pixels, w, h, stride, quality, &output));
+    }
+
+    if (size == 0 ||
+        output == NULL)
+    {
+      if (output != NULL)
+      {
+        WebPFree(output);
+      }
+
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                      "Cannot encode a WebP image");
+    }
+
+    try
+    {
+      compressed.assign(reinterpret_cast<const char*>(output), size);
+    }
+    catch (...)
+    {
+      WebPFree(output);
+      throw;
+    }
+
+    WebPFree(output);
+  }
+
+
+  void WebPWriter::SetQuality(uint8_t quality)
+  {
+    if (quality == 0 ||
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
+    {
+      quality_ = quality;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+# Orthanc - A Lightweight, RESTful DICOM Store
+# Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+# Department, University Hospital of Liege, Belgium
+# Copyright (C) 2017-2023 Osimis S.A., Belgium
+# Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+# Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+#
+# This program is free software: you can redistribute it and/or
+# modify it under the terms of the GNU Affero General Public License
+# as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Affero General Public License for more details.
+# 
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+# https://developers.google.com/speed/webp/
+
+if (ENABLE_WEBP AND STATIC_BUILD)
+  message(WARNING "The WebP encoding is only available if linking against the system version of libwebp, disabling it")
+  set(ENABLE_WEBP OFF)
+endif()
+
+if (ENABLE_WEBP)
+  find_path(LIBWEBP_INCLUDE_DIR
+    NAMES webp/encode.h
+    PATHS
+    /usr/include/
+    /usr/local/include/
+    )
+
+  CHECK_INCLUDE_FILE_CXX(${LIBWEBP_INCLUDE_DIR}/webp/encode.h HAVE_LIBWEBP_H)
+  if (NOT HAVE_LIBWEBP_H)
+    message(FATAL_ERROR "Please install the libwebp development package (libwebp-dev on Ubuntu)")
+  endif()
+
+  CHECK_LIBRARY_EXISTS(webp WebPEncodeLosslessRGB "" HAVE_LIBWEBP_LIB)
+  if (NOT HAVE_LIBWEBP_LIB)
+    message(FATAL_ERROR "Please install the libwebp development package")
+  endif()
+
+  link_libraries(webp)
+  include_directories(${LIBWEBP_INCLUDE_DIR})
+
+  set(LIBWEBP_SOURCES
+    ${ORTHANC_WSI_DIR}/Framework/WebPWriter.cpp
+    )
+
+  add_definitions(-DORTHANC_WSI_ENABLE_WEBP=1)
+else()
+  add_definitions(-DORTHANC_WSI_ENABLE_WEBP=0)
+endif()
@@ -0,0 +1,206 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "BackgroundTiles.h"
+
+#include "../Framework/ImageToolbox.h"
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Images/Image.h>
+#include <Images/ImageProcessing.h>
+#include <OrthancException.h>
+
+#include <map>
+
+
+namespace OrthancWSI
+{
+  namespace BackgroundTiles
+  {
+    // Tiles whose size is not registered yet (e.g. arbitrary IIIF
+    // crops) are encoded on each request once this limit is reached
+    static const size_t MAX_REGISTERED_TILES = 256;
+
+
+    namespace
+    {
+      class Key
+      {
+      private:
+        unsigned int       width_;
+        unsigned int       height_;
+        uint32_t           color_;
+        Orthanc::MimeType  encoding_;
+
+      public:
+        Key(unsigned int width,
+            unsigned int height,
+            uint8_t red,
+            uint8_t green,
+            uint8_t blue,
+            Orthanc::MimeType encoding) :
+          width_(width),
+          height_(height),
+          color_((static_cast<uint32_t>(red) << 16) |
+                 (static_cast<uint32_t>(green) << 8) |
+                 static_cast<uint32_t>(blue)),
+          encoding_(encoding)
+        {
+        }
+
+        bool operator< (const Key& other) const
+        {
+          if (width_ != other.width_)
+          {
+            return width_ < other.width_;
+          }
+          else if (height_ != other.height_)
+          {
+            return height_ < other.height_;
+          }
+          else if (color_ != other.color_)
+          {
+            return color_ < other.color_;
+          }
+          else
+          {
+            return encoding_ < other.encoding_;
+          }
+        }
+      };
+
+      typedef std::map<Key, TileHandle>           Registry;
+      typedef boost::shared_ptr<const Registry>   RegistryHandle;
+    }
+
+
+    /**
+     * The registry is never modified once published: Registering a
+     * new tile publishes a modified copy of the registry using an
+     * atomic compare-and-swap, which is cheap as the registry is
+     * small and rarely grows.
+     **/
+    static RegistryHandle  registry_(new Registry);
+
+
+    static TileHandle Encode(unsigned int tileWidth,
+                             unsigned int tileHeight,
+                             uint8_t red,
+                             uint8_t green,
+                             uint8_t blue,
+                             Orthanc::MimeType encoding)
+    {
+      const ImageCompression compression = ImageToolbox::Convert(encoding);
+
+      // JPEG and JPEG 2000 don't support transparency
+      const bool hasAlpha = (compression == ImageCompression_Png ||
+                             compression == ImageCompression_WebP);
+
+      Orthanc::Image tile(hasAlpha ? Orthanc::PixelFormat_RGBA32 : Orthanc::PixelFormat_RGB24,
+                          tileWidth, tileHeight, false);
+      Orthanc::ImageProcessing::Set(tile, red, green, blue, 0 /* alpha - fully transparent */);
+
+      std::string encoded;
+      ImageToolbox::EncodeTile(encoded, tile, compression, 100 /* lossless WebP, best JPEG */);
+
+      return TileHandle(new std::string(encoded));
+    }
+
+
+    TileHandle GetTile(unsigned int tileWidth,
+                       unsigned int tileHeight,
+                       uint8_t red,
+                       uint8_t green,
+                       uint8_t blue,
+                       Orthanc::MimeType encoding)
+    {
+      if (tileWidth == 0 ||
+          tileHeight == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      const Key key(tileWidth, tileHeight, red, green, blue, encoding);
+
+      {
+        RegistryHandle registry = boost::atomic_load(&registry_);
+
+        Registry::const_iterator found = registry->find(key);
+        if (found != registry->end())
+        {
+          return found->second;
+        }
+      }
+
+      // This is the first request for this tile: Encode it, then
+      // register it, unless another thread did it in between
+      TileHandle tile = Encode(tileWidth, tileHeight, red, green, blue, encoding);
+
+      for (;;)
+      {
+        RegistryHandle registry = boost::atomic_load(&registry_);
+
+        Registry::const_iterator found = registry->find(key);
+        if (found != registry->end())
+        {
+          return found->second;
+        }
+        else if (registry->size() >= MAX_REGISTERED_TILES)
+        {
+          return tile;
+        }
+
+        boost::shared_ptr<Registry> modified(new Registry(*registry));
+        (*modified) [key] = tile;
+
+        if (boost::atomic_compare_exchange(&registry_, &registry, RegistryHandle(modified)))
+        {
+          return tile;
+        }
+      }
+    }
+
+
+    void Answer(OrthancPluginRestOutput* output,
+                unsigned int tileWidth,
+                unsigned int tileHeight,
+                uint8_t red,
+                uint8_t green,
+                uint8_t blue,
+                Orthanc::MimeType encoding)
+    {
+      // The handle keeps the tile alive while it is sent
+      TileHandle tile = GetTile(tileWidth, tileHeight, red, green, blue, encoding);
+
+      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, tile->c_str(),
+                                tile->size(), Orthanc::EnumerationToString(encoding));
+    }
+
+
+    void Clear()
+    {
+      boost::atomic_store(&registry_, RegistryHandle(new Registry));
+    }
+  }
+}
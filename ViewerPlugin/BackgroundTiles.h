@@ -0,0 +1,67 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Enumerations.h>
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Registry of the pre-encoded tiles that are served in place of the
+   * empty tiles of sparse pyramids, indexed by their size, color and
+   * encoding. The tiles are painted with the background color of the
+   * pyramid, and are fully transparent if the encoding supports
+   * transparency. Once encoded, a tile is never modified, which
+   * allows to answer it without copying it, and the lookups don't
+   * lock any mutex.
+   **/
+  namespace BackgroundTiles
+  {
+    typedef boost::shared_ptr<const std::string>  TileHandle;
+
+    TileHandle GetTile(unsigned int tileWidth,
+                       unsigned int tileHeight,
+                       uint8_t red,
+                       uint8_t green,
+                       uint8_t blue,
+                       Orthanc::MimeType encoding);
+
+    void Answer(OrthancPluginRestOutput* output,
+                unsigned int tileWidth,
+                unsigned int tileHeight,
+                uint8_t red,
+                uint8_t green,
+                uint8_t blue,
+                Orthanc::MimeType encoding);
+
+    void Clear();
+  }
+}
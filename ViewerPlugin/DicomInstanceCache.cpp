@@ -0,0 +1,299 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "DicomInstanceCache.h"
+
+#include "OrthancPluginConnection.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <cassert>
+
+
+static std::unique_ptr<OrthancWSI::DicomInstanceCache>  singleton_;
+
+
+namespace OrthancWSI
+{
+  class DicomInstanceCache::CachedInstance : public boost::noncopyable
+  {
+  private:
+    boost::mutex                                   mutex_;
+    std::unique_ptr<OrthancPlugins::DicomInstance>  instance_;
+    size_t                                         size_;
+
+  public:
+    CachedInstance(OrthancPlugins::DicomInstance* instance,
+                   size_t size) :
+      instance_(instance),
+      size_(size)
+    {
+      if (instance == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      }
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+
+    void ReadRawFrame(std::string& target,
+                      unsigned int frame)
+    {
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 7, 0)
+      // The Orthanc core lazily indexes the frames of a parsed DICOM
+      // file, which is not thread-safe
+      boost::mutex::scoped_lock lock(mutex_);
+      instance_->GetRawFrame(target, frame);
+#else
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+#endif
+    }
+  };
+
+
+  void DicomInstanceCache::Remove(const std::string& instanceId)
+  {
+    // Mutex must be locked
+
+    Content::iterator found = content_.find(instanceId);
+    if (found != content_.end())
+    {
+      assert(found->second.get() != NULL &&
+             memoryUsage_ >= found->second->GetSize());
+
+      memoryUsage_ -= found->second->GetSize();
+      content_.erase(found);
+      index_.Invalidate(instanceId);
+    }
+  }
+
+
+  DicomInstanceCache::InstanceHandle DicomInstanceCache::Load(const std::string& instanceId)
+  {
+    // Mutex must *not* be locked, as this reads the DICOM file
+
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 12, 1)
+    if (hasLoadInstance_)
+    {
+      std::unique_ptr<OrthancPlugins::DicomInstance> instance(
+        OrthancPlugins::DicomInstance::Load(instanceId, OrthancPluginLoadDicomInstanceMode_WholeDicom));
+
+      const size_t size = instance->GetSize();
+      return InstanceHandle(new CachedInstance(instance.release(), size));
+    }
+#endif
+
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 7, 0)
+    OrthancPlugins::MemoryBuffer dicom;
+    dicom.GetDicomInstance(instanceId);
+
+    return InstanceHandle(new CachedInstance(new OrthancPlugins::DicomInstance(dicom.GetData(), dicom.GetSize()),
+                                             dicom.GetSize()));
+#else
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+#endif
+  }
+
+
+  DicomInstanceCache::DicomInstanceCache(size_t maxMemory) :
+    isAvailable_(false),
+    hasLoadInstance_(false),
+    maxMemory_(maxMemory),
+    memoryUsage_(0)
+  {
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 7, 0)
+    // "OrthancPluginGetInstanceRawFrame()" was introduced in Orthanc 1.7.0
+    isAvailable_ = (maxMemory != 0 &&
+                    OrthancPlugins::CheckMinimalOrthancVersion(1, 7, 0));
+#endif
+
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 12, 1)
+    // "OrthancPluginLoadDicomInstance()" avoids one copy of the DICOM file
+    hasLoadInstance_ = OrthancPlugins::CheckMinimalOrthancVersion(1, 12, 1);
+#endif
+
+    if (!isAvailable_ &&
+        maxMemory != 0)
+    {
+      LOG(WARNING) << "The raw frames will be read through the REST API, as the Orthanc core or the plugin SDK is too old";
+    }
+  }
+
+
+  bool DicomInstanceCache::ReadRawFrame(std::string& target,
+                                        const std::string& instanceId,
+                                        unsigned int frame)
+  {
+    if (!isAvailable_)
+    {
+      return false;
+    }
+
+    InstanceHandle instance;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // If another thread is loading this instance, wait for it
+      while (loading_.find(instanceId) != loading_.end())
+      {
+        loaded_.wait(lock);
+      }
+
+      if (oversized_.find(instanceId) != oversized_.end())
+      {
+        return false;
+      }
+
+      Content::const_iterator found = content_.find(instanceId);
+      if (found == content_.end())
+      {
+        loading_.insert(instanceId);
+      }
+      else
+      {
+        index_.MakeMostRecent(instanceId);
+        instance = found->second;
+      }
+    }
+
+    if (instance.get() == NULL)
+    {
+      // Check the size of the instance, then load it, outside of the
+      // mutex, as this is slow
+      bool tooLarge = false;
+
+      try
+      {
+        uint64_t size;
+        if (!OrthancPluginConnection::LookupDicomFileSize(size, instanceId))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+        }
+
+        if (size > static_cast<uint64_t>(maxMemory_))
+        {
+          tooLarge = true;
+        }
+        else
+        {
+          instance = Load(instanceId);
+        }
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        loading_.erase(instanceId);
+        loaded_.notify_all();
+        throw;
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      loading_.erase(instanceId);
+      loaded_.notify_all();
+
+      if (tooLarge ||
+          instance->GetSize() > maxMemory_)
+      {
+        LOG(INFO) << "Instance " << instanceId << " is too large for the cache of DICOM instances, "
+                  << "its frames will be read through the REST API";
+        oversized_.insert(instanceId);
+        return false;
+      }
+      else
+      {
+        while (memoryUsage_ + instance->GetSize() > maxMemory_)
+        {
+          assert(!index_.IsEmpty());
+          const std::string oldest = index_.GetOldest();
+          Remove(oldest);
+        }
+
+        content_[instanceId] = instance;
+        index_.Add(instanceId, true);
+        memoryUsage_ += instance->GetSize();
+      }
+    }
+
+    assert(instance.get() != NULL);
+    instance->ReadRawFrame(target, frame);
+
+    return true;
+  }
+
+
+  void DicomInstanceCache::Invalidate(const std::string& instanceId)
+  {
+    InstanceHandle instance;   // Release the instance out of the mutex
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::iterator found = content_.find(instanceId);
+      if (found != content_.end())
+      {
+        instance = found->second;
+        Remove(instanceId);
+      }
+
+      oversized_.erase(instanceId);
+    }
+  }
+
+
+  void DicomInstanceCache::InitializeInstance(size_t maxMemory)
+  {
+    if (singleton_.get() == NULL)
+    {
+      singleton_.reset(new DicomInstanceCache(maxMemory));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void DicomInstanceCache::FinalizeInstance()
+  {
+    singleton_.reset(NULL);
+  }
+
+
+  DicomInstanceCache& DicomInstanceCache::GetInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *singleton_;
+    }
+  }
+}
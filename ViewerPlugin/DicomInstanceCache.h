@@ -0,0 +1,95 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+#include <Compatibility.h>  // For std::unique_ptr
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <set>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Least-recently-used cache of the DICOM instances that are parsed
+   * by the Orthanc core, whose size is bounded by a number of
+   * bytes. This gives access to the raw frames through the primitives
+   * of the plugin SDK, which avoids the overhead of the REST API. The
+   * frames are copied out of the instances, as the SDK doesn't give
+   * access to their memory. The size of the instances is checked
+   * before they are loaded: The instances that are larger than the
+   * cache are never loaded, and their frames must be read through the
+   * REST API. Concurrent reads of the same missing instance only load
+   * it once. This class is thread-safe.
+   **/
+  class DicomInstanceCache : public boost::noncopyable
+  {
+  private:
+    class CachedInstance;
+
+    typedef boost::shared_ptr<CachedInstance>                     InstanceHandle;
+    typedef std::map<std::string, InstanceHandle>                 Content;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, bool>    Index;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  loaded_;
+    bool                       isAvailable_;
+    bool                       hasLoadInstance_;
+    size_t                     maxMemory_;
+    size_t                     memoryUsage_;
+    Content                    content_;
+    Index                      index_;
+    std::set<std::string>      loading_;
+    std::set<std::string>      oversized_;
+
+    void Remove(const std::string& instanceId);
+
+    InstanceHandle Load(const std::string& instanceId);
+
+  public:
+    // "0" disables the cache
+    explicit DicomInstanceCache(size_t maxMemory);
+
+    // Returns "false" if the plugin SDK or the Orthanc core is too
+    // old, if the cache is disabled, or if the instance is too large
+    bool ReadRawFrame(std::string& target,
+                      const std::string& instanceId,
+                      unsigned int frame);
+
+    void Invalidate(const std::string& instanceId);
+
+    static void InitializeInstance(size_t maxMemory);
+
+    static void FinalizeInstance();
+
+    static DicomInstanceCache& GetInstance();
+  };
+}
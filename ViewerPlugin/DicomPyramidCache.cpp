@@ -24,137 +24,293 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 #include "DicomPyramidCache.h"
 
+#include "HttpCaching.h"
 #include "OrthancPluginConnection.h"
+#include "TileCache.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
 
+#include <algorithm>
 #include <cassert>
 
 static std::unique_ptr<OrthancWSI::DicomPyramidCache>  singleton_;
 
+// Lower bound on the number of series whose instances are remembered
+static const size_t MIN_KNOWN_SERIES = 1024;
+
 
 namespace OrthancWSI
 {
-  DicomPyramid* DicomPyramidCache::GetCachedPyramid(const std::string& seriesId)
+  DicomPyramidCache::CachedPyramid::CachedPyramid(PyramidHandle pyramid) :
+    pyramid_(pyramid)
+  {
+    if (pyramid.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+    else
+    {
+      // The pyramid is immutable once constructed, except for its
+      // cache of synthetic tiles (cf. "RefreshMemoryUsage()")
+      memory_ = pyramid->GetMemoryUsage();
+    }
+  }
+
+
+  bool DicomPyramidCache::LookupCachedPyramid(PyramidHandle& pyramid,
+                                              const std::string& seriesId)
   {
     // Mutex is assumed to be locked
-    DicomPyramid* pyramid = NULL;
 
     // Is the series of interest already cached as a pyramid?
-    if (cache_.Contains(seriesId, pyramid))
+    CachedPyramid cached;
+    if (cache_.Contains(seriesId, cached))
     {
-      if (pyramid == NULL)
+      pyramid = cached.GetPyramid();
+
+      if (pyramid.get() == NULL)
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
       }
 
       // Tag the series as the most recently used
       cache_.MakeMostRecent(seriesId);
+
+      if (knownSeries_.Contains(seriesId))
+      {
+        knownSeries_.MakeMostRecent(seriesId);
+      }
+
+      return true;
+    }
+    else
+    {
+      return false;
     }
+  }
+
+
+  void DicomPyramidCache::UnregisterSeries(const std::string& seriesId)
+  {
+    // Mutex is assumed to be locked
+
+    if (knownSeries_.Contains(seriesId))
+    {
+      const std::vector<std::string> instances = knownSeries_.Invalidate(seriesId);
 
-    return pyramid;
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        instancesSeries_.erase(instances[i]);
+      }
+    }
   }
 
 
-  DicomPyramid& DicomPyramidCache::GetPyramid(const std::string& seriesId,
-                                              boost::mutex::scoped_lock& lock,
-                                              bool useMetadataCache)
+  void DicomPyramidCache::RegisterSeries(std::vector<std::string>& forgottenSeries,
+                                         const std::string& seriesId,
+                                         const DicomPyramid& pyramid)
   {
     // Mutex is assumed to be locked
 
+    UnregisterSeries(seriesId);
+
+    while (knownSeries_.GetSize() >= maxKnownSeries_)
     {
-      DicomPyramid* pyramid = GetCachedPyramid(seriesId);
-      if (pyramid != NULL)
+      std::vector<std::string> instances;
+      const std::string oldest = knownSeries_.RemoveOldest(instances);
+
+      for (size_t i = 0; i < instances.size(); i++)
       {
-        return *pyramid;
+        instancesSeries_.erase(instances[i]);
       }
+
+      forgottenSeries.push_back(oldest);
+    }
+
+    std::vector<std::string> instances;
+    pyramid.GetInstanceIds(instances);
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      instancesSeries_[instances[i]] = seriesId;
+    }
+
+    knownSeries_.Add(seriesId, instances);
+  }
+
+
+  void DicomPyramidCache::MakeRoom(size_t memory)
+  {
+    // Mutex must be locked
+
+    while (cache_.GetSize() >= maxCount_ ||
+           (!cache_.IsEmpty() &&
+            maxMemory_ != 0 &&
+            memoryUsage_ + memory > maxMemory_))
+    {
+      // The pyramid is only destroyed once the pending accessors
+      // have released it
+      CachedPyramid oldest;
+      cache_.RemoveOldest(oldest);
+
+      assert(memoryUsage_ >= oldest.GetMemoryUsage());
+      memoryUsage_ -= oldest.GetMemoryUsage();
+      evictions_++;
     }
+  }
 
-    // Unlock the mutex to construct the pyramid (this is a
-    // time-consuming operation, we don't want it to block other clients)
-    lock.unlock();
 
+  DicomPyramidCache::PyramidHandle DicomPyramidCache::GetPyramid(const std::string& seriesId)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      PyramidHandle cached;
+      if (LookupCachedPyramid(cached, seriesId))
+      {
+        hits_++;
+        return cached;
+      }
+      else
+      {
+        misses_++;
+      }
+    }
+
+    // The mutex is not locked while constructing the pyramid (this is
+    // a time-consuming operation, we don't want it to block other clients)
     assert(orthanc_.get() != NULL);
-    std::unique_ptr<DicomPyramid> pyramid
-      (new DicomPyramid(*orthanc_, seriesId, useMetadataCache));
+    PyramidHandle pyramid(new DicomPyramid(*orthanc_, seriesId, useMetadataCache_, synthesizeLevels_));
+    CachedPyramid payload(pyramid);
+
+    PyramidHandle result;
+    std::vector<std::string> forgottenSeries;
 
     {
       // The pyramid is constructed: Store it into the cache
-      lock.lock();
+      boost::mutex::scoped_lock lock(mutex_);
 
-      DicomPyramid* cached = GetCachedPyramid(seriesId);
-      if (cached != NULL)
+      // Remember the instances of the series, even if the pyramid is
+      // not cached below, as tiles of this series can be cached
+      RegisterSeries(forgottenSeries, seriesId, *pyramid);
+
+      PyramidHandle cached;
+      if (LookupCachedPyramid(cached, seriesId))
       {
         // The pyramid was already constructed by another request in
-        // between, reuse the cached value (the auto_ptr destroys
-        // the just-constructed pyramid)
-        return *cached;
+        // between, reuse the cached value (the just-constructed
+        // pyramid is destroyed when leaving this method)
+        result = cached;
       }
-
-      if (cache_.GetSize() == maxSize_)
+      else if (maxMemory_ != 0 &&
+               payload.GetMemoryUsage() > maxMemory_)
+      {
+        // This pyramid alone is larger than the cache, don't store it
+        LOG(WARNING) << "The pyramid of series " << seriesId << " uses " << (payload.GetMemoryUsage() / (1024 * 1024))
+                     << "MB, which is larger than the cache of pyramids";
+        result = pyramid;
+      }
+      else
       {
-        // The cache has grown too large: First delete the least
+        MakeRoom(payload.GetMemoryUsage());
+
+        // Add a new element to the cache and make it the most
         // recently used entry
-        DicomPyramid* oldest = NULL;
-        cache_.RemoveOldest(oldest);
+        cache_.Add(seriesId, payload);
+        memoryUsage_ += payload.GetMemoryUsage();
 
-        if (oldest == NULL)
-        {
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-        }
-        else
-        {
-          delete oldest;
-        }
+        assert(cache_.GetSize() <= maxCount_);
+        result = pyramid;
       }
+    }
+
+    /**
+     * The deletion of the instances of the forgotten series could not
+     * be tracked anymore: Drop their cached tiles right away, as they
+     * would otherwise stay stale if those instances are deleted.
+     **/
+    for (size_t i = 0; i < forgottenSeries.size(); i++)
+    {
+      HttpCaching::InvalidateSeries(forgottenSeries[i]);
+      TileCache::GetEncodedTiles().InvalidatePrefix(TileCache::GetSeriesPrefix(forgottenSeries[i]));
+      TileCache::GetRawTiles().InvalidatePrefix(TileCache::GetSeriesPrefix(forgottenSeries[i]));
+      TileCache::GetFullImages().InvalidatePrefix(TileCache::GetSeriesPrefix(forgottenSeries[i]));
+    }
 
-      // Now we have at least one free entry in the cache
-      assert(cache_.GetSize() < maxSize_);
+    return result;
+  }
+
+
+  void DicomPyramidCache::UpdateMemoryUsage(const std::string& seriesId,
+                                            PyramidHandle pyramid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    CachedPyramid cached;
+    if (cache_.Contains(seriesId, cached) &&
+        cached.GetPyramid() == pyramid)
+    {
+      assert(memoryUsage_ >= cached.GetMemoryUsage());
+      memoryUsage_ -= cached.GetMemoryUsage();
+      cached.RefreshMemoryUsage();
+      memoryUsage_ += cached.GetMemoryUsage();
+      cache_.MakeMostRecent(seriesId, cached);
+
+      // Evict the other pyramids if the memory budget is now exceeded
+      while (maxMemory_ != 0 &&
+             memoryUsage_ > maxMemory_ &&
+             cache_.GetSize() > 1 &&
+             cache_.GetOldest() != seriesId)
+      {
+        CachedPyramid oldest;
+        cache_.RemoveOldest(oldest);
 
-      // Add a new element to the cache and make it the most
-      // recently used entry
-      DicomPyramid* payload = pyramid.release();
-      cache_.Add(seriesId, payload);
-      return *payload;
+        assert(memoryUsage_ >= oldest.GetMemoryUsage());
+        memoryUsage_ -= oldest.GetMemoryUsage();
+        evictions_++;
+      }
     }
   }
 
 
   DicomPyramidCache::DicomPyramidCache(OrthancStone::IOrthancConnection* orthanc /* takes ownership */,
-                                       size_t maxSize,
-                                       bool useMetadataCache) :
+                                       size_t maxCount,
+                                       size_t maxMemory,
+                                       bool useMetadataCache,
+                                       bool synthesizeLevels) :
     orthanc_(orthanc),
-    maxSize_(maxSize),
-    useMetadataCache_(useMetadataCache)
+    maxCount_(maxCount),
+    maxMemory_(maxMemory),
+    memoryUsage_(0),
+    useMetadataCache_(useMetadataCache),
+    synthesizeLevels_(synthesizeLevels),
+    hits_(0),
+    misses_(0),
+    evictions_(0),
+    maxKnownSeries_(std::max(MIN_KNOWN_SERIES, maxCount))
   {
     if (orthanc == NULL)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
     }
-  }
 
-
-  DicomPyramidCache::~DicomPyramidCache()
-  {
-    while (!cache_.IsEmpty())
+    if (maxCount == 0)
     {
-      DicomPyramid* pyramid = NULL;
-      std::string seriesId = cache_.RemoveOldest(pyramid);
-
-      if (pyramid != NULL)
-      {
-        delete pyramid;
-      }        
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
   }
 
 
-  void DicomPyramidCache::InitializeInstance(size_t maxSize,
-                                             bool useMetadataCache)
+  void DicomPyramidCache::InitializeInstance(size_t maxCount,
+                                             size_t maxMemory,
+                                             bool useMetadataCache,
+                                             bool synthesizeLevels)
   {
     if (singleton_.get() == NULL)
     {
-      singleton_.reset(new DicomPyramidCache(new OrthancWSI::OrthancPluginConnection, maxSize, useMetadataCache));
+      singleton_.reset(new DicomPyramidCache(new OrthancWSI::OrthancPluginConnection, maxCount, maxMemory,
+                                               useMetadataCache, synthesizeLevels));
     }
     else
     {
@@ -189,26 +345,94 @@ namespace OrthancWSI
   }
 
 
-  void DicomPyramidCache::Invalidate(const std::string& seriesId)
+  void DicomPyramidCache::GetStatistics(size_t& count,
+                                        size_t& memoryUsage,
+                                        uint64_t& hits,
+                                        uint64_t& misses,
+                                        uint64_t& evictions)
   {
     boost::mutex::scoped_lock  lock(mutex_);
+    count = cache_.GetSize();
+    memoryUsage = memoryUsage_;
+    hits = hits_;
+    misses = misses_;
+    evictions = evictions_;
+  }
+
+
+  void DicomPyramidCache::Invalidate(const std::string& seriesId)
+  {
+    CachedPyramid pyramid;
 
-    if (cache_.Contains(seriesId))
     {
-      std::unique_ptr<DicomPyramid> pyramid(cache_.Invalidate(seriesId));
+      boost::mutex::scoped_lock  lock(mutex_);
 
-      if (pyramid.get() == NULL)
+      if (cache_.Contains(seriesId))
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        pyramid = cache_.Invalidate(seriesId);
+
+        if (pyramid.GetPyramid().get() == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        assert(memoryUsage_ >= pyramid.GetMemoryUsage());
+        memoryUsage_ -= pyramid.GetMemoryUsage();
       }
+
+      UnregisterSeries(seriesId);
     }
+
+    // If this was the last reference, the pyramid is destroyed here,
+    // once the mutex has been released
   }
 
 
-  DicomPyramidCache::Locker::Locker(const std::string& seriesId) :
-    cache_(DicomPyramidCache::GetInstance()),
-    lock_(cache_.mutex_),
-    pyramid_(cache_.GetPyramid(seriesId, lock_, cache_.useMetadataCache_))
+  void DicomPyramidCache::InvalidateInstance(std::set<std::string>& seriesIds,
+                                             const std::string& instanceId)
   {
+    seriesIds.clear();
+
+    {
+      boost::mutex::scoped_lock  lock(mutex_);
+
+      std::map<std::string, std::string>::const_iterator found = instancesSeries_.find(instanceId);
+      if (found != instancesSeries_.end())
+      {
+        seriesIds.insert(found->second);
+      }
+    }
+
+    for (std::set<std::string>::const_iterator it = seriesIds.begin(); it != seriesIds.end(); ++it)
+    {
+      Invalidate(*it);
+    }
+  }
+
+
+  DicomPyramidCache::Accessor::Accessor(const std::string& seriesId) :
+    seriesId_(seriesId),
+    pyramid_(DicomPyramidCache::GetInstance().GetPyramid(seriesId))
+  {
+    if (pyramid_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  DicomPyramidCache::Accessor::~Accessor()
+  {
+    if (pyramid_->HasSyntheticLevels())
+    {
+      try
+      {
+        DicomPyramidCache::GetInstance().UpdateMemoryUsage(seriesId_, pyramid_);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot update the memory usage of a pyramid: " << e.What();
+      }
+    }
   }
 }
@@ -27,8 +27,12 @@
 
 #include <Cache/LeastRecentlyUsedIndex.h>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 
 namespace OrthancWSI
@@ -36,50 +40,138 @@ namespace OrthancWSI
   class DicomPyramidCache : public boost::noncopyable
   {
   private:
-    typedef Orthanc::LeastRecentlyUsedIndex<std::string, DicomPyramid*>  Cache;
+    typedef boost::shared_ptr<DicomPyramid>  PyramidHandle;
+
+    class CachedPyramid
+    {
+    private:
+      PyramidHandle  pyramid_;
+      size_t         memory_;
+
+    public:
+      CachedPyramid() :
+        memory_(0)
+      {
+      }
+
+      explicit CachedPyramid(PyramidHandle pyramid);
+
+      PyramidHandle GetPyramid() const
+      {
+        return pyramid_;
+      }
+
+      size_t GetMemoryUsage() const
+      {
+        return memory_;
+      }
+
+      // The memory usage of the pyramids with synthetic levels grows
+      // as their tiles are generated
+      void RefreshMemoryUsage()
+      {
+        memory_ = pyramid_->GetMemoryUsage();
+      }
+    };
+
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, CachedPyramid>  Cache;
+
+    // Maps a series to its instances, as long as their cached tiles are kept
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, std::vector<std::string> >  KnownSeries;
 
     std::unique_ptr<OrthancStone::IOrthancConnection>  orthanc_;
 
-    boost::mutex  mutex_;
-    size_t        maxSize_;
-    Cache         cache_;
-    bool          useMetadataCache_;
+    boost::mutex           mutex_;
+    size_t                 maxCount_;
+    size_t                 maxMemory_;
+    size_t                 memoryUsage_;
+    Cache                  cache_;
+    bool                   useMetadataCache_;
+    bool                   synthesizeLevels_;
+    uint64_t               hits_;
+    uint64_t               misses_;
+    uint64_t               evictions_;
+
+    /**
+     * The parent series of a deleted instance cannot be retrieved
+     * from Orthanc anymore, and its pyramid might have been evicted
+     * from "cache_" in the meantime. The series whose pyramid was
+     * opened are thus remembered independently of "cache_".
+     **/
+    size_t                              maxKnownSeries_;
+    KnownSeries                         knownSeries_;
+    std::map<std::string, std::string>  instancesSeries_;  // Reverse index of "knownSeries_"
 
     DicomPyramidCache(OrthancStone::IOrthancConnection* orthanc /* takes ownership */,
-                      size_t maxSize,
-                      bool useMetadataCache);
+                      size_t maxCount,
+                      size_t maxMemory,
+                      bool useMetadataCache,
+                      bool synthesizeLevels);
 
-    DicomPyramid* GetCachedPyramid(const std::string& seriesId);
+    bool LookupCachedPyramid(PyramidHandle& pyramid,
+                             const std::string& seriesId);
 
-    DicomPyramid& GetPyramid(const std::string& seriesId,
-                             boost::mutex::scoped_lock& lock,
-                             bool useMetadataCache);
+    void UnregisterSeries(const std::string& seriesId);
 
-  public:
-    ~DicomPyramidCache();
+    void RegisterSeries(std::vector<std::string>& forgottenSeries,
+                        const std::string& seriesId,
+                        const DicomPyramid& pyramid);
 
-    static void InitializeInstance(size_t maxSize,
-                                   bool useMetadataCache);
+    void MakeRoom(size_t memory);
+
+    PyramidHandle GetPyramid(const std::string& seriesId);
+
+    void UpdateMemoryUsage(const std::string& seriesId,
+                           PyramidHandle pyramid);
+
+  public:
+    // "maxMemory" is expressed in bytes, "0" means no memory limit
+    static void InitializeInstance(size_t maxCount,
+                                   size_t maxMemory,
+                                   bool useMetadataCache,
+                                   bool synthesizeLevels);
 
     static void FinalizeInstance();
 
     static DicomPyramidCache& GetInstance();
 
+    void GetStatistics(size_t& count,
+                       size_t& memoryUsage,
+                       uint64_t& hits,
+                       uint64_t& misses,
+                       uint64_t& evictions);
+
     void Invalidate(const std::string& seriesId);
 
-    class Locker : public boost::noncopyable
+    /**
+     * Invalidates the pyramid of the series that contains some
+     * instance, whose parent series cannot be retrieved anymore once
+     * it has been deleted. The series is found even if its pyramid
+     * was evicted from the cache. Returns the invalidated series.
+     **/
+    void InvalidateInstance(std::set<std::string>& seriesIds,
+                            const std::string& instanceId);
+
+    /**
+     * The accessor holds a reference to the pyramid, but not the
+     * mutex of the cache: The pyramid survives its eviction from the
+     * cache until the last accessor is destroyed. The "DicomPyramid"
+     * class being thread-safe, tiles can be read concurrently.
+     **/
+    class Accessor : public boost::noncopyable
     {
     private:
-      DicomPyramidCache&         cache_;
-      boost::mutex::scoped_lock  lock_;
-      DicomPyramid&              pyramid_;
+      std::string    seriesId_;
+      PyramidHandle  pyramid_;
 
     public:
-      explicit Locker(const std::string& seriesId);
+      explicit Accessor(const std::string& seriesId);
+
+      ~Accessor();
 
       DicomPyramid& GetPyramid() const
       {
-        return pyramid_;
+        return *pyramid_;
       }
     };
   };
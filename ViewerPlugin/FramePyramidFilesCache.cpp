@@ -0,0 +1,478 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "FramePyramidFilesCache.h"
+
+#include "MemoryMappedFile.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cassert>
+
+
+static std::unique_ptr<OrthancWSI::FramePyramidFilesCache>  singleton_;
+
+static const char* const PYRAMID_EXTENSION = ".pyramid";
+static const char* const TEMPORARY_EXTENSION = ".tmp";
+
+// The pending stores keep their pyramid in memory: Beyond this number,
+// the oldest ones are dropped
+static const unsigned int MAX_PENDING_STORES = 8;
+
+
+namespace OrthancWSI
+{
+  class FramePyramidFilesCache::StoreJob : public Orthanc::IDynamicObject
+  {
+  private:
+    FramePyramidFilesCache&                   that_;
+    std::string                               instanceId_;
+    unsigned int                              frameNumber_;
+    boost::shared_ptr<const OnTheFlyPyramid>  pyramid_;
+    uint64_t                                  generation_;
+
+  public:
+    StoreJob(FramePyramidFilesCache& that,
+             const std::string& instanceId,
+             unsigned int frameNumber,
+             const boost::shared_ptr<const OnTheFlyPyramid>& pyramid,
+             uint64_t generation) :
+      that_(that),
+      instanceId_(instanceId),
+      frameNumber_(frameNumber),
+      pyramid_(pyramid),
+      generation_(generation)
+    {
+      if (pyramid.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      }
+    }
+
+    // The job is also destroyed if it is dropped by the queue
+    virtual ~StoreJob()
+    {
+      that_.ReleasePendingStore(instanceId_);
+    }
+
+    const std::string& GetInstanceId() const
+    {
+      return instanceId_;
+    }
+
+    unsigned int GetFrameNumber() const
+    {
+      return frameNumber_;
+    }
+
+    const OnTheFlyPyramid& GetPyramid() const
+    {
+      return *pyramid_;
+    }
+
+    // Generation of the cache at the time the store was scheduled
+    uint64_t GetGeneration() const
+    {
+      return generation_;
+    }
+  };
+
+
+  std::string FramePyramidFilesCache::GetKey(const std::string& instanceId,
+                                             unsigned int frameNumber)
+  {
+    // The Orthanc identifiers never contain an underscore
+    return instanceId + "_" + boost::lexical_cast<std::string>(frameNumber);
+  }
+
+
+  std::string FramePyramidFilesCache::GetPath(const std::string& key) const
+  {
+    return (boost::filesystem::path(directory_) / (key + PYRAMID_EXTENSION)).string();
+  }
+
+
+  void FramePyramidFilesCache::Remove(const std::string& key)
+  {
+    // Mutex must be locked
+
+    Content::iterator found = content_.find(key);
+    if (found != content_.end())
+    {
+      assert(currentSize_ >= found->second);
+      currentSize_ -= found->second;
+      content_.erase(found);
+      index_.Invalidate(key);
+
+      try
+      {
+        Orthanc::SystemToolbox::RemoveFile(GetPath(key));
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Cannot remove a file from the cache of frame pyramids: " << e.What();
+      }
+    }
+  }
+
+
+  void FramePyramidFilesCache::ScanDirectory()
+  {
+    // Mutex must be locked
+
+    for (boost::filesystem::directory_iterator it(directory_);
+         it != boost::filesystem::directory_iterator(); ++it)
+    {
+      if (boost::filesystem::is_regular_file(it->status()))
+      {
+        const std::string extension = it->path().extension().string();
+
+        if (extension == PYRAMID_EXTENSION)
+        {
+          const std::string key = it->path().stem().string();
+          const uint64_t size = Orthanc::SystemToolbox::GetFileSize(it->path().string());
+
+          content_[key] = size;
+          index_.Add(key, true);
+          currentSize_ += size;
+        }
+        else if (extension == TEMPORARY_EXTENSION)
+        {
+          // The writing of this file was interrupted
+          Orthanc::SystemToolbox::RemoveFile(it->path().string());
+        }
+      }
+    }
+
+    // The order of the directory iterator is arbitrary, so the budget
+    // might have to be enforced if the maximum size was lowered
+    while (currentSize_ > maxSize_ &&
+           !index_.IsEmpty())
+    {
+      const std::string oldest = index_.GetOldest();
+      Remove(oldest);
+    }
+
+    LOG(WARNING) << "The cache of frame pyramids in " << directory_ << " contains " << content_.size()
+                 << " pyramids (" << (currentSize_ / (1024 * 1024)) << "MB)";
+  }
+
+
+  void FramePyramidFilesCache::ReleasePendingStore(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    PendingStores::iterator found = pendingStores_.find(instanceId);
+    if (found != pendingStores_.end())
+    {
+      assert(found->second > 0);
+      found->second--;
+
+      if (found->second == 0)
+      {
+        pendingStores_.erase(found);
+        invalidations_.erase(instanceId);
+      }
+    }
+  }
+
+
+  void FramePyramidFilesCache::Worker(FramePyramidFilesCache* that)
+  {
+    while (that->continue_)
+    {
+      std::unique_ptr<Orthanc::IDynamicObject> obj(that->queue_.Dequeue(100));
+      if (obj.get() != NULL)
+      {
+        const StoreJob& job = dynamic_cast<const StoreJob&>(*obj);
+
+        try
+        {
+          that->Store(job);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(WARNING) << "Cannot store frame " << job.GetFrameNumber() << " of instance " << job.GetInstanceId()
+                       << " in the cache of frame pyramids: " << e.What();
+        }
+      }
+    }
+  }
+
+
+  FramePyramidFilesCache::FramePyramidFilesCache(const std::string& directory,
+                                                 uint64_t maxSize) :
+    directory_(directory),
+    maxSize_(maxSize),
+    currentSize_(0),
+    generation_(0),
+    queue_(MAX_PENDING_STORES),
+    continue_(true)
+  {
+    if (!directory.empty())
+    {
+      if (maxSize == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      Orthanc::SystemToolbox::MakeDirectory(directory);
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        ScanDirectory();
+      }
+
+      worker_.reset(new boost::thread(Worker, this));
+    }
+  }
+
+
+  FramePyramidFilesCache::~FramePyramidFilesCache()
+  {
+    // The stores that are still pending are dropped
+    continue_ = false;
+
+    if (worker_.get() != NULL &&
+        worker_->joinable())
+    {
+      worker_->join();
+    }
+  }
+
+
+  void FramePyramidFilesCache::ScheduleStore(const std::string& instanceId,
+                                             unsigned int frameNumber,
+                                             const boost::shared_ptr<const OnTheFlyPyramid>& pyramid)
+  {
+    if (!IsEnabled())
+    {
+      return;
+    }
+
+    uint64_t generation;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pendingStores_[instanceId]++;
+      generation = generation_;
+    }
+
+    std::unique_ptr<StoreJob> job;
+
+    try
+    {
+      job.reset(new StoreJob(*this, instanceId, frameNumber, pyramid, generation));
+    }
+    catch (...)
+    {
+      ReleasePendingStore(instanceId);
+      throw;
+    }
+
+    queue_.Enqueue(job.release());
+  }
+
+
+  void FramePyramidFilesCache::Store(const StoreJob& job)
+  {
+    // Serialize and write the pyramid without holding the mutex. The
+    // file is written under a temporary name, then renamed, so that
+    // the concurrent readers never see a partially written file.
+    std::string serialized;
+    job.GetPyramid().Serialize(serialized);
+
+    if (serialized.size() > maxSize_)
+    {
+      LOG(INFO) << "The pyramid of frame " << job.GetFrameNumber() << " of instance " << job.GetInstanceId()
+                << " is too large for the cache of frame pyramids";
+      return;
+    }
+
+    const std::string key = GetKey(job.GetInstanceId(), job.GetFrameNumber());
+    const std::string temporary = (boost::filesystem::path(directory_) /
+                                   (Orthanc::Toolbox::GenerateUuid() + TEMPORARY_EXTENSION)).string();
+
+    Orthanc::SystemToolbox::WriteFile(serialized, temporary);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Invalidations::const_iterator invalidated = invalidations_.find(job.GetInstanceId());
+    if (invalidated != invalidations_.end() &&
+        invalidated->second > job.GetGeneration())
+    {
+      LOG(INFO) << "Instance " << job.GetInstanceId() << " was invalidated while storing its frame "
+                << job.GetFrameNumber() << " in the cache of frame pyramids, dropping it";
+      Orthanc::SystemToolbox::RemoveFile(temporary);
+      return;
+    }
+
+    Remove(key);
+
+    while (currentSize_ + serialized.size() > maxSize_ &&
+           !index_.IsEmpty())
+    {
+      const std::string oldest = index_.GetOldest();
+      Remove(oldest);
+    }
+
+    try
+    {
+      boost::filesystem::rename(temporary, GetPath(key));
+    }
+    catch (boost::filesystem::filesystem_error& e)
+    {
+      Orthanc::SystemToolbox::RemoveFile(temporary);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, e.what());
+    }
+
+    content_[key] = serialized.size();
+    index_.Add(key, true);
+    currentSize_ += serialized.size();
+  }
+
+
+  OnTheFlyPyramid* FramePyramidFilesCache::Load(const std::string& instanceId,
+                                                unsigned int frameNumber)
+  {
+    if (!IsEnabled())
+    {
+      return NULL;
+    }
+
+    const std::string key = GetKey(instanceId, frameNumber);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (content_.find(key) == content_.end())
+      {
+        return NULL;
+      }
+      else
+      {
+        index_.MakeMostRecent(key);
+      }
+    }
+
+    // The file is parsed without holding the mutex. On POSIX systems,
+    // the mapping remains valid even if the file is concurrently
+    // replaced or removed by another thread.
+    std::unique_ptr<OnTheFlyPyramid> pyramid;
+
+    try
+    {
+      MemoryMappedFile mapping(GetPath(key));
+      pyramid.reset(OnTheFlyPyramid::Unserialize(mapping.GetData(), mapping.GetSize()));
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot read a file from the cache of frame pyramids: " << e.What();
+    }
+
+    if (pyramid.get() == NULL)
+    {
+      LOG(WARNING) << "Removing frame " << frameNumber << " of instance " << instanceId
+                   << " from the cache of frame pyramids";
+
+      boost::mutex::scoped_lock lock(mutex_);
+      Remove(key);
+    }
+
+    return pyramid.release();
+  }
+
+
+  void FramePyramidFilesCache::Invalidate(const std::string& instanceId)
+  {
+    if (!IsEnabled())
+    {
+      return;
+    }
+
+    const std::string prefix = instanceId + "_";
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    generation_++;
+
+    if (pendingStores_.find(instanceId) != pendingStores_.end())
+    {
+      invalidations_[instanceId] = generation_;
+    }
+
+    for (;;)
+    {
+      Content::const_iterator it = content_.lower_bound(prefix);
+      if (it != content_.end() &&
+          it->first.compare(0, prefix.size(), prefix) == 0)
+      {
+        const std::string key = it->first;  // Copy, as "Remove()" erases "it"
+        Remove(key);
+      }
+      else
+      {
+        break;
+      }
+    }
+  }
+
+
+  void FramePyramidFilesCache::InitializeInstance(const std::string& directory,
+                                                  uint64_t maxSize)
+  {
+    if (singleton_.get() == NULL)
+    {
+      singleton_.reset(new FramePyramidFilesCache(directory, maxSize));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void FramePyramidFilesCache::FinalizeInstance()
+  {
+    singleton_.reset(NULL);
+  }
+
+
+  FramePyramidFilesCache& FramePyramidFilesCache::GetInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *singleton_;
+    }
+  }
+}
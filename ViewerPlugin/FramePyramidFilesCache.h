@@ -0,0 +1,123 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "../Framework/Inputs/OnTheFlyPyramid.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+#include <MultiThreading/SharedMessageQueue.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <map>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Least-recently-used cache of the pyramids of individual frames
+   * in a local directory, whose size is bounded by a number of
+   * bytes. This is the second tier of "DecodedPyramidCache": The
+   * pyramids that are evicted from the memory are serialized to the
+   * disk, so that they can be reloaded without downloading and
+   * decoding their frame again. The pyramids are serialized and
+   * written by a background thread, so that the evictions don't slow
+   * down the HTTP threads. This class is thread-safe.
+   **/
+  class FramePyramidFilesCache : public boost::noncopyable
+  {
+  private:
+    class StoreJob;
+
+    typedef std::map<std::string, uint64_t>                       Content;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, bool>    Index;
+    typedef std::map<std::string, unsigned int>                   PendingStores;
+    typedef std::map<std::string, uint64_t>                       Invalidations;
+
+    boost::mutex   mutex_;
+    std::string    directory_;
+    uint64_t       maxSize_;
+    uint64_t       currentSize_;
+    Content        content_;  // Maps a key to the size of its file
+    Index          index_;
+
+    // A store that was scheduled before the last invalidation of its
+    // instance is dropped, as it would write a stale pyramid
+    uint64_t       generation_;     // Incremented by each invalidation
+    PendingStores  pendingStores_;  // Number of scheduled stores for each instance
+    Invalidations  invalidations_;  // Generation of the last invalidation of the instances with pending stores
+
+    // Must be declared after the members above, as the destruction
+    // of the pending jobs accesses them
+    Orthanc::SharedMessageQueue     queue_;
+    bool                            continue_;
+    std::unique_ptr<boost::thread>  worker_;
+
+    static std::string GetKey(const std::string& instanceId,
+                              unsigned int frameNumber);
+
+    std::string GetPath(const std::string& key) const;
+
+    void Remove(const std::string& key);
+
+    void ScanDirectory();
+
+    void ReleasePendingStore(const std::string& instanceId);
+
+    void Store(const StoreJob& job);
+
+    static void Worker(FramePyramidFilesCache* that);
+
+  public:
+    // An empty directory disables the cache
+    FramePyramidFilesCache(const std::string& directory,
+                           uint64_t maxSize);
+
+    ~FramePyramidFilesCache();
+
+    bool IsEnabled() const
+    {
+      return !directory_.empty();
+    }
+
+    // Only schedules the store, the actual writing is done asynchronously
+    void ScheduleStore(const std::string& instanceId,
+                       unsigned int frameNumber,
+                       const boost::shared_ptr<const OnTheFlyPyramid>& pyramid);
+
+    // Returns NULL if the pyramid is not in the cache
+    OnTheFlyPyramid* Load(const std::string& instanceId,
+                          unsigned int frameNumber);
+
+    void Invalidate(const std::string& instanceId);
+
+    static void InitializeInstance(const std::string& directory,
+                                   uint64_t maxSize);
+
+    static void FinalizeInstance();
+
+    static FramePyramidFilesCache& GetInstance();
+  };
+}
@@ -0,0 +1,198 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "HttpCaching.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Toolbox.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+
+namespace OrthancWSI
+{
+  namespace HttpCaching
+  {
+    /**
+     * The revisions are stored in a fixed number of slots that are
+     * indexed by a hash of the Orthanc identifiers, which bounds the
+     * memory whatever the number of modified resources. A collision
+     * only causes the spurious revalidation of another resource.
+     **/
+    static const size_t REVISION_SLOTS = 4096;
+
+    static boost::mutex  mutex_;
+    static std::string   epoch_;                               // Changes at each startup of the plugin
+    static std::string   configuration_;                       // Options that change the served content
+    static uint64_t      seriesRevisions_[REVISION_SLOTS];     // Incremented when a series is modified
+    static uint64_t      instancesRevisions_[REVISION_SLOTS];  // Incremented when an instance is deleted
+
+
+    static size_t GetSlot(const std::string& resourceId)
+    {
+      return boost::hash<std::string>()(resourceId) % REVISION_SLOTS;
+    }
+
+
+    static std::string FormatETag(const std::string& content)
+    {
+      std::string md5;
+      Orthanc::Toolbox::ComputeMD5(md5, content);
+      return "\"" + md5 + "\"";   // Strong entity tag
+    }
+
+
+    static bool MatchesETag(const OrthancPluginHttpRequest* request,
+                            const std::string& etag)
+    {
+      for (uint32_t i = 0; i < request->headersCount; i++)
+      {
+        std::string key(request->headersKeys[i]);
+        Orthanc::Toolbox::ToLowerCase(key);
+
+        if (key == "if-none-match")
+        {
+          std::vector<std::string> tokens;
+          Orthanc::Toolbox::TokenizeString(tokens, request->headersValues[i], ',');
+
+          for (size_t j = 0; j < tokens.size(); j++)
+          {
+            std::string s = Orthanc::Toolbox::StripSpaces(tokens[j]);
+
+            // "If-None-Match" uses the weak comparison function (RFC 9110, Section 13.1.2)
+            if (s.size() > 2 &&
+                s[0] == 'W' &&
+                s[1] == '/')
+            {
+              s = s.substr(2);
+            }
+
+            if (s == etag ||
+                s == "*")
+            {
+              return true;
+            }
+          }
+        }
+      }
+
+      return false;
+    }
+
+
+    void Initialize(const std::string& configuration)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      epoch_ = Orthanc::Toolbox::GenerateUuid();
+      configuration_ = configuration;
+
+      for (size_t i = 0; i < REVISION_SLOTS; i++)
+      {
+        seriesRevisions_[i] = 0;
+        instancesRevisions_[i] = 0;
+      }
+    }
+
+
+    void InvalidateSeries(const std::string& seriesId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      seriesRevisions_[GetSlot(seriesId)] += 1;
+    }
+
+
+    void InvalidateInstance(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      instancesRevisions_[GetSlot(instanceId)] += 1;
+    }
+
+
+    std::string ComputeSeriesETag(const std::string& seriesId,
+                                  const std::string& resource)
+    {
+      uint64_t revision;
+      std::string epoch;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        revision = seriesRevisions_[GetSlot(seriesId)];
+        epoch = epoch_;
+      }
+
+      return FormatETag(epoch + "|" + boost::lexical_cast<std::string>(revision) + "|" + resource);
+    }
+
+
+    std::string ComputeInstanceETag(const std::string& instanceId,
+                                    const std::string& resource)
+    {
+      uint64_t revision;
+      std::string epoch, configuration;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        revision = instancesRevisions_[GetSlot(instanceId)];
+        epoch = epoch_;
+        configuration = configuration_;
+      }
+
+      return FormatETag(std::string(ORTHANC_WSI_VERSION) + "|" + epoch + "|" + configuration + "|" +
+                        boost::lexical_cast<std::string>(revision) + "|" + resource);
+    }
+
+
+    bool HandleConditionalRequest(OrthancPluginRestOutput* output,
+                                  const OrthancPluginHttpRequest* request,
+                                  const std::string& etag)
+    {
+      OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+      OrthancPluginSetHttpHeader(context, output, "ETag", etag.c_str());
+
+      /**
+       * The client must always revalidate the resource, which is cheap
+       * thanks to the "ETag". The resources are never "immutable", as
+       * the Orthanc identifiers are derived from the DICOM UIDs: An
+       * instance that is deleted, then stored again with other pixel
+       * data, is published at the same URI.
+       **/
+      OrthancPluginSetHttpHeader(context, output, "Cache-Control", "no-cache");
+
+      if (MatchesETag(request, etag))
+      {
+        OrthancPluginSendHttpStatusCode(context, output, 304 /* Not Modified */);
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+  }
+}
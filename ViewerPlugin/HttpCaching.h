@@ -0,0 +1,67 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * HTTP caching validators ("ETag" and "Cache-Control" headers).
+   * The entity tags are computed from the URI of the request, without
+   * accessing the pyramids, so that "304 Not Modified" answers are
+   * cheap. The resources that depend on a series are associated with
+   * a revision that is incremented whenever the series is modified.
+   * The resources that depend on an instance additionally depend on
+   * the startup of the plugin and on its configuration.
+   **/
+  namespace HttpCaching
+  {
+    // "configuration" summarizes the options that change the content
+    // of the resources that depend on an instance
+    void Initialize(const std::string& configuration);
+
+    void InvalidateSeries(const std::string& seriesId);
+
+    void InvalidateInstance(const std::string& instanceId);
+
+    // For resources that might change if new instances are added to the series
+    std::string ComputeSeriesETag(const std::string& seriesId,
+                                  const std::string& resource);
+
+    // For resources that only change if the instance is deleted
+    std::string ComputeInstanceETag(const std::string& instanceId,
+                                    const std::string& resource);
+
+    // Returns "true" iff a "304 Not Modified" was sent to the client,
+    // in which case the caller must not send any other answer. If the
+    // answer is "false", the caching headers have been set.
+    bool HandleConditionalRequest(OrthancPluginRestOutput* output,
+                                  const OrthancPluginHttpRequest* request,
+                                  const std::string& etag);
+  }
+}
@@ -24,17 +24,30 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 #include "IIIF.h"
 
+#include "../Framework/ImageToolbox.h"
 #include "../Framework/Inputs/DecodedPyramidCache.h"
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+#include "BackgroundTiles.h"
 #include "DicomPyramidCache.h"
+#include "HttpCaching.h"
 #include "RawTile.h"
+#include "SeriesRegions.h"
+#include "TileCache.h"
 
+#include <Cache/LeastRecentlyUsedIndex.h>
 #include <CompatibilityMath.h>
 #include <Images/Image.h>
 #include <Images/ImageProcessing.h>
 #include <Logging.h>
 #include <SerializationToolbox.h>
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <set>
+
 
 static const char* const ROWS = "0028,0010";
 static const char* const COLUMNS = "0028,0011";
@@ -44,6 +57,178 @@ static std::string  iiifPublicUrl_;
 static bool         iiifForcePowersOfTwoScaleFactors_ = false;
 
 
+// Maximum number of bytes of the cached IIIF documents
+static const size_t MAX_DOCUMENTS_MEMORY = 16 * 1024 * 1024;
+
+
+namespace
+{
+  /**
+   * Cache of the serialized IIIF documents (manifests and info.json),
+   * whose generation requires several calls to the REST API of
+   * Orthanc. Each document is associated with the Orthanc resources
+   * it depends on, so that it can be invalidated by the change
+   * callback. This class is thread-safe.
+   **/
+  class DocumentsCache : public boost::noncopyable
+  {
+  private:
+    struct Document
+    {
+      std::string               content_;
+      std::vector<std::string>  resources_;
+    };
+
+    typedef std::map<std::string, Document>                     Documents;
+    typedef std::map<std::string, std::set<std::string> >       Dependencies;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, bool>  Index;
+
+    boost::mutex  mutex_;
+    Documents     documents_;
+    Dependencies  dependencies_;   // Maps an Orthanc resource to the keys of its documents
+    Index         index_;
+    size_t        memoryUsage_;
+
+    void RemoveDocument(const std::string& key)
+    {
+      // Mutex must be locked
+      Documents::iterator found = documents_.find(key);
+
+      if (found != documents_.end())
+      {
+        for (size_t i = 0; i < found->second.resources_.size(); i++)
+        {
+          Dependencies::iterator dependency = dependencies_.find(found->second.resources_[i]);
+
+          if (dependency != dependencies_.end())
+          {
+            dependency->second.erase(key);
+
+            if (dependency->second.empty())
+            {
+              dependencies_.erase(dependency);
+            }
+          }
+        }
+
+        assert(memoryUsage_ >= found->second.content_.size());
+        memoryUsage_ -= found->second.content_.size();
+        documents_.erase(found);
+      }
+    }
+
+  public:
+    DocumentsCache() :
+      memoryUsage_(0)
+    {
+    }
+
+    bool Lookup(std::string& content,
+                const std::string& key)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Documents::const_iterator found = documents_.find(key);
+      if (found == documents_.end())
+      {
+        return false;
+      }
+      else
+      {
+        index_.MakeMostRecent(key);
+        content = found->second.content_;
+        return true;
+      }
+    }
+
+    void Store(const std::string& key,
+               const std::string& content,
+               const std::vector<std::string>& resources)
+    {
+      if (content.size() > MAX_DOCUMENTS_MEMORY)
+      {
+        return;
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (index_.Contains(key))
+      {
+        index_.Invalidate(key);
+        RemoveDocument(key);
+      }
+
+      while (!index_.IsEmpty() &&
+             memoryUsage_ + content.size() > MAX_DOCUMENTS_MEMORY)
+      {
+        RemoveDocument(index_.RemoveOldest());
+      }
+
+      Document& document = documents_[key];
+      document.content_ = content;
+      document.resources_ = resources;
+
+      for (size_t i = 0; i < resources.size(); i++)
+      {
+        dependencies_[resources[i]].insert(key);
+      }
+
+      index_.Add(key);
+      memoryUsage_ += content.size();
+    }
+
+    void Invalidate(const std::string& resourceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Dependencies::const_iterator found = dependencies_.find(resourceId);
+
+      if (found != dependencies_.end())
+      {
+        // Copy the keys, as "RemoveDocument()" modifies the dependencies
+        const std::set<std::string> keys = found->second;
+
+        for (std::set<std::string>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+        {
+          index_.Invalidate(*it);
+          RemoveDocument(*it);
+        }
+      }
+    }
+  };
+}
+
+
+static DocumentsCache  documentsCache_;
+
+
+static bool AnswerCachedDocument(OrthancPluginRestOutput* output,
+                                 const std::string& key)
+{
+  std::string s;
+  if (documentsCache_.Lookup(s, key))
+  {
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+static void AnswerDocument(OrthancPluginRestOutput* output,
+                           const std::string& key,
+                           const Json::Value& document,
+                           const std::vector<std::string>& resources)
+{
+  std::string s = document.toStyledString();
+  documentsCache_.Store(key, s, resources);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+}
+
+
 static void GeneratePyramidInfo(Json::Value& result,
                                 const OrthancWSI::ITiledPyramid& pyramid,
                                 const std::string& logName)
@@ -73,6 +258,7 @@ static void GeneratePyramidInfo(Json::Value& result,
   Json::Value scaleFactors = Json::arrayValue;
 
   unsigned int power = 1;
+  unsigned int previousScaleFactor = 0;
 
   for (unsigned int i = 0; i < pyramid.GetLevelCount(); i++)
   {
@@ -83,40 +269,46 @@ static void GeneratePyramidInfo(Json::Value& result,
      * which to divide the full size of the image. For example, a
      * scale factor of 4 indicates that the service can efficiently
      * deliver images at 1/4 or 25% of the height and width of the
-     * full image." => We can only serve the levels for which the full
-     * width/height of the image is divisible by the width/height of
-     * the level.
+     * full image." => The levels for which the full width/height of
+     * the image is not divisible by the width/height of the level
+     * are advertised using the nearest integer scale factor: Their
+     * tiles are then rendered by resampling the level.
      **/
-    if (pyramid.GetLevelWidth(0) % pyramid.GetLevelWidth(i) == 0 &&
-        pyramid.GetLevelHeight(0) % pyramid.GetLevelHeight(i) == 0)
-    {
-      unsigned int scaleFactor = pyramid.GetLevelWidth(0) / pyramid.GetLevelWidth(i);
+    const unsigned int scaleFactor = static_cast<unsigned int>(
+      std::floor(static_cast<double>(pyramid.GetLevelWidth(0)) /
+                 static_cast<double>(pyramid.GetLevelWidth(i)) + 0.5));
 
-      if (!iiifForcePowersOfTwoScaleFactors_ ||
-          scaleFactor == power)
+    if (scaleFactor <= previousScaleFactor)
+    {
+      LOG(WARNING) << "IIIF - Dropping level " << i << " of " << logName
+                   << ", as its scale factor is not larger than the one of the previous level";
+    }
+    else if (!iiifForcePowersOfTwoScaleFactors_ ||
+             scaleFactor == power)
+    {
+      if (pyramid.GetLevelWidth(0) % pyramid.GetLevelWidth(i) != 0 ||
+          pyramid.GetLevelHeight(0) % pyramid.GetLevelHeight(i) != 0)
       {
-        Json::Value level;
-        level["width"] = pyramid.GetLevelWidth(i);
-        level["height"] = pyramid.GetLevelHeight(i);
-        sizes.append(level);
+        LOG(INFO) << "IIIF - Level " << i << " of " << logName << " will be resampled, as the full width/height ("
+                  << pyramid.GetLevelWidth(0) << "x" << pyramid.GetLevelHeight(0)
+                  << ") of the image is not an integer multiple of the level width/height ("
+                  << pyramid.GetLevelWidth(i) << "x" << pyramid.GetLevelHeight(i) << ")";
+      }
 
-        scaleFactors.append(scaleFactor);
+      Json::Value level;
+      level["width"] = pyramid.GetLevelWidth(i);
+      level["height"] = pyramid.GetLevelHeight(i);
+      sizes.append(level);
 
-        power *= 2;
-      }
-      else
-      {
-        LOG(WARNING) << "IIIF - Dropping level " << i << " of " << logName
-                     << ", as it doesn't follow the powers-of-two pattern";
-      }
+      scaleFactors.append(scaleFactor);
+      previousScaleFactor = scaleFactor;
+
+      power *= 2;
     }
     else
     {
       LOG(WARNING) << "IIIF - Dropping level " << i << " of " << logName
-                   << ", as the full width/height ("
-                   << pyramid.GetLevelWidth(0) << "x" << pyramid.GetLevelHeight(0)
-                   << ") of the image is not an integer multiple of the level width/height ("
-                   << pyramid.GetLevelWidth(i) << "x" << pyramid.GetLevelHeight(i) << ")";
+                   << ", as it doesn't follow the powers-of-two pattern";
     }
   }
 
@@ -147,6 +339,23 @@ static void GeneratePyramidInfo(Json::Value& result,
   result["height"] = pyramid.GetLevelHeight(0);
   result["sizes"] = reversedSizes;
   result["tiles"].append(tiles);
+
+  /**
+   * Besides the tiles, arbitrary regions and sizes are rendered by
+   * compositing the tiles of the nearest level
+   **/
+  result["extraFeatures"].append("regionByPct");
+  result["extraFeatures"].append("regionByPx");
+  result["extraFeatures"].append("regionSquare");
+  result["extraFeatures"].append("sizeByConfinedWh");
+  result["extraFeatures"].append("sizeByH");
+  result["extraFeatures"].append("sizeByPct");
+  result["extraFeatures"].append("sizeByW");
+  result["extraFeatures"].append("sizeByWh");
+
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+  result["extraFormats"].append("webp");
+#endif
 }
 
 
@@ -158,17 +367,22 @@ void ServeIIIFSeriesPyramidInfo(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "IIIF: Image API call to whole-slide pyramid of series " << seriesId;
 
+  const std::string key = "series-info/" + seriesId;
+  if (AnswerCachedDocument(output, key))
+  {
+    return;
+  }
+
   Json::Value result;
 
   {
-    OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-    GeneratePyramidInfo(result, locker.GetPyramid(), "series " + seriesId);
+    OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+    GeneratePyramidInfo(result, accessor.GetPyramid(), "series " + seriesId);
   }
 
   result["id"] = iiifPublicUrl_ + "tiles/" + seriesId;
 
-  std::string s = result.toStyledString();
-  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+  AnswerDocument(output, key, result, std::vector<std::string>(1, seriesId));
 }
 
 
@@ -177,20 +391,62 @@ namespace
   class RegionParameters
   {
   private:
-    bool        isFull_;
-    uint32_t    x_;
-    uint32_t    y_;
-    uint32_t    regionWidth_;
-    uint32_t    regionHeight_;
-    uint32_t    cropWidth_;
-    uint32_t    cropHeight_;
+    enum RegionType
+    {
+      RegionType_Full,
+      RegionType_Square,
+      RegionType_Pixels,
+      RegionType_Percentage
+    };
 
-    void CheckNotFull() const
+    enum SizeType
     {
-      if (isFull_)
+      SizeType_Max,
+      SizeType_Width,
+      SizeType_Height,
+      SizeType_WidthHeight,
+      SizeType_Confined,
+      SizeType_Percentage
+    };
+
+    Orthanc::MimeType  mime_;
+    RegionType         regionType_;
+    double             region_[4];  // (x, y, width, height), in pixels or in percents
+    SizeType           sizeType_;
+    double             size_[2];    // (width, height), or percentage in the first cell
+
+    static bool ParseNumbers(double* target,
+                             size_t count,
+                             const std::string& source,
+                             bool allowEmpty)
+    {
+      std::vector<std::string> tokens;
+      Orthanc::Toolbox::TokenizeString(tokens, source, ',');
+
+      if (tokens.size() != count)
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        return false;
       }
+
+      for (size_t i = 0; i < count; i++)
+      {
+        if (tokens[i].empty() && allowEmpty)
+        {
+          target[i] = 0;
+        }
+        else if (!Orthanc::SerializationToolbox::ParseDouble(target[i], tokens[i]) ||
+                 target[i] < 0)
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    static unsigned int Round(double value)
+    {
+      return static_cast<unsigned int>(std::max(1.0, std::floor(value + 0.5)));
     }
 
   public:
@@ -199,14 +455,13 @@ namespace
                      const std::string& rotation,
                      const std::string& quality,
                      const std::string& format) :
-      isFull_(true),
-      x_(0),
-      y_(0),
-      regionWidth_(0),
-      regionHeight_(0),
-      cropWidth_(0),
-      cropHeight_(0)
+      mime_(Orthanc::MimeType_Jpeg),
+      regionType_(RegionType_Full),
+      sizeType_(SizeType_Max)
     {
+      region_[0] = region_[1] = region_[2] = region_[3] = 0;
+      size_[0] = size_[1] = 0;
+
       if (rotation != "0")
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Unsupported rotation: " + rotation);
@@ -217,102 +472,282 @@ namespace
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Unsupported quality: " + quality);
       }
 
-      if (format != "jpg")
+      if (format == "jpg")
+      {
+        mime_ = Orthanc::MimeType_Jpeg;
+      }
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+      else if (format == "webp")
+      {
+        mime_ = Orthanc::MimeType_WebP;
+      }
+#endif
+      else
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Unsupported format: " + format);
       }
 
       if (region == "full")
       {
-        isFull_ = true;
+        regionType_ = RegionType_Full;
+      }
+      else if (region == "square")
+      {
+        regionType_ = RegionType_Square;
+      }
+      else if (boost::starts_with(region, "pct:"))
+      {
+        regionType_ = RegionType_Percentage;
+
+        if (!ParseNumbers(region_, 4, region.substr(4), false))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Invalid pct:x,y,w,h region, found: " + region);
+        }
       }
       else
       {
-        isFull_ = false;
+        regionType_ = RegionType_Pixels;
 
+        uint32_t values[4];
         std::vector<std::string> tokens;
         Orthanc::Toolbox::TokenizeString(tokens, region, ',');
 
         if (tokens.size() != 4 ||
-            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(x_, tokens[0]) ||
-            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(y_, tokens[1]) ||
-            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(regionWidth_, tokens[2]) ||
-            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(regionHeight_, tokens[3]))
+            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(values[0], tokens[0]) ||
+            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(values[1], tokens[1]) ||
+            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(values[2], tokens[2]) ||
+            !Orthanc::SerializationToolbox::ParseUnsignedInteger32(values[3], tokens[3]))
         {
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Invalid (x,y,width,height) region, found: " + region);
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Invalid (x,y,width,height) region, found: " + region);
         }
 
-        Orthanc::Toolbox::TokenizeString(tokens, size, ',');
+        for (unsigned int i = 0; i < 4; i++)
+        {
+          region_[i] = values[i];
+        }
+      }
 
-        bool ok = false;
-        if (tokens.size() == 2 &&
-            Orthanc::SerializationToolbox::ParseUnsignedInteger32(cropWidth_, tokens[0]))
+      if (boost::starts_with(size, "^"))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Upscaling is not supported: " + size);
+      }
+      else if (size == "max")
+      {
+        sizeType_ = SizeType_Max;
+      }
+      else if (boost::starts_with(size, "pct:"))
+      {
+        sizeType_ = SizeType_Percentage;
+
+        if (!ParseNumbers(size_, 1, size.substr(4), false) ||
+            size_[0] <= 0 ||
+            size_[0] > 100)
         {
-          if (tokens[1].empty())
-          {
-            cropHeight_ = cropWidth_;
-            ok = true;
-          }
-          else if (Orthanc::SerializationToolbox::ParseUnsignedInteger32(cropHeight_, tokens[1]))
-          {
-            ok = true;
-          }
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Invalid pct:n size, found: " + size);
         }
+      }
+      else
+      {
+        const bool confined = boost::starts_with(size, "!");
+
+        if (!ParseNumbers(size_, 2, confined ? size.substr(1) : size, !confined))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Invalid (width,height) size, found: " + size);
+        }
+
+        const bool hasWidth = (size_[0] >= 1);
+        const bool hasHeight = (size_[1] >= 1);
 
-        if (!ok)
+        if (confined && hasWidth && hasHeight)
+        {
+          sizeType_ = SizeType_Confined;
+        }
+        else if (!confined && hasWidth && hasHeight)
+        {
+          sizeType_ = SizeType_WidthHeight;
+        }
+        else if (!confined && hasWidth && size.find(',') == size.size() - 1)
+        {
+          sizeType_ = SizeType_Width;
+        }
+        else if (!confined && hasHeight && size.find(',') == 0)
         {
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "IIIF - Invalid (width,height) crop, found: " + size);
+          sizeType_ = SizeType_Height;
+        }
+        else
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Invalid (width,height) size, found: " + size);
         }
       }
     }
 
-    bool IsFull() const
+    // The full images are cached, whatever their size (thumbnails)
+    bool IsFullRegion() const
     {
-      return isFull_;
+      return regionType_ == RegionType_Full;
     }
 
-    uint32_t GetX() const
+    /**
+     * Computes the size of the target image of a "full" region. At
+     * its maximum size, the full image corresponds to the coarsest
+     * level of the pyramid.
+     **/
+    void ResolveFullImage(unsigned int& targetWidth,
+                          unsigned int& targetHeight,
+                          const OrthancWSI::ITiledPyramid& pyramid) const
     {
-      CheckNotFull();
-      return x_;
+      if (regionType_ != RegionType_Full)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else if (sizeType_ == SizeType_Max)
+      {
+        const unsigned int level = pyramid.GetLevelCount() - 1;
+        targetWidth = pyramid.GetLevelWidth(level);
+        targetHeight = pyramid.GetLevelHeight(level);
+      }
+      else
+      {
+        unsigned int x, y, width, height;
+        Resolve(x, y, width, height, targetWidth, targetHeight, pyramid.GetLevelWidth(0), pyramid.GetLevelHeight(0));
+      }
     }
 
-    uint32_t GetY() const
+    Orthanc::MimeType GetMimeType() const
     {
-      CheckNotFull();
-      return y_;
+      return mime_;
     }
 
-    uint32_t GetRegionWidth() const
+    /**
+     * Computes the region of interest in the pixels of the finest
+     * level, clipped to the image, and the size of the target image,
+     * given the dimensions of the finest level.
+     **/
+    void Resolve(unsigned int& x,
+                 unsigned int& y,
+                 unsigned int& width,
+                 unsigned int& height,
+                 unsigned int& targetWidth,
+                 unsigned int& targetHeight,
+                 unsigned int imageWidth,
+                 unsigned int imageHeight) const
     {
-      CheckNotFull();
-      return regionWidth_;
-    }
+      double regionX, regionY, regionWidth, regionHeight;
 
-    uint32_t GetRegionHeight() const
-    {
-      CheckNotFull();
-      return regionHeight_;
-    }
+      switch (regionType_)
+      {
+        case RegionType_Full:
+          regionX = 0;
+          regionY = 0;
+          regionWidth = imageWidth;
+          regionHeight = imageHeight;
+          break;
 
-    uint32_t GetCropWidth() const
-    {
-      CheckNotFull();
-      return cropWidth_;
-    }
+        case RegionType_Square:
+        {
+          const unsigned int side = std::min(imageWidth, imageHeight);
+          regionX = (imageWidth - side) / 2;
+          regionY = (imageHeight - side) / 2;
+          regionWidth = side;
+          regionHeight = side;
+          break;
+        }
 
-    uint32_t GetCropHeight() const
-    {
-      CheckNotFull();
-      return cropHeight_;
+        case RegionType_Pixels:
+          regionX = region_[0];
+          regionY = region_[1];
+          regionWidth = region_[2];
+          regionHeight = region_[3];
+          break;
+
+        case RegionType_Percentage:
+          regionX = std::floor(region_[0] * static_cast<double>(imageWidth) / 100.0 + 0.5);
+          regionY = std::floor(region_[1] * static_cast<double>(imageHeight) / 100.0 + 0.5);
+          regionWidth = std::floor(region_[2] * static_cast<double>(imageWidth) / 100.0 + 0.5);
+          regionHeight = std::floor(region_[3] * static_cast<double>(imageHeight) / 100.0 + 0.5);
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      if (regionX >= imageWidth ||
+          regionY >= imageHeight ||
+          regionWidth < 1 ||
+          regionHeight < 1)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - The region is empty or outside of the image");
+      }
+
+      // The regions that extend beyond the image are cropped
+      x = static_cast<unsigned int>(regionX);
+      y = static_cast<unsigned int>(regionY);
+      width = static_cast<unsigned int>(std::min(regionWidth, static_cast<double>(imageWidth - x)));
+      height = static_cast<unsigned int>(std::min(regionHeight, static_cast<double>(imageHeight - y)));
+
+      switch (sizeType_)
+      {
+        case SizeType_Max:
+          targetWidth = width;
+          targetHeight = height;
+          break;
+
+        case SizeType_Width:
+          targetWidth = Round(size_[0]);
+          targetHeight = Round(size_[0] * static_cast<double>(height) / static_cast<double>(width));
+          break;
+
+        case SizeType_Height:
+          targetWidth = Round(size_[1] * static_cast<double>(width) / static_cast<double>(height));
+          targetHeight = Round(size_[1]);
+          break;
+
+        case SizeType_WidthHeight:
+          targetWidth = Round(size_[0]);
+          targetHeight = Round(size_[1]);
+          break;
+
+        case SizeType_Confined:
+        {
+          const double scale = std::min(size_[0] / static_cast<double>(width),
+                                        size_[1] / static_cast<double>(height));
+          targetWidth = Round(scale * static_cast<double>(width));
+          targetHeight = Round(scale * static_cast<double>(height));
+          break;
+        }
+
+        case SizeType_Percentage:
+          targetWidth = Round(size_[0] * static_cast<double>(width) / 100.0);
+          targetHeight = Round(size_[0] * static_cast<double>(height) / 100.0);
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      if (targetWidth > width ||
+          targetHeight > height)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Upscaling is not supported");
+      }
     }
   };
 
 
+  /**
+   * Fast path for the regions that correspond to one tile of some
+   * level of the pyramid, at the native resolution of this level:
+   * The tile is served as such if possible.
+   **/
   class RegionRenderer : public boost::noncopyable
   {
   private:
-    RegionParameters                         parameters_;
+    Orthanc::MimeType                        mime_;
+    unsigned int                             targetWidth_;
+    unsigned int                             targetHeight_;
+    uint8_t                                  backgroundRed_;
+    uint8_t                                  backgroundGreen_;
+    uint8_t                                  backgroundBlue_;
     std::unique_ptr<OrthancWSI::RawTile>     rawTile_;
     std::unique_ptr<Orthanc::ImageAccessor>  toCrop_;
 
@@ -333,68 +768,85 @@ namespace
     }
 
   public:
-    RegionRenderer(const RegionParameters& parameters,
-                   OrthancWSI::ITiledPyramid& pyramid) :
-      parameters_(parameters)
+    static bool LookupNativeTile(unsigned int& level,
+                                 unsigned int& tileX,
+                                 unsigned int& tileY,
+                                 const OrthancWSI::ITiledPyramid& pyramid,
+                                 unsigned int x,
+                                 unsigned int y,
+                                 unsigned int width,
+                                 unsigned int height,
+                                 unsigned int targetWidth,
+                                 unsigned int targetHeight)
     {
-      unsigned int level;
       for (level = 0; level < pyramid.GetLevelCount(); level++)
       {
         const unsigned int physicalTileWidth = GetPhysicalTileWidth(pyramid, level);
         const unsigned int physicalTileHeight = GetPhysicalTileHeight(pyramid, level);
 
-        if (parameters.GetX() % physicalTileWidth == 0 &&
-            parameters.GetY() % physicalTileHeight == 0 &&
-            parameters.GetRegionWidth() <= physicalTileWidth &&
-            parameters.GetRegionHeight() <= physicalTileHeight &&
-            parameters.GetX() + parameters.GetRegionWidth() <= pyramid.GetLevelWidth(0) &&
-            parameters.GetY() + parameters.GetRegionHeight() <= pyramid.GetLevelHeight(0))
+        // Size of the region in the pixels of the level
+        const double levelWidth = (static_cast<double>(width) * static_cast<double>(pyramid.GetLevelWidth(level)) /
+                                   static_cast<double>(pyramid.GetLevelWidth(0)));
+        const double levelHeight = (static_cast<double>(height) * static_cast<double>(pyramid.GetLevelHeight(level)) /
+                                    static_cast<double>(pyramid.GetLevelHeight(0)));
+
+        if (x % physicalTileWidth == 0 &&
+            y % physicalTileHeight == 0 &&
+            width <= physicalTileWidth &&
+            height <= physicalTileHeight &&
+            targetWidth <= pyramid.GetTileWidth(level) &&
+            targetHeight <= pyramid.GetTileHeight(level) &&
+            std::abs(static_cast<double>(targetWidth) - levelWidth) < 1.0 &&
+            std::abs(static_cast<double>(targetHeight) - levelHeight) < 1.0)
         {
-          break;
+          tileX = x / physicalTileWidth;
+          tileY = y / physicalTileHeight;
+          return true;
         }
       }
 
-      if (level == pyramid.GetLevelCount())
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Cannot locate the level of interest");
-      }
-      else if (parameters.GetCropWidth() > pyramid.GetTileWidth(level))
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Request for a cropping that is too large for the tile size");
-      }
-      else
-      {
-        const unsigned int tileX = parameters.GetX() / GetPhysicalTileWidth(pyramid, level);
-        const unsigned int tileY = parameters.GetY() / GetPhysicalTileHeight(pyramid, level);
-        rawTile_.reset(new OrthancWSI::RawTile(pyramid, level, tileX, tileY));
+      return false;
+    }
 
-        if (rawTile_->IsEmpty())
+    RegionRenderer(Orthanc::MimeType mime,
+                   OrthancWSI::ITiledPyramid& pyramid,
+                   unsigned int level,
+                   unsigned int tileX,
+                   unsigned int tileY,
+                   unsigned int targetWidth,
+                   unsigned int targetHeight,
+                   uint8_t backgroundRed,
+                   uint8_t backgroundGreen,
+                   uint8_t backgroundBlue) :
+      mime_(mime),
+      targetWidth_(targetWidth),
+      targetHeight_(targetHeight),
+      backgroundRed_(backgroundRed),
+      backgroundGreen_(backgroundGreen),
+      backgroundBlue_(backgroundBlue)
+    {
+      rawTile_.reset(new OrthancWSI::RawTile(pyramid, level, tileX, tileY));
+
+      if (rawTile_->IsEmpty())
+      {
+        bool isEmpty;
+        toCrop_.reset(pyramid.DecodeTile(isEmpty, level, tileX, tileY));
+        if (isEmpty)
         {
-          bool isEmpty;
-          toCrop_.reset(pyramid.DecodeTile(isEmpty, level, tileX, tileY));
-          if (isEmpty)
-          {
-            toCrop_.reset(NULL);
-          }
-          else
-          {
-            rawTile_.reset(NULL);
-          }
+          toCrop_.reset(NULL);
         }
         else
         {
-          assert(rawTile_->GetTileWidth() == pyramid.GetTileWidth(level));
-          assert(rawTile_->GetTileHeight() == pyramid.GetTileHeight(level));
-
-          if (!rawTile_->IsEmpty() &&
-              (parameters.GetCropWidth() < pyramid.GetTileWidth(level) ||
-               parameters.GetCropHeight() < pyramid.GetTileHeight(level)))
-          {
-            toCrop_.reset(rawTile_->Decode());
-            rawTile_.reset(NULL);
-          }
+          rawTile_.reset(NULL);
         }
       }
+      else
+      {
+        // The tiles on the right and bottom edges are cropped in
+        // "Answer()", outside of the lock on the pyramid
+        assert(rawTile_->GetTileWidth() == pyramid.GetTileWidth(level));
+        assert(rawTile_->GetTileHeight() == pyramid.GetTileHeight(level));
+      }
     }
 
     void Answer(OrthancPluginRestOutput* output)
@@ -405,40 +857,44 @@ namespace
 
         if (rawTile_->IsEmpty())
         {
-          if (parameters_.GetCropWidth() < rawTile_->GetTileWidth() ||
-              parameters_.GetCropHeight() < rawTile_->GetTileHeight())
-          {
-            OrthancWSI::RawTile::AnswerBackgroundTile(output, parameters_.GetCropWidth(), parameters_.GetCropHeight());
-          }
-          else
-          {
-            OrthancWSI::RawTile::AnswerBackgroundTile(output, rawTile_->GetTileWidth(), rawTile_->GetTileHeight());
-          }
+          OrthancWSI::BackgroundTiles::Answer(output, targetWidth_, targetHeight_, backgroundRed_,
+                                              backgroundGreen_, backgroundBlue_, mime_);
+        }
+        else if (targetWidth_ < rawTile_->GetTileWidth() ||
+                 targetHeight_ < rawTile_->GetTileHeight())
+        {
+          // Edge tile: JPEG tiles are losslessly cropped in the DCT domain
+          std::string cropped;
+          rawTile_->TranscodeCropped(cropped, mime_, targetWidth_, targetHeight_, OrthancWSI::TranscodingPriority_Region);
+
+          OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, cropped.c_str(),
+                                    cropped.size(), Orthanc::EnumerationToString(mime_));
         }
         else
         {
-          // Level 0 Compliance of IIIF expects JPEG files
-          rawTile_->Answer(output, Orthanc::MimeType_Jpeg);
+          // Level 0 Compliance of IIIF expects JPEG files, WebP is
+          // only served if explicitly requested
+          rawTile_->Answer(output, mime_, OrthancWSI::TranscodingPriority_Region);
         }
       }
       else if (toCrop_.get() != NULL)
       {
         assert(rawTile_.get() == NULL);
 
-        if (parameters_.GetCropWidth() > toCrop_->GetWidth() ||
-            parameters_.GetCropHeight() > toCrop_->GetHeight())
+        if (targetWidth_ > toCrop_->GetWidth() ||
+            targetHeight_ > toCrop_->GetHeight())
         {
           throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "IIIF - Asking to crop outside of the tile size");
         }
 
         Orthanc::ImageAccessor cropped;
-        toCrop_->GetRegion(cropped, 0, 0, parameters_.GetCropWidth(), parameters_.GetCropHeight());
+        toCrop_->GetRegion(cropped, 0, 0, targetWidth_, targetHeight_);
 
         std::string encoded;
-        OrthancWSI::RawTile::Encode(encoded, cropped, Orthanc::MimeType_Jpeg);
+        OrthancWSI::RawTile::Encode(encoded, cropped, mime_, OrthancWSI::TranscodingPriority_Region);
 
         OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
-                                  encoded.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg));
+                                  encoded.size(), Orthanc::EnumerationToString(mime_));
       }
       else
       {
@@ -449,38 +905,48 @@ namespace
 }
 
 
-static Orthanc::ImageAccessor* RenderFullImage(OrthancWSI::ITiledPyramid& pyramid)
+static void AnswerImage(OrthancPluginRestOutput* output,
+                        const Orthanc::ImageAccessor& image,
+                        Orthanc::MimeType mime)
 {
-  const unsigned int level = pyramid.GetLevelCount() - 1;
-
-  std::unique_ptr<Orthanc::ImageAccessor> full(new Orthanc::Image(Orthanc::PixelFormat_RGB24, pyramid.GetLevelWidth(level), pyramid.GetLevelHeight(level), false));
-  Orthanc::ImageProcessing::Set(*full, 255, 255, 255, 0);
-
-  const unsigned int nx = OrthancWSI::CeilingDivision(pyramid.GetLevelWidth(level), pyramid.GetTileWidth(level));
-  const unsigned int ny = OrthancWSI::CeilingDivision(pyramid.GetLevelHeight(level), pyramid.GetTileHeight(level));
-  for (unsigned int ty = 0; ty < ny; ty++)
-  {
-    const unsigned int y = ty * pyramid.GetTileHeight(level);
-    const unsigned int height = std::min(pyramid.GetTileHeight(level), full->GetHeight() - y);
-
-    for (unsigned int tx = 0; tx < nx; tx++)
-    {
-      const unsigned int x = tx * pyramid.GetTileWidth(level);
-
-      bool isEmpty;  // Unused
-      std::unique_ptr<Orthanc::ImageAccessor> tile(pyramid.DecodeTile(isEmpty, level, tx, ty));
+  std::string encoded;
+  OrthancWSI::RawTile::Encode(encoded, image, mime, OrthancWSI::TranscodingPriority_Region);
 
-      const unsigned int width = std::min(pyramid.GetTileWidth(level), full->GetWidth() - x);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
+                            encoded.size(), Orthanc::EnumerationToString(mime));
+}
 
-      Orthanc::ImageAccessor source, target;
-      tile->GetRegion(source, 0, 0, width, height);
-      full->GetRegion(target, x, y, width, height);
 
-      Orthanc::ImageProcessing::Copy(target, source);
-    }
+/**
+ * The "full" images are rendered from the tiles of the nearest level,
+ * decoded in parallel. The encoded images are kept in the cache of
+ * full images, indexed by their size and format, as the thumbnails
+ * of Mirador and OpenSeadragon request them for each canvas using
+ * the advertised "sizes".
+ **/
+static void AnswerFullImage(OrthancPluginRestOutput* output,
+                            OrthancWSI::TileCache::Accessor& cached,
+                            const Orthanc::ImageAccessor* rendered,
+                            Orthanc::MimeType mime)
+{
+  if (cached.IsHit())
+  {
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, cached.GetContent().c_str(),
+                              cached.GetContent().size(), Orthanc::EnumerationToString(mime));
   }
+  else if (rendered == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+  }
+  else
+  {
+    std::string encoded;
+    OrthancWSI::RawTile::Encode(encoded, *rendered, mime, OrthancWSI::TranscodingPriority_Region);
+    cached.Store(encoded, OrthancWSI::ImageToolbox::Convert(mime));
 
-  return full.release();
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
+                              encoded.size(), Orthanc::EnumerationToString(mime));
+  }
 }
 
 
@@ -501,31 +967,81 @@ void ServeIIIFTiledImageTile(OrthancPluginRestOutput* output,
 
   const RegionParameters parameters(region, size, rotation, quality, format);
 
-  if (parameters.IsFull())
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeSeriesETag(seriesId, url)))
+  {
+    return;
+  }
+
+  if (parameters.IsFullRegion())
   {
+    // The accessor only holds a reference to the pyramid, which doesn't block the other HTTP threads
+    OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+    OrthancWSI::DicomPyramid& pyramid = accessor.GetPyramid();
+
+    unsigned int targetWidth, targetHeight;
+    parameters.ResolveFullImage(targetWidth, targetHeight, pyramid);
+
+    // Concurrent requests for the same full image are merged by the cache
+    OrthancWSI::TileCache::Accessor cached(OrthancWSI::TileCache::GetFullImages(),
+                                           OrthancWSI::TileCache::FormatSeriesFullImageKey(
+                                             seriesId, targetWidth, targetHeight,
+                                             Orthanc::EnumerationToString(parameters.GetMimeType())));
+
     std::unique_ptr<Orthanc::ImageAccessor> image;
 
+    if (!cached.IsHit())
     {
-      OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-      image.reset(RenderFullImage(locker.GetPyramid()));
-    }
+      const unsigned int level = pyramid.GetLevelCount() - 1;
 
-    std::string encoded;
-    OrthancWSI::RawTile::Encode(encoded, *image, Orthanc::MimeType_Jpeg);
+      if (static_cast<uint64_t>(pyramid.GetLevelWidth(level)) * static_cast<uint64_t>(pyramid.GetLevelHeight(level)) >
+          OrthancWSI::SeriesRegions::GetMaxMosaicPixels())
+      {
+        // This can only happen if "SynthesizeMissingLevels" is "false"
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest,
+                                        "IIIF - The coarsest level of series " + seriesId + " is too large to render the " +
+                                        "full image, consider enabling the \"SynthesizeMissingLevels\" option");
+      }
 
-    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
-                              encoded.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg));
+      image.reset(OrthancWSI::SeriesRegions::Render(pyramid, seriesId, 0, 0, pyramid.GetLevelWidth(0), pyramid.GetLevelHeight(0),
+                                                    targetWidth, targetHeight, OrthancWSI::TranscodingPriority_Region));
+    }
+
+    AnswerFullImage(output, cached, image.get(), parameters.GetMimeType());
   }
   else
   {
     std::unique_ptr<RegionRenderer> renderer;
+    std::unique_ptr<Orthanc::ImageAccessor> rendered;
 
     {
-      OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-      renderer.reset(new RegionRenderer(parameters, locker.GetPyramid()));
+      OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+      OrthancWSI::DicomPyramid& pyramid = accessor.GetPyramid();
+
+      unsigned int x, y, width, height, targetWidth, targetHeight, level, tileX, tileY;
+      parameters.Resolve(x, y, width, height, targetWidth, targetHeight, pyramid.GetLevelWidth(0), pyramid.GetLevelHeight(0));
+
+      if (RegionRenderer::LookupNativeTile(level, tileX, tileY, pyramid, x, y, width, height, targetWidth, targetHeight))
+      {
+        renderer.reset(new RegionRenderer(parameters.GetMimeType(), pyramid, level, tileX, tileY, targetWidth, targetHeight,
+                                          pyramid.GetBackgroundRed(), pyramid.GetBackgroundGreen(), pyramid.GetBackgroundBlue()));
+      }
+      else
+      {
+        // Arbitrary region or size: Composite the tiles of the nearest level
+        rendered.reset(OrthancWSI::SeriesRegions::Render(pyramid, seriesId, x, y, width, height, targetWidth, targetHeight,
+                                                         OrthancWSI::TranscodingPriority_Region));
+      }
     }
 
-    renderer->Answer(output);
+    if (renderer.get() != NULL)
+    {
+      renderer->Answer(output);
+    }
+    else
+    {
+      AnswerImage(output, *rendered, parameters.GetMimeType());
+    }
   }
 }
 
@@ -620,6 +1136,16 @@ void ServeIIIFManifest(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "IIIF: Presentation API call to series " << seriesId;
 
+  const std::string key = "series-manifest/" + seriesId;
+  if (AnswerCachedDocument(output, key))
+  {
+    return;
+  }
+
+  // The manifest must be invalidated if the series or one of its instances is modified
+  std::vector<std::string> resources;
+  resources.push_back(seriesId);
+
   Json::Value study, series;
   if (!OrthancPlugins::RestApiGet(series, "/series/" + seriesId, false) ||
       !OrthancPlugins::RestApiGet(study, "/series/" + seriesId + "/study", false))
@@ -661,9 +1187,9 @@ void ServeIIIFManifest(OrthancPluginRestOutput* output,
     unsigned int width, height;
 
     {
-      OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-      width = locker.GetPyramid().GetLevelWidth(0);
-      height = locker.GetPyramid().GetLevelHeight(0);
+      OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+      width = accessor.GetPyramid().GetLevelWidth(0);
+      height = accessor.GetPyramid().GetLevelHeight(0);
     }
 
     AddCanvas(manifest, seriesId, "tiles/" + seriesId, 1, width, height, "");
@@ -719,6 +1245,8 @@ void ServeIIIFManifest(OrthancPluginRestOutput* output,
       const unsigned int start = slicesShort[instance][1].asUInt();
       const unsigned int count = slicesShort[instance][2].asUInt();
 
+      resources.push_back(instanceId);
+
       for (unsigned int frame = start; frame < start + count; frame++, page++)
       {
         AddCanvas(manifest, instanceId, "frames/" + instanceId + "/" + boost::lexical_cast<std::string>(frame),
@@ -727,8 +1255,7 @@ void ServeIIIFManifest(OrthancPluginRestOutput* output,
     }
   }
 
-  std::string s = manifest.toStyledString();
-  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+  AnswerDocument(output, key, manifest, resources);
 }
 
 
@@ -741,6 +1268,12 @@ void ServeIIIFFrameInfo(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "IIIF: Image API call to manifest of instance " << instanceId << " at frame " << frame;
 
+  const std::string key = "frame-info/" + instanceId + "/" + frame;
+  if (AnswerCachedDocument(output, key))
+  {
+    return;
+  }
+
   Json::Value instance;
   if (!OrthancPlugins::RestApiGet(instance, "/instances/" + instanceId + "/tags?short", false))
   {
@@ -774,8 +1307,7 @@ void ServeIIIFFrameInfo(OrthancPluginRestOutput* output,
   result["height"] = height;
   result["tiles"].append(tile);
 
-  std::string s = result.toStyledString();
-  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+  AnswerDocument(output, key, result, std::vector<std::string>(1, instanceId));
 }
 
 
@@ -816,6 +1348,12 @@ void ServeIIIFFramePyramidManifest(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "IIIF: Presentation API call to frame " << frameNumber << " of instance " << instanceId;
 
+  const std::string key = "frame-pyramid-manifest/" + instanceId + "/" + boost::lexical_cast<std::string>(frameNumber);
+  if (AnswerCachedDocument(output, key))
+  {
+    return;
+  }
+
   Json::Value instance, study, series;
   if (!OrthancPlugins::RestApiGet(instance, "/instances/" + instanceId, false) ||
       !OrthancPlugins::RestApiGet(series, "/instances/" + instanceId + "/series", false) ||
@@ -851,8 +1389,7 @@ void ServeIIIFFramePyramidManifest(OrthancPluginRestOutput* output,
 
   AddCanvas(manifest, resourceBase, resourceBase, 1, width, height, "");
 
-  std::string s = manifest.toStyledString();
-  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+  AnswerDocument(output, key, manifest, std::vector<std::string>(1, instanceId));
 }
 
 
@@ -869,6 +1406,12 @@ void ServeIIIFFramePyramidInfo(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "IIIF: Image API call to whole-slide pyramid of frame " << frameNumber << " of instance " << instanceId;
 
+  const std::string key = "frame-pyramid-info/" + instanceId + "/" + boost::lexical_cast<std::string>(frameNumber);
+  if (AnswerCachedDocument(output, key))
+  {
+    return;
+  }
+
   Json::Value result;
 
   {
@@ -878,8 +1421,7 @@ void ServeIIIFFramePyramidInfo(OrthancPluginRestOutput* output,
 
   result["id"] = iiifPublicUrl_ + "frames-pyramids/" + instanceId + "/" + boost::lexical_cast<std::string>(frameNumber);
 
-  std::string s = result.toStyledString();
-  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Json));
+  AnswerDocument(output, key, result, std::vector<std::string>(1, instanceId));
 }
 
 
@@ -906,31 +1448,69 @@ void ServeIIIFFramePyramidTile(OrthancPluginRestOutput* output,
 
   const RegionParameters parameters(region, size, rotation, quality, format);
 
-  if (parameters.IsFull())
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeInstanceETag(instanceId, url)))
+  {
+    return;
+  }
+
+  if (parameters.IsFullRegion())
   {
+    OrthancWSI::DecodedPyramidCache::Accessor accessor(OrthancWSI::DecodedPyramidCache::GetInstance(), instanceId, frameNumber);
+    OrthancWSI::DecodedTiledPyramid& pyramid = accessor.GetPyramid();
+
+    unsigned int targetWidth, targetHeight;
+    parameters.ResolveFullImage(targetWidth, targetHeight, pyramid);
+
+    OrthancWSI::TileCache::Accessor cached(OrthancWSI::TileCache::GetFullImages(),
+                                           OrthancWSI::TileCache::FormatFrameFullImageKey(
+                                             instanceId, frameNumber, targetWidth, targetHeight,
+                                             Orthanc::EnumerationToString(parameters.GetMimeType())));
+
     std::unique_ptr<Orthanc::ImageAccessor> image;
 
+    if (!cached.IsHit())
     {
-      OrthancWSI::DecodedPyramidCache::Accessor accessor(OrthancWSI::DecodedPyramidCache::GetInstance(), instanceId, frameNumber);
-      image.reset(RenderFullImage(accessor.GetPyramid()));
+      image.reset(OrthancWSI::SeriesRegions::Render(pyramid, 0, 0, pyramid.GetLevelWidth(0), pyramid.GetLevelHeight(0),
+                                                    targetWidth, targetHeight, OrthancWSI::TranscodingPriority_Region));
     }
 
-    std::string encoded;
-    OrthancWSI::RawTile::Encode(encoded, *image, Orthanc::MimeType_Jpeg);
-
-    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
-                              encoded.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg));
+    AnswerFullImage(output, cached, image.get(), parameters.GetMimeType());
   }
   else
   {
     std::unique_ptr<RegionRenderer> renderer;
+    std::unique_ptr<Orthanc::ImageAccessor> rendered;
 
     {
       OrthancWSI::DecodedPyramidCache::Accessor accessor(OrthancWSI::DecodedPyramidCache::GetInstance(), instanceId, frameNumber);
-      renderer.reset(new RegionRenderer(parameters, accessor.GetPyramid()));
+      OrthancWSI::DecodedTiledPyramid& pyramid = accessor.GetPyramid();
+
+      unsigned int x, y, width, height, targetWidth, targetHeight, level, tileX, tileY;
+      parameters.Resolve(x, y, width, height, targetWidth, targetHeight, pyramid.GetLevelWidth(0), pyramid.GetLevelHeight(0));
+
+      if (RegionRenderer::LookupNativeTile(level, tileX, tileY, pyramid, x, y, width, height, targetWidth, targetHeight))
+      {
+        uint8_t red, green, blue;
+        pyramid.GetBackgroundColor(red, green, blue);
+        renderer.reset(new RegionRenderer(parameters.GetMimeType(), pyramid, level, tileX, tileY,
+                                          targetWidth, targetHeight, red, green, blue));
+      }
+      else
+      {
+        rendered.reset(OrthancWSI::SeriesRegions::Render(pyramid, x, y, width, height, targetWidth, targetHeight,
+                                                         OrthancWSI::TranscodingPriority_Region));
+      }
     }
 
-    renderer->Answer(output);
+    if (renderer.get() != NULL)
+    {
+      renderer->Answer(output);
+    }
+    else
+    {
+      AnswerImage(output, *rendered, parameters.GetMimeType());
+    }
   }
 }
 
@@ -940,7 +1520,7 @@ void InitializeIIIF(const std::string& iiifPublicUrl)
   iiifPublicUrl_ = iiifPublicUrl;
 
   OrthancPlugins::RegisterRestCallback<ServeIIIFSeriesPyramidInfo>("/wsi/iiif/tiles/([0-9a-f-]+)/info.json", true);
-  OrthancPlugins::RegisterRestCallback<ServeIIIFTiledImageTile>("/wsi/iiif/tiles/([0-9a-f-]+)/([0-9a-z,:]+)/([0-9a-z,!:]+)/([0-9,!]+)/([a-z]+)\\.([a-z]+)", true);
+  OrthancPlugins::RegisterRestCallback<ServeIIIFTiledImageTile>("/wsi/iiif/tiles/([0-9a-f-]+)/([0-9a-z,:.]+)/([0-9a-z,!:.^]+)/([0-9,!]+)/([a-z]+)\\.([a-z]+)", true);
   OrthancPlugins::RegisterRestCallback<ServeIIIFManifest>("/wsi/iiif/series/([0-9a-f-]+)/manifest.json", true);
   OrthancPlugins::RegisterRestCallback<ServeIIIFFrameInfo>("/wsi/iiif/frames/([0-9a-f-]+)/([0-9]+)/info.json", true);
   OrthancPlugins::RegisterRestCallback<ServeIIIFFrameImage>("/wsi/iiif/frames/([0-9a-f-]+)/([0-9]+)/full/max/0/default.jpg", true);
@@ -948,10 +1528,15 @@ void InitializeIIIF(const std::string& iiifPublicUrl)
   // New in WSI 3.0
   OrthancPlugins::RegisterRestCallback<ServeIIIFFramePyramidManifest>("/wsi/iiif/frames-pyramids/([0-9a-f-]+)/([0-9]+)/manifest.json", true);
   OrthancPlugins::RegisterRestCallback<ServeIIIFFramePyramidInfo>("/wsi/iiif/frames-pyramids/([0-9a-f-]+)/([0-9]+)/info.json", true);
-  OrthancPlugins::RegisterRestCallback<ServeIIIFFramePyramidTile>("/wsi/iiif/frames-pyramids/([0-9a-f-]+)/([0-9]+)/([0-9a-z,:]+)/([0-9a-z,!:]+)/([0-9,!]+)/([a-z]+)\\.([a-z]+)", true);
+  OrthancPlugins::RegisterRestCallback<ServeIIIFFramePyramidTile>("/wsi/iiif/frames-pyramids/([0-9a-f-]+)/([0-9]+)/([0-9a-z,:.]+)/([0-9a-z,!:.^]+)/([0-9,!]+)/([a-z]+)\\.([a-z]+)", true);
 }
 
 void SetIIIFForcePowersOfTwoScaleFactors(bool force)
 {
   iiifForcePowersOfTwoScaleFactors_ = force;
 }
+
+void InvalidateIIIFResource(const std::string& resourceId)
+{
+  documentsCache_.Invalidate(resourceId);
+}
@@ -33,3 +33,9 @@ void InitializeIIIF(const std::string& iiifPublicUrl);
  * 4.1: https://github.com/openseadragon/openseadragon/issues/2379
  **/
 void SetIIIFForcePowersOfTwoScaleFactors(bool force);
+
+/**
+ * Remove the cached manifests and info.json documents that depend on
+ * the given Orthanc resource (series or instance).
+ **/
+void InvalidateIIIFResource(const std::string& resourceId);
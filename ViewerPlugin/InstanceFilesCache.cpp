@@ -0,0 +1,473 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "InstanceFilesCache.h"
+
+#include "OrthancPluginConnection.h"
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <cassert>
+
+
+static std::unique_ptr<OrthancWSI::InstanceFilesCache>  singleton_;
+
+static const char* const DICOM_EXTENSION = ".dcm";
+static const char* const INDEX_EXTENSION = ".idx";
+static const char* const TEMPORARY_EXTENSION = ".tmp";
+
+
+namespace OrthancWSI
+{
+  class InstanceFilesCache::CachedFile : public boost::noncopyable
+  {
+  private:
+    boost::mutex                       mutex_;
+    std::string                        dicomPath_;
+    std::string                        indexPath_;
+    uint64_t                           size_;
+    std::unique_ptr<DicomFramesIndex>  index_;
+    std::unique_ptr<MemoryMappedFile>  mapping_;
+
+  public:
+    // The index is read from the disk on the first access ("index" can be NULL)
+    CachedFile(const std::string& dicomPath,
+               const std::string& indexPath,
+               uint64_t size,
+               DicomFramesIndex* index) :
+      dicomPath_(dicomPath),
+      indexPath_(indexPath),
+      size_(size),
+      index_(index)
+    {
+    }
+
+    uint64_t GetSize() const
+    {
+      return size_;
+    }
+
+    void ReadRawFrame(std::string& target,
+                      unsigned int frame)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (index_.get() == NULL)
+        {
+          std::string serialized;
+          Orthanc::SystemToolbox::ReadFile(serialized, indexPath_);
+
+          std::unique_ptr<DicomFramesIndex> index(new DicomFramesIndex);
+          if (!index->Unserialize(serialized))
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Corrupted index of frames: " + indexPath_);
+          }
+
+          index_.reset(index.release());
+        }
+
+        if (mapping_.get() == NULL)
+        {
+          mapping_.reset(new MemoryMappedFile(dicomPath_));
+        }
+      }
+
+      // Once created, the index and the mapping are read-only
+      index_->ExtractFrame(target, mapping_->GetData(), mapping_->GetSize(), frame);
+    }
+
+    void RemoveFiles()
+    {
+      // The index is removed first, as the DICOM files without an
+      // index are discarded by "ScanDirectory()"
+      try
+      {
+        Orthanc::SystemToolbox::RemoveFile(indexPath_);
+        Orthanc::SystemToolbox::RemoveFile(dicomPath_);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Cannot remove a file from the cache of DICOM instances: " << e.What();
+      }
+    }
+  };
+
+
+  std::string InstanceFilesCache::GetDicomPath(const std::string& instanceId) const
+  {
+    return (boost::filesystem::path(directory_) / (instanceId + DICOM_EXTENSION)).string();
+  }
+
+
+  std::string InstanceFilesCache::GetIndexPath(const std::string& instanceId) const
+  {
+    return (boost::filesystem::path(directory_) / (instanceId + INDEX_EXTENSION)).string();
+  }
+
+
+  std::string InstanceFilesCache::GetTemporaryPath() const
+  {
+    return (boost::filesystem::path(directory_) / (Orthanc::Toolbox::GenerateUuid() + TEMPORARY_EXTENSION)).string();
+  }
+
+
+  void InstanceFilesCache::RemoveFiles(const std::string& temporaryDicom,
+                                       const std::string& temporaryIndex,
+                                       const std::string& instanceId) const
+  {
+    // Cleanup after a failed write, the index being removed first
+    const std::string paths[4] = { temporaryIndex, temporaryDicom, GetIndexPath(instanceId), GetDicomPath(instanceId) };
+
+    for (size_t i = 0; i < 4; i++)
+    {
+      try
+      {
+        Orthanc::SystemToolbox::RemoveFile(paths[i]);
+      }
+      catch (...)
+      {
+        // Best effort, the temporary files are removed at the next startup
+      }
+    }
+  }
+
+
+  void InstanceFilesCache::Remove(const std::string& instanceId)
+  {
+    // Mutex must be locked
+
+    Content::iterator found = content_.find(instanceId);
+    if (found != content_.end())
+    {
+      assert(found->second.get() != NULL &&
+             currentSize_ >= found->second->GetSize());
+
+      currentSize_ -= found->second->GetSize();
+      found->second->RemoveFiles();
+      content_.erase(found);
+      index_.Invalidate(instanceId);
+    }
+  }
+
+
+  void InstanceFilesCache::Store(const std::string& instanceId,
+                                 FileHandle file)
+  {
+    // Mutex must be locked
+
+    assert(file.get() != NULL &&
+           content_.find(instanceId) == content_.end());
+
+    while (currentSize_ + file->GetSize() > maxSize_ &&
+           !index_.IsEmpty())
+    {
+      const std::string oldest = index_.GetOldest();
+      Remove(oldest);
+    }
+
+    content_[instanceId] = file;
+    index_.Add(instanceId, true);
+    currentSize_ += file->GetSize();
+  }
+
+
+  void InstanceFilesCache::ScanDirectory()
+  {
+    // Mutex must be locked
+
+    std::set<std::string> dicomFiles, indexFiles;
+
+    for (boost::filesystem::directory_iterator it(directory_);
+         it != boost::filesystem::directory_iterator(); ++it)
+    {
+      if (boost::filesystem::is_regular_file(it->status()))
+      {
+        const std::string extension = it->path().extension().string();
+        const std::string instanceId = it->path().stem().string();
+
+        if (extension == DICOM_EXTENSION)
+        {
+          dicomFiles.insert(instanceId);
+        }
+        else if (extension == INDEX_EXTENSION)
+        {
+          indexFiles.insert(instanceId);
+        }
+        else if (extension == TEMPORARY_EXTENSION)
+        {
+          // The writing of this file was interrupted
+          Orthanc::SystemToolbox::RemoveFile(it->path().string());
+        }
+      }
+    }
+
+    for (std::set<std::string>::const_iterator it = dicomFiles.begin(); it != dicomFiles.end(); ++it)
+    {
+      if (indexFiles.find(*it) == indexFiles.end())
+      {
+        // The writing of this file was interrupted
+        Orthanc::SystemToolbox::RemoveFile(GetDicomPath(*it));
+      }
+      else
+      {
+        const uint64_t size = (Orthanc::SystemToolbox::GetFileSize(GetDicomPath(*it)) +
+                               Orthanc::SystemToolbox::GetFileSize(GetIndexPath(*it)));
+        Store(*it, FileHandle(new CachedFile(GetDicomPath(*it), GetIndexPath(*it), size, NULL)));
+      }
+    }
+
+    for (std::set<std::string>::const_iterator it = indexFiles.begin(); it != indexFiles.end(); ++it)
+    {
+      if (dicomFiles.find(*it) == dicomFiles.end())
+      {
+        Orthanc::SystemToolbox::RemoveFile(GetIndexPath(*it));
+      }
+    }
+
+    LOG(WARNING) << "The cache of DICOM instances in " << directory_ << " contains " << content_.size()
+                 << " instances (" << (currentSize_ / (1024 * 1024)) << "MB)";
+  }
+
+
+  InstanceFilesCache::FileHandle InstanceFilesCache::Download(const std::string& instanceId)
+  {
+    // Mutex must *not* be locked, as this downloads the DICOM file
+
+    uint64_t size;
+    if (!OrthancPluginConnection::LookupDicomFileSize(size, instanceId))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+
+    if (size > maxSize_)
+    {
+      LOG(INFO) << "Instance " << instanceId << " is too large for the cache of DICOM instances";
+      return FileHandle();
+    }
+
+    OrthancPlugins::MemoryBuffer dicom;
+    dicom.GetDicomInstance(instanceId);
+
+    std::unique_ptr<DicomFramesIndex> index(new DicomFramesIndex);
+
+    if (dicom.GetSize() > maxSize_)
+    {
+      LOG(INFO) << "Instance " << instanceId << " is too large for the cache of DICOM instances";
+      return FileHandle();
+    }
+    else if (!index->Parse(dicom.GetData(), dicom.GetSize()))
+    {
+      LOG(INFO) << "Cannot index the frames of instance " << instanceId << ", they will be read by the Orthanc core";
+      return FileHandle();
+    }
+
+    std::string serialized;
+    index->Serialize(serialized);
+
+    /**
+     * Both files are written under temporary names, then renamed, so
+     * that the files of the cache are never partially written. The
+     * DICOM file is renamed before its index, as "ScanDirectory()"
+     * discards the DICOM files without an index.
+     **/
+    const std::string temporaryDicom = GetTemporaryPath();
+    const std::string temporaryIndex = GetTemporaryPath();
+
+    try
+    {
+      Orthanc::SystemToolbox::WriteFile(dicom.GetData(), dicom.GetSize(), temporaryDicom);
+      Orthanc::SystemToolbox::WriteFile(serialized, temporaryIndex);
+      boost::filesystem::rename(temporaryDicom, GetDicomPath(instanceId));
+      boost::filesystem::rename(temporaryIndex, GetIndexPath(instanceId));
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot write instance " << instanceId << " to the cache of DICOM instances, "
+                   << "its frames will be read by the Orthanc core: " << e.What();
+      RemoveFiles(temporaryDicom, temporaryIndex, instanceId);
+      return FileHandle();
+    }
+    catch (boost::filesystem::filesystem_error& e)
+    {
+      LOG(WARNING) << "Cannot write instance " << instanceId << " to the cache of DICOM instances, "
+                   << "its frames will be read by the Orthanc core: " << e.what();
+      RemoveFiles(temporaryDicom, temporaryIndex, instanceId);
+      return FileHandle();
+    }
+
+    return FileHandle(new CachedFile(GetDicomPath(instanceId), GetIndexPath(instanceId),
+                                     dicom.GetSize() + serialized.size(), index.release()));
+  }
+
+
+  InstanceFilesCache::InstanceFilesCache(const std::string& directory,
+                                         uint64_t maxSize) :
+    directory_(directory),
+    maxSize_(maxSize),
+    currentSize_(0)
+  {
+    if (!directory.empty())
+    {
+      if (maxSize == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      Orthanc::SystemToolbox::MakeDirectory(directory);
+
+      boost::mutex::scoped_lock lock(mutex_);
+      ScanDirectory();
+    }
+  }
+
+
+  bool InstanceFilesCache::ReadRawFrame(std::string& target,
+                                        const std::string& instanceId,
+                                        unsigned int frame)
+  {
+    if (!IsEnabled())
+    {
+      return false;
+    }
+
+    FileHandle file;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // If another thread is downloading this instance, wait for it
+      while (loading_.find(instanceId) != loading_.end())
+      {
+        loaded_.wait(lock);
+      }
+
+      if (unsupported_.find(instanceId) != unsupported_.end())
+      {
+        return false;
+      }
+
+      Content::const_iterator found = content_.find(instanceId);
+      if (found == content_.end())
+      {
+        loading_.insert(instanceId);
+      }
+      else
+      {
+        index_.MakeMostRecent(instanceId);
+        file = found->second;
+      }
+    }
+
+    if (file.get() == NULL)
+    {
+      try
+      {
+        file = Download(instanceId);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // Fallback to the other mechanisms to read the frame
+        LOG(WARNING) << "Cannot add instance " << instanceId << " to the cache of DICOM instances: " << e.What();
+
+        boost::mutex::scoped_lock lock(mutex_);
+        loading_.erase(instanceId);
+        loaded_.notify_all();
+        return false;
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      loading_.erase(instanceId);
+      loaded_.notify_all();
+
+      if (file.get() == NULL)
+      {
+        unsupported_.insert(instanceId);
+        return false;
+      }
+      else
+      {
+        Store(instanceId, file);
+      }
+    }
+
+    try
+    {
+      file->ReadRawFrame(target, frame);
+      return true;
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Removing instance " << instanceId << " from the cache of DICOM instances: " << e.What();
+      Invalidate(instanceId);
+      return false;
+    }
+  }
+
+
+  void InstanceFilesCache::Invalidate(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    Remove(instanceId);
+    unsupported_.erase(instanceId);
+  }
+
+
+  void InstanceFilesCache::InitializeInstance(const std::string& directory,
+                                              uint64_t maxSize)
+  {
+    if (singleton_.get() == NULL)
+    {
+      singleton_.reset(new InstanceFilesCache(directory, maxSize));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void InstanceFilesCache::FinalizeInstance()
+  {
+    singleton_.reset(NULL);
+  }
+
+
+  InstanceFilesCache& InstanceFilesCache::GetInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *singleton_;
+    }
+  }
+}
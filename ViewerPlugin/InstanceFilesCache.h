@@ -0,0 +1,113 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "MemoryMappedFile.h"
+#include "../Framework/Inputs/DicomFramesIndex.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+#include <Compatibility.h>  // For std::unique_ptr
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <set>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Least-recently-used cache of DICOM files in a local directory,
+   * whose size is bounded by a number of bytes. Each file is stored
+   * together with the index of its frames, so that the raw frames
+   * can be sliced out of a memory mapping of the file, without
+   * parsing the DICOM file. The cache survives the restarts of
+   * Orthanc. This class is thread-safe.
+   **/
+  class InstanceFilesCache : public boost::noncopyable
+  {
+  private:
+    class CachedFile;
+
+    typedef boost::shared_ptr<CachedFile>                         FileHandle;
+    typedef std::map<std::string, FileHandle>                     Content;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, bool>    Index;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  loaded_;
+    std::string                directory_;
+    uint64_t                   maxSize_;
+    uint64_t                   currentSize_;
+    Content                    content_;
+    Index                      index_;
+    std::set<std::string>      loading_;
+    std::set<std::string>      unsupported_;   // Instances that cannot be indexed, or that are too large
+
+    std::string GetDicomPath(const std::string& instanceId) const;
+
+    std::string GetIndexPath(const std::string& instanceId) const;
+
+    std::string GetTemporaryPath() const;
+
+    void RemoveFiles(const std::string& temporaryDicom,
+                     const std::string& temporaryIndex,
+                     const std::string& instanceId) const;
+
+    void Remove(const std::string& instanceId);
+
+    void Store(const std::string& instanceId,
+               FileHandle file);
+
+    void ScanDirectory();
+
+    FileHandle Download(const std::string& instanceId);
+
+  public:
+    // An empty directory disables the cache
+    InstanceFilesCache(const std::string& directory,
+                       uint64_t maxSize);
+
+    bool IsEnabled() const
+    {
+      return !directory_.empty();
+    }
+
+    // Returns "false" if the cache is disabled, or if the frame must
+    // be read using another mechanism
+    bool ReadRawFrame(std::string& target,
+                      const std::string& instanceId,
+                      unsigned int frame);
+
+    void Invalidate(const std::string& instanceId);
+
+    static void InitializeInstance(const std::string& directory,
+                                   uint64_t maxSize);
+
+    static void FinalizeInstance();
+
+    static InstanceFilesCache& GetInstance();
+  };
+}
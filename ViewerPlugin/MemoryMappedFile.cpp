@@ -0,0 +1,130 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "MemoryMappedFile.h"
+
+#include <OrthancException.h>
+
+#if !defined(_WIN32)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+namespace OrthancWSI
+{
+#if defined(_WIN32)
+  MemoryMappedFile::MemoryMappedFile(const std::string& path) :
+    file_(INVALID_HANDLE_VALUE),
+    mapping_(NULL),
+    data_(NULL),
+    size_(0)
+  {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot open file: " + path);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) ||
+        size.QuadPart == 0)
+    {
+      CloseHandle(file_);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Cannot map an empty file: " + path);
+    }
+
+    size_ = static_cast<size_t>(size.QuadPart);
+
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ != NULL)
+    {
+      data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    if (data_ == NULL)
+    {
+      if (mapping_ != NULL)
+      {
+        CloseHandle(mapping_);
+      }
+
+      CloseHandle(file_);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Cannot map file: " + path);
+    }
+  }
+
+
+  MemoryMappedFile::~MemoryMappedFile()
+  {
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+  }
+
+#else
+
+  MemoryMappedFile::MemoryMappedFile(const std::string& path) :
+    data_(NULL),
+    size_(0)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot open file: " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        info.st_size == 0)
+    {
+      close(fd);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Cannot map an empty file: " + path);
+    }
+
+    size_ = static_cast<size_t>(info.st_size);
+
+    void* data = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping remains valid after the file descriptor is closed
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Cannot map file: " + path);
+    }
+
+    data_ = data;
+  }
+
+
+  MemoryMappedFile::~MemoryMappedFile()
+  {
+    munmap(const_cast<void*>(data_), size_);
+  }
+#endif
+}
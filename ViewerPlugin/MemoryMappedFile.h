@@ -0,0 +1,62 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#endif
+
+
+namespace OrthancWSI
+{
+  // Read-only mapping of a whole file into memory
+  class MemoryMappedFile : public boost::noncopyable
+  {
+  private:
+#if defined(_WIN32)
+    HANDLE       file_;
+    HANDLE       mapping_;
+#endif
+    const void*  data_;
+    size_t       size_;
+
+  public:
+    explicit MemoryMappedFile(const std::string& path);
+
+    ~MemoryMappedFile();
+
+    const void* GetData() const
+    {
+      return data_;
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+  };
+}
@@ -24,9 +24,14 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 #include "OrthancPluginConnection.h"
 
+#include "DicomInstanceCache.h"
+#include "InstanceFilesCache.h"
+
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <OrthancException.h>
+#include <SerializationToolbox.h>
+#include <Toolbox.h>
 
 namespace OrthancWSI
 {
@@ -89,4 +94,24 @@ namespace OrthancWSI
       throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
   }
+
+
+  bool OrthancPluginConnection::ReadRawFrame(std::string& target,
+                                             const std::string& instanceId,
+                                             unsigned int frame)
+  {
+    // Memory-mapped local files are preferred over the DICOM instances
+    // that are parsed by the Orthanc core
+    return (InstanceFilesCache::GetInstance().ReadRawFrame(target, instanceId, frame) ||
+            DicomInstanceCache::GetInstance().ReadRawFrame(target, instanceId, frame));
+  }
+
+
+  bool OrthancPluginConnection::LookupDicomFileSize(uint64_t& size,
+                                                    const std::string& instanceId)
+  {
+    std::string s;
+    return (OrthancPlugins::RestApiGetString(s, "/instances/" + instanceId + "/attachments/dicom/size", false) &&
+            Orthanc::SerializationToolbox::ParseUnsignedInteger64(size, Orthanc::Toolbox::StripSpaces(s)));
+  }
 }
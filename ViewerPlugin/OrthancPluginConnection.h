@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include "../Framework/Inputs/IRawFramesSource.h"
 #include "../Resources/Orthanc/Stone/IOrthancConnection.h"
 
 #include <Compatibility.h>
@@ -36,7 +37,9 @@ namespace OrthancWSI
    * releases up to 1.7.1 (in folder "Plugins/Samples/Common/"). This
    * class is thread-safe.
    **/
-  class OrthancPluginConnection : public OrthancStone::IOrthancConnection
+  class OrthancPluginConnection :
+    public OrthancStone::IOrthancConnection,
+    public IRawFramesSource
   {
   public:
     virtual void RestApiGet(std::string& result,
@@ -51,5 +54,16 @@ namespace OrthancWSI
                             const std::string& body) ORTHANC_OVERRIDE;
 
     virtual void RestApiDelete(const std::string& uri) ORTHANC_OVERRIDE;
+
+    // Reads the frame through "InstanceFilesCache" or "DicomInstanceCache"
+    virtual bool ReadRawFrame(std::string& target,
+                              const std::string& instanceId,
+                              unsigned int frame) ORTHANC_OVERRIDE;
+
+    // Size of the DICOM file of an instance, which is known to the
+    // Orthanc core without reading the file. Returns "false" if the
+    // instance does not exist.
+    static bool LookupDicomFileSize(uint64_t& size,
+                                    const std::string& instanceId);
   };
 }
@@ -24,18 +24,108 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 #include "OrthancPyramidFrameFetcher.h"
 
+#include "FramePyramidFilesCache.h"
+
+#include "../Framework/ImageToolbox.h"
+#include "../Framework/Inputs/IRawFramesSource.h"
 #include "../Framework/Inputs/OnTheFlyPyramid.h"
 
 #include <DicomFormat/DicomImageInformation.h>
 #include <DicomFormat/DicomMap.h>
 #include <Images/Image.h>
 #include <Images/ImageProcessing.h>
+#include <SerializationToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
+#include <cmath>
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 
 namespace OrthancWSI
 {
+  static bool LookupFirstDouble(double& target,
+                                const Orthanc::DicomMap& tags,
+                                const Orthanc::DicomTag& tag)
+  {
+    // The windowing tags can be multi-valued, e.g. "40\\400". Non-finite
+    // values ("nan", "inf") are ignored, as they cannot be rendered.
+    std::string value;
+    return (tags.LookupStringValue(value, tag, false) &&
+            Orthanc::SerializationToolbox::ParseFirstDouble(target, Orthanc::Toolbox::StripSpaces(value)) &&
+            boost::math::isfinite(target));
+  }
+
+
+  template <typename PixelType>
+  static void MaskStoredBits(Orthanc::ImageAccessor& image,
+                             unsigned int shift,
+                             unsigned int bitsStored,
+                             bool isSigned)
+  {
+    const uint32_t mask = (1u << bitsStored) - 1u;
+    const uint32_t signBit = 1u << (bitsStored - 1);
+
+    const unsigned int width = image.GetWidth();
+    const unsigned int height = image.GetHeight();
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      PixelType* p = reinterpret_cast<PixelType*>(image.GetRow(y));
+
+      for (unsigned int x = 0; x < width; x++, p++)
+      {
+        int32_t value = static_cast<int32_t>((static_cast<uint32_t>(*p) >> shift) & mask);
+
+        if (isSigned &&
+            (value & signBit))
+        {
+          value -= static_cast<int32_t>(mask) + 1;  // Sign extension
+        }
+
+        *p = static_cast<PixelType>(value);
+      }
+    }
+  }
+
+
+  static void MaskStoredBits(Orthanc::ImageAccessor& image,
+                             const Orthanc::DicomImageInformation& info)
+  {
+    /**
+     * Only keep the "BitsStored" bits that end at "HighBit", as done
+     * by the decoder of the Orthanc core for uncompressed frames
+     * (cf. "DicomIntegerPixelAccessor"): The unused high bits can
+     * contain overlays or garbage.
+     **/
+    if (info.GetBitsStored() == 0 ||
+        info.GetBitsStored() >= info.GetBitsAllocated())
+    {
+      return;
+    }
+
+    switch (image.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        MaskStoredBits<uint8_t>(image, info.GetShift(), info.GetBitsStored(), false);
+        break;
+
+      case Orthanc::PixelFormat_Grayscale16:
+        MaskStoredBits<uint16_t>(image, info.GetShift(), info.GetBitsStored(), false);
+        break;
+
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        MaskStoredBits<uint16_t>(image, info.GetShift(), info.GetBitsStored(), true);
+        break;
+
+      default:
+        break;  // Color images always use all their allocated bits
+    }
+  }
+
+
   OrthancPyramidFrameFetcher::OrthancPyramidFrameFetcher(OrthancStone::IOrthancConnection* orthanc,
                                                          bool smooth) :
     orthanc_(orthanc),
@@ -46,7 +136,8 @@ namespace OrthancWSI
     paddingY_(0),
     defaultBackgroundRed_(0),
     defaultBackgroundGreen_(0),
-    defaultBackgroundBlue_(0)
+    defaultBackgroundBlue_(0),
+    tilesCompression_(ImageCompression_None)
   {
     if (orthanc == NULL)
     {
@@ -81,6 +172,21 @@ namespace OrthancWSI
   }
 
 
+  void OrthancPyramidFrameFetcher::SetTilesCompression(ImageCompression compression)
+  {
+    if (compression == ImageCompression_None ||
+        compression == ImageCompression_Png ||
+        compression == ImageCompression_Jpeg)
+    {
+      tilesCompression_ = compression;
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
   void OrthancPyramidFrameFetcher::SetDefaultBackgroundColor(uint8_t red,
                                                              uint8_t green,
                                                              uint8_t blue)
@@ -91,22 +197,188 @@ namespace OrthancWSI
   }
 
 
-  DecodedTiledPyramid* OrthancPyramidFrameFetcher::Fetch(const std::string &instanceId,
-                                                         unsigned frameNumber)
+  Orthanc::ImageAccessor* OrthancPyramidFrameFetcher::DecodeRawFrame(const Orthanc::DicomImageInformation& info,
+                                                                      const std::string& instanceId,
+                                                                      unsigned int frameNumber)
   {
+    /**
+     * The transfer syntax is read from the metadata that is stored by
+     * the Orthanc core, which doesn't imply the reading of the DICOM
+     * file. NULL is returned if the frame must be decoded by the
+     * Orthanc core.
+     **/
+    std::string syntax;
+
+    try
+    {
+      orthanc_->RestApiGet(syntax, "/instances/" + instanceId + "/metadata/TransferSyntax");
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return NULL;  // Missing metadata in old databases
+    }
+
+    syntax = Orthanc::Toolbox::StripSpaces(syntax);
+
+    ImageCompression compression;
+    Orthanc::PixelFormat format;
+
+    if (syntax == "1.2.840.10008.1.2" ||
+        syntax == "1.2.840.10008.1.2.1")
+    {
+      if (info.IsPlanar() ||
+          !info.ExtractPixelFormat(format, false))
+      {
+        return NULL;
+      }
+
+      compression = ImageCompression_None;
+    }
+    else if (syntax == "1.2.840.10008.1.2.4.50")
+    {
+      compression = ImageCompression_Jpeg;
+    }
+    else if ((syntax == "1.2.840.10008.1.2.4.90" ||
+              syntax == "1.2.840.10008.1.2.4.91") &&
+             info.GetBitsStored() == 8 &&
+             !info.IsSigned())
+    {
+      // "Jpeg2000Reader" only supports 8bpp images
+      compression = ImageCompression_Jpeg2000;
+    }
+    else
+    {
+      return NULL;
+    }
+
+    std::string raw;
+
+    IRawFramesSource* source = dynamic_cast<IRawFramesSource*>(orthanc_.get());
+
+    if (source == NULL ||
+        !source->ReadRawFrame(raw, instanceId, frameNumber))
+    {
+      orthanc_->RestApiGet(raw, "/instances/" + instanceId + "/frames/" +
+                           boost::lexical_cast<std::string>(frameNumber) + "/raw");
+    }
+
+    std::unique_ptr<Orthanc::ImageAccessor> decoded;
+
+    if (compression == ImageCompression_None)
+    {
+      decoded.reset(ImageToolbox::DecodeRawTile(raw, format, info.GetWidth(), info.GetHeight()));
+      MaskStoredBits(*decoded, info);
+    }
+    else
+    {
+      decoded.reset(ImageToolbox::DecodeTile(raw, compression));
+
+      if (compression == ImageCompression_Jpeg2000 &&
+          (info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBRFull ||
+           info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBRFull422 ||
+           info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBRPartial420 ||
+           info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBRPartial422 ||
+           info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBR_ICT ||
+           info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_YBR_RCT))
+      {
+        ImageToolbox::ConvertJpegYCbCrToRgb(*decoded);
+      }
+    }
+
+    if (decoded->GetWidth() != info.GetWidth() ||
+        decoded->GetHeight() != info.GetHeight())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    return decoded.release();
+  }
+
+
+  Orthanc::ImageAccessor* OrthancPyramidFrameFetcher::DecodeFrameWithOrthanc(const std::string& instanceId,
+                                                                              unsigned int frameNumber)
+  {
+    // Slow path: The whole DICOM instance is parsed by the Orthanc core
     OrthancPlugins::MemoryBuffer buffer;
     buffer.GetDicomInstance(instanceId.c_str());
 
     OrthancPlugins::DicomInstance dicom(buffer.GetData(), buffer.GetSize());
+    std::unique_ptr<OrthancPlugins::OrthancImage> frame(dicom.GetDecodedFrame(frameNumber));
+
+    Orthanc::PixelFormat format;
+    switch (frame->GetPixelFormat())
+    {
+      case OrthancPluginPixelFormat_RGB24:
+        format = Orthanc::PixelFormat_RGB24;
+        break;
+
+      case OrthancPluginPixelFormat_Grayscale8:
+        format = Orthanc::PixelFormat_Grayscale8;
+        break;
+
+      case OrthancPluginPixelFormat_Grayscale16:
+        format = Orthanc::PixelFormat_Grayscale16;
+        break;
+
+      case OrthancPluginPixelFormat_SignedGrayscale16:
+        format = Orthanc::PixelFormat_SignedGrayscale16;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+    }
+
+    Orthanc::ImageAccessor accessor;
+    accessor.AssignReadOnly(format, frame->GetWidth(), frame->GetHeight(), frame->GetPitch(), frame->GetBuffer());
+
+    return Orthanc::Image::Clone(accessor);
+  }
 
-    Json::Value tags;
-    dicom.GetJson(tags);
+
+  DecodedTiledPyramid* OrthancPyramidFrameFetcher::Fetch(const std::string &instanceId,
+                                                         unsigned frameNumber)
+  {
+    {
+      // Reload the pyramid if it was previously spilled to the disk
+      std::unique_ptr<OnTheFlyPyramid> spilled(FramePyramidFilesCache::GetInstance().Load(instanceId, frameNumber));
+      if (spilled.get() != NULL)
+      {
+        return spilled.release();
+      }
+    }
+
+    /**
+     * Only the tags and the requested frame are retrieved, which
+     * avoids loading and parsing the full DICOM instance (that can
+     * weigh gigabytes in the case of multiframe instances) in order
+     * to display a single frame.
+     **/
+    std::string tags;
+    orthanc_->RestApiGet(tags, "/instances/" + instanceId + "/tags");
+
+    Json::Value json;
+    if (!Orthanc::Toolbox::ReadJson(json, tags))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
 
     Orthanc::DicomMap m;
-    m.FromDicomAsJson(tags);
+    m.FromDicomAsJson(json);
 
     Orthanc::DicomImageInformation info(m);
 
+    if (frameNumber >= info.GetNumberOfFrames())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    std::unique_ptr<Orthanc::ImageAccessor> frame(DecodeRawFrame(info, instanceId, frameNumber));
+
+    if (frame.get() == NULL)
+    {
+      frame.reset(DecodeFrameWithOrthanc(instanceId, frameNumber));
+    }
+
     uint8_t backgroundRed, backgroundGreen, backgroundBlue;
 
     if (info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_Monochrome1 ||
@@ -123,8 +395,6 @@ namespace OrthancWSI
       backgroundBlue = defaultBackgroundBlue_;
     }
 
-    std::unique_ptr<OrthancPlugins::OrthancImage> frame(dicom.GetDecodedFrame(frameNumber));
-
     unsigned int paddedWidth, paddedHeight;
 
     if (paddingX_ >= 2)
@@ -146,26 +416,78 @@ namespace OrthancWSI
     }
 
 
-    Orthanc::PixelFormat sourceFormat, targetFormat;
-    switch (frame->GetPixelFormat())
+    if (frame->GetFormat() == Orthanc::PixelFormat_Grayscale16 ||
+        frame->GetFormat() == Orthanc::PixelFormat_SignedGrayscale16)
     {
-      case OrthancPluginPixelFormat_RGB24:
-        sourceFormat = Orthanc::PixelFormat_RGB24;
-        targetFormat = Orthanc::PixelFormat_RGB24;
-        break;
+      /**
+       * The 16bpp samples are kept in the pyramid, together with the
+       * modality LUT and the default window, so that the window can
+       * be changed by the viewer without fetching the frame again.
+       **/
+      double rescaleSlope, rescaleIntercept;
+
+      if (!LookupFirstDouble(rescaleSlope, m, Orthanc::DICOM_TAG_RESCALE_SLOPE) ||
+          rescaleSlope == 0)
+      {
+        rescaleSlope = 1;
+      }
+
+      if (!LookupFirstDouble(rescaleIntercept, m, Orthanc::DICOM_TAG_RESCALE_INTERCEPT))
+      {
+        rescaleIntercept = 0;
+      }
+
+      const bool invert = (info.GetPhotometricInterpretation() == Orthanc::PhotometricInterpretation_Monochrome1);
+
+      int64_t minValue, maxValue;
+      Orthanc::ImageProcessing::GetMinMaxIntegerValue(minValue, maxValue, *frame);
+
+      double windowCenter, windowWidth;
+
+      if (!LookupFirstDouble(windowCenter, m, Orthanc::DICOM_TAG_WINDOW_CENTER) ||
+          !LookupFirstDouble(windowWidth, m, Orthanc::DICOM_TAG_WINDOW_WIDTH) ||
+          windowWidth <= 0)
+      {
+        // No window in the DICOM tags: Use the full dynamic range of the frame
+        const double a = rescaleSlope * static_cast<double>(minValue) + rescaleIntercept;
+        const double b = rescaleSlope * static_cast<double>(maxValue) + rescaleIntercept;
+        windowCenter = (a + b) / 2.0;
+        windowWidth = std::max(1.0, std::abs(b - a));
+      }
+
+      std::unique_ptr<Orthanc::ImageAccessor> padded(new Orthanc::Image(frame->GetFormat(), paddedWidth, paddedHeight, false));
+
+      if (paddedWidth != frame->GetWidth() ||
+          paddedHeight != frame->GetHeight())
+      {
+        // Pad with the sample of the frame that is rendered the darkest
+        const bool darkestIsMax = (invert != (rescaleSlope < 0));
+        Orthanc::ImageProcessing::Set(*padded, darkestIsMax ? maxValue : minValue);
+      }
+
+      {
+        Orthanc::ImageAccessor target;
+        padded->GetRegion(target, 0, 0, frame->GetWidth(), frame->GetHeight());
+        Orthanc::ImageProcessing::Copy(target, *frame);
+      }
+
+      std::unique_ptr<OnTheFlyPyramid> result(new OnTheFlyPyramid(padded.release(), tileWidth_, tileHeight_,
+                                                                  smooth_, tilesCompression_));
+      result->SetBackgroundColor(backgroundRed, backgroundGreen, backgroundBlue);
+      result->SetWindowing(rescaleSlope, rescaleIntercept, windowCenter, windowWidth, invert);
+
+      return result.release();
+    }
 
-      case OrthancPluginPixelFormat_Grayscale8:
-        sourceFormat = Orthanc::PixelFormat_Grayscale8;
-        targetFormat = Orthanc::PixelFormat_Grayscale8;
-        break;
 
-      case OrthancPluginPixelFormat_Grayscale16:
-        sourceFormat = Orthanc::PixelFormat_Grayscale16;
-        targetFormat = Orthanc::PixelFormat_Grayscale8;
+    Orthanc::PixelFormat targetFormat;
+    switch (frame->GetFormat())
+    {
+      case Orthanc::PixelFormat_RGB24:
+        targetFormat = Orthanc::PixelFormat_RGB24;
         break;
 
-      case OrthancPluginPixelFormat_SignedGrayscale16:
-        sourceFormat = Orthanc::PixelFormat_SignedGrayscale16;
+      case Orthanc::PixelFormat_Grayscale8:
         targetFormat = Orthanc::PixelFormat_Grayscale8;
         break;
 
@@ -187,16 +509,26 @@ namespace OrthancWSI
       Orthanc::ImageAccessor target;
       rendered->GetRegion(target, 0, 0, frame->GetWidth(), frame->GetHeight());
 
-      Orthanc::ImageAccessor source;
-      source.AssignReadOnly(sourceFormat, frame->GetWidth(), frame->GetHeight(), frame->GetPitch(), frame->GetBuffer());
-
-      Orthanc::ImageProcessing::RenderDefaultWindow(target, info, source);
+      Orthanc::ImageProcessing::RenderDefaultWindow(target, info, *frame);
     }
 
 
-    std::unique_ptr<DecodedTiledPyramid> result(new OnTheFlyPyramid(rendered.release(), tileWidth_, tileHeight_, smooth_));
+    std::unique_ptr<DecodedTiledPyramid> result(new OnTheFlyPyramid(rendered.release(), tileWidth_, tileHeight_,
+                                                                    smooth_, tilesCompression_));
     result->SetBackgroundColor(backgroundRed, backgroundGreen, backgroundBlue);
 
     return result.release();
   }
+
+
+  void OrthancPyramidFrameFetcher::NotifyEvicted(const std::string& instanceId,
+                                                 unsigned int frameNumber,
+                                                 const boost::shared_ptr<DecodedTiledPyramid>& pyramid)
+  {
+    boost::shared_ptr<const OnTheFlyPyramid> onTheFly = boost::dynamic_pointer_cast<const OnTheFlyPyramid>(pyramid);
+    if (onTheFly.get() != NULL)
+    {
+      FramePyramidFilesCache::GetInstance().ScheduleStore(instanceId, frameNumber, onTheFly);
+    }
+  }
 }
@@ -26,6 +26,8 @@
 #include "../Framework/Inputs/DecodedPyramidCache.h"
 #include "../Resources/Orthanc/Stone/IOrthancConnection.h"
 
+#include <DicomFormat/DicomImageInformation.h>
+
 
 namespace OrthancWSI
 {
@@ -41,6 +43,16 @@ namespace OrthancWSI
     uint8_t                                            defaultBackgroundRed_;
     uint8_t                                            defaultBackgroundGreen_;
     uint8_t                                            defaultBackgroundBlue_;
+    ImageCompression                                   tilesCompression_;
+
+    // Decodes the raw frame using the built-in decoders, returns NULL
+    // if the transfer syntax is not supported
+    Orthanc::ImageAccessor* DecodeRawFrame(const Orthanc::DicomImageInformation& info,
+                                           const std::string& instanceId,
+                                           unsigned int frameNumber);
+
+    static Orthanc::ImageAccessor* DecodeFrameWithOrthanc(const std::string& instanceId,
+                                                          unsigned int frameNumber);
 
   public:
     OrthancPyramidFrameFetcher(OrthancStone::IOrthancConnection* orthanc,
@@ -82,11 +94,25 @@ namespace OrthancWSI
       paddingY_ = paddingY;
     }
 
+    ImageCompression GetTilesCompression() const
+    {
+      return tilesCompression_;
+    }
+
+    // Compression of the tiles that are stored in the pyramids, which
+    // must be "None", "PNG" or "JPEG" (cf. "OnTheFlyPyramid")
+    void SetTilesCompression(ImageCompression compression);
+
     void SetDefaultBackgroundColor(uint8_t red,
                                    uint8_t green,
                                    uint8_t blue);
 
     DecodedTiledPyramid* Fetch(const std::string &instanceId,
                                unsigned frameNumber) ORTHANC_OVERRIDE;
+
+    // Schedules the spilling of the evicted pyramid to "FramePyramidFilesCache"
+    void NotifyEvicted(const std::string& instanceId,
+                       unsigned int frameNumber,
+                       const boost::shared_ptr<DecodedTiledPyramid>& pyramid) ORTHANC_OVERRIDE;
   };
 }
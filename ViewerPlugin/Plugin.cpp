@@ -24,9 +24,19 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 
 #include "OrthancPyramidFrameFetcher.h"
+#include "BackgroundTiles.h"
+#include "DicomInstanceCache.h"
 #include "DicomPyramidCache.h"
+#include "HttpCaching.h"
+#include "FramePyramidFilesCache.h"
+#include "InstanceFilesCache.h"
 #include "IIIF.h"
 #include "RawTile.h"
+#include "SeriesRegions.h"
+#include "SeriesTiles.h"
+#include "TileCache.h"
+#include "TilePrefetcher.h"
+#include "TranscodingScheduler.h"
 #include "../Framework/ColorSpaces.h"
 #include "../Framework/Inputs/DecodedTiledPyramid.h"
 #include "../Framework/Inputs/OnTheFlyPyramid.h"
@@ -38,13 +48,17 @@
 #include <Images/ImageProcessing.h>
 #include <Logging.h>
 #include <OrthancException.h>
+#include <SerializationToolbox.h>
 #include <SystemToolbox.h>
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <EmbeddedResources.h>
 
+#include <algorithm>
+#include <boost/math/special_functions/fpclassify.hpp>
 #include <cassert>
+#include <cmath>
 #include <Images/PngReader.h>
 
 #include "OrthancPluginConnection.h"
@@ -114,25 +128,31 @@ void ServePyramid(OrthancPluginRestOutput* output,
 
   LOG(INFO) << "Accessing whole-slide pyramid of series " << seriesId;
 
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeSeriesETag(seriesId, url)))
+  {
+    return;
+  }
+
   Json::Value answer;
   answer["ID"] = seriesId;
 
   {
-    OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-    DescribePyramid(answer, locker.GetPyramid());
+    OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+    DescribePyramid(answer, accessor.GetPyramid());
 
     {
       // New in WSI 2.1
       char tmp[16];
-      sprintf(tmp, "#%02x%02x%02x", locker.GetPyramid().GetBackgroundRed(),
-              locker.GetPyramid().GetBackgroundGreen(),
-              locker.GetPyramid().GetBackgroundBlue());
+      sprintf(tmp, "#%02x%02x%02x", accessor.GetPyramid().GetBackgroundRed(),
+              accessor.GetPyramid().GetBackgroundGreen(),
+              accessor.GetPyramid().GetBackgroundBlue());
       answer["BackgroundColor"] = tmp;
     }
 
     // New in WSI 3.1
     double imagedVolumeWidth, imagedVolumeHeight;
-    if (locker.GetPyramid().LookupImagedVolumeSize(imagedVolumeWidth, imagedVolumeHeight))
+    if (accessor.GetPyramid().LookupImagedVolumeSize(imagedVolumeWidth, imagedVolumeHeight))
     {
       answer["ImagedVolumeWidth"] = imagedVolumeWidth;
       answer["ImagedVolumeHeight"] = imagedVolumeHeight;
@@ -158,6 +178,12 @@ void ServeFramePyramid(OrthancPluginRestOutput* output,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
 
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeInstanceETag(instanceId, url)))
+  {
+    return;
+  }
+
   Json::Value answer;
   answer["ID"] = instanceId;
   answer["FrameNumber"] = frameNumber;
@@ -174,6 +200,16 @@ void ServeFramePyramid(OrthancPluginRestOutput* output,
       sprintf(tmp, "#%02x%02x%02x", red, green, blue);
       answer["BackgroundColor"] = tmp;
     }
+
+    // Default window of the 16bpp grayscale frames, which can be
+    // overridden by the GET arguments of "/wsi/frames-tiles/"
+    const OrthancWSI::OnTheFlyPyramid* onTheFly = dynamic_cast<const OrthancWSI::OnTheFlyPyramid*>(&accessor.GetPyramid());
+    if (onTheFly != NULL &&
+        onTheFly->HasWindowing())
+    {
+      answer["WindowCenter"] = onTheFly->GetDefaultWindowCenter();
+      answer["WindowWidth"] = onTheFly->GetDefaultWindowWidth();
+    }
   }
 
   std::string s = answer.toStyledString();
@@ -181,9 +217,51 @@ void ServeFramePyramid(OrthancPluginRestOutput* output,
 }
 
 
+static bool ParseTileEncoding(Orthanc::MimeType& target,
+                              const std::string& s)
+{
+  if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Png))
+  {
+    target = Orthanc::MimeType_Png;
+    return true;
+  }
+  else if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg))
+  {
+    target = Orthanc::MimeType_Jpeg;
+    return true;
+  }
+  else if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg2000))
+  {
+    target = Orthanc::MimeType_Jpeg2000;
+    return true;
+  }
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+  else if (s == Orthanc::EnumerationToString(Orthanc::MimeType_WebP))
+  {
+    target = Orthanc::MimeType_WebP;
+    return true;
+  }
+#endif
+  else
+  {
+    return false;
+  }
+}
+
+
+/**
+ * Returns "true" iff the "Accept" HTTP header forces the encoding of
+ * the tiles. Otherwise, "lossless" is set to the encoding to be used
+ * for the tiles that must be transcoded without loss: Web browsers
+ * advertise WebP together with wildcards, in which case WebP replaces
+ * PNG, but JPEG tiles are still served as such.
+ **/
 static bool LookupAcceptHeader(Orthanc::MimeType& target,
+                               Orthanc::MimeType& lossless,
                                const OrthancPluginHttpRequest* request)
 {
+  lossless = Orthanc::MimeType_Png;
+
   // Lookup whether a "Accept" HTTP header is present, to overwrite
   // the default MIME type
   for (uint32_t i = 0; i < request->headersCount; i++)
@@ -196,26 +274,28 @@ static bool LookupAcceptHeader(Orthanc::MimeType& target,
       std::vector<std::string> tokens;
       Orthanc::Toolbox::TokenizeString(tokens, request->headersValues[i], ',');
 
+      bool found = false;
       bool compatible = false;
+      bool hasWebP = false;
 
       for (size_t j = 0; j < tokens.size(); j++)
       {
-        std::string s = Orthanc::Toolbox::StripSpaces(tokens[j]);
+        // Ignore the parameters, such as the "q" quality factor
+        std::string s = Orthanc::Toolbox::StripSpaces(tokens[j].substr(0, tokens[j].find(';')));
 
-        if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Png))
-        {
-          target = Orthanc::MimeType_Png;
-          return true;
-        }
-        else if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg))
-        {
-          target = Orthanc::MimeType_Jpeg;
-          return true;
-        }
-        else if (s == Orthanc::EnumerationToString(Orthanc::MimeType_Jpeg2000))
+        Orthanc::MimeType mime;
+        if (ParseTileEncoding(mime, s))
         {
-          target = Orthanc::MimeType_Jpeg2000;
-          return true;
+          if (!found)
+          {
+            target = mime;
+            found = true;
+          }
+
+          if (mime == Orthanc::MimeType_WebP)
+          {
+            hasWebP = true;
+          }
         }
         else if (s == "*/*" ||
                  s == "image/*")
@@ -224,7 +304,17 @@ static bool LookupAcceptHeader(Orthanc::MimeType& target,
         }
       }
 
-      if (!compatible)
+      if (hasWebP)
+      {
+        lossless = Orthanc::MimeType_WebP;
+      }
+
+      if (found &&
+          (target != Orthanc::MimeType_WebP || !compatible))
+      {
+        return true;
+      }
+      else if (!compatible)
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_NotAcceptable);
       }
@@ -253,50 +343,308 @@ void ServeTile(OrthancPluginRestOutput* output,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
 
-  // Retrieve the raw tile from the WSI pyramid
-  std::unique_ptr<OrthancWSI::RawTile> rawTile;
+  Orthanc::MimeType accept, lossless;
+  const bool hasAccept = LookupAcceptHeader(accept, lossless, request);
 
+  if (!hasAccept)
   {
-    // NB: Don't call "rawTile" while the Locker is around, as
-    // "Answer()" can be a costly operation.
-    OrthancWSI::DicomPyramidCache::Locker locker(seriesId);
-
-    rawTile.reset(new OrthancWSI::RawTile(locker.GetPyramid(),
-                                          static_cast<unsigned int>(level),
-                                          static_cast<unsigned int>(tileX),
-                                          static_cast<unsigned int>(tileY)));
+    // Encoding of the tiles that are not already JPEG
+    accept = lossless;
   }
 
-  if (rawTile->IsEmpty())
+  OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, "Vary", "Accept");
+
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeSeriesETag(
+          seriesId, std::string(url) + "|" + OrthancWSI::SeriesTiles::GetEncodingFormat(hasAccept, accept))))
   {
-    OrthancWSI::RawTile::AnswerBackgroundTile(output, rawTile->GetTileWidth(), rawTile->GetTileHeight());
     return;
   }
 
+  std::string encoded;
   Orthanc::MimeType mime;
+  unsigned int tileWidth, tileHeight;
+
+  const bool isEmpty = !OrthancWSI::SeriesTiles::LoadEncodedTile(
+    encoded, mime, tileWidth, tileHeight, seriesId, static_cast<unsigned int>(level),
+    static_cast<unsigned int>(tileX), static_cast<unsigned int>(tileY), hasAccept, accept,
+    OrthancWSI::TranscodingPriority_Interactive);
+
+  if (isEmpty)
+  {
+    // Empty tiles are not cached, so the pyramid is still in the cache of pyramids.
+    // No prefetching here, as the region around an empty tile of a sparse pyramid
+    // is most likely empty as well, and it would open the pyramid once more.
+    OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+    const OrthancWSI::DicomPyramid& pyramid = accessor.GetPyramid();
+
+    OrthancWSI::BackgroundTiles::Answer(output, tileWidth, tileHeight, pyramid.GetBackgroundRed(),
+                                        pyramid.GetBackgroundGreen(), pyramid.GetBackgroundBlue(), accept);
+  }
+  else
+  {
+    // Load the tiles that are likely to be requested next by the
+    // viewer, in the background
+    OrthancWSI::TilePrefetcher::GetInstance().ScheduleNeighbourhood(
+      seriesId, static_cast<unsigned int>(level), static_cast<unsigned int>(tileX),
+      static_cast<unsigned int>(tileY), hasAccept, accept);
+
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
+                              encoded.size(), Orthanc::EnumerationToString(mime));
+  }
+}
+
+
+static const size_t MAX_TILES_PER_BATCH = 256;
+
+void ServeTilesBatch(OrthancPluginRestOutput* output,
+                     const char* url,
+                     const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
+
+  std::string seriesId(request->groups[0]);
+
+  /**
+   * The body is formatted as follows, where "Encoding" is optional
+   * and plays the same role as the "Accept" HTTP header of the
+   * individual tiles:
+   *
+   * { "Tiles" : [ [ level, x, y ], ... ], "Encoding" : "image/png" }
+   **/
+
+  Json::Value body;
+  if (!Orthanc::Toolbox::ReadJson(body, request->body, request->bodySize) ||
+      body.type() != Json::objectValue ||
+      !body.isMember("Tiles") ||
+      body["Tiles"].type() != Json::arrayValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "The body must contain a \"Tiles\" array");
+  }
+
+  Orthanc::MimeType accept = Orthanc::MimeType_Png;
+  bool hasAccept = false;
+
+  if (body.isMember("Encoding"))
+  {
+    if (body["Encoding"].type() != Json::stringValue ||
+        !ParseTileEncoding(accept, body["Encoding"].asString()))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotAcceptable);
+    }
+
+    hasAccept = true;
+  }
+
+  const Json::Value& tiles = body["Tiles"];
+
+  if (tiles.size() > MAX_TILES_PER_BATCH)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "Too many tiles in the batch, the maximum is " +
+                                    boost::lexical_cast<std::string>(MAX_TILES_PER_BATCH));
+  }
+
+  LOG(INFO) << "Accessing a batch of " << tiles.size() << " tiles in series " << seriesId;
+
+  OrthancWSI::SeriesTiles::Batch batch(seriesId, hasAccept, accept);
+
+  for (Json::Value::ArrayIndex i = 0; i < tiles.size(); i++)
+  {
+    const Json::Value& tile = tiles[i];
+
+    if (tile.type() != Json::arrayValue ||
+        tile.size() != 3 ||
+        !tile[0].isUInt() ||
+        !tile[1].isUInt() ||
+        !tile[2].isUInt())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Each tile must be an array [ level, x, y ]");
+    }
+
+    batch.AddTile(tile[0].asUInt(), tile[1].asUInt(), tile[2].asUInt());
+  }
+
+  batch.Load();
+
+  /**
+   * The tiles are sent in the order of the request, as a multipart
+   * answer. The "Content-Location" header of each part identifies
+   * its tile using the same path as in "/wsi/tiles/". A tile that
+   * cannot be loaded is sent as an "application/json" part that
+   * describes its error, using the same fields as the REST API of
+   * Orthanc.
+   **/
+
+  if (OrthancPluginStartMultipartAnswer(context, output, "mixed", "application/octet-stream") != OrthancPluginErrorCode_Success)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+
+  for (size_t i = 0; i < batch.GetSize(); i++)
+  {
+    const std::string location = ("/wsi/tiles/" + seriesId + "/" +
+                                  boost::lexical_cast<std::string>(batch.GetLevel(i)) + "/" +
+                                  boost::lexical_cast<std::string>(batch.GetTileX(i)) + "/" +
+                                  boost::lexical_cast<std::string>(batch.GetTileY(i)));
+
+    const char* keys[] = { "Content-Type", "Content-Location" };
+    const char* values[] = { NULL, location.c_str() };
+
+    std::string error;
+
+    if (batch.IsSuccess(i))
+    {
+      values[0] = Orthanc::EnumerationToString(batch.GetMimeType(i));
+    }
+    else
+    {
+      Json::Value json = Json::objectValue;
+      json["HttpError"] = Orthanc::EnumerationToString(batch.GetHttpStatus(i));
+      json["HttpStatus"] = static_cast<int>(batch.GetHttpStatus(i));
+      json["Message"] = batch.GetErrorMessage(i);
+      json["OrthancError"] = Orthanc::EnumerationToString(batch.GetErrorCode(i));
+      json["OrthancStatus"] = static_cast<int>(batch.GetErrorCode(i));
+
+      error = json.toStyledString();
+      values[0] = Orthanc::EnumerationToString(Orthanc::MimeType_Json);
+    }
+
+    const std::string& content = (batch.IsSuccess(i) ? batch.GetEncoded(i) : error);
+
+    if (OrthancPluginSendMultipartItem2(context, output, content.empty() ? NULL : content.c_str(),
+                                        content.size(), 2, keys, values) != OrthancPluginErrorCode_Success)
+    {
+      // The connection was probably closed by the client
+      return;
+    }
+  }
+}
+
+
+static bool LookupGetArgument(std::string& value,
+                              const OrthancPluginHttpRequest* request,
+                              const std::string& key)
+{
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    if (key == request->getKeys[i])
+    {
+      value = request->getValues[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static unsigned int GetUnsignedIntegerArgument(const OrthancPluginHttpRequest* request,
+                                               const std::string& key)
+{
+  std::string s;
+  uint32_t value;
 
-  if (rawTile->GetCompression() == OrthancWSI::ImageCompression_Jpeg)
+  if (!LookupGetArgument(s, request, key) ||
+      !Orthanc::SerializationToolbox::ParseUnsignedInteger32(value, s))
   {
-    // The tile is already a JPEG image. In such a case, we can
-    // serve it as such, because any Web browser can handle JPEG.
-    mime = Orthanc::MimeType_Jpeg;
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "Missing or bad GET argument: " + key);
   }
   else
   {
-    // This is a lossless frame (coming from JPEG2000 or uncompressed
-    // DICOM instance), not a DICOM-JPEG instance. Decompress the raw
-    // tile, then transcode it to PNG to prevent lossy compression and
-    // to avoid JPEG2000 that is not supported by all the browsers.
-    mime = Orthanc::MimeType_Png;
+    return value;
+  }
+}
+
+
+void ServeRegion(OrthancPluginRestOutput* output,
+                 const char* url,
+                 const OrthancPluginHttpRequest* request)
+{
+  const std::string seriesId(request->groups[0]);
+
+  /**
+   * The region is expressed in the pixels of the finest level of the
+   * pyramid, and is downsampled by the optional "scale" factor, which
+   * must lie in ]0,1]. The "format" argument is either a MIME type,
+   * or one of "jpeg" (default), "png" and "webp".
+   **/
+  const unsigned int x = GetUnsignedIntegerArgument(request, "x");
+  const unsigned int y = GetUnsignedIntegerArgument(request, "y");
+  const unsigned int width = GetUnsignedIntegerArgument(request, "w");
+  const unsigned int height = GetUnsignedIntegerArgument(request, "h");
+
+  double scale = 1;
+
+  std::string s;
+  if (LookupGetArgument(s, request, "scale") &&
+      (!Orthanc::SerializationToolbox::ParseDouble(scale, s) ||
+       scale <= 0 ||
+       scale > 1))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest, "The scale must lie in ]0,1], found: " + s);
+  }
+
+  Orthanc::MimeType mime = Orthanc::MimeType_Jpeg;
+
+  if (LookupGetArgument(s, request, "format"))
+  {
+    if (s == "jpeg" || s == "jpg")
+    {
+      mime = Orthanc::MimeType_Jpeg;
+    }
+    else if (s == "png")
+    {
+      mime = Orthanc::MimeType_Png;
+    }
+#if ORTHANC_WSI_ENABLE_WEBP == 1
+    else if (s == "webp")
+    {
+      mime = Orthanc::MimeType_WebP;
+    }
+#endif
+    else if (!ParseTileEncoding(mime, s))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotAcceptable, "Unsupported format: " + s);
+    }
+  }
+
+  const unsigned int targetWidth = static_cast<unsigned int>(std::max(1.0, std::floor(static_cast<double>(width) * scale + 0.5)));
+  const unsigned int targetHeight = static_cast<unsigned int>(std::max(1.0, std::floor(static_cast<double>(height) * scale + 0.5)));
+
+  LOG(INFO) << "Rendering region (" << x << "," << y << "," << width << "," << height << ") of series "
+            << seriesId << " as a " << targetWidth << "x" << targetHeight << " image";
+
+  // The GET arguments are not part of "url", so they are normalized into the ETag
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeSeriesETag(
+          seriesId, (std::string(url) + "|" + boost::lexical_cast<std::string>(x) + "," +
+                     boost::lexical_cast<std::string>(y) + "," + boost::lexical_cast<std::string>(width) + "," +
+                     boost::lexical_cast<std::string>(height) + "|" + boost::lexical_cast<std::string>(targetWidth) + "x" +
+                     boost::lexical_cast<std::string>(targetHeight) + "|" + Orthanc::EnumerationToString(mime)))))
+  {
+    return;
   }
 
-  Orthanc::MimeType accept;
-  if (LookupAcceptHeader(accept, request))
+  std::unique_ptr<Orthanc::ImageAccessor> rendered;
+
   {
-    mime = accept;
+    // The accessor keeps the pyramid alive until all the tiles are loaded
+    OrthancWSI::DicomPyramidCache::Accessor accessor(seriesId);
+    rendered.reset(OrthancWSI::SeriesRegions::Render(accessor.GetPyramid(), seriesId, x, y, width, height,
+                                                     targetWidth, targetHeight, OrthancWSI::TranscodingPriority_Region));
   }
 
-  rawTile->Answer(output, mime);
+  std::string encoded;
+  OrthancWSI::RawTile::Encode(encoded, *rendered, mime, OrthancWSI::TranscodingPriority_Region);
+
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
+                            encoded.size(), Orthanc::EnumerationToString(mime));
 }
 
 
@@ -320,6 +668,74 @@ void ServeFrameTile(OrthancPluginRestOutput* output,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
 
+  /**
+   * The optional "window-center" and "window-width" arguments apply
+   * a window to the frames with 16bpp grayscale samples, which are
+   * otherwise rendered with their default window. They are ignored
+   * for the other frames.
+   **/
+  bool hasWindow = false;
+  double windowCenter = 0;
+  double windowWidth = 0;
+
+  {
+    std::string center, width;
+    const bool hasCenter = LookupGetArgument(center, request, "window-center");
+    const bool hasWidth = LookupGetArgument(width, request, "window-width");
+
+    if (hasCenter || hasWidth)
+    {
+      if (!hasCenter ||
+          !hasWidth ||
+          !Orthanc::SerializationToolbox::ParseDouble(windowCenter, center) ||
+          !Orthanc::SerializationToolbox::ParseDouble(windowWidth, width) ||
+          !boost::math::isfinite(windowCenter) ||   // "ParseDouble()" accepts "nan" and "inf"
+          !boost::math::isfinite(windowWidth) ||
+          windowWidth <= 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest,
+                                        "The \"window-center\" and \"window-width\" arguments must be "
+                                        "provided together as finite numbers, and the width must be positive");
+      }
+
+      hasWindow = true;
+    }
+  }
+
+  Orthanc::MimeType mime, lossless;
+  if (!LookupAcceptHeader(mime, lossless, request))
+  {
+    mime = lossless;  // By default, use lossless compression
+  }
+
+  // The GET arguments are not part of "url", so the window is
+  // normalized into the ETag and into the key of the cached tile
+  std::string variant = Orthanc::EnumerationToString(mime);
+  if (hasWindow)
+  {
+    variant += "|" + boost::lexical_cast<std::string>(windowCenter) + "," + boost::lexical_cast<std::string>(windowWidth);
+  }
+
+  OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, "Vary", "Accept");
+
+  if (OrthancWSI::HttpCaching::HandleConditionalRequest(
+        output, request, OrthancWSI::HttpCaching::ComputeInstanceETag(instanceId, std::string(url) + "|" + variant)))
+  {
+    return;
+  }
+
+  OrthancWSI::TileCache::Accessor cached(
+    OrthancWSI::TileCache::GetEncodedTiles(),
+    OrthancWSI::TileCache::FormatFrameTileKey(instanceId, frameNumber, level, tileX, tileY, variant));
+
+  if (cached.IsHit())
+  {
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, cached.GetContent().c_str(),
+                              cached.GetContent().size(), Orthanc::EnumerationToString(mime));
+    return;
+  }
+
+  std::unique_ptr<OrthancWSI::RawTile> rawTile;
   std::unique_ptr<Orthanc::ImageAccessor> tile;
 
   {
@@ -329,24 +745,62 @@ void ServeFrameTile(OrthancPluginRestOutput* output,
       throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
 
-    bool isEmpty;  // Ignored
-    tile.reset(accessor.GetPyramid().DecodeTile(isEmpty, level, tileX, tileY));
-  }
+    OrthancWSI::OnTheFlyPyramid* onTheFly = dynamic_cast<OrthancWSI::OnTheFlyPyramid*>(&accessor.GetPyramid());
 
-  Orthanc::MimeType mime;
-  if (!LookupAcceptHeader(mime, request))
-  {
-    mime = Orthanc::MimeType_Png;  // By default, use lossless compression
+    if (hasWindow &&
+        onTheFly != NULL &&
+        onTheFly->HasWindowing())
+    {
+      bool isEmpty;  // Ignored
+      tile.reset(onTheFly->DecodeWindowedTile(isEmpty, level, tileX, tileY, windowCenter, windowWidth));
+    }
+    else
+    {
+      // The pyramids whose tiles are stored compressed give access to
+      // them, which avoids their decoding if the encoding matches
+      rawTile.reset(new OrthancWSI::RawTile(accessor.GetPyramid(), level, tileX, tileY));
+
+      if (rawTile->IsEmpty())
+      {
+        rawTile.reset(NULL);
+
+        bool isEmpty;  // Ignored
+        tile.reset(accessor.GetPyramid().DecodeTile(isEmpty, level, tileX, tileY));
+      }
+    }
   }
 
   std::string encoded;
-  OrthancWSI::ImageToolbox::EncodeTile(encoded, *tile, OrthancWSI::ImageToolbox::Convert(mime), 90 /* only used for JPEG */);
+
+  if (rawTile.get() != NULL)
+  {
+    rawTile->Transcode(encoded, mime, OrthancWSI::TranscodingPriority_Interactive);
+  }
+  else
+  {
+    OrthancWSI::TranscodingScheduler::Locker locker(OrthancWSI::TranscodingScheduler::GetInstance(),
+                                                    OrthancWSI::TranscodingPriority_Interactive);
+    OrthancWSI::ImageToolbox::EncodeTile(encoded, *tile, OrthancWSI::ImageToolbox::Convert(mime),
+                                         mime == Orthanc::MimeType_WebP ? 100 /* lossless WebP */ : 90 /* only used for JPEG */);
+  }
+  cached.Store(encoded, OrthancWSI::ImageToolbox::Convert(mime));
 
   OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, encoded.c_str(),
                             encoded.size(), Orthanc::EnumerationToString(mime));
 }
 
 
+static void InvalidateSeries(const std::string& seriesId)
+{
+  OrthancWSI::DicomPyramidCache::GetInstance().Invalidate(seriesId);
+  OrthancWSI::HttpCaching::InvalidateSeries(seriesId);
+  OrthancWSI::TileCache::GetEncodedTiles().InvalidatePrefix(OrthancWSI::TileCache::GetSeriesPrefix(seriesId));
+  OrthancWSI::TileCache::GetRawTiles().InvalidatePrefix(OrthancWSI::TileCache::GetSeriesPrefix(seriesId));
+  OrthancWSI::TileCache::GetFullImages().InvalidatePrefix(OrthancWSI::TileCache::GetSeriesPrefix(seriesId));
+  InvalidateIIIFResource(seriesId);
+}
+
+
 OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
                                         OrthancPluginResourceType resourceType, 
                                         const char *resourceId)
@@ -355,13 +809,79 @@ OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
       changeType == OrthancPluginChangeType_NewChildInstance)
   {
     LOG(INFO) << "New instance has been added to series " << resourceId << ", invalidating it";
-    OrthancWSI::DicomPyramidCache::GetInstance().Invalidate(resourceId);
+    InvalidateSeries(resourceId);
+  }
+  else if (resourceType == OrthancPluginResourceType_Series &&
+           changeType == OrthancPluginChangeType_Deleted)
+  {
+    // The cached tiles are served without opening the pyramid, so they must be dropped
+    LOG(INFO) << "Series " << resourceId << " has been deleted, invalidating it";
+    InvalidateSeries(resourceId);
+  }
+  else if (resourceType == OrthancPluginResourceType_Instance &&
+           changeType == OrthancPluginChangeType_Deleted)
+  {
+    OrthancWSI::HttpCaching::InvalidateInstance(resourceId);
+    OrthancWSI::DicomInstanceCache::GetInstance().Invalidate(resourceId);
+    OrthancWSI::InstanceFilesCache::GetInstance().Invalidate(resourceId);
+    OrthancWSI::DecodedPyramidCache::GetInstance().Invalidate(resourceId);
+    OrthancWSI::FramePyramidFilesCache::GetInstance().Invalidate(resourceId);
+    OrthancWSI::TileCache::GetEncodedTiles().InvalidatePrefix(OrthancWSI::TileCache::GetInstancePrefix(resourceId));
+    OrthancWSI::TileCache::GetFullImages().InvalidatePrefix(OrthancWSI::TileCache::GetInstancePrefix(resourceId));
+    InvalidateIIIFResource(resourceId);
+
+    // The series that contains this instance is invalidated, even if its
+    // pyramid is not cached anymore. Its pyramid is rebuilt on the next
+    // access, and its persisted index is discarded, as it doesn't match
+    // the fingerprint of the remaining instances anymore.
+    std::set<std::string> series;
+    OrthancWSI::DicomPyramidCache::GetInstance().InvalidateInstance(series, resourceId);
+
+    for (std::set<std::string>::const_iterator it = series.begin(); it != series.end(); ++it)
+    {
+      LOG(INFO) << "Instance " << resourceId << " has been deleted from series " << *it << ", invalidating it";
+      InvalidateSeries(*it);
+    }
   }
 
   return OrthancPluginErrorCode_Success;
 }
 
 
+#if HAS_ORTHANC_PLUGIN_METRICS == 1
+void RefreshMetrics()
+{
+  try
+  {
+    size_t count, memoryUsage;
+    uint64_t hits, misses, evictions;
+    OrthancWSI::DicomPyramidCache::GetInstance().GetStatistics(count, memoryUsage, hits, misses, evictions);
+
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_pyramids_cache_count", static_cast<float>(count));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_pyramids_cache_size_mb", static_cast<float>(memoryUsage) / (1024.0f * 1024.0f));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_pyramids_cache_hits", static_cast<float>(hits));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_pyramids_cache_misses", static_cast<float>(misses));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_pyramids_cache_evictions", static_cast<float>(evictions));
+
+    unsigned int running;
+    size_t waitingInteractive, waitingRegion, waitingPrefetch;
+    uint64_t dropped;
+    OrthancWSI::TranscodingScheduler::GetInstance().GetStatistics(running, waitingInteractive, waitingRegion, waitingPrefetch, dropped);
+
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_transcoding_running", static_cast<float>(running));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_transcoding_waiting_interactive", static_cast<float>(waitingInteractive));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_transcoding_waiting_region", static_cast<float>(waitingRegion));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_transcoding_waiting_prefetch", static_cast<float>(waitingPrefetch));
+    OrthancPlugins::SetMetricsValue("orthanc_wsi_transcoding_dropped_prefetch", static_cast<float>(dropped));
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << "Cannot refresh the metrics of the whole-slide imaging plugin: " << e.What();
+  }
+}
+#endif
+
+
 void ServeJavaScriptLibraries(OrthancPluginRestOutput* output,
                               const char* url,
                               const OrthancPluginHttpRequest* request)
@@ -551,15 +1071,14 @@ extern "C"
     // hardware threads (e.g. number of CPUs or cores or
     // hyperthreading units)
     unsigned int threads = Orthanc::SystemToolbox::GetHardwareConcurrency();
-    OrthancWSI::RawTile::InitializeTranscoderSemaphore(threads);
+    OrthancWSI::TranscodingScheduler::InitializeInstance(threads, 1000 /* drop prefetching that waits for more than 1 second */);
+    OrthancWSI::SeriesTiles::InitializeProcessor(threads);
+    OrthancWSI::DicomPyramid::InitializeLoadingProcessor();
 
     LOG(WARNING) << "The whole-slide imaging plugin will use at most " << threads << " threads to transcode the tiles";
 
     OrthancPlugins::SetDescription(ORTHANC_PLUGIN_NAME, "Provides a Web viewer of whole-slide microscopic images within Orthanc.");
 
-    OrthancWSI::DicomPyramidCache::InitializeInstance(10 /* Number of pyramids to be cached - TODO parameter */,
-                                                      true /* Use the metadata cache - Should be "false" only during development */);
-
     {
       std::unique_ptr<OrthancWSI::OrthancPyramidFrameFetcher> fetcher(
         new OrthancWSI::OrthancPyramidFrameFetcher(new OrthancWSI::OrthancPluginConnection(), false /* smooth - TODO PARAMETER */));
@@ -567,13 +1086,129 @@ extern "C"
       fetcher->SetPaddingY(64);  // TODO PARAMETER
       fetcher->SetDefaultBackgroundColor(255, 255, 255);  // TODO PARAMETER
 
+      OrthancPlugins::OrthancConfiguration mainConfiguration;
+
+      OrthancPlugins::OrthancConfiguration wsiConfiguration;
+      mainConfiguration.GetSection(wsiConfiguration, "WholeSlideImaging");
+
+      // Compression of the tiles of the pyramids of individual frames,
+      // while they are stored in memory: "None", "PNG" (lossless) or
+      // "JPEG" (quality 95). Compressed tiles fit more frames in the
+      // cache, at the price of their decoding on access.
+      const std::string framesCompression = wsiConfiguration.GetStringValue("FramesPyramidsCompression", "None");
+
+      if (framesCompression == "None")
+      {
+        fetcher->SetTilesCompression(OrthancWSI::ImageCompression_None);
+      }
+      else if (framesCompression == "PNG")
+      {
+        fetcher->SetTilesCompression(OrthancWSI::ImageCompression_Png);
+      }
+      else if (framesCompression == "JPEG")
+      {
+        fetcher->SetTilesCompression(OrthancWSI::ImageCompression_Jpeg);
+      }
+      else
+      {
+        LOG(ERROR) << "Bad value for option \"FramesPyramidsCompression\" (must be \"None\", \"PNG\" or \"JPEG\"): "
+                   << framesCompression;
+        return -1;
+      }
+
+      // The compression of the stored tiles changes the content of
+      // the tiles of the frames, whose entity tags must differ
+      OrthancWSI::HttpCaching::Initialize("FramesPyramidsCompression=" + framesCompression);
+
+      // Optional local directory where the pyramids of individual
+      // frames are spilled once evicted from the memory, expressed in MB
+      const std::string framesCacheDirectory = wsiConfiguration.GetStringValue("FramesPyramidsCacheDirectory", "");
+      const unsigned int framesCacheDiskSize = wsiConfiguration.GetUnsignedIntegerValue("FramesPyramidsCacheDiskSize", 1024);
+
+      OrthancWSI::FramePyramidFilesCache::InitializeInstance(framesCacheDirectory,
+                                                             static_cast<uint64_t>(framesCacheDiskSize) * 1024 * 1024);
+
       OrthancWSI::DecodedPyramidCache::InitializeInstance(fetcher.release(),
                                                           10 /* TODO - PARAMETER */,
                                                           256 * 1024 * 1024 /* TODO - PARAMETER */);
     }
 
+    {
+      OrthancPlugins::OrthancConfiguration mainConfiguration;
+
+      OrthancPlugins::OrthancConfiguration wsiConfiguration;
+      mainConfiguration.GetSection(wsiConfiguration, "WholeSlideImaging");
+
+      // Maximum number of pyramids to be cached, and memory budget of
+      // the cache of pyramids, expressed in MB ("0" for no memory limit)
+      const unsigned int pyramidsCacheCount = wsiConfiguration.GetUnsignedIntegerValue("PyramidsCacheCount", 100);
+      const unsigned int pyramidsCacheSize = wsiConfiguration.GetUnsignedIntegerValue("PyramidsCacheSize", 128);
+
+      // Whether to generate the upper levels that are missing in
+      // incomplete pyramids, by downsampling the coarsest level
+      const bool synthesizeLevels = wsiConfiguration.GetBooleanValue("SynthesizeMissingLevels", true);
+
+      OrthancWSI::DicomPyramidCache::InitializeInstance(std::max(1u, pyramidsCacheCount),
+                                                        static_cast<size_t>(pyramidsCacheSize) * 1024 * 1024,
+                                                        true /* Use the metadata cache - Should be "false" only during development */,
+                                                        synthesizeLevels);
+
+      LOG(WARNING) << "The whole-slide imaging plugin will cache at most " << pyramidsCacheCount
+                   << " pyramids within " << pyramidsCacheSize << "MB";
+
+      // Sizes of the caches of tiles, expressed in MB ("0" to disable the cache)
+      const unsigned int encodedTilesCacheSize = wsiConfiguration.GetUnsignedIntegerValue("TilesCacheSize", 128);
+      const unsigned int rawTilesCacheSize = wsiConfiguration.GetUnsignedIntegerValue("RawTilesCacheSize", 0);
+
+      // Size of the cache of the images served by the IIIF "full"
+      // requests, as used by the thumbnails of Mirador (in MB)
+      const unsigned int fullImagesCacheSize = wsiConfiguration.GetUnsignedIntegerValue("FullImagesCacheSize", 16);
+
+      OrthancWSI::TileCache::InitializeInstances(static_cast<size_t>(encodedTilesCacheSize) * 1024 * 1024,
+                                                 static_cast<size_t>(rawTilesCacheSize) * 1024 * 1024,
+                                                 static_cast<size_t>(fullImagesCacheSize) * 1024 * 1024);
+
+      // Size of the cache of parsed DICOM instances, expressed in MB
+      // ("0" to read the raw frames through the REST API). Disabled by
+      // default: Each cached instance holds a whole copy of its DICOM
+      // file, in addition to the storage cache of the Orthanc core,
+      // whereas it only saves the routing of the REST requests.
+      const unsigned int instancesCacheSize = wsiConfiguration.GetUnsignedIntegerValue("InstancesCacheSize", 0);
+
+      OrthancWSI::DicomInstanceCache::InitializeInstance(static_cast<size_t>(instancesCacheSize) * 1024 * 1024);
+
+      // Optional local directory where the DICOM files are stored
+      // together with the index of their frames, expressed in MB
+      const std::string instancesCacheDirectory = wsiConfiguration.GetStringValue("InstancesCacheDirectory", "");
+      const unsigned int instancesCacheDiskSize = wsiConfiguration.GetUnsignedIntegerValue("InstancesCacheDiskSize", 10240);
+
+      OrthancWSI::InstanceFilesCache::InitializeInstance(instancesCacheDirectory,
+                                                         static_cast<uint64_t>(instancesCacheDiskSize) * 1024 * 1024);
+
+      LOG(WARNING) << "The whole-slide imaging plugin will cache at most " << encodedTilesCacheSize
+                   << "MB of encoded tiles, " << rawTilesCacheSize << "MB of raw tiles, and "
+                   << instancesCacheSize << "MB of DICOM instances";
+
+      // Number of background threads that prefetch the neighbours of
+      // the served tiles ("0" to disable prefetching, which is of no
+      // use if the cache of encoded tiles is disabled)
+      unsigned int prefetchThreads = wsiConfiguration.GetUnsignedIntegerValue("PrefetchThreads", 2);
+      if (encodedTilesCacheSize == 0)
+      {
+        prefetchThreads = 0;
+      }
+
+      OrthancWSI::TilePrefetcher::InitializeInstance(prefetchThreads, 256 /* maximum number of pending jobs */);
+
+      LOG(WARNING) << "The whole-slide imaging plugin will use " << prefetchThreads << " threads to prefetch the tiles";
+    }
+
     OrthancPluginRegisterOnChangeCallback(OrthancPlugins::GetGlobalContext(), OnChangeCallback);
 
+#if HAS_ORTHANC_PLUGIN_METRICS == 1
+    OrthancPluginRegisterRefreshMetricsCallback(OrthancPlugins::GetGlobalContext(), RefreshMetrics);
+#endif
+
     OrthancPlugins::RegisterRestCallback<ServeJavaScriptLibraries>("/wsi/libs/(.*)", true);
 
 #if ORTHANC_STANDALONE == 1
@@ -586,6 +1221,8 @@ extern "C"
 
     OrthancPlugins::RegisterRestCallback<ServePyramid>("/wsi/pyramids/([0-9a-f-]+)", true);
     OrthancPlugins::RegisterRestCallback<ServeTile>("/wsi/tiles/([0-9a-f-]+)/([0-9-]+)/([0-9-]+)/([0-9-]+)", true);
+    OrthancPlugins::RegisterRestCallback<ServeTilesBatch>("/wsi/tiles/([0-9a-f-]+)/batch", true);
+    OrthancPlugins::RegisterRestCallback<ServeRegion>("/wsi/regions/([0-9a-f-]+)", true);
     OrthancPlugins::RegisterRestCallback<ServeFramePyramid>("/wsi/frames-pyramids/([0-9a-f-]+)/([0-9-]+)", true);
     OrthancPlugins::RegisterRestCallback<ServeFrameTile>("/wsi/frames-tiles/([0-9a-f-]+)/([0-9-]+)/([0-9-]+)/([0-9-]+)/([0-9-]+)", true);
 
@@ -671,9 +1308,17 @@ extern "C"
 
   ORTHANC_PLUGINS_API void OrthancPluginFinalize()
   {
+    OrthancWSI::TilePrefetcher::FinalizeInstance();
     OrthancWSI::DecodedPyramidCache::FinalizeInstance();
+    OrthancWSI::FramePyramidFilesCache::FinalizeInstance();
     OrthancWSI::DicomPyramidCache::FinalizeInstance();
-    OrthancWSI::RawTile::FinalizeTranscoderSemaphore();
+    OrthancWSI::DicomPyramid::FinalizeLoadingProcessor();
+    OrthancWSI::SeriesTiles::FinalizeProcessor();
+    OrthancWSI::TileCache::FinalizeInstances();
+    OrthancWSI::DicomInstanceCache::FinalizeInstance();
+    OrthancWSI::InstanceFilesCache::FinalizeInstance();
+    OrthancWSI::TranscodingScheduler::FinalizeInstance();
+    OrthancWSI::BackgroundTiles::Clear();
   }
 
 
@@ -24,21 +24,19 @@
 #include "../Framework/PrecompiledHeadersWSI.h"
 #include "RawTile.h"
 
+#include "TileCache.h"
 #include "../Framework/ImageToolbox.h"
 #include "../Framework/Jpeg2000Reader.h"
+#include "../Framework/JpegToolbox.h"
+#include "../Framework/ScaledJpegReader.h"
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
-#include <Images/ImageProcessing.h>
 #include <Images/JpegReader.h>
 #include <Images/PngReader.h>
-#include <Images/PngWriter.h>
-#include <MultiThreading/Semaphore.h>
 #include <OrthancException.h>
 
 
-static std::unique_ptr<Orthanc::Semaphore>  transcoderSemaphore_;
-
 namespace OrthancWSI
 {
   Orthanc::ImageAccessor* RawTile::DecodeInternal()
@@ -104,9 +102,16 @@ namespace OrthancWSI
 
   void RawTile::EncodeInternal(std::string& encoded,
                                const Orthanc::ImageAccessor& decoded,
-                               Orthanc::MimeType encoding)
+                               Orthanc::MimeType encoding,
+                               bool isLossless)
   {
-    ImageToolbox::EncodeTile(encoded, decoded, ImageToolbox::Convert(encoding), 90 /* only used for JPEG */);
+    /**
+     * The quality is only used for JPEG and WebP. Tiles that come
+     * from a lossless source are encoded as lossless WebP, which is
+     * smaller and faster to generate than PNG.
+     **/
+    const uint8_t quality = (encoding == Orthanc::MimeType_WebP && isLossless ? 100 : 90);
+    ImageToolbox::EncodeTile(encoded, decoded, ImageToolbox::Convert(encoding), quality);
   }
 
 
@@ -123,6 +128,37 @@ namespace OrthancWSI
   }
 
 
+  RawTile::RawTile(ITiledPyramid& pyramid,
+                   unsigned int level,
+                   unsigned int tileX,
+                   unsigned int tileY,
+                   const std::string& cacheKey) :
+    format_(pyramid.GetPixelFormat()),
+    tileWidth_(pyramid.GetTileWidth(level)),
+    tileHeight_(pyramid.GetTileHeight(level)),
+    photometric_(pyramid.GetPhotometricInterpretation())
+  {
+    TileCache::Accessor accessor(TileCache::GetRawTiles(), cacheKey);
+
+    if (accessor.IsHit())
+    {
+      isEmpty_ = false;
+      tile_ = accessor.GetContent();
+      compression_ = accessor.GetCompression();
+    }
+    else
+    {
+      isEmpty_ = !pyramid.ReadRawTile(tile_, compression_, level, tileX, tileY);
+
+      if (!isEmpty_)
+      {
+        // Empty tiles are not cached, as they imply no download
+        accessor.Store(tile_, compression_);
+      }
+    }
+  }
+
+
   ImageCompression RawTile::GetCompression() const
   {
     if (isEmpty_)
@@ -137,7 +173,8 @@ namespace OrthancWSI
 
 
   void RawTile::Answer(OrthancPluginRestOutput* output,
-                       Orthanc::MimeType encoding)
+                       Orthanc::MimeType encoding,
+                       TranscodingPriority priority)
   {
     if (isEmpty_)
     {
@@ -145,7 +182,8 @@ namespace OrthancWSI
     }
 
     if ((compression_ == ImageCompression_Jpeg && encoding == Orthanc::MimeType_Jpeg) ||
-        (compression_ == ImageCompression_Jpeg2000 && encoding == Orthanc::MimeType_Jpeg2000))
+        (compression_ == ImageCompression_Jpeg2000 && encoding == Orthanc::MimeType_Jpeg2000) ||
+        (compression_ == ImageCompression_Png && encoding == Orthanc::MimeType_Png))
     {
       // No transcoding is needed, the tile can be served as such
       OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, tile_.c_str(),
@@ -154,14 +192,7 @@ namespace OrthancWSI
     else
     {
       std::string transcoded;
-
-      {
-        // The semaphore is used to throttle the number of simultaneous computations
-        Orthanc::Semaphore::Locker locker(*transcoderSemaphore_);
-
-        std::unique_ptr<Orthanc::ImageAccessor> decoded(DecodeInternal());
-        EncodeInternal(transcoded, *decoded, encoding);
-      }
+      Transcode(transcoded, encoding, priority);
 
       OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, transcoded.c_str(),
                                 transcoded.size(), Orthanc::EnumerationToString(encoding));
@@ -169,72 +200,124 @@ namespace OrthancWSI
   }
 
 
-  Orthanc::ImageAccessor* RawTile::Decode()
+  void RawTile::Transcode(std::string& target,
+                          Orthanc::MimeType encoding,
+                          TranscodingPriority priority)
   {
     if (isEmpty_)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
 
-    Orthanc::Semaphore::Locker locker(*transcoderSemaphore_);
-    return DecodeInternal();
+    if ((compression_ == ImageCompression_Jpeg && encoding == Orthanc::MimeType_Jpeg) ||
+        (compression_ == ImageCompression_Jpeg2000 && encoding == Orthanc::MimeType_Jpeg2000) ||
+        (compression_ == ImageCompression_Png && encoding == Orthanc::MimeType_Png))
+    {
+      target = tile_;
+    }
+    else
+    {
+      // The scheduler is used to throttle the number of simultaneous computations
+      TranscodingScheduler::Locker locker(TranscodingScheduler::GetInstance(), priority);
+
+      std::unique_ptr<Orthanc::ImageAccessor> decoded(DecodeInternal());
+      EncodeInternal(target, *decoded, encoding, compression_ != ImageCompression_Jpeg);
+    }
   }
 
 
-  void RawTile::Encode(std::string& encoded,
-                       const Orthanc::ImageAccessor& decoded,
-                       Orthanc::MimeType encoding)
+  void RawTile::TranscodeCropped(std::string& target,
+                                 Orthanc::MimeType encoding,
+                                 unsigned int width,
+                                 unsigned int height,
+                                 TranscodingPriority priority)
   {
-    Orthanc::Semaphore::Locker locker(*transcoderSemaphore_);
-    EncodeInternal(encoded, decoded, encoding);
-  }
+    if (isEmpty_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
 
+    if (width > tileWidth_ ||
+        height > tileHeight_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
 
-  void RawTile::InitializeTranscoderSemaphore(unsigned int maxThreads)
-  {
-    transcoderSemaphore_.reset(new Orthanc::Semaphore(maxThreads));
-  }
+    if (width == tileWidth_ &&
+        height == tileHeight_)
+    {
+      Transcode(target, encoding, priority);
+      return;
+    }
 
+    TranscodingScheduler::Locker locker(TranscodingScheduler::GetInstance(), priority);
 
-  void RawTile::FinalizeTranscoderSemaphore()
-  {
-    transcoderSemaphore_.reset(NULL);
+    if (compression_ == ImageCompression_Jpeg &&
+        encoding == Orthanc::MimeType_Jpeg)
+    {
+      JpegToolbox::LosslessCrop(target, tile_, width, height);
+    }
+    else
+    {
+      std::unique_ptr<Orthanc::ImageAccessor> decoded(DecodeInternal());
+
+      Orthanc::ImageAccessor cropped;
+      decoded->GetRegion(cropped, 0, 0, width, height);
+      EncodeInternal(target, cropped, encoding, compression_ != ImageCompression_Jpeg);
+    }
   }
 
 
-  void RawTile::AnswerBackgroundTile(OrthancPluginRestOutput* output,
-                                     unsigned int tileWidth,
-                                     unsigned int tileHeight)
+  Orthanc::ImageAccessor* RawTile::Decode(TranscodingPriority priority)
   {
-    std::string answer;
-
+    if (isEmpty_)
     {
-      static boost::mutex mutex;
-      static std::string cachedTile;
-      static unsigned int cachedWidth = 0;
-      static unsigned int cachedHeight = 0;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
 
-      boost::mutex::scoped_lock lock(mutex);
+    TranscodingScheduler::Locker locker(TranscodingScheduler::GetInstance(), priority);
+    return DecodeInternal();
+  }
 
-      if (cachedTile.empty() ||
-          cachedWidth != tileWidth ||
-          cachedHeight != tileHeight)
-      {
-        Orthanc::Image tile(Orthanc::PixelFormat_RGBA32, tileWidth, tileHeight, false);
 
-        Orthanc::ImageProcessing::Set(tile, 255 /* red */, 255 /* green */,
-                                      255 /* blue */, 0 /* alpha - fully transparent */);
+  Orthanc::ImageAccessor* RawTile::DecodeReduced(unsigned int& reduction,
+                                                 unsigned int maxReduction,
+                                                 TranscodingPriority priority)
+  {
+    if (isEmpty_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    if (!ScaledJpegReader::IsSupportedScaleDenominator(maxReduction))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
 
-        Orthanc::PngWriter writer;
-        Orthanc::IImageWriter::WriteToMemory(writer, cachedTile, tile);
-        cachedWidth = tileWidth;
-        cachedHeight = tileHeight;
-      }
+    TranscodingScheduler::Locker locker(TranscodingScheduler::GetInstance(), priority);
 
-      answer = cachedTile;  // Make a private copy to avoid mutex on "OrthancPluginAnswerBuffer()"
+    if (compression_ == ImageCompression_Jpeg &&
+        maxReduction > 1)
+    {
+      std::unique_ptr<ScaledJpegReader> decoded(new ScaledJpegReader);
+      decoded->ReadFromMemory(tile_, maxReduction);
+      reduction = maxReduction;
+      return decoded.release();
     }
+    else
+    {
+      reduction = 1;
+      return DecodeInternal();
+    }
+  }
 
-    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, answer.c_str(),
-                              answer.size(), Orthanc::EnumerationToString(Orthanc::MimeType_Png));
+
+  void RawTile::Encode(std::string& encoded,
+                       const Orthanc::ImageAccessor& decoded,
+                       Orthanc::MimeType encoding,
+                       TranscodingPriority priority)
+  {
+    TranscodingScheduler::Locker locker(TranscodingScheduler::GetInstance(), priority);
+    EncodeInternal(encoded, decoded, encoding, false /* rendered images are served as lossy WebP */);
   }
 }
@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include "TranscodingScheduler.h"
 #include "../Framework/Enumerations.h"
 #include "../Framework/Inputs/ITiledPyramid.h"
 
@@ -46,7 +47,8 @@ namespace OrthancWSI
 
     static void EncodeInternal(std::string& encoded,
                                const Orthanc::ImageAccessor& decoded,
-                               Orthanc::MimeType encoding);
+                               Orthanc::MimeType encoding,
+                               bool isLossless);
 
   public:
     RawTile(ITiledPyramid& pyramid,
@@ -54,6 +56,14 @@ namespace OrthancWSI
             unsigned int tileX,
             unsigned int tileY);
 
+    // Same as above, but the raw tile is read through the raw-tiles
+    // cache, using the provided key
+    RawTile(ITiledPyramid& pyramid,
+            unsigned int level,
+            unsigned int tileX,
+            unsigned int tileY,
+            const std::string& cacheKey);
+
     bool IsEmpty() const
     {
       return isEmpty_;
@@ -71,23 +81,47 @@ namespace OrthancWSI
 
     ImageCompression GetCompression() const;
 
+    /**
+     * The decoding/encoding of tiles is throttled by the transcoding
+     * scheduler, according to the given priority.
+     **/
     void Answer(OrthancPluginRestOutput* output,
-                Orthanc::MimeType encoding);
-
-    Orthanc::ImageAccessor* Decode();
+                Orthanc::MimeType encoding,
+                TranscodingPriority priority);
+
+    void Transcode(std::string& target,
+                   Orthanc::MimeType encoding,
+                   TranscodingPriority priority);
+
+    /**
+     * Same as "Transcode()", but only keeps the top-left "width" x
+     * "height" pixels of the tile, which is needed for the tiles on
+     * the right and bottom edges of the IIIF images. JPEG tiles that
+     * are served as JPEG are cropped in the DCT domain, which is both
+     * faster and lossless.
+     **/
+    void TranscodeCropped(std::string& target,
+                          Orthanc::MimeType encoding,
+                          unsigned int width,
+                          unsigned int height,
+                          TranscodingPriority priority);
+
+    Orthanc::ImageAccessor* Decode(TranscodingPriority priority);
+
+    /**
+     * Decodes the tile at a resolution reduced by a power of two that
+     * is at most "maxReduction" (1, 2, 4 or 8). The DCT scaling of
+     * libjpeg is used for JPEG tiles, the other tiles are decoded at
+     * full resolution. "reduction" is set to the actually applied
+     * factor.
+     **/
+    Orthanc::ImageAccessor* DecodeReduced(unsigned int& reduction,
+                                          unsigned int maxReduction,
+                                          TranscodingPriority priority);
 
     static void Encode(std::string& encoded,
                        const Orthanc::ImageAccessor& decoded,
-                       Orthanc::MimeType encoding);
-
-    // This semaphore is used to implement throttling for the
-    // decoding/encoding of tiles
-    static void InitializeTranscoderSemaphore(unsigned int maxThreads);
-
-    static void FinalizeTranscoderSemaphore();
-
-    static void AnswerBackgroundTile(OrthancPluginRestOutput* output,
-                                     unsigned int tileWidth,
-                                     unsigned int tileHeight);
+                       Orthanc::MimeType encoding,
+                       TranscodingPriority priority);
   };
 }
@@ -0,0 +1,429 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "SeriesRegions.h"
+
+#include "RawTile.h"
+#include "SeriesTiles.h"
+#include "TileCache.h"
+#include "../Framework/ImageToolbox.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Images/Image.h>
+#include <Images/ImageProcessing.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cassert>
+
+
+// Maximum number of pixels of the mosaic that is extracted from the
+// selected level, to bound the memory used by one request
+static const uint64_t MAX_MOSAIC_PIXELS = 16 * 1024 * 1024;
+
+// Maximum number of bytes of the mosaics and of the resampled images
+// that are simultaneously rendered by all the requests
+static const uint64_t MAX_RENDERING_MEMORY = 256 * 1024 * 1024;
+
+static boost::mutex               renderingMutex_;
+static boost::condition_variable  renderingReleased_;
+static uint64_t                   renderingMemory_ = 0;
+
+// Maximum reduction factor of the DCT scaling of libjpeg
+static const unsigned int MAX_REDUCTION = 8;
+
+
+namespace OrthancWSI
+{
+  namespace SeriesRegions
+  {
+    /**
+     * Reserves memory within the budget that is shared by all the
+     * renderings, waiting until the concurrent renderings release
+     * enough memory.
+     **/
+    class MemoryReservation : public boost::noncopyable
+    {
+    private:
+      uint64_t  size_;
+
+    public:
+      explicit MemoryReservation(uint64_t size) :
+        size_(std::min(size, MAX_RENDERING_MEMORY))
+      {
+        boost::mutex::scoped_lock lock(renderingMutex_);
+
+        while (renderingMemory_ + size_ > MAX_RENDERING_MEMORY)
+        {
+          renderingReleased_.wait(lock);
+        }
+
+        renderingMemory_ += size_;
+      }
+
+      ~MemoryReservation()
+      {
+        {
+          boost::mutex::scoped_lock lock(renderingMutex_);
+          assert(renderingMemory_ >= size_);
+          renderingMemory_ -= size_;
+        }
+
+        renderingReleased_.notify_all();
+      }
+    };
+
+
+    class TileTask : public ICommand
+    {
+    private:
+      Orthanc::ImageAccessor&  mosaic_;
+      ITiledPyramid&           pyramid_;
+      const std::string*       seriesId_;
+      unsigned int             level_;
+      unsigned int             tileX_;
+      unsigned int             tileY_;
+      unsigned int             reduction_;
+      unsigned int             mosaicX_;
+      unsigned int             mosaicY_;
+      TranscodingPriority      priority_;
+
+    public:
+      // If "seriesId" is NULL, the pyramid has no raw tiles
+      TileTask(Orthanc::ImageAccessor& mosaic,
+               ITiledPyramid& pyramid,
+               const std::string* seriesId,
+               unsigned int level,
+               unsigned int tileX,
+               unsigned int tileY,
+               unsigned int reduction,
+               unsigned int mosaicX,
+               unsigned int mosaicY,
+               TranscodingPriority priority) :
+        mosaic_(mosaic),
+        pyramid_(pyramid),
+        seriesId_(seriesId),
+        level_(level),
+        tileX_(tileX),
+        tileY_(tileY),
+        reduction_(reduction),
+        mosaicX_(mosaicX),
+        mosaicY_(mosaicY),
+        priority_(priority)
+      {
+      }
+
+      virtual bool Execute() ORTHANC_OVERRIDE
+      {
+        std::unique_ptr<RawTile> rawTile;
+        std::unique_ptr<Orthanc::ImageAccessor> decoded;
+        unsigned int reduction = 1;
+
+        if (seriesId_ == NULL)
+        {
+          bool isEmpty;
+          decoded.reset(pyramid_.DecodeTile(isEmpty, level_, tileX_, tileY_));
+
+          if (isEmpty)
+          {
+            return true;  // Keep the background color
+          }
+        }
+        else
+        {
+          rawTile.reset(new RawTile(pyramid_, level_, tileX_, tileY_,
+                                    TileCache::FormatSeriesTileKey(*seriesId_, level_, tileX_, tileY_, "raw")));
+
+          if (rawTile->IsEmpty())
+          {
+            return true;  // Keep the background color
+          }
+
+          // The decoded image can refer to the content of "rawTile"
+          decoded.reset(rawTile->DecodeReduced(reduction, reduction_, priority_));
+        }
+
+        if (decoded.get() == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        // The tiles that could not be downscaled by the decoder are halved
+        while (reduction < reduction_)
+        {
+          decoded.reset(Orthanc::ImageProcessing::Halve(*decoded, false /* don't force minimal pitch */));
+          reduction *= 2;
+        }
+
+        /**
+         * Intersect the tile with the mosaic, whose origin is
+         * (mosaicX_, mosaicY_) in the reduced coordinates of the
+         * level. Each task writes to a distinct area of the mosaic, so
+         * no mutex is needed.
+         **/
+        const unsigned int tileLeft = tileX_ * (pyramid_.GetTileWidth(level_) / reduction_);
+        const unsigned int tileTop = tileY_ * (pyramid_.GetTileHeight(level_) / reduction_);
+
+        const unsigned int left = std::max(tileLeft, mosaicX_);
+        const unsigned int top = std::max(tileTop, mosaicY_);
+        const unsigned int right = std::min(tileLeft + decoded->GetWidth(), mosaicX_ + mosaic_.GetWidth());
+        const unsigned int bottom = std::min(tileTop + decoded->GetHeight(), mosaicY_ + mosaic_.GetHeight());
+
+        if (left < right &&
+            top < bottom)
+        {
+          Orthanc::ImageAccessor source, target;
+          decoded->GetRegion(source, left - tileLeft, top - tileTop, right - left, bottom - top);
+          mosaic_.GetRegion(target, left - mosaicX_, top - mosaicY_, right - left, bottom - top);
+
+          // Tiles that come from the REST API of Orthanc might have another pixel format
+          Orthanc::ImageProcessing::Convert(target, source);
+        }
+
+        return true;
+      }
+    };
+
+
+    static unsigned int SelectLevel(const ITiledPyramid& pyramid,
+                                    unsigned int width,
+                                    unsigned int height,
+                                    unsigned int targetWidth,
+                                    unsigned int targetHeight)
+    {
+      const uint64_t fullWidth = pyramid.GetLevelWidth(0);
+      const uint64_t fullHeight = pyramid.GetLevelHeight(0);
+
+      unsigned int level = 0;
+
+      for (unsigned int i = 1; i < pyramid.GetLevelCount(); i++)
+      {
+        if (static_cast<uint64_t>(width) * pyramid.GetLevelWidth(i) >= static_cast<uint64_t>(targetWidth) * fullWidth &&
+            static_cast<uint64_t>(height) * pyramid.GetLevelHeight(i) >= static_cast<uint64_t>(targetHeight) * fullHeight &&
+            pyramid.GetLevelWidth(i) <= pyramid.GetLevelWidth(level))
+        {
+          level = i;
+        }
+      }
+
+      return level;
+    }
+
+
+    static unsigned int SelectReduction(const ITiledPyramid& pyramid,
+                                        unsigned int level,
+                                        unsigned int width,
+                                        unsigned int height,
+                                        unsigned int targetWidth,
+                                        unsigned int targetHeight)
+    {
+      // Size of the region in the coordinates of the selected level
+      const uint64_t levelRegionWidth = (static_cast<uint64_t>(width) * pyramid.GetLevelWidth(level) /
+                                         pyramid.GetLevelWidth(0));
+      const uint64_t levelRegionHeight = (static_cast<uint64_t>(height) * pyramid.GetLevelHeight(level) /
+                                          pyramid.GetLevelHeight(0));
+
+      unsigned int reduction = 1;
+
+      // The reduced tiles must remain aligned on the mosaic
+      while (reduction < MAX_REDUCTION &&
+             levelRegionWidth >= 2 * reduction * static_cast<uint64_t>(targetWidth) &&
+             levelRegionHeight >= 2 * reduction * static_cast<uint64_t>(targetHeight) &&
+             pyramid.GetTileWidth(level) % (2 * reduction) == 0 &&
+             pyramid.GetTileHeight(level) % (2 * reduction) == 0)
+      {
+        reduction *= 2;
+      }
+
+      return reduction;
+    }
+
+
+    static Orthanc::ImageAccessor* RenderInternal(ITiledPyramid& pyramid,
+                                                  const std::string* seriesId,
+                                                  uint8_t backgroundRed,
+                                                  uint8_t backgroundGreen,
+                                                  uint8_t backgroundBlue,
+                                                  unsigned int x,
+                                                  unsigned int y,
+                                                  unsigned int width,
+                                                  unsigned int height,
+                                                  unsigned int targetWidth,
+                                                  unsigned int targetHeight,
+                                                  TranscodingPriority priority)
+    {
+      if (pyramid.GetLevelCount() == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const uint64_t fullWidth = pyramid.GetLevelWidth(0);
+      const uint64_t fullHeight = pyramid.GetLevelHeight(0);
+
+      if (width == 0 ||
+          height == 0 ||
+          targetWidth == 0 ||
+          targetHeight == 0 ||
+          static_cast<uint64_t>(x) + width > fullWidth ||
+          static_cast<uint64_t>(y) + height > fullHeight)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                        "The region is empty or exceeds the size of the image");
+      }
+
+      const unsigned int level = SelectLevel(pyramid, width, height, targetWidth, targetHeight);
+      const unsigned int reduction = SelectReduction(pyramid, level, width, height, targetWidth, targetHeight);
+
+      // Scale factors from the finest level to the reduced coordinates of the selected level
+      const uint64_t scaleX = fullWidth * reduction;
+      const uint64_t scaleY = fullHeight * reduction;
+      const uint64_t levelWidth = pyramid.GetLevelWidth(level);
+      const uint64_t levelHeight = pyramid.GetLevelHeight(level);
+      const uint64_t reducedWidth = CeilingDivision(pyramid.GetLevelWidth(level), reduction);
+      const uint64_t reducedHeight = CeilingDivision(pyramid.GetLevelHeight(level), reduction);
+
+      // Bounding box of the region in the reduced coordinates of the selected level
+      const unsigned int left = static_cast<unsigned int>(static_cast<uint64_t>(x) * levelWidth / scaleX);
+      const unsigned int top = static_cast<unsigned int>(static_cast<uint64_t>(y) * levelHeight / scaleY);
+      const unsigned int right = static_cast<unsigned int>(
+        std::min(reducedWidth, ((static_cast<uint64_t>(x) + width) * levelWidth + scaleX - 1) / scaleX));
+      const unsigned int bottom = static_cast<unsigned int>(
+        std::min(reducedHeight, ((static_cast<uint64_t>(y) + height) * levelHeight + scaleY - 1) / scaleY));
+
+      assert(left < right &&
+             top < bottom);
+
+      if (static_cast<uint64_t>(right - left) * static_cast<uint64_t>(bottom - top) > MAX_MOSAIC_PIXELS)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                        "The region is too large with respect to the levels of the pyramid");
+      }
+
+      // The mosaic and the resampled image are alive at the same time
+      const uint64_t bytesPerPixel = Orthanc::GetBytesPerPixel(pyramid.GetPixelFormat());
+      MemoryReservation reservation(bytesPerPixel * (static_cast<uint64_t>(right - left) * static_cast<uint64_t>(bottom - top) +
+                                                     static_cast<uint64_t>(targetWidth) * static_cast<uint64_t>(targetHeight)));
+
+      std::unique_ptr<Orthanc::ImageAccessor> mosaic(
+        new Orthanc::Image(pyramid.GetPixelFormat(), right - left, bottom - top, false));
+      ImageToolbox::Set(*mosaic, backgroundRed, backgroundGreen, backgroundBlue);
+
+      const unsigned int tileWidth = pyramid.GetTileWidth(level) / reduction;
+      const unsigned int tileHeight = pyramid.GetTileHeight(level) / reduction;
+
+      BagOfTasks tasks;
+
+      for (unsigned int tileY = top / tileHeight; tileY <= (bottom - 1) / tileHeight; tileY++)
+      {
+        for (unsigned int tileX = left / tileWidth; tileX <= (right - 1) / tileWidth; tileX++)
+        {
+          tasks.Push(new TileTask(*mosaic, pyramid, seriesId, level, tileX, tileY, reduction, left, top, priority));
+        }
+      }
+
+      {
+        std::unique_ptr<BagOfTasksProcessor::Handle> handle(SeriesTiles::GetProcessor().Submit(tasks));
+
+        if (!handle->Join())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Cannot load some tile of the region");
+        }
+      }
+
+      /**
+       * The bounding box of the mosaic is aligned on the pixels of the
+       * reduced level. Round the exact position of the region within
+       * the mosaic, whose pixels are not larger than those of the
+       * target, before resampling.
+       **/
+      const unsigned int cropLeft = std::min(
+        right - 1, static_cast<unsigned int>((2 * static_cast<uint64_t>(x) * levelWidth + scaleX) / (2 * scaleX))) - left;
+      const unsigned int cropTop = std::min(
+        bottom - 1, static_cast<unsigned int>((2 * static_cast<uint64_t>(y) * levelHeight + scaleY) / (2 * scaleY))) - top;
+      const unsigned int cropRight = std::max(
+        cropLeft + 1, std::min(right, static_cast<unsigned int>(
+                                 (2 * (static_cast<uint64_t>(x) + width) * levelWidth + scaleX) / (2 * scaleX))) - left);
+      const unsigned int cropBottom = std::max(
+        cropTop + 1, std::min(bottom, static_cast<unsigned int>(
+                                (2 * (static_cast<uint64_t>(y) + height) * levelHeight + scaleY) / (2 * scaleY))) - top);
+
+      Orthanc::ImageAccessor region;
+      mosaic->GetRegion(region, cropLeft, cropTop, cropRight - cropLeft, cropBottom - cropTop);
+
+      std::unique_ptr<Orthanc::ImageAccessor> resized(
+        new Orthanc::Image(mosaic->GetFormat(), targetWidth, targetHeight, false));
+
+      if (region.GetWidth() == targetWidth &&
+          region.GetHeight() == targetHeight)
+      {
+        Orthanc::ImageProcessing::Copy(*resized, region);
+      }
+      else
+      {
+        Orthanc::ImageProcessing::Resize(*resized, region);
+      }
+
+      return resized.release();
+    }
+
+
+    uint64_t GetMaxMosaicPixels()
+    {
+      return MAX_MOSAIC_PIXELS;
+    }
+
+
+    Orthanc::ImageAccessor* Render(DicomPyramid& pyramid,
+                                   const std::string& seriesId,
+                                   unsigned int x,
+                                   unsigned int y,
+                                   unsigned int width,
+                                   unsigned int height,
+                                   unsigned int targetWidth,
+                                   unsigned int targetHeight,
+                                   TranscodingPriority priority)
+    {
+      return RenderInternal(pyramid, &seriesId, pyramid.GetBackgroundRed(), pyramid.GetBackgroundGreen(),
+                            pyramid.GetBackgroundBlue(), x, y, width, height, targetWidth, targetHeight, priority);
+    }
+
+
+    Orthanc::ImageAccessor* Render(DecodedTiledPyramid& pyramid,
+                                   unsigned int x,
+                                   unsigned int y,
+                                   unsigned int width,
+                                   unsigned int height,
+                                   unsigned int targetWidth,
+                                   unsigned int targetHeight,
+                                   TranscodingPriority priority)
+    {
+      uint8_t red, green, blue;
+      pyramid.GetBackgroundColor(red, green, blue);
+
+      return RenderInternal(pyramid, NULL, red, green, blue, x, y, width, height, targetWidth, targetHeight, priority);
+    }
+  }
+}
@@ -0,0 +1,79 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "TranscodingScheduler.h"
+#include "../Framework/Inputs/DecodedTiledPyramid.h"
+#include "../Framework/Inputs/DicomPyramid.h"
+
+#include <Images/ImageAccessor.h>
+
+#include <string>
+
+
+namespace OrthancWSI
+{
+  namespace SeriesRegions
+  {
+    // Maximum number of pixels of the mosaic that is extracted from
+    // the selected level, which bounds the memory used by one request
+    uint64_t GetMaxMosaicPixels();
+
+    /**
+     * Renders the region (x, y, width, height) of a DICOM pyramid,
+     * whose coordinates are expressed in the pixels of the finest
+     * level, into an image of size "targetWidth" x "targetHeight".
+     * The coarsest level whose resolution is at least that of the
+     * target is selected, then its tiles that intersect the region
+     * are read through the cache of raw tiles and decoded in parallel
+     * by the pool of SeriesTiles. If the target is still at least 2x
+     * smaller than the selected level, the JPEG tiles are decoded at
+     * a reduced resolution using DCT scaling. The mosaic is finally
+     * resampled to the target size. The missing tiles are painted
+     * with the background color of the pyramid. The size of the
+     * mosaic is bounded, and the concurrent renderings share a memory
+     * budget: The renderings wait until enough memory is available.
+     **/
+    Orthanc::ImageAccessor* Render(DicomPyramid& pyramid,
+                                   const std::string& seriesId,
+                                   unsigned int x,
+                                   unsigned int y,
+                                   unsigned int width,
+                                   unsigned int height,
+                                   unsigned int targetWidth,
+                                   unsigned int targetHeight,
+                                   TranscodingPriority priority);
+
+    // Same as above, for the pyramids that are computed on-the-fly
+    // from a frame, whose tiles are already decoded
+    Orthanc::ImageAccessor* Render(DecodedTiledPyramid& pyramid,
+                                   unsigned int x,
+                                   unsigned int y,
+                                   unsigned int width,
+                                   unsigned int height,
+                                   unsigned int targetWidth,
+                                   unsigned int targetHeight,
+                                   TranscodingPriority priority);
+  }
+}
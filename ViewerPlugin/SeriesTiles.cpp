@@ -0,0 +1,528 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "SeriesTiles.h"
+
+#include "BackgroundTiles.h"
+#include "DicomPyramidCache.h"
+#include "RawTile.h"
+#include "TileCache.h"
+#include "../Framework/ImageToolbox.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <cassert>
+#include <new>
+
+
+static std::unique_ptr<OrthancWSI::BagOfTasksProcessor>  processor_;
+
+
+namespace OrthancWSI
+{
+  namespace SeriesTiles
+  {
+    static bool EncodeTile(std::string& encoded,
+                           Orthanc::MimeType& mime,
+                           unsigned int& tileWidth,
+                           unsigned int& tileHeight,
+                           TileCache::Accessor& cached,
+                           ITiledPyramid& pyramid,
+                           const std::string& seriesId,
+                           unsigned int level,
+                           unsigned int tileX,
+                           unsigned int tileY,
+                           bool hasAccept,
+                           Orthanc::MimeType accept,
+                           TranscodingPriority priority)
+    {
+      // Retrieve the raw tile from the WSI pyramid
+      RawTile rawTile(pyramid, level, tileX, tileY,
+                      TileCache::FormatSeriesTileKey(seriesId, level, tileX, tileY, "raw"));
+
+      if (rawTile.IsEmpty())
+      {
+        tileWidth = rawTile.GetTileWidth();
+        tileHeight = rawTile.GetTileHeight();
+        return false;
+      }
+
+      if (hasAccept)
+      {
+        mime = accept;
+      }
+      else if (rawTile.GetCompression() == ImageCompression_Jpeg)
+      {
+        // The tile is already a JPEG image. In such a case, we can
+        // serve it as such, because any Web browser can handle JPEG.
+        mime = Orthanc::MimeType_Jpeg;
+      }
+      else
+      {
+        // This is a lossless frame (coming from JPEG2000 or uncompressed
+        // DICOM instance), not a DICOM-JPEG instance. Decompress the raw
+        // tile, then transcode it to PNG or to lossless WebP to prevent
+        // lossy compression and to avoid JPEG2000 that is not supported
+        // by all the browsers.
+        mime = accept;
+      }
+
+      rawTile.Transcode(encoded, mime, priority);
+      cached.Store(encoded, ImageToolbox::Convert(mime));
+
+      return true;
+    }
+
+
+    bool LoadEncodedTile(std::string& encoded,
+                         Orthanc::MimeType& mime,
+                         unsigned int& tileWidth,
+                         unsigned int& tileHeight,
+                         const std::string& seriesId,
+                         unsigned int level,
+                         unsigned int tileX,
+                         unsigned int tileY,
+                         bool hasAccept,
+                         Orthanc::MimeType accept,
+                         TranscodingPriority priority)
+    {
+      TileCache::Accessor cached(TileCache::GetEncodedTiles(),
+                                 TileCache::FormatSeriesTileKey(seriesId, level, tileX, tileY,
+                                                                GetEncodingFormat(hasAccept, accept)));
+
+      if (cached.IsHit())
+      {
+        encoded = cached.GetContent();
+        mime = ImageToolbox::Convert(cached.GetCompression());
+        return true;
+      }
+      else
+      {
+        // The accessor only holds a reference to the pyramid, so
+        // downloading the frame doesn't block the other HTTP threads
+        DicomPyramidCache::Accessor accessor(seriesId);
+
+        return EncodeTile(encoded, mime, tileWidth, tileHeight, cached, accessor.GetPyramid(),
+                          seriesId, level, tileX, tileY, hasAccept, accept, priority);
+      }
+    }
+
+
+    void PrefetchEncodedTile(const std::string& seriesId,
+                             unsigned int level,
+                             unsigned int tileX,
+                             unsigned int tileY,
+                             bool hasAccept,
+                             Orthanc::MimeType accept)
+    {
+      TileCache::Accessor cached(TileCache::GetEncodedTiles(),
+                                 TileCache::FormatSeriesTileKey(seriesId, level, tileX, tileY,
+                                                                GetEncodingFormat(hasAccept, accept)),
+                                 true /* background */);
+
+      if (cached.IsLoader())
+      {
+        DicomPyramidCache::Accessor accessor(seriesId);
+
+        std::string encoded;
+        Orthanc::MimeType mime;
+        unsigned int tileWidth, tileHeight;
+        EncodeTile(encoded, mime, tileWidth, tileHeight, cached, accessor.GetPyramid(),
+                   seriesId, level, tileX, tileY, hasAccept, accept, TranscodingPriority_Prefetch);
+      }
+    }
+
+
+    std::string GetEncodingFormat(bool hasAccept,
+                                  Orthanc::MimeType accept)
+    {
+      if (hasAccept)
+      {
+        return Orthanc::EnumerationToString(accept);
+      }
+      else if (accept == Orthanc::MimeType_Png)
+      {
+        return "default";
+      }
+      else
+      {
+        return std::string("default-") + Orthanc::EnumerationToString(accept);
+      }
+    }
+
+
+    void InitializeProcessor(unsigned int threadsCount)
+    {
+      if (processor_.get() == NULL)
+      {
+        processor_.reset(new BagOfTasksProcessor(threadsCount));
+      }
+      else
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+    }
+
+
+    void FinalizeProcessor()
+    {
+      processor_.reset(NULL);
+    }
+
+
+    BagOfTasksProcessor& GetProcessor()
+    {
+      if (processor_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        return *processor_;
+      }
+    }
+
+
+    class Batch::Item : public boost::noncopyable
+    {
+    private:
+      unsigned int                 level_;
+      unsigned int                 tileX_;
+      unsigned int                 tileY_;
+      std::string                  encoded_;
+      BackgroundTiles::TileHandle  background_;
+      Orthanc::MimeType            mime_;
+      Orthanc::ErrorCode           errorCode_;
+      Orthanc::HttpStatus          httpStatus_;
+      std::string                  errorMessage_;
+
+    public:
+      Item(unsigned int level,
+           unsigned int tileX,
+           unsigned int tileY) :
+        level_(level),
+        tileX_(tileX),
+        tileY_(tileY),
+        mime_(Orthanc::MimeType_Png),
+        errorCode_(Orthanc::ErrorCode_Success),
+        httpStatus_(Orthanc::HttpStatus_200_Ok)
+      {
+      }
+
+      unsigned int GetLevel() const
+      {
+        return level_;
+      }
+
+      unsigned int GetTileX() const
+      {
+        return tileX_;
+      }
+
+      unsigned int GetTileY() const
+      {
+        return tileY_;
+      }
+
+      const std::string& GetEncoded() const
+      {
+        if (background_.get() != NULL)
+        {
+          return *background_;
+        }
+        else
+        {
+          return encoded_;
+        }
+      }
+
+      std::string& GetEncoded()
+      {
+        return encoded_;
+      }
+
+      Orthanc::MimeType GetMimeType() const
+      {
+        return mime_;
+      }
+
+      void SetMimeType(Orthanc::MimeType mime)
+      {
+        mime_ = mime;
+      }
+
+      // Empty tiles share the registered background tiles, without copy
+      void SetBackground(BackgroundTiles::TileHandle background,
+                         Orthanc::MimeType mime)
+      {
+        background_ = background;
+        mime_ = mime;
+      }
+
+      void SetError(const Orthanc::OrthancException& e)
+      {
+        encoded_.clear();
+        background_.reset();
+        errorCode_ = e.GetErrorCode();
+        httpStatus_ = e.GetHttpStatus();
+        errorMessage_ = (e.HasDetails() ? e.GetDetails() : e.What());
+      }
+
+      bool IsSuccess() const
+      {
+        return errorCode_ == Orthanc::ErrorCode_Success;
+      }
+
+      Orthanc::ErrorCode GetErrorCode() const
+      {
+        return errorCode_;
+      }
+
+      Orthanc::HttpStatus GetHttpStatus() const
+      {
+        return httpStatus_;
+      }
+
+      const std::string& GetErrorMessage() const
+      {
+        return errorMessage_;
+      }
+    };
+
+
+    class Batch::Task : public ICommand
+    {
+    private:
+      Item&               item_;
+      DicomPyramid&       pyramid_;
+      const std::string&  seriesId_;
+      bool                hasAccept_;
+      Orthanc::MimeType   accept_;
+
+      void Load()
+      {
+        // Each task only writes to its own item, so no mutex is needed
+        TileCache::Accessor cached(TileCache::GetEncodedTiles(),
+                                   TileCache::FormatSeriesTileKey(seriesId_, item_.GetLevel(), item_.GetTileX(), item_.GetTileY(),
+                                                                  GetEncodingFormat(hasAccept_, accept_)));
+
+        if (cached.IsHit())
+        {
+          item_.GetEncoded() = cached.GetContent();
+          item_.SetMimeType(ImageToolbox::Convert(cached.GetCompression()));
+        }
+        else
+        {
+          Orthanc::MimeType mime;
+          unsigned int tileWidth, tileHeight;
+
+          if (EncodeTile(item_.GetEncoded(), mime, tileWidth, tileHeight, cached, pyramid_, seriesId_,
+                         item_.GetLevel(), item_.GetTileX(), item_.GetTileY(), hasAccept_, accept_,
+                         TranscodingPriority_Interactive))
+          {
+            item_.SetMimeType(mime);
+          }
+          else
+          {
+            item_.SetBackground(BackgroundTiles::GetTile(tileWidth, tileHeight, pyramid_.GetBackgroundRed(),
+                                                         pyramid_.GetBackgroundGreen(), pyramid_.GetBackgroundBlue(),
+                                                         accept_), accept_);
+          }
+        }
+      }
+
+    public:
+      Task(Item& item,
+           DicomPyramid& pyramid,
+           const std::string& seriesId,
+           bool hasAccept,
+           Orthanc::MimeType accept) :
+        item_(item),
+        pyramid_(pyramid),
+        seriesId_(seriesId),
+        hasAccept_(hasAccept),
+        accept_(accept)
+      {
+      }
+
+      virtual bool Execute() ORTHANC_OVERRIDE
+      {
+        // A tile that cannot be loaded doesn't fail the other tiles of
+        // the batch: Its error is reported in its own part of the answer
+        try
+        {
+          Load();
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(ERROR) << "Cannot load tile (" << item_.GetTileX() << "," << item_.GetTileY() << ") at level "
+                     << item_.GetLevel() << " of series " << seriesId_ << ": " << e.What();
+          item_.SetError(e);
+        }
+        catch (std::bad_alloc&)
+        {
+          item_.SetError(Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory));
+        }
+
+        return true;
+      }
+    };
+
+
+    const Batch::Item& Batch::GetItem(size_t index) const
+    {
+      if (index >= items_.size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+      else
+      {
+        assert(items_[index] != NULL);
+        return *items_[index];
+      }
+    }
+
+
+    Batch::Batch(const std::string& seriesId,
+                 bool hasAccept,
+                 Orthanc::MimeType accept) :
+      seriesId_(seriesId),
+      hasAccept_(hasAccept),
+      accept_(accept)
+    {
+    }
+
+
+    Batch::~Batch()
+    {
+      for (size_t i = 0; i < items_.size(); i++)
+      {
+        assert(items_[i] != NULL);
+        delete items_[i];
+      }
+    }
+
+
+    void Batch::AddTile(unsigned int level,
+                        unsigned int tileX,
+                        unsigned int tileY)
+    {
+      items_.push_back(new Item(level, tileX, tileY));
+    }
+
+
+    void Batch::Load()
+    {
+      if (items_.empty())
+      {
+        return;
+      }
+
+      // Resolve the pyramid once for all the tiles. The accessor
+      // keeps the pyramid alive until all the tasks are done.
+      DicomPyramidCache::Accessor accessor(seriesId_);
+      DicomPyramid& pyramid = accessor.GetPyramid();
+
+      BagOfTasks tasks;
+
+      for (size_t i = 0; i < items_.size(); i++)
+      {
+        const Item& item = *items_[i];
+
+        if (item.GetLevel() >= pyramid.GetLevelCount() ||
+            item.GetTileX() >= CeilingDivision(pyramid.GetLevelWidth(item.GetLevel()), pyramid.GetTileWidth(item.GetLevel())) ||
+            item.GetTileY() >= CeilingDivision(pyramid.GetLevelHeight(item.GetLevel()), pyramid.GetTileHeight(item.GetLevel())))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        tasks.Push(new Task(*items_[i], pyramid, seriesId_, hasAccept_, accept_));
+      }
+
+      std::unique_ptr<BagOfTasksProcessor::Handle> handle(GetProcessor().Submit(tasks));
+
+      if (!handle->Join())
+      {
+        // Only happens on exceptions that are not reported by "Task::Execute()"
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Cannot load some tile of the batch");
+      }
+    }
+
+
+    unsigned int Batch::GetLevel(size_t index) const
+    {
+      return GetItem(index).GetLevel();
+    }
+
+
+    unsigned int Batch::GetTileX(size_t index) const
+    {
+      return GetItem(index).GetTileX();
+    }
+
+
+    unsigned int Batch::GetTileY(size_t index) const
+    {
+      return GetItem(index).GetTileY();
+    }
+
+
+    const std::string& Batch::GetEncoded(size_t index) const
+    {
+      return GetItem(index).GetEncoded();
+    }
+
+
+    Orthanc::MimeType Batch::GetMimeType(size_t index) const
+    {
+      return GetItem(index).GetMimeType();
+    }
+
+
+    bool Batch::IsSuccess(size_t index) const
+    {
+      return GetItem(index).IsSuccess();
+    }
+
+
+    Orthanc::ErrorCode Batch::GetErrorCode(size_t index) const
+    {
+      return GetItem(index).GetErrorCode();
+    }
+
+
+    Orthanc::HttpStatus Batch::GetHttpStatus(size_t index) const
+    {
+      return GetItem(index).GetHttpStatus();
+    }
+
+
+    const std::string& Batch::GetErrorMessage(size_t index) const
+    {
+      return GetItem(index).GetErrorMessage();
+    }
+  }
+}
@@ -0,0 +1,146 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "TranscodingScheduler.h"
+#include "../Framework/MultiThreading/BagOfTasksProcessor.h"
+
+#include <Enumerations.h>
+
+#include <string>
+#include <vector>
+
+
+namespace OrthancWSI
+{
+  namespace SeriesTiles
+  {
+    /**
+     * Returns a tile of the DICOM pyramid of a series, as sent to the
+     * HTTP clients. The tile is read through the caches of encoded and
+     * raw tiles. If "hasAccept" is "false", the encoding depends on the
+     * compression of the raw tile: JPEG tiles are served as such, and
+     * the other tiles are encoded using "accept", that must be a
+     * lossless encoding (PNG or WebP). Returns "false" if the tile is
+     * empty, in which case only "tileWidth" and "tileHeight" are set.
+     **/
+    bool LoadEncodedTile(std::string& encoded,
+                         Orthanc::MimeType& mime,
+                         unsigned int& tileWidth,
+                         unsigned int& tileHeight,
+                         const std::string& seriesId,
+                         unsigned int level,
+                         unsigned int tileX,
+                         unsigned int tileY,
+                         bool hasAccept,
+                         Orthanc::MimeType accept,
+                         TranscodingPriority priority);
+
+    /**
+     * Stores a tile in the cache of encoded tiles, with the priority
+     * of prefetching. Nothing is done if the tile is already cached,
+     * or if another thread is loading it. If an HTTP request asks for
+     * the same tile in between, this request does not wait for the
+     * prefetching, but loads the tile by itself.
+     **/
+    void PrefetchEncodedTile(const std::string& seriesId,
+                             unsigned int level,
+                             unsigned int tileX,
+                             unsigned int tileY,
+                             bool hasAccept,
+                             Orthanc::MimeType accept);
+
+    // Format used to identify the encoding in the caches and in the ETags
+    std::string GetEncodingFormat(bool hasAccept,
+                                  Orthanc::MimeType accept);
+
+    // Pool of threads that is shared by the HTTP threads to load
+    // multiple tiles in parallel
+    void InitializeProcessor(unsigned int threadsCount);
+
+    void FinalizeProcessor();
+
+    BagOfTasksProcessor& GetProcessor();
+
+
+    /**
+     * Set of tiles of the same series that are loaded in parallel. The
+     * pyramid is only resolved once, and empty tiles are replaced by
+     * the background tile. The tiles are transcoded with the
+     * interactive priority.
+     **/
+    class Batch : public boost::noncopyable
+    {
+    private:
+      class Item;
+      class Task;
+
+      std::string         seriesId_;
+      bool                hasAccept_;
+      Orthanc::MimeType   accept_;
+      std::vector<Item*>  items_;
+
+      const Item& GetItem(size_t index) const;
+
+    public:
+      Batch(const std::string& seriesId,
+            bool hasAccept,
+            Orthanc::MimeType accept);
+
+      ~Batch();
+
+      void AddTile(unsigned int level,
+                   unsigned int tileX,
+                   unsigned int tileY);
+
+      size_t GetSize() const
+      {
+        return items_.size();
+      }
+
+      // Throws an exception if some tile is out of the pyramid. The
+      // tiles that cannot be loaded are reported by "IsSuccess()",
+      // without failing the other tiles.
+      void Load();
+
+      unsigned int GetLevel(size_t index) const;
+
+      unsigned int GetTileX(size_t index) const;
+
+      unsigned int GetTileY(size_t index) const;
+
+      const std::string& GetEncoded(size_t index) const;
+
+      Orthanc::MimeType GetMimeType(size_t index) const;
+
+      bool IsSuccess(size_t index) const;
+
+      Orthanc::ErrorCode GetErrorCode(size_t index) const;
+
+      Orthanc::HttpStatus GetHttpStatus(size_t index) const;
+
+      const std::string& GetErrorMessage(size_t index) const;
+    };
+  }
+}
@@ -0,0 +1,409 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "TileCache.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+#include <cassert>
+
+
+static std::unique_ptr<OrthancWSI::TileCache>  encodedTiles_;
+static std::unique_ptr<OrthancWSI::TileCache>  rawTiles_;
+static std::unique_ptr<OrthancWSI::TileCache>  fullImages_;
+
+
+namespace OrthancWSI
+{
+  void TileCache::Remove(Content::iterator it)
+  {
+    // Mutex must be locked
+
+    assert(it != content_.end() &&
+           it->second.get() != NULL &&
+           memoryUsage_ >= it->second->GetContent().size());
+
+    memoryUsage_ -= it->second->GetContent().size();
+    index_.Invalidate(it->first);
+    content_.erase(it);
+  }
+
+
+  void TileCache::MakeRoom(size_t memory)
+  {
+    // Mutex must be locked
+
+    while (!index_.IsEmpty() &&
+           memoryUsage_ + memory > maxMemory_)
+    {
+      Content::iterator it = content_.find(index_.GetOldest());
+      if (it == content_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+      else
+      {
+        Remove(it);
+      }
+    }
+  }
+
+
+  void TileCache::Store(const Accessor& loader,
+                        TileHandle tile)
+  {
+    assert(tile.get() != NULL);
+
+    const std::string& key = loader.GetKey();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Loading::iterator found = loading_.find(key);
+      if (found == loading_.end() ||
+          found->second != &loader)
+      {
+        return;  // A foreground accessor has taken over the loading of this tile
+      }
+
+      loading_.erase(found);
+
+      const size_t size = tile->GetContent().size();
+
+      if (stale_.erase(key) == 0 &&
+          size <= maxMemory_ &&
+          content_.find(key) == content_.end())
+      {
+        MakeRoom(size);
+        memoryUsage_ += size;
+        content_[key] = tile;
+        index_.Add(key);
+      }
+    }
+
+    loaded_.notify_all();
+  }
+
+
+  void TileCache::ReleaseLoading(const Accessor& loader)
+  {
+    const std::string& key = loader.GetKey();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Loading::iterator found = loading_.find(key);
+      if (found == loading_.end() ||
+          found->second != &loader)
+      {
+        return;
+      }
+
+      loading_.erase(found);
+      stale_.erase(key);
+    }
+
+    // Wake up the threads that were waiting for this key, one of
+    // them will become responsible for loading it
+    loaded_.notify_all();
+  }
+
+
+  TileCache::TileCache(size_t maxMemory) :
+    maxMemory_(maxMemory),
+    memoryUsage_(0)
+  {
+  }
+
+
+  size_t TileCache::GetMemoryUsage()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return memoryUsage_;
+  }
+
+
+  void TileCache::InvalidatePrefix(const std::string& prefix)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::iterator it = content_.lower_bound(prefix);
+    while (it != content_.end() &&
+           it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+      Content::iterator next = it;
+      ++next;
+      Remove(it);
+      it = next;
+    }
+
+    // The tiles that are currently being loaded might be outdated
+    for (Loading::const_iterator loading = loading_.lower_bound(prefix);
+         loading != loading_.end() && loading->first.compare(0, prefix.size(), prefix) == 0; ++loading)
+    {
+      stale_.insert(loading->first);
+    }
+  }
+
+
+  TileCache::Accessor::Accessor(TileCache& cache,
+                                const std::string& key,
+                                bool isBackground) :
+    cache_(cache),
+    key_(key),
+    isBackground_(isBackground),
+    isLoader_(false)
+  {
+    if (!cache.IsEnabled())
+    {
+      return;  // Always a miss
+    }
+
+    boost::mutex::scoped_lock lock(cache.mutex_);
+
+    for (;;)
+    {
+      Content::const_iterator found = cache.content_.find(key);
+      if (found != cache.content_.end())
+      {
+        // Hit: Tag the tile as the most recently used
+        tile_ = found->second;
+        cache.index_.MakeMostRecent(key);
+        return;
+      }
+
+      Loading::iterator loading = cache.loading_.find(key);
+      if (loading == cache.loading_.end())
+      {
+        // Miss, and nobody else is loading this tile: We are responsible for loading it
+        cache.loading_[key] = this;
+        isLoader_ = true;
+        return;
+      }
+      else if (isBackground)
+      {
+        // Another thread is loading the same tile, nothing to do
+        return;
+      }
+      else if (loading->second->isBackground_)
+      {
+        // The loader might be waiting for a low-priority slot of the
+        // transcoding scheduler: Don't wait for it, and take over the
+        // loading. The loading starts now, after any invalidation.
+        loading->second = this;
+        cache.stale_.erase(key);
+        isLoader_ = true;
+        return;
+      }
+      else
+      {
+        // Another thread is loading the same tile, wait for it
+        cache.loaded_.wait(lock);
+      }
+    }
+  }
+
+
+  TileCache::Accessor::~Accessor()
+  {
+    if (isLoader_)
+    {
+      // The tile was not stored (e.g. because of an exception)
+      cache_.ReleaseLoading(*this);
+    }
+  }
+
+
+  const std::string& TileCache::Accessor::GetContent() const
+  {
+    if (IsHit())
+    {
+      return tile_->GetContent();
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  ImageCompression TileCache::Accessor::GetCompression() const
+  {
+    if (IsHit())
+    {
+      return tile_->GetCompression();
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void TileCache::Accessor::Store(const std::string& content,
+                                  ImageCompression compression)
+  {
+    if (IsHit())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else if (isLoader_)
+    {
+      isLoader_ = false;
+      cache_.Store(*this, TileHandle(new CachedTile(content, compression)));
+    }
+  }
+
+
+  void TileCache::InitializeInstances(size_t encodedTilesMaxMemory,
+                                      size_t rawTilesMaxMemory,
+                                      size_t fullImagesMaxMemory)
+  {
+    if (encodedTiles_.get() == NULL &&
+        rawTiles_.get() == NULL &&
+        fullImages_.get() == NULL)
+    {
+      encodedTiles_.reset(new TileCache(encodedTilesMaxMemory));
+      rawTiles_.reset(new TileCache(rawTilesMaxMemory));
+      fullImages_.reset(new TileCache(fullImagesMaxMemory));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void TileCache::FinalizeInstances()
+  {
+    encodedTiles_.reset(NULL);
+    rawTiles_.reset(NULL);
+    fullImages_.reset(NULL);
+  }
+
+
+  TileCache& TileCache::GetEncodedTiles()
+  {
+    if (encodedTiles_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *encodedTiles_;
+    }
+  }
+
+
+  TileCache& TileCache::GetRawTiles()
+  {
+    if (rawTiles_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *rawTiles_;
+    }
+  }
+
+
+  TileCache& TileCache::GetFullImages()
+  {
+    if (fullImages_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *fullImages_;
+    }
+  }
+
+
+  std::string TileCache::GetSeriesPrefix(const std::string& seriesId)
+  {
+    return "series/" + seriesId + "/";
+  }
+
+
+  std::string TileCache::GetInstancePrefix(const std::string& instanceId)
+  {
+    return "frames/" + instanceId + "/";
+  }
+
+
+  std::string TileCache::FormatSeriesTileKey(const std::string& seriesId,
+                                             unsigned int level,
+                                             unsigned int tileX,
+                                             unsigned int tileY,
+                                             const std::string& format)
+  {
+    return (GetSeriesPrefix(seriesId) +
+            boost::lexical_cast<std::string>(level) + "/" +
+            boost::lexical_cast<std::string>(tileX) + "/" +
+            boost::lexical_cast<std::string>(tileY) + "/" + format);
+  }
+
+
+  std::string TileCache::FormatSeriesFullImageKey(const std::string& seriesId,
+                                                  unsigned int width,
+                                                  unsigned int height,
+                                                  const std::string& format)
+  {
+    return (GetSeriesPrefix(seriesId) + "full/" +
+            boost::lexical_cast<std::string>(width) + "x" +
+            boost::lexical_cast<std::string>(height) + "/" + format);
+  }
+
+
+  std::string TileCache::FormatFrameFullImageKey(const std::string& instanceId,
+                                                 unsigned int frameNumber,
+                                                 unsigned int width,
+                                                 unsigned int height,
+                                                 const std::string& format)
+  {
+    return (GetInstancePrefix(instanceId) +
+            boost::lexical_cast<std::string>(frameNumber) + "/full/" +
+            boost::lexical_cast<std::string>(width) + "x" +
+            boost::lexical_cast<std::string>(height) + "/" + format);
+  }
+
+
+  std::string TileCache::FormatFrameTileKey(const std::string& instanceId,
+                                            unsigned int frameNumber,
+                                            unsigned int level,
+                                            unsigned int tileX,
+                                            unsigned int tileY,
+                                            const std::string& format)
+  {
+    return (GetInstancePrefix(instanceId) +
+            boost::lexical_cast<std::string>(frameNumber) + "/" +
+            boost::lexical_cast<std::string>(level) + "/" +
+            boost::lexical_cast<std::string>(tileX) + "/" +
+            boost::lexical_cast<std::string>(tileY) + "/" + format);
+  }
+}
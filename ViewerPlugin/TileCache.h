@@ -0,0 +1,210 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "../Framework/Enumerations.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <set>
+#include <string>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Least-recently-used cache of tiles, whose size is bounded by a
+   * number of bytes. Concurrent misses for the same key are merged:
+   * The first accessor is responsible for loading the tile, and the
+   * other ones wait until the tile is stored. The background
+   * accessors (prefetching) never wait, and give up their loading to
+   * the first foreground accessor that asks for the same tile, so
+   * that a request is never queued behind a low-priority loader. This
+   * class is thread-safe.
+   **/
+  class TileCache : public boost::noncopyable
+  {
+  public:
+    class Accessor;
+
+  private:
+    class CachedTile : public boost::noncopyable
+    {
+    private:
+      std::string       content_;
+      ImageCompression  compression_;
+
+    public:
+      CachedTile(const std::string& content,
+                 ImageCompression compression) :
+        content_(content),
+        compression_(compression)
+      {
+      }
+
+      const std::string& GetContent() const
+      {
+        return content_;
+      }
+
+      ImageCompression GetCompression() const
+      {
+        return compression_;
+      }
+    };
+
+    typedef boost::shared_ptr<CachedTile>                       TileHandle;
+    typedef std::map<std::string, TileHandle>                   Content;
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, bool>  Index;
+    typedef std::map<std::string, const Accessor*>              Loading;
+
+    boost::mutex                mutex_;
+    boost::condition_variable   loaded_;
+    size_t                      maxMemory_;
+    size_t                      memoryUsage_;
+    Content                     content_;
+    Index                       index_;
+    Loading                     loading_;  // Accessor that is responsible for loading each tile
+    std::set<std::string>       stale_;    // Loading tiles that were invalidated in between
+
+    void Remove(Content::iterator it);
+
+    void MakeRoom(size_t memory);
+
+    void Store(const Accessor& loader,
+               TileHandle tile);
+
+    void ReleaseLoading(const Accessor& loader);
+
+  public:
+    // "0" disables the cache
+    explicit TileCache(size_t maxMemory);
+
+    bool IsEnabled() const
+    {
+      return maxMemory_ != 0;
+    }
+
+    size_t GetMemoryUsage();
+
+    // Remove all the tiles whose key starts with the given prefix
+    void InvalidatePrefix(const std::string& prefix);
+
+    class Accessor : public boost::noncopyable
+    {
+    private:
+      TileCache&   cache_;
+      std::string  key_;
+      bool         isBackground_;
+      bool         isLoader_;
+      TileHandle   tile_;
+
+    public:
+      // If another thread is loading the same key, a foreground
+      // accessor waits until the tile is available, unless the loader
+      // is a background accessor, in which case the foreground
+      // accessor takes over the loading. A background accessor
+      // returns immediately, neither as a hit nor as a loader.
+      Accessor(TileCache& cache,
+               const std::string& key,
+               bool isBackground = false);
+
+      ~Accessor();
+
+      const std::string& GetKey() const
+      {
+        return key_;
+      }
+
+      bool IsHit() const
+      {
+        return tile_.get() != NULL;
+      }
+
+      // Whether this accessor was responsible for loading the tile
+      // when it was created. The content that is stored by a
+      // background loader that was taken over is discarded.
+      bool IsLoader() const
+      {
+        return isLoader_;
+      }
+
+      const std::string& GetContent() const;
+
+      ImageCompression GetCompression() const;
+
+      // Must only be called on a miss, ignored if not the loader
+      void Store(const std::string& content,
+                 ImageCompression compression);
+    };
+
+    static void InitializeInstances(size_t encodedTilesMaxMemory,
+                                    size_t rawTilesMaxMemory,
+                                    size_t fullImagesMaxMemory);
+
+    static void FinalizeInstances();
+
+    // Tiles as sent to the HTTP clients (after transcoding)
+    static TileCache& GetEncodedTiles();
+
+    // Tiles as stored in the DICOM instances (before transcoding)
+    static TileCache& GetRawTiles();
+
+    // Encoded images of the full region, as served by the IIIF "full"
+    // requests (thumbnails), indexed by their size and format
+    static TileCache& GetFullImages();
+
+    static std::string GetSeriesPrefix(const std::string& seriesId);
+
+    static std::string GetInstancePrefix(const std::string& instanceId);
+
+    static std::string FormatSeriesTileKey(const std::string& seriesId,
+                                           unsigned int level,
+                                           unsigned int tileX,
+                                           unsigned int tileY,
+                                           const std::string& format);
+
+    static std::string FormatSeriesFullImageKey(const std::string& seriesId,
+                                                unsigned int width,
+                                                unsigned int height,
+                                                const std::string& format);
+
+    static std::string FormatFrameFullImageKey(const std::string& instanceId,
+                                               unsigned int frameNumber,
+                                               unsigned int width,
+                                               unsigned int height,
+                                               const std::string& format);
+
+    static std::string FormatFrameTileKey(const std::string& instanceId,
+                                          unsigned int frameNumber,
+                                          unsigned int level,
+                                          unsigned int tileX,
+                                          unsigned int tileY,
+                                          const std::string& format);
+  };
+}
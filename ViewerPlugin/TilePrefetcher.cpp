@@ -0,0 +1,315 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "TilePrefetcher.h"
+
+#include "DicomPyramidCache.h"
+#include "SeriesTiles.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+
+
+static std::unique_ptr<OrthancWSI::TilePrefetcher>  singleton_;
+
+
+namespace OrthancWSI
+{
+  class TilePrefetcher::Job : public Orthanc::IDynamicObject
+  {
+  private:
+    bool               isNeighbourhood_;
+    std::string        seriesId_;
+    unsigned int       level_;
+    unsigned int       tileX_;
+    unsigned int       tileY_;
+    bool               hasAccept_;
+    Orthanc::MimeType  accept_;
+
+  public:
+    Job(bool isNeighbourhood,
+        const std::string& seriesId,
+        unsigned int level,
+        unsigned int tileX,
+        unsigned int tileY,
+        bool hasAccept,
+        Orthanc::MimeType accept) :
+      isNeighbourhood_(isNeighbourhood),
+      seriesId_(seriesId),
+      level_(level),
+      tileX_(tileX),
+      tileY_(tileY),
+      hasAccept_(hasAccept),
+      accept_(accept)
+    {
+    }
+
+    // If "true", this job must be expanded into the jobs that load
+    // the neighbours and the children of the tile
+    bool IsNeighbourhood() const
+    {
+      return isNeighbourhood_;
+    }
+
+    const std::string& GetSeriesId() const
+    {
+      return seriesId_;
+    }
+
+    unsigned int GetLevel() const
+    {
+      return level_;
+    }
+
+    unsigned int GetTileX() const
+    {
+      return tileX_;
+    }
+
+    unsigned int GetTileY() const
+    {
+      return tileY_;
+    }
+
+    bool HasAccept() const
+    {
+      return hasAccept_;
+    }
+
+    Orthanc::MimeType GetAccept() const
+    {
+      return accept_;
+    }
+  };
+
+
+  void TilePrefetcher::Worker(TilePrefetcher* that)
+  {
+    while (that->continue_)
+    {
+      std::unique_ptr<Orthanc::IDynamicObject> obj(that->queue_.Dequeue(100));
+      if (obj.get() != NULL)
+      {
+        const Job& job = dynamic_cast<const Job&>(*obj);
+
+        try
+        {
+          if (job.IsNeighbourhood())
+          {
+            that->ExpandNeighbourhood(job);
+          }
+          else
+          {
+            Prefetch(job);
+          }
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          // Prefetching is a best-effort optimization
+          LOG(INFO) << "Cannot prefetch tile (" << job.GetTileX() << "," << job.GetTileY() << ") at level "
+                    << job.GetLevel() << " of series " << job.GetSeriesId() << ": " << e.What();
+        }
+      }
+    }
+  }
+
+
+  void TilePrefetcher::ExpandNeighbourhood(const Job& job)
+  {
+    std::vector<Job*> jobs;
+
+    {
+      DicomPyramidCache::Accessor accessor(job.GetSeriesId());
+      const DicomPyramid& pyramid = accessor.GetPyramid();
+
+      const unsigned int level = job.GetLevel();
+      if (level >= pyramid.GetLevelCount())
+      {
+        return;
+      }
+
+      const unsigned int tileWidth = pyramid.GetTileWidth(level);
+      const unsigned int tileHeight = pyramid.GetTileHeight(level);
+      const unsigned int countX = CeilingDivision(pyramid.GetLevelWidth(level), tileWidth);
+      const unsigned int countY = CeilingDivision(pyramid.GetLevelHeight(level), tileHeight);
+
+      // The 8 neighbours at the same level
+      for (int dy = -1; dy <= 1; dy++)
+      {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+          const int x = static_cast<int>(job.GetTileX()) + dx;
+          const int y = static_cast<int>(job.GetTileY()) + dy;
+
+          if ((dx != 0 || dy != 0) &&
+              x >= 0 && x < static_cast<int>(countX) &&
+              y >= 0 && y < static_cast<int>(countY))
+          {
+            jobs.push_back(new Job(false, job.GetSeriesId(), level, x, y, job.HasAccept(), job.GetAccept()));
+          }
+        }
+      }
+
+      // The children at the next finer level (level 0 is the finest
+      // level). The tiles are not necessarily aligned across levels,
+      // so compute the tiles of the finer level that cover the same
+      // physical region.
+      if (level > 0)
+      {
+        const unsigned int child = level - 1;
+        const uint64_t childTileWidth = pyramid.GetTileWidth(child);
+        const uint64_t childTileHeight = pyramid.GetTileHeight(child);
+        const uint64_t scaleX = static_cast<uint64_t>(pyramid.GetLevelWidth(level)) * childTileWidth;
+        const uint64_t scaleY = static_cast<uint64_t>(pyramid.GetLevelHeight(level)) * childTileHeight;
+        const uint64_t childWidth = pyramid.GetLevelWidth(child);
+        const uint64_t childHeight = pyramid.GetLevelHeight(child);
+
+        const uint64_t childCountX = CeilingDivision(pyramid.GetLevelWidth(child), pyramid.GetTileWidth(child));
+        const uint64_t childCountY = CeilingDivision(pyramid.GetLevelHeight(child), pyramid.GetTileHeight(child));
+
+        const uint64_t x1 = static_cast<uint64_t>(job.GetTileX()) * tileWidth * childWidth / scaleX;
+        const uint64_t y1 = static_cast<uint64_t>(job.GetTileY()) * tileHeight * childHeight / scaleY;
+        const uint64_t x2 = std::min(childCountX, (static_cast<uint64_t>(job.GetTileX() + 1) * tileWidth * childWidth + scaleX - 1) / scaleX);
+        const uint64_t y2 = std::min(childCountY, (static_cast<uint64_t>(job.GetTileY() + 1) * tileHeight * childHeight + scaleY - 1) / scaleY);
+
+        for (uint64_t y = y1; y < y2; y++)
+        {
+          for (uint64_t x = x1; x < x2; x++)
+          {
+            jobs.push_back(new Job(false, job.GetSeriesId(), child, static_cast<unsigned int>(x),
+                                   static_cast<unsigned int>(y), job.HasAccept(), job.GetAccept()));
+          }
+        }
+      }
+    }
+
+    // Enqueue the children first, so that the neighbours are
+    // processed first because of the LIFO policy
+    for (size_t i = jobs.size(); i > 0; i--)
+    {
+      queue_.Enqueue(jobs[i - 1]);
+    }
+  }
+
+
+  void TilePrefetcher::Prefetch(const Job& job)
+  {
+    // This stores the tile in the cache of encoded tiles, unless it
+    // is already present or being loaded
+    SeriesTiles::PrefetchEncodedTile(job.GetSeriesId(), job.GetLevel(), job.GetTileX(), job.GetTileY(),
+                                     job.HasAccept(), job.GetAccept());
+  }
+
+
+  TilePrefetcher::TilePrefetcher(unsigned int threadsCount,
+                                 unsigned int maxQueueSize) :
+    queue_(maxQueueSize),
+    continue_(true)
+  {
+    if (threadsCount != 0 &&
+        maxQueueSize == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    queue_.SetLifoPolicy();
+
+    threads_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      threads_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  TilePrefetcher::~TilePrefetcher()
+  {
+    continue_ = false;
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i])
+      {
+        if (threads_[i]->joinable())
+        {
+          threads_[i]->join();
+        }
+
+        delete threads_[i];
+        threads_[i] = NULL;
+      }
+    }
+  }
+
+
+  void TilePrefetcher::ScheduleNeighbourhood(const std::string& seriesId,
+                                             unsigned int level,
+                                             unsigned int tileX,
+                                             unsigned int tileY,
+                                             bool hasAccept,
+                                             Orthanc::MimeType accept)
+  {
+    if (IsEnabled())
+    {
+      queue_.Enqueue(new Job(true, seriesId, level, tileX, tileY, hasAccept, accept));
+    }
+  }
+
+
+  void TilePrefetcher::InitializeInstance(unsigned int threadsCount,
+                                          unsigned int maxQueueSize)
+  {
+    if (singleton_.get() == NULL)
+    {
+      singleton_.reset(new TilePrefetcher(threadsCount, maxQueueSize));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void TilePrefetcher::FinalizeInstance()
+  {
+    singleton_.reset(NULL);
+  }
+
+
+  TilePrefetcher& TilePrefetcher::GetInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *singleton_;
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Enumerations.h>
+#include <MultiThreading/SharedMessageQueue.h>
+
+#include <boost/thread.hpp>
+#include <string>
+#include <vector>
+
+
+namespace OrthancWSI
+{
+  /**
+   * Pool of low-priority threads that load the tiles that are likely
+   * to be requested next by a viewer into the cache of encoded tiles,
+   * namely the 8 neighbours of a served tile, and its children at the
+   * next finer level. The queue of pending jobs is bounded and uses
+   * a LIFO policy: If the user pans quickly, the oldest (i.e. the
+   * most likely stale) jobs are dropped.
+   **/
+  class TilePrefetcher : public boost::noncopyable
+  {
+  private:
+    class Job;
+
+    Orthanc::SharedMessageQueue  queue_;
+    bool                         continue_;
+    std::vector<boost::thread*>  threads_;
+
+    static void Worker(TilePrefetcher* that);
+
+    void ExpandNeighbourhood(const Job& job);
+
+    static void Prefetch(const Job& job);
+
+  public:
+    // "0" thread disables prefetching
+    TilePrefetcher(unsigned int threadsCount,
+                   unsigned int maxQueueSize);
+
+    ~TilePrefetcher();
+
+    bool IsEnabled() const
+    {
+      return !threads_.empty();
+    }
+
+    // Only schedules the jobs, the actual loading is done asynchronously
+    void ScheduleNeighbourhood(const std::string& seriesId,
+                               unsigned int level,
+                               unsigned int tileX,
+                               unsigned int tileY,
+                               bool hasAccept,
+                               Orthanc::MimeType accept);
+
+    static void InitializeInstance(unsigned int threadsCount,
+                                   unsigned int maxQueueSize);
+
+    static void FinalizeInstance();
+
+    static TilePrefetcher& GetInstance();
+  };
+}
@@ -0,0 +1,199 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "../Framework/PrecompiledHeadersWSI.h"
+#include "TranscodingScheduler.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <OrthancException.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <cassert>
+
+
+static std::unique_ptr<OrthancWSI::TranscodingScheduler>  singleton_;
+
+
+namespace OrthancWSI
+{
+  bool TranscodingScheduler::IsAdmissible(TranscodingPriority priority,
+                                          uint64_t ticket) const
+  {
+    // Mutex must be locked
+
+    if (running_ >= maxThreads_)
+    {
+      return false;
+    }
+
+    for (int i = 0; i < static_cast<int>(priority); i++)
+    {
+      if (!waiting_[i].empty())
+      {
+        return false;  // Some thread with a higher priority is waiting
+      }
+    }
+
+    assert(!waiting_[priority].empty());
+    return (*waiting_[priority].begin() == ticket);
+  }
+
+
+  bool TranscodingScheduler::Acquire(TranscodingPriority priority)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const uint64_t ticket = nextTicket_++;
+    waiting_[priority].insert(ticket);
+
+    const boost::system_time timeout = (boost::get_system_time() +
+                                        boost::posix_time::milliseconds(prefetchTimeout_));
+
+    while (!IsAdmissible(priority, ticket))
+    {
+      if (priority == TranscodingPriority_Prefetch)
+      {
+        if (!released_.timed_wait(lock, timeout) &&
+            !IsAdmissible(priority, ticket))
+        {
+          waiting_[priority].erase(ticket);
+          dropped_++;
+
+          // The next prefetching thread might now be admissible
+          released_.notify_all();
+          return false;
+        }
+      }
+      else
+      {
+        released_.wait(lock);
+      }
+    }
+
+    waiting_[priority].erase(ticket);
+    running_++;
+
+    // Wake up the next thread in the queue, if some slot is still available
+    released_.notify_all();
+    return true;
+  }
+
+
+  void TranscodingScheduler::Release()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      assert(running_ > 0);
+      running_--;
+    }
+
+    released_.notify_all();
+  }
+
+
+  TranscodingScheduler::TranscodingScheduler(unsigned int maxThreads,
+                                             unsigned int prefetchTimeout) :
+    maxThreads_(maxThreads),
+    running_(0),
+    nextTicket_(0),
+    prefetchTimeout_(prefetchTimeout),
+    dropped_(0)
+  {
+    if (maxThreads == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void TranscodingScheduler::GetStatistics(unsigned int& running,
+                                           size_t& waitingInteractive,
+                                           size_t& waitingRegion,
+                                           size_t& waitingPrefetch,
+                                           uint64_t& dropped)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    running = running_;
+    waitingInteractive = waiting_[TranscodingPriority_Interactive].size();
+    waitingRegion = waiting_[TranscodingPriority_Region].size();
+    waitingPrefetch = waiting_[TranscodingPriority_Prefetch].size();
+    dropped = dropped_;
+  }
+
+
+  TranscodingScheduler::Locker::Locker(TranscodingScheduler& scheduler,
+                                       TranscodingPriority priority) :
+    scheduler_(scheduler)
+  {
+    if (!scheduler_.Acquire(priority))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Timeout, "Dropping stale prefetching of a tile");
+    }
+  }
+
+
+  TranscodingScheduler::Locker::~Locker()
+  {
+    scheduler_.Release();
+  }
+
+
+  void TranscodingScheduler::InitializeInstance(unsigned int maxThreads,
+                                                unsigned int prefetchTimeout)
+  {
+    if (singleton_.get() == NULL)
+    {
+      singleton_.reset(new TranscodingScheduler(maxThreads, prefetchTimeout));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void TranscodingScheduler::FinalizeInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      singleton_.reset(NULL);
+    }
+  }
+
+
+  TranscodingScheduler& TranscodingScheduler::GetInstance()
+  {
+    if (singleton_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return *singleton_;
+    }
+  }
+}
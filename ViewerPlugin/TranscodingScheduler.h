@@ -0,0 +1,109 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <set>
+#include <stdint.h>
+
+
+namespace OrthancWSI
+{
+  enum TranscodingPriority
+  {
+    TranscodingPriority_Interactive = 0,   // Tiles requested by the viewers
+    TranscodingPriority_Region = 1,        // IIIF regions and full renders
+    TranscodingPriority_Prefetch = 2       // Background prefetching
+  };
+
+
+  /**
+   * Bounds the number of tiles that are simultaneously decoded or
+   * encoded, like a semaphore, but admits the waiting threads by
+   * priority class, then in FIFO order within the same class. The
+   * prefetching threads are dropped if they have not been admitted
+   * within a given delay, as their work is most likely stale by then.
+   **/
+  class TranscodingScheduler : public boost::noncopyable
+  {
+  private:
+    typedef std::set<uint64_t>  Tickets;
+
+    enum
+    {
+      PRIORITIES_COUNT = 3
+    };
+
+    boost::mutex               mutex_;
+    boost::condition_variable  released_;
+    unsigned int               maxThreads_;
+    unsigned int               running_;
+    uint64_t                   nextTicket_;
+    Tickets                    waiting_[PRIORITIES_COUNT];
+    unsigned int               prefetchTimeout_;
+    uint64_t                   dropped_;
+
+    bool IsAdmissible(TranscodingPriority priority,
+                      uint64_t ticket) const;
+
+    bool Acquire(TranscodingPriority priority);
+
+    void Release();
+
+  public:
+    // "prefetchTimeout" is expressed in milliseconds
+    TranscodingScheduler(unsigned int maxThreads,
+                         unsigned int prefetchTimeout);
+
+    // Number of threads that are currently transcoding, and number
+    // of threads that are waiting in each priority class
+    void GetStatistics(unsigned int& running,
+                       size_t& waitingInteractive,
+                       size_t& waitingRegion,
+                       size_t& waitingPrefetch,
+                       uint64_t& dropped);
+
+    class Locker : public boost::noncopyable
+    {
+    private:
+      TranscodingScheduler&  scheduler_;
+
+    public:
+      // Throws "ErrorCode_Timeout" if prefetching work is dropped
+      Locker(TranscodingScheduler& scheduler,
+             TranscodingPriority priority);
+
+      ~Locker();
+    };
+
+    static void InitializeInstance(unsigned int maxThreads,
+                                   unsigned int prefetchTimeout);
+
+    static void FinalizeInstance();
+
+    static TranscodingScheduler& GetInstance();
+  };
+}
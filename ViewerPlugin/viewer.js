@@ -27,7 +27,7 @@ function IsNear(a, b)
 }
 
 
-function InitializePyramid(pyramid, tilesBaseUrl)
+function InitializePyramid(pyramid, tilesBaseUrl, tilesArguments)
 {
   $('#map').css('background', pyramid['BackgroundColor']);  // New in WSI 2.1
 
@@ -120,7 +120,8 @@ function InitializePyramid(pyramid, tilesBaseUrl)
     source: new ol.source.TileImage({
       projection: proj,
       tileUrlFunction: function(tileCoord, pixelRatio, projection) {
-        return (tilesBaseUrl + (countLevels - 1 - tileCoord[0]) + '/' + tileCoord[1] + '/' + tileCoord[2]);
+        return (tilesBaseUrl + (countLevels - 1 - tileCoord[0]) + '/' + tileCoord[1] + '/' + tileCoord[2] +
+                (tilesArguments === undefined ? '' : tilesArguments));
       },
       tileGrid: new ol.tilegrid.TileGrid({
         extent: extent,
@@ -195,6 +196,13 @@ $(document).ready(function() {
       frameNumber = params.get('frame');
     }
 
+    // Optional window for the frames with 16bpp grayscale samples
+    var tilesArguments = '';
+    if (params.has('window-center') && params.has('window-width')) {
+      tilesArguments = ('?window-center=' + encodeURIComponent(params.get('window-center')) +
+                        '&window-width=' + encodeURIComponent(params.get('window-width')));
+    }
+
     var instanceId = params.get('instance');
     $.ajax({
       url : '../frames-pyramids/' + instanceId + '/' + frameNumber,
@@ -202,7 +210,7 @@ $(document).ready(function() {
         alert('Error - Cannot get the pyramid structure of frame ' + frameNumber + ' of instance: ' + instanceId);
       },
       success : function(pyramid) {
-        InitializePyramid(pyramid, '../frames-tiles/' + instanceId + '/' + frameNumber + '/');
+        InitializePyramid(pyramid, '../frames-tiles/' + instanceId + '/' + frameNumber + '/', tilesArguments);
       }
     });
   } else {